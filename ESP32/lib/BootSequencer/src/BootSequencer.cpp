@@ -0,0 +1,117 @@
+#include "BootSequencer.h"
+
+static const char *const STAGE_NAMES[BOOT_STAGE_COUNT] = {
+    "setup", "config_ready", "setup_done", "wifi",
+    "mqtt",  "reported",     "config_checked"};
+
+BootSequencer::BootSequencer()
+    : _lock(xSemaphoreCreateMutex()), _reached(0), _at(), _pending() {}
+
+const char *BootSequencer::stageName(BootStage stage) {
+  return stage < BOOT_STAGE_COUNT ? STAGE_NAMES[stage] : "unknown";
+}
+
+bool BootSequencer::mark(BootStage stage) {
+  if (stage >= BOOT_STAGE_COUNT) {
+    return false;
+  }
+  uint32_t now = millis();
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  bool first = !(_reached & bit(stage));
+  if (first) {
+    _reached |= bit(stage);
+    _at[stage] = now;
+  }
+  xSemaphoreGive(_lock);
+  if (first) {
+    Serial.printf("[Boot] %s at %u ms\n", STAGE_NAMES[stage], now);
+    _runReady();
+  }
+  return first;
+}
+
+bool BootSequencer::reached(BootStage stage) const {
+  return stage < BOOT_STAGE_COUNT && (_reached & bit(stage));
+}
+
+uint32_t BootSequencer::at(BootStage stage) const {
+  return reached(stage) ? _at[stage] : 0;
+}
+
+bool BootSequencer::when(uint32_t stages, Action action) {
+  bool stored = false;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (size_t i = 0; i < MAX_ACTIONS; i++) {
+    if (!_pending[i].action) {
+      _pending[i].stages = stages;
+      _pending[i].action = std::move(action);
+      stored = true;
+      break;
+    }
+  }
+  xSemaphoreGive(_lock);
+  if (!stored) {
+    Serial.println("[Boot] No free action slot");
+    return false;
+  }
+  _runReady();
+  return true;
+}
+
+void BootSequencer::_runReady() {
+  // Take one ready action at a time and run it without the lock held, so
+  // it can mark stages or register actions itself
+  for (;;) {
+    Action ready;
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    for (size_t i = 0; i < MAX_ACTIONS; i++) {
+      if (_pending[i].action &&
+          (_reached & _pending[i].stages) == _pending[i].stages) {
+        ready = std::move(_pending[i].action);
+        _pending[i].action = nullptr;
+        break;
+      }
+    }
+    xSemaphoreGive(_lock);
+    if (!ready) {
+      return;
+    }
+    ready();
+  }
+}
+
+size_t BootSequencer::_sortedStages(BootStage *order) const {
+  size_t count = 0;
+  for (uint8_t s = 0; s < BOOT_STAGE_COUNT; s++) {
+    BootStage stage = static_cast<BootStage>(s);
+    if (!reached(stage)) {
+      continue;
+    }
+    // Insertion sort by time; there are only a handful of stages
+    size_t i = count++;
+    while (i > 0 && _at[order[i - 1]] > _at[stage]) {
+      order[i] = order[i - 1];
+      i--;
+    }
+    order[i] = stage;
+  }
+  return count;
+}
+
+void BootSequencer::toJson(JsonObject timeline) const {
+  BootStage order[BOOT_STAGE_COUNT];
+  size_t count = _sortedStages(order);
+  for (size_t i = 0; i < count; i++) {
+    timeline[STAGE_NAMES[order[i]]] = _at[order[i]];
+  }
+}
+
+void BootSequencer::printTimeline() const {
+  BootStage order[BOOT_STAGE_COUNT];
+  size_t count = _sortedStages(order);
+  Serial.println("=== Boot Timeline ===");
+  for (size_t i = 0; i < count; i++) {
+    Serial.printf("%-15s %6u ms\n", STAGE_NAMES[order[i]], _at[order[i]]);
+  }
+  Serial.println("=====================");
+}
@@ -0,0 +1,75 @@
+#ifndef BOOT_SEQUENCER_H
+#define BOOT_SEQUENCER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <functional>
+
+// Milestones of a boot, in the order they are usually reached
+enum BootStage : uint8_t {
+  BOOT_STAGE_SETUP,          // setup() entered
+  BOOT_STAGE_CONFIG_READY,   // MQTT settings known (cache, server or defaults)
+  BOOT_STAGE_SETUP_DONE,     // setup() returned
+  BOOT_STAGE_WIFI_CONNECTED, // got an IP address
+  BOOT_STAGE_MQTT_CONNECTED, // first MQTT connection
+  BOOT_STAGE_REPORTED,       // first status message published
+  BOOT_STAGE_CONFIG_CHECKED, // config fetched or revalidated, or given up
+  BOOT_STAGE_COUNT
+};
+
+// Records when each boot stage is first reached and runs actions once the
+// stages they depend on are all reached. Stages are marked from event
+// handlers (Wi-Fi, MQTT, tasks), so independent work starts as soon as its
+// own inputs are ready instead of waiting on a fixed order in setup():
+//
+//   boot.when(BootSequencer::bit(BOOT_STAGE_WIFI_CONNECTED) |
+//                 BootSequencer::bit(BOOT_STAGE_CONFIG_READY),
+//             [] { mqttController.connectToMqtt(); });
+//   ...
+//   boot.mark(BOOT_STAGE_WIFI_CONNECTED); // from the Wi-Fi event handler
+//
+// Actions run on the task that marks the last stage they need, so they
+// should only start work (a connect, a task), not wait for it.
+class BootSequencer {
+public:
+  using Action = std::function<void()>;
+  static const size_t MAX_ACTIONS = 8;
+
+  BootSequencer();
+
+  static uint32_t bit(BootStage stage) { return 1u << stage; }
+  static const char *stageName(BootStage stage);
+
+  // Records the time of the first mark; returns false if the stage had
+  // already been reached
+  bool mark(BootStage stage);
+  bool reached(BootStage stage) const;
+  // Milliseconds since reset, 0 if not reached
+  uint32_t at(BootStage stage) const;
+
+  // Runs action once every stage in the stages bitmask is reached, right
+  // away if they already are. Returns false if no slot is left.
+  bool when(uint32_t stages, Action action);
+
+  // Stage name -> ms since reset, in the order the stages were reached
+  void toJson(JsonObject timeline) const;
+  void printTimeline() const;
+
+private:
+  struct PendingAction {
+    uint32_t stages;
+    Action action;
+  };
+
+  size_t _sortedStages(BootStage *order) const;
+  void _runReady();
+
+  SemaphoreHandle_t _lock;
+  uint32_t _reached;
+  uint32_t _at[BOOT_STAGE_COUNT];
+  PendingAction _pending[MAX_ACTIONS];
+};
+
+#endif // BOOT_SEQUENCER_H
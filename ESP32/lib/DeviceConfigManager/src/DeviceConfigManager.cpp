@@ -1,15 +1,54 @@
 #include "DeviceConfigManager.h"
 #include "../../../include/secrets.h"
 
+static const char *CONFIG_CACHE_NAMESPACE = "device_cfg";
+
+#ifndef CONFIG_PARSE_ARENA_SIZE
+// Filter and filtered document of one response: a 1 KB slot pool each on
+// the ESP32, plus the kept strings
+#define CONFIG_PARSE_ARENA_SIZE 4096
+#endif
+
+#ifndef CONFIG_CONNECTION_WAIT_MS
+// How long a config fetch waits for its connection before giving up, so
+// MQTT is not held back behind another fetch
+#define CONFIG_CONNECTION_WAIT_MS 2000
+#endif
+
+#ifndef CONFIG_HTTP_TIMEOUT_MS
+// Connect and read timeout of a config fetch; the cached config is used
+// when the server is slow
+#define CONFIG_HTTP_TIMEOUT_MS 5000
+#endif
+
+// Responses are parsed by the config task, pushes by the task that handles
+// MQTT messages, so each has its own arena
+static StaticConfigArena<CONFIG_PARSE_ARENA_SIZE> parseArena;
+static StaticConfigArena<CONFIG_PARSE_ARENA_SIZE> pushArena;
+
 DeviceConfigManager::DeviceConfigManager()
     : serverHost(SERVER_HOST), serverPort(80), useCustomPort(false),
-      configLoaded(false), wifiConnected(false) {
+      config(), previousConfig(), hasPreviousConfig(false), revertedVersion(),
+      configLock(xSemaphoreCreateMutex()), configLoaded(false),
+      configFromCache(false), configChanged(false), wifiConnected(false) {
   deviceId = getDeviceId();
   chipType = getChipType();
   boardType = getBoardType();
   gitVersion = getGitVersion();
   wifiSsid = WIFI_SSID;
   wifiPassword = WIFI_PASSWORD;
+#ifdef WIFI_STATIC_IP
+  IPAddress ip, gateway, subnet, dns;
+  ip.fromString(WIFI_STATIC_IP);
+  gateway.fromString(WIFI_GATEWAY);
+  subnet.fromString(WIFI_SUBNET);
+#ifdef WIFI_DNS
+  dns.fromString(WIFI_DNS);
+#else
+  dns = gateway;
+#endif
+  wifiConnect.setStaticIP(ip, gateway, subnet, dns);
+#endif
 }
 
 // DeviceConfigManager::DeviceConfigManager(const String &host)
@@ -86,28 +125,30 @@ bool DeviceConfigManager::connectToWiFi() {
     return true;
   }
 
-  Serial.printf("[ConfigManager] Connecting to WiFi: %s\n", wifiSsid.c_str());
-  WiFi.begin(wifiSsid.c_str(), wifiPassword.c_str());
-
+  beginWiFi();
   return waitForWiFiConnection();
 }
 
-bool DeviceConfigManager::waitForWiFiConnection(int timeoutMs) {
-  unsigned long startTime = millis();
-
-  while (WiFi.status() != WL_CONNECTED && (millis() - startTime) < timeoutMs) {
-    delay(500);
-    Serial.print(".");
+void DeviceConfigManager::beginWiFi() {
+  if (WiFi.status() == WL_CONNECTED) {
+    return;
   }
+  wifiConnect.begin(wifiSsid, wifiPassword);
+}
+
+bool DeviceConfigManager::waitForWiFiConnection(int timeoutMs) {
+  // Blocks on the event group the WiFi driver sets on GOT_IP instead of
+  // polling the status
+  WiFi.waitStatusBits(STA_HAS_IP_BIT, timeoutMs);
 
   if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("\n[ConfigManager] WiFi connected successfully");
+    Serial.println("[ConfigManager] WiFi connected successfully");
     Serial.printf("[ConfigManager] IP address: %s\n",
                   WiFi.localIP().toString().c_str());
     wifiConnected = true;
     return true;
   } else {
-    Serial.println("\n[ConfigManager] WiFi connection failed");
+    Serial.println("[ConfigManager] WiFi connection failed");
     wifiConnected = false;
     return false;
   }
@@ -120,13 +161,29 @@ bool DeviceConfigManager::loadDeviceConfig() {
     return false;
   }
 
-  HTTPClient http;
   String url = buildServerUrl();
 
   Serial.printf("[ConfigManager] Requesting config from: %s\n", url.c_str());
 
-  http.begin(url);
+  // OTA downloads on its own connection, so a running download does not
+  // hold this up; the TLS session set up here is still resumed when the
+  // firmware download follows. No root CA, as before.
+  SecureConnectionManager &connections = SecureConnectionManager::shared();
+  HTTPClient *request = connections.acquire(
+      SECURE_CHANNEL_CONFIG, url, nullptr, CONFIG_CONNECTION_WAIT_MS);
+  if (!request) {
+    Serial.println("[ConfigManager] Cannot load config: connection is busy");
+    return false;
+  }
+  HTTPClient &http = *request;
+  http.setConnectTimeout(CONFIG_HTTP_TIMEOUT_MS);
+  http.setTimeout(CONFIG_HTTP_TIMEOUT_MS);
   http.addHeader("Content-Type", "application/json");
+  String currentVersion = getConfigVersion();
+  if (!currentVersion.isEmpty()) {
+    // The server answers 304 if this is still the current version
+    http.addHeader("If-None-Match", "\"" + currentVersion + "\"");
+  }
 
   // Prepare request body
   JsonDocument requestDoc;
@@ -139,104 +196,245 @@ bool DeviceConfigManager::loadDeviceConfig() {
 
   int httpResponseCode = http.POST(requestBody);
 
-  if (httpResponseCode > 0) {
-    String response = http.getString();
-    Serial.printf("[ConfigManager] HTTP Response code: %d\n", httpResponseCode);
-    Serial.printf("[ConfigManager] Response: %s\n", response.c_str());
+  if (httpResponseCode == HTTP_CODE_NOT_MODIFIED) {
+    // A 304 has no body, so the connection can stay open
+    connections.release(SECURE_CHANNEL_CONFIG, true);
+    Serial.printf("[ConfigManager] Configuration not modified (version %s)\n",
+                  currentVersion.c_str());
+    configLoaded = true;
+    configChanged = false;
+    return true;
+  }
 
-    if (httpResponseCode == 200) {
-      bool success = parseConfigResponse(response);
-      if (success) {
-        Serial.println("[ConfigManager] Configuration loaded successfully");
-        configLoaded = true;
-        printConfig();
-      } else {
-        Serial.println(
-            "[ConfigManager] Failed to parse configuration response");
+  if (httpResponseCode == HTTP_CODE_OK) {
+    Serial.printf("[ConfigManager] HTTP Response code: %d\n", httpResponseCode);
+    String previousVersion = currentVersion;
+    // Parsed straight off the connection when the length is known; a
+    // chunked body goes through HTTPClient, which removes the framing
+    bool success = http.getSize() > 0 ? parseConfigResponse(http.getStream())
+                                      : parseConfigResponse(http.getString());
+    // After a good parse only trailing whitespace can be left, which
+    // HTTPClient drains; after a bad one the rest of the body is unknown
+    connections.release(SECURE_CHANNEL_CONFIG, success);
+    if (success) {
+      Serial.println("[ConfigManager] Configuration loaded successfully");
+      configLoaded = true;
+      configFromCache = false;
+      configChanged = previousVersion != getConfigVersion();
+      if (configChanged) {
+        saveCachedConfig();
       }
-      http.end();
-      return success;
+      printConfig();
     } else {
-      Serial.printf("[ConfigManager] HTTP request failed with code: %d\n",
-                    httpResponseCode);
+      Serial.println("[ConfigManager] Failed to parse configuration response");
     }
+    return success;
+  } else if (httpResponseCode > 0) {
+    String response = http.getString();
+    // The whole body has been read, so the connection can stay open
+    connections.release(SECURE_CHANNEL_CONFIG, true);
+    Serial.printf("[ConfigManager] HTTP request failed with code: %d\n",
+                  httpResponseCode);
+    Serial.printf("[ConfigManager] Response: %s\n", response.c_str());
   } else {
     Serial.printf("[ConfigManager] HTTP request failed: %s\n",
                   http.errorToString(httpResponseCode).c_str());
+    connections.release(SECURE_CHANNEL_CONFIG, false);
   }
 
-  http.end();
   return false;
 }
 
-bool DeviceConfigManager::parseConfigResponse(const String &response) {
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, response);
-
-  if (error) {
-    Serial.printf("[ConfigManager] JSON parsing failed: %s\n", error.c_str());
+template <typename TInput>
+bool DeviceConfigManager::parseConfigResponse(TInput &&input) {
+  DeviceConfig parsed;
+  uint32_t started = micros();
+  ConfigParseResult result = parseDeviceConfig(input, parsed, parseArena);
+  uint32_t elapsed = micros() - started;
+
+  if (result.status != CONFIG_PARSE_OK) {
+    if (result.status == CONFIG_PARSE_INVALID_JSON) {
+      Serial.printf("[ConfigManager] JSON parsing failed: %s\n",
+                    DeserializationError(result.jsonError).c_str());
+    } else {
+      Serial.printf("[ConfigManager] Bad config response: %s (%s)\n",
+                    configParseStatusString(result.status),
+                    result.field ? result.field : "-");
+    }
     return false;
   }
 
-  // Check if version exists
-  if (!doc["version"].is<String>()) {
-    Serial.println("[ConfigManager] Missing version in response");
-    return false;
-  }
+  // Includes waiting for the body when parsing from the connection
+  Serial.printf("[ConfigManager] Parsed config in %u us, %u of %u arena "
+                "bytes\n",
+                elapsed, (unsigned)result.arenaPeak,
+                (unsigned)parseArena.capacity());
+  xSemaphoreTake(configLock, portMAX_DELAY);
+  config = parsed;
+  hasPreviousConfig = false;
+  xSemaphoreGive(configLock);
+  return true;
+}
 
-  // Check if config object exists
-  if (!doc["config"].is<JsonObject>()) {
-    Serial.println("[ConfigManager] Missing config object in response");
+bool DeviceConfigManager::loadCachedConfig() {
+  Preferences prefs;
+  if (!prefs.begin(CONFIG_CACHE_NAMESPACE, true)) {
     return false;
   }
-
-  JsonObject config = doc["config"];
-
-  // Parse MQTT configuration
-  if (config["MQTT_HOST"].is<String>()) {
-    mqttHost = config["MQTT_HOST"].as<String>();
+  DeviceConfig cached = DeviceConfig();
+  bool found =
+      prefs.isKey("version") && prefs.isKey("mqtt_host") &&
+      prefs.getString("version", cached.version, sizeof(cached.version)) &&
+      prefs.getString("mqtt_host", cached.mqttHost, sizeof(cached.mqttHost));
+  if (found) {
+    cached.mqttPort = prefs.getInt("mqtt_port", 1883);
+    // Optional, left empty if missing
+    prefs.getString("mqtt_user", cached.mqttUser, sizeof(cached.mqttUser));
+    prefs.getString("mqtt_pass", cached.mqttPassword,
+                    sizeof(cached.mqttPassword));
+    prefs.getString("status_fmt", cached.statusFormat,
+                    sizeof(cached.statusFormat));
+    xSemaphoreTake(configLock, portMAX_DELAY);
+    config = cached;
+    xSemaphoreGive(configLock);
+    configLoaded = true;
+    configFromCache = true;
+    Serial.printf("[ConfigManager] Loaded cached configuration (version %s)\n",
+                  cached.version);
   } else {
-    Serial.println("[ConfigManager] Missing MQTT_HOST in config");
-    return false;
+    Serial.println("[ConfigManager] No cached configuration");
   }
+  prefs.end();
+  return found;
+}
 
-  if (config["MQTT_PORT"].is<int>()) {
-    mqttPort = config["MQTT_PORT"].as<int>();
-  } else {
-    Serial.println("[ConfigManager] Missing MQTT_PORT in config");
+bool DeviceConfigManager::saveCachedConfig() {
+  DeviceConfig current = snapshot();
+  Preferences prefs;
+  if (!prefs.begin(CONFIG_CACHE_NAMESPACE, false)) {
+    Serial.println("[ConfigManager] Failed to open NVS for config cache");
     return false;
   }
+  // Version last, so an interrupted save is never mistaken for a valid one
+  prefs.remove("version");
+  bool ok = prefs.putString("mqtt_host", current.mqttHost) > 0 &&
+            prefs.putInt("mqtt_port", current.mqttPort) > 0;
+  prefs.putString("mqtt_user", current.mqttUser);
+  prefs.putString("mqtt_pass", current.mqttPassword);
+  prefs.putString("status_fmt", current.statusFormat);
+  ok = ok && prefs.putString("version", current.version) > 0;
+  prefs.end();
+  if (!ok) {
+    Serial.println("[ConfigManager] Failed to save configuration to NVS");
+  }
+  return ok;
+}
 
-  if (config["MQTT_USER"].is<String>()) {
-    mqttUser = config["MQTT_USER"].as<String>();
-  } else {
-    mqttUser = ""; // Optional field
+void DeviceConfigManager::clearCachedConfig() {
+  Preferences prefs;
+  if (prefs.begin(CONFIG_CACHE_NAMESPACE, false)) {
+    prefs.clear();
+    prefs.end();
   }
+}
 
-  if (config["MQTT_PASSWORD"].is<String>()) {
-    mqttPassword = config["MQTT_PASSWORD"].as<String>();
-  } else {
-    mqttPassword = ""; // Optional field
+ConfigPushResult DeviceConfigManager::applyConfigPush(const char *payload,
+                                                      size_t length) {
+  xSemaphoreTake(configLock, portMAX_DELAY);
+  DeviceConfig before = config;
+  ConfigPushResult result = ::applyConfigPush(payload, length, config,
+                                              pushArena);
+  if (result.status == CONFIG_PUSH_APPLIED &&
+      strcmp(config.version, revertedVersion) == 0) {
+    // Retained pushes come back on every connect
+    config = before;
+    result.status = CONFIG_PUSH_CURRENT;
+    result.changed = 0;
+  } else if (result.status == CONFIG_PUSH_APPLIED) {
+    previousConfig = before;
+    hasPreviousConfig = true;
+  }
+  xSemaphoreGive(configLock);
+
+  switch (result.status) {
+  case CONFIG_PUSH_APPLIED:
+    Serial.printf("[ConfigManager] Applied pushed config version %s (was "
+                  "%s)\n",
+                  getConfigVersion().c_str(), before.version);
+    configLoaded = true;
+    saveCachedConfig();
+    break;
+  case CONFIG_PUSH_CURRENT:
+    Serial.printf("[ConfigManager] Pushed config is not newer than %s or "
+                  "was reverted\n",
+                  before.version);
+    break;
+  case CONFIG_PUSH_STALE:
+    Serial.printf("[ConfigManager] Pushed delta is not for version %s\n",
+                  before.version);
+    break;
+  case CONFIG_PUSH_INVALID:
+    Serial.printf("[ConfigManager] Rejected pushed config: %s (%s)\n",
+                  configParseStatusString(result.error),
+                  result.field ? result.field : "-");
+    break;
   }
+  return result;
+}
 
-  configVersion = doc["version"].as<String>();
+bool DeviceConfigManager::revertConfigPush() {
+  xSemaphoreTake(configLock, portMAX_DELAY);
+  bool reverted = hasPreviousConfig;
+  if (reverted) {
+    memcpy(revertedVersion, config.version, sizeof(revertedVersion));
+    config = previousConfig;
+    hasPreviousConfig = false;
+  }
+  xSemaphoreGive(configLock);
+  if (reverted) {
+    Serial.printf("[ConfigManager] Reverted to config version %s\n",
+                  getConfigVersion().c_str());
+    saveCachedConfig();
+  }
+  return reverted;
+}
 
-  return true;
+DeviceConfig DeviceConfigManager::snapshot() const {
+  xSemaphoreTake(configLock, portMAX_DELAY);
+  DeviceConfig copy = config;
+  xSemaphoreGive(configLock);
+  return copy;
 }
 
 bool DeviceConfigManager::isConfigLoaded() const { return configLoaded; }
 
+bool DeviceConfigManager::isConfigFromCache() const { return configFromCache; }
+
+bool DeviceConfigManager::wasConfigChanged() const { return configChanged; }
+
 bool DeviceConfigManager::isWiFiConnected() const { return wifiConnected; }
 
-String DeviceConfigManager::getMqttHost() const { return mqttHost; }
+String DeviceConfigManager::getMqttHost() const {
+  return snapshot().mqttHost;
+}
 
-int DeviceConfigManager::getMqttPort() const { return mqttPort; }
+int DeviceConfigManager::getMqttPort() const { return snapshot().mqttPort; }
 
-String DeviceConfigManager::getMqttUser() const { return mqttUser; }
+String DeviceConfigManager::getMqttUser() const {
+  return snapshot().mqttUser;
+}
 
-String DeviceConfigManager::getMqttPassword() const { return mqttPassword; }
+String DeviceConfigManager::getMqttPassword() const {
+  return snapshot().mqttPassword;
+}
 
-String DeviceConfigManager::getConfigVersion() const { return configVersion; }
+String DeviceConfigManager::getStatusFormat() const {
+  return snapshot().statusFormat;
+}
+
+String DeviceConfigManager::getConfigVersion() const {
+  return snapshot().version;
+}
 
 void DeviceConfigManager::printConfig() const {
   Serial.println("=== Device Configuration ===");
@@ -248,10 +446,13 @@ void DeviceConfigManager::printConfig() const {
     Serial.printf("WiFi IP: %s\n", WiFi.localIP().toString().c_str());
   }
   // Serial.printf("Server URL: %s\n", buildServerUrl().c_str());
-  Serial.printf("Config Version: %s\n", configVersion.c_str());
-  Serial.printf("MQTT Host: %s\n", mqttHost.c_str());
-  Serial.printf("MQTT Port: %d\n", mqttPort);
-  Serial.printf("MQTT User: %s\n", mqttUser.c_str());
-  Serial.printf("MQTT Password: %s\n", mqttPassword.c_str());
+  DeviceConfig current = snapshot();
+  Serial.printf("Config Version: %s\n", current.version);
+  Serial.printf("MQTT Host: %s\n", current.mqttHost);
+  Serial.printf("MQTT Port: %d\n", (int)current.mqttPort);
+  Serial.printf("MQTT User: %s\n", current.mqttUser);
+  Serial.printf("MQTT Password: %s\n", current.mqttPassword);
+  Serial.printf("Status Format: %s\n",
+                current.statusFormat[0] ? current.statusFormat : "json");
   Serial.println("============================");
 }
\ No newline at end of file
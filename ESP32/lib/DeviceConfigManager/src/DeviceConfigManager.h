@@ -4,7 +4,13 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <HTTPClient.h>
+#include <Preferences.h>
+#include "DeviceConfigParser.h"
+#include "WiFiFastConnect.h"
+#include <SecureConnectionManager.h>
 #include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
 class DeviceConfigManager {
 private:
@@ -17,21 +23,26 @@ private:
   String gitVersion;
   String wifiSsid;
   String wifiPassword;
+  WiFiFastConnect wifiConnect;
 
-  // Configuration storage
-  String mqttHost;
-  int mqttPort;
-  String mqttUser;
-  String mqttPassword;
-  String configVersion;
+  // Configuration storage. Written by the config task and by MQTT pushes,
+  // so copies in and out go through configLock.
+  DeviceConfig config;
+  DeviceConfig previousConfig; // before the last applied push
+  bool hasPreviousConfig;
+  char revertedVersion[sizeof(DeviceConfig::version)]; // not applied again
+  SemaphoreHandle_t configLock;
 
   bool configLoaded;
+  bool configFromCache;
+  bool configChanged;
   bool wifiConnected;
 
   // Helper methods
 
-  bool parseConfigResponse(const String &response);
-  bool connectToWiFi();
+  template <typename TInput> bool parseConfigResponse(TInput &&input);
+  bool saveCachedConfig();
+  DeviceConfig snapshot() const;
   bool waitForWiFiConnection(int timeoutMs = 10000);
   String buildServerUrl();
 
@@ -43,15 +54,38 @@ public:
   //                     const String &password);
 
   // Configuration methods
+  // Starts connecting and returns; ARDUINO_EVENT_WIFI_STA_GOT_IP follows.
+  // Targets the AP and IP settings of the last good connection first.
+  void beginWiFi();
+  bool connectToWiFi();
+  // Fetches the config from the server. Once a version is known (from the
+  // cache or an earlier fetch) the request is conditional and a 304 keeps
+  // the current config.
   bool loadDeviceConfig();
+  // Restores the last config saved to NVS, without touching the network
+  bool loadCachedConfig();
+  void clearCachedConfig();
   bool isConfigLoaded() const;
+  bool isConfigFromCache() const;
+  // True if the last successful loadDeviceConfig() got a new version
+  bool wasConfigChanged() const;
+  // Applies a delta pushed over MQTT and saves the result to NVS; see
+  // applyConfigPush() in DeviceConfigParser.h for the message format
+  ConfigPushResult applyConfigPush(const char *payload, size_t length);
+  // Puts back the config from before the last applied push, e.g. when the
+  // new broker settings do not connect. False if there is none. That
+  // version is not applied again until reboot, even if pushed again.
+  bool revertConfigPush();
   bool isWiFiConnected() const;
+  WiFiFastConnect &getWiFiConnect() { return wifiConnect; }
 
   // Getter methods for configuration
   String getMqttHost() const;
   int getMqttPort() const;
   String getMqttUser() const;
   String getMqttPassword() const;
+  // STATUS_FORMAT of the device profile, empty for the default (JSON)
+  String getStatusFormat() const;
 
   String getConfigVersion() const;
   String getDeviceId();
@@ -0,0 +1,301 @@
+#include "DeviceConfigParser.h"
+#include <string.h>
+
+const char *configParseStatusString(ConfigParseStatus status) {
+  switch (status) {
+  case CONFIG_PARSE_OK:
+    return "ok";
+  case CONFIG_PARSE_INVALID_JSON:
+    return "invalid_json";
+  case CONFIG_PARSE_NO_MEMORY:
+    return "no_memory";
+  case CONFIG_PARSE_MISSING_FIELD:
+    return "missing_field";
+  case CONFIG_PARSE_WRONG_TYPE:
+    return "wrong_type";
+  case CONFIG_PARSE_TOO_LONG:
+    return "too_long";
+  }
+  return "unknown";
+}
+
+const char *configPushStatusString(ConfigPushStatus status) {
+  switch (status) {
+  case CONFIG_PUSH_APPLIED:
+    return "applied";
+  case CONFIG_PUSH_CURRENT:
+    return "current";
+  case CONFIG_PUSH_STALE:
+    return "stale";
+  case CONFIG_PUSH_INVALID:
+    return "rejected";
+  }
+  return "unknown";
+}
+
+bool configChangeNeedsReconnect(uint32_t changed) {
+  for (size_t i = 0; i < DEVICE_CONFIG_FIELD_COUNT; i++) {
+    if ((changed & (1u << i)) && DEVICE_CONFIG_FIELDS[i].reconnect) {
+      return true;
+    }
+  }
+  return false;
+}
+
+ConfigArena::ConfigArena(uint8_t *buffer, size_t capacity)
+    : _buffer(buffer), _capacity(capacity), _top(0), _peak(0),
+      _last(nullptr) {}
+
+void ConfigArena::reset() {
+  _top = 0;
+  _peak = 0;
+  _last = nullptr;
+}
+
+size_t &ConfigArena::_blockSize(void *ptr) const {
+  return *reinterpret_cast<size_t *>(static_cast<uint8_t *>(ptr) - ALIGN);
+}
+
+void *ConfigArena::allocate(size_t size) {
+  size_t needed = ALIGN + _align(size);
+  if (needed > _capacity - _top) {
+    return nullptr;
+  }
+  uint8_t *block = _buffer + _top + ALIGN;
+  _top += needed;
+  if (_top > _peak) {
+    _peak = _top;
+  }
+  _last = block;
+  _blockSize(block) = size;
+  return block;
+}
+
+void ConfigArena::deallocate(void *ptr) {
+  if (ptr && ptr == _last) {
+    _top = _last - ALIGN - _buffer;
+    _last = nullptr;
+  }
+}
+
+void *ConfigArena::reallocate(void *ptr, size_t size) {
+  if (!ptr) {
+    return allocate(size);
+  }
+  if (ptr == _last) {
+    // String builders grow and then shrink the block they just took
+    size_t end = _last - _buffer + _align(size);
+    if (end > _capacity) {
+      return nullptr;
+    }
+    _top = end;
+    if (_top > _peak) {
+      _peak = _top;
+    }
+    _blockSize(ptr) = size;
+    return ptr;
+  }
+  size_t oldSize = _blockSize(ptr);
+  void *moved = allocate(size);
+  if (moved) {
+    memcpy(moved, ptr, oldSize < size ? oldSize : size);
+  }
+  return moved;
+}
+
+void buildDeviceConfigFilter(JsonDocument &filter) {
+  filter["version"] = true;
+  JsonObject config = filter["config"].to<JsonObject>();
+  for (const ConfigField &field : DEVICE_CONFIG_FIELDS) {
+    config[field.key] = true;
+  }
+}
+
+static ConfigParseResult parseError(ConfigParseStatus status,
+                                    const char *field) {
+  ConfigParseResult result = {status, field, DeserializationError::Ok, 0};
+  return result;
+}
+
+static ConfigParseStatus copyString(JsonVariantConst value, char *target,
+                                    size_t size) {
+  if (!value.is<const char *>()) {
+    return CONFIG_PARSE_WRONG_TYPE;
+  }
+  const char *text = value.as<const char *>();
+  size_t length = strlen(text);
+  if (length >= size) {
+    return CONFIG_PARSE_TOO_LONG;
+  }
+  memcpy(target, text, length + 1);
+  return CONFIG_PARSE_OK;
+}
+
+// Copies one value into its place in config; null clears the field
+static ConfigParseStatus readField(const ConfigField &field,
+                                   JsonVariantConst value,
+                                   DeviceConfig &config) {
+  uint8_t *target = reinterpret_cast<uint8_t *>(&config) + field.offset;
+  if (value.isNull()) {
+    memset(target, 0, field.size);
+    return CONFIG_PARSE_OK;
+  }
+  switch (field.type) {
+  case CONFIG_FIELD_STRING:
+    return copyString(value, reinterpret_cast<char *>(target), field.size);
+  case CONFIG_FIELD_INT:
+    if (!value.is<int32_t>()) {
+      return CONFIG_PARSE_WRONG_TYPE;
+    }
+    {
+      int32_t number = value.as<int32_t>();
+      memcpy(target, &number, sizeof(number));
+    }
+    return CONFIG_PARSE_OK;
+  }
+  return CONFIG_PARSE_WRONG_TYPE;
+}
+
+ConfigParseResult readDeviceConfig(DeserializationError error,
+                                   const JsonDocument &doc,
+                                   DeviceConfig &out) {
+  if (error) {
+    ConfigParseResult result = parseError(
+        error == DeserializationError::NoMemory ? CONFIG_PARSE_NO_MEMORY
+                                                : CONFIG_PARSE_INVALID_JSON,
+        nullptr);
+    result.jsonError = error.code();
+    return result;
+  }
+
+  // Filled in completely before out is touched, so a bad response leaves
+  // the current config alone
+  DeviceConfig parsed;
+  memset(&parsed, 0, sizeof(parsed));
+
+  JsonVariantConst version = doc["version"];
+  if (version.isNull()) {
+    return parseError(CONFIG_PARSE_MISSING_FIELD, "version");
+  }
+  ConfigParseStatus status =
+      copyString(version, parsed.version, sizeof(parsed.version));
+  if (status != CONFIG_PARSE_OK) {
+    return parseError(status, "version");
+  }
+
+  JsonObjectConst config = doc["config"].as<JsonObjectConst>();
+  if (config.isNull()) {
+    return parseError(CONFIG_PARSE_MISSING_FIELD, "config");
+  }
+
+  for (const ConfigField &field : DEVICE_CONFIG_FIELDS) {
+    JsonVariantConst value = config[field.key];
+    if (value.isNull() && field.required) {
+      return parseError(CONFIG_PARSE_MISSING_FIELD, field.key);
+    }
+    status = readField(field, value, parsed);
+    if (status != CONFIG_PARSE_OK) {
+      return parseError(status, field.key);
+    }
+  }
+
+  out = parsed;
+  return parseError(CONFIG_PARSE_OK, nullptr);
+}
+
+static const uint8_t *fieldBytes(const DeviceConfig &config,
+                                 const ConfigField &field) {
+  return reinterpret_cast<const uint8_t *>(&config) + field.offset;
+}
+
+static bool isZero(const uint8_t *bytes, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (bytes[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static ConfigPushResult pushResult(ConfigPushStatus status,
+                                   ConfigParseStatus error,
+                                   const char *field) {
+  ConfigPushResult result = {status, 0, error, field};
+  return result;
+}
+
+ConfigPushResult applyConfigPush(const char *payload, size_t length,
+                                 DeviceConfig &config, ConfigArena &arena) {
+  arena.reset();
+  JsonDocument filter(&arena);
+  buildDeviceConfigFilter(filter);
+  filter["base"] = true;
+  JsonDocument doc(&arena);
+  DeserializationError error = deserializeJson(
+      doc, payload, length, DeserializationOption::Filter(filter));
+  if (error) {
+    return pushResult(CONFIG_PUSH_INVALID,
+                      error == DeserializationError::NoMemory
+                          ? CONFIG_PARSE_NO_MEMORY
+                          : CONFIG_PARSE_INVALID_JSON,
+                      nullptr);
+  }
+
+  DeviceConfig updated = config;
+  JsonVariantConst version = doc["version"];
+  ConfigParseStatus status = CONFIG_PARSE_MISSING_FIELD;
+  if (!version.isNull()) {
+    status = copyString(version, updated.version, sizeof(updated.version));
+  }
+  if (status == CONFIG_PARSE_OK && updated.version[0] == '\0') {
+    status = CONFIG_PARSE_MISSING_FIELD;
+  }
+  if (status != CONFIG_PARSE_OK) {
+    return pushResult(CONFIG_PUSH_INVALID, status, "version");
+  }
+  if (strcmp(updated.version, config.version) <= 0) {
+    return pushResult(CONFIG_PUSH_CURRENT, CONFIG_PARSE_OK, nullptr);
+  }
+  const char *base = doc["base"].as<const char *>();
+  if (base && strcmp(base, config.version) != 0) {
+    return pushResult(CONFIG_PUSH_STALE, CONFIG_PARSE_OK, "base");
+  }
+  JsonObjectConst delta = doc["config"].as<JsonObjectConst>();
+  if (delta.isNull()) {
+    return pushResult(CONFIG_PUSH_INVALID, CONFIG_PARSE_MISSING_FIELD,
+                      "config");
+  }
+
+  ConfigPushResult result =
+      pushResult(CONFIG_PUSH_APPLIED, CONFIG_PARSE_OK, nullptr);
+  for (size_t i = 0; i < DEVICE_CONFIG_FIELD_COUNT; i++) {
+    const ConfigField &field = DEVICE_CONFIG_FIELDS[i];
+    JsonVariantConst value = delta[field.key];
+    if (value.isUnbound()) {
+      continue; // not in this delta
+    }
+    if (value.isNull() && field.required) {
+      return pushResult(CONFIG_PUSH_INVALID, CONFIG_PARSE_MISSING_FIELD,
+                        field.key);
+    }
+    status = readField(field, value, updated);
+    if (status != CONFIG_PARSE_OK) {
+      return pushResult(CONFIG_PUSH_INVALID, status, field.key);
+    }
+    if (memcmp(fieldBytes(config, field), fieldBytes(updated, field),
+               field.size) != 0) {
+      result.changed |= 1u << i;
+    }
+  }
+
+  // A delta on top of no config at all must still bring every required key
+  for (const ConfigField &field : DEVICE_CONFIG_FIELDS) {
+    if (field.required && isZero(fieldBytes(updated, field), field.size)) {
+      return pushResult(CONFIG_PUSH_INVALID, CONFIG_PARSE_MISSING_FIELD,
+                        field.key);
+    }
+  }
+
+  config = updated;
+  return result;
+}
@@ -0,0 +1,171 @@
+#ifndef DEVICE_CONFIG_PARSER_H
+#define DEVICE_CONFIG_PARSER_H
+
+#include <ArduinoJson.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Settings from the config server. Fixed-size fields, so reading a response
+// into it does not allocate.
+struct DeviceConfig {
+  char version[32];
+  char mqttHost[64];
+  int32_t mqttPort;
+  char mqttUser[32];
+  char mqttPassword[64];
+  char statusFormat[12]; // "json" (or empty) or "msgpack"
+};
+
+enum ConfigFieldType : uint8_t { CONFIG_FIELD_STRING, CONFIG_FIELD_INT };
+
+// Where one key of the response's "config" object goes in DeviceConfig
+struct ConfigField {
+  const char *key;
+  ConfigFieldType type;
+  uint16_t offset;
+  uint16_t size;  // including the terminator for strings
+  bool required;  // optional fields are cleared when absent
+  bool reconnect; // a change only takes effect on a new MQTT connection
+};
+
+#define CONFIG_FIELD(key, type, member, required, reconnect)                  \
+  {key, type, offsetof(DeviceConfig, member), sizeof(DeviceConfig::member),   \
+   required, reconnect}
+
+// Every key read from "config". The parser filter is built from this table,
+// so anything else in the response is skipped without being stored.
+static constexpr ConfigField DEVICE_CONFIG_FIELDS[] = {
+    CONFIG_FIELD("MQTT_HOST", CONFIG_FIELD_STRING, mqttHost, true, true),
+    CONFIG_FIELD("MQTT_PORT", CONFIG_FIELD_INT, mqttPort, true, true),
+    CONFIG_FIELD("MQTT_USER", CONFIG_FIELD_STRING, mqttUser, false, true),
+    CONFIG_FIELD("MQTT_PASSWORD", CONFIG_FIELD_STRING, mqttPassword, false,
+                 true),
+    CONFIG_FIELD("STATUS_FORMAT", CONFIG_FIELD_STRING, statusFormat, false,
+                 false),
+};
+
+static constexpr size_t DEVICE_CONFIG_FIELD_COUNT =
+    sizeof(DEVICE_CONFIG_FIELDS) / sizeof(DEVICE_CONFIG_FIELDS[0]);
+
+enum ConfigParseStatus : uint8_t {
+  CONFIG_PARSE_OK,
+  CONFIG_PARSE_INVALID_JSON, // also a truncated body
+  CONFIG_PARSE_NO_MEMORY,    // the arena is too small
+  CONFIG_PARSE_MISSING_FIELD,
+  CONFIG_PARSE_WRONG_TYPE,
+  CONFIG_PARSE_TOO_LONG, // string does not fit its DeviceConfig field
+};
+
+struct ConfigParseResult {
+  ConfigParseStatus status;
+  const char *field; // offending key, nullptr if none
+  DeserializationError::Code jsonError;
+  size_t arenaPeak; // bytes of the arena used by the filter and document
+};
+
+const char *configParseStatusString(ConfigParseStatus status);
+
+enum ConfigPushStatus : uint8_t {
+  CONFIG_PUSH_APPLIED,
+  CONFIG_PUSH_CURRENT, // this version or a newer one is already in use
+  CONFIG_PUSH_STALE,   // a delta against another version than ours
+  CONFIG_PUSH_INVALID,
+};
+
+struct ConfigPushResult {
+  ConfigPushStatus status;
+  uint32_t changed;        // a bit per DEVICE_CONFIG_FIELDS entry
+  ConfigParseStatus error; // why an invalid push was rejected
+  const char *field;       // offending key, nullptr if none
+};
+
+const char *configPushStatusString(ConfigPushStatus status);
+// True if any field in the changed mask needs a new MQTT connection
+bool configChangeNeedsReconnect(uint32_t changed);
+
+// Bump allocator over a fixed buffer, for the JsonDocuments of one parse.
+// Freeing or resizing the most recent block happens in place; anything else
+// is only reclaimed by reset().
+class ConfigArena : public ArduinoJson::Allocator {
+public:
+  ConfigArena(uint8_t *buffer, size_t capacity);
+
+  void reset();
+  size_t capacity() const { return _capacity; }
+  size_t used() const { return _top; }
+  size_t peak() const { return _peak; }
+
+  void *allocate(size_t size) override;
+  void deallocate(void *ptr) override;
+  void *reallocate(void *ptr, size_t size) override;
+
+private:
+  static const size_t ALIGN = 8; // also the block header size
+
+  static size_t _align(size_t size) {
+    return (size + ALIGN - 1) & ~(ALIGN - 1);
+  }
+  size_t &_blockSize(void *ptr) const;
+
+  uint8_t *_buffer;
+  size_t _capacity;
+  size_t _top;
+  size_t _peak;
+  uint8_t *_last; // most recent block, nullptr after it was freed
+};
+
+template <size_t N> class StaticConfigArena : public ConfigArena {
+public:
+  StaticConfigArena() : ConfigArena(_storage, N) {}
+
+private:
+  alignas(8) uint8_t _storage[N];
+};
+
+// Builds the filter that keeps "version" and the DEVICE_CONFIG_FIELDS keys
+void buildDeviceConfigFilter(JsonDocument &filter);
+
+// Checks a filtered document against DEVICE_CONFIG_FIELDS and copies it into
+// out. out is only written when the whole document is valid.
+ConfigParseResult readDeviceConfig(DeserializationError error,
+                                   const JsonDocument &doc, DeviceConfig &out);
+
+// Applies a config pushed over MQTT:
+//
+//   {"version": "20250801T120000", "base": "20250622T043111",
+//    "config": {"MQTT_PORT": 8883, "MQTT_USER": null}}
+//
+// Only the keys in "config" are applied; null clears an optional key.
+// "base", when present, is the version the delta was made against, and the
+// push is refused as stale if config is at another one. Versions are server
+// timestamps, so a push whose version does not sort after config.version is
+// already in use. config is only written when the push is applied.
+ConfigPushResult applyConfigPush(const char *payload, size_t length,
+                                 DeviceConfig &config, ConfigArena &arena);
+
+// Parses a config response from any ArduinoJson input (Stream, String,
+// std::istream) straight into out. Only the filtered fields are stored, in
+// arena, which is reset first; nothing is allocated from the heap.
+template <typename TInput>
+ConfigParseResult parseDeviceConfig(TInput &&input, DeviceConfig &out,
+                                    ConfigArena &arena) {
+  arena.reset();
+  ConfigParseResult result;
+  {
+    JsonDocument filter(&arena);
+    buildDeviceConfigFilter(filter);
+    if (filter.overflowed()) {
+      result = {CONFIG_PARSE_NO_MEMORY, nullptr, DeserializationError::Ok,
+                0};
+    } else {
+      JsonDocument doc(&arena);
+      DeserializationError error = deserializeJson(
+          doc, input, DeserializationOption::Filter(filter));
+      result = readDeviceConfig(error, doc, out);
+    }
+  }
+  result.arenaPeak = arena.peak();
+  return result;
+}
+
+#endif // DEVICE_CONFIG_PARSER_H
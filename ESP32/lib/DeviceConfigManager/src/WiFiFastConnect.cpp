@@ -0,0 +1,364 @@
+#include "WiFiFastConnect.h"
+#include <Preferences.h>
+#include <esp_netif.h>
+#include <esp_netif_net_stack.h>
+#include <esp_private/esp_clk.h>
+#include <lwip/dhcp.h>
+
+static const uint32_t CACHE_MAGIC = 0x57464332; // "WFC2"
+static const char *WIFI_CACHE_NAMESPACE = "wifi_cache";
+
+// Survives software resets and panics, not power cycles
+RTC_NOINIT_ATTR static WiFiConnectCache rtcCache;
+
+WiFiFastConnect::WiFiFastConnect()
+    : _eventsRegistered(false), _hasStaticIP(false), _cache(),
+      _cacheValid(false), _lock(xSemaphoreCreateMutex()),
+      _timeoutTimer(nullptr), _fallbackTaskHandle(nullptr), _attemptId(0),
+      _attemptActive(false), _attemptFast(false), _attemptCachedIp(false),
+      _attemptStart(0), _onCachedLease(false), _renewPending(false),
+      _leaseCounted(false), _stats() {}
+
+void WiFiFastConnect::setStaticIP(IPAddress ip, IPAddress gateway,
+                                  IPAddress subnet, IPAddress dns) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _hasStaticIP = true;
+  _staticIP = ip;
+  _staticGateway = gateway;
+  _staticSubnet = subnet;
+  _staticDns = dns;
+  xSemaphoreGive(_lock);
+}
+
+void WiFiFastConnect::begin(const String &ssid, const String &password) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _ssid = ssid;
+  _password = password;
+  if (!_eventsRegistered) {
+    WiFi.onEvent([this](arduino_event_id_t event, arduino_event_info_t info) {
+      xSemaphoreTake(_lock, portMAX_DELAY);
+      _onEvent(event, info);
+      xSemaphoreGive(_lock);
+    });
+    _timeoutTimer = xTimerCreate("wifiFast", pdMS_TO_TICKS(FAST_TIMEOUT_MS),
+                                 pdFALSE, this, _timeoutCallback);
+    xTaskCreate(_fallbackTask, "wifiFast", 4096, this, 1,
+                &_fallbackTaskHandle);
+    _eventsRegistered = true;
+  }
+  // The cache below replaces the driver's own copy in flash
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  _cacheValid = _loadCache();
+  _startAttempt(_cacheValid);
+  xSemaphoreGive(_lock);
+}
+
+void WiFiFastConnect::_startAttempt(bool fast) {
+  _attemptId++;
+  _attemptStart = millis();
+  _attemptFast = fast;
+  _attemptCachedIp = true;
+  if (_hasStaticIP) {
+    WiFi.config(_staticIP, _staticGateway, _staticSubnet, _staticDns);
+  } else if (fast && _leaseUsable()) {
+    WiFi.config(IPAddress(_cache.ip), IPAddress(_cache.gateway),
+                IPAddress(_cache.subnet), IPAddress(_cache.dns));
+  } else {
+    // Back to DHCP
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    _attemptCachedIp = false;
+  }
+  _onCachedLease = _attemptCachedIp && !_hasStaticIP;
+  _attemptActive = true;
+  _stats.attempts++;
+
+  if (fast) {
+    Serial.printf("[ConfigManager] Fast connect to %s: BSSID "
+                  "%02X:%02X:%02X:%02X:%02X:%02X, channel %u, %s\n",
+                  _ssid.c_str(), _cache.bssid[0], _cache.bssid[1],
+                  _cache.bssid[2], _cache.bssid[3], _cache.bssid[4],
+                  _cache.bssid[5], _cache.channel,
+                  _attemptCachedIp ? "cached IP" : "DHCP");
+    WiFi.begin(_ssid.c_str(), _password.c_str(), _cache.channel,
+               _cache.bssid, true);
+    xTimerStart(_timeoutTimer, 0);
+  } else {
+    Serial.printf("[ConfigManager] Connecting to WiFi: %s (full scan)\n",
+                  _ssid.c_str());
+    WiFi.begin(_ssid.c_str(), _password.c_str());
+  }
+}
+
+void WiFiFastConnect::_onEvent(arduino_event_id_t event,
+                               arduino_event_info_t info) {
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    if (_attemptActive) {
+      xTimerStop(_timeoutTimer, 0);
+      _endAttempt(true, 0);
+    }
+    _saveCache(_onCachedLease);
+    if (_onCachedLease && !_renewPending) {
+      // The address is up; have the server renew the lease. Not from the
+      // event task, as WiFi.config() waits on the network stack.
+      _renewPending = true;
+      xTaskNotify(_fallbackTaskHandle, 0, eSetValueWithOverwrite);
+    }
+  } else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) {
+    uint8_t reason = info.wifi_sta_disconnected.reason;
+    if (reason == WIFI_REASON_ASSOC_LEAVE) {
+      return; // our own disconnect
+    }
+    if (_attemptActive && _attemptFast) {
+      xTimerStop(_timeoutTimer, 0);
+      _fallBackToScan(reason);
+    } else if (_attemptActive) {
+      _endAttempt(false, reason);
+    }
+    if (!_attemptActive) {
+      // The driver reconnects by itself, with the IP settings of the last
+      // attempt; time that as an attempt too
+      _attemptStart = millis();
+      _attemptFast = false;
+      _attemptActive = true;
+      _stats.attempts++;
+    }
+  }
+}
+
+void WiFiFastConnect::_timeoutCallback(TimerHandle_t timer) {
+  WiFiFastConnect *self =
+      static_cast<WiFiFastConnect *>(pvTimerGetTimerID(timer));
+  // Read without the lock: a stale id only makes the task do nothing
+  xTaskNotify(self->_fallbackTaskHandle, self->_attemptId,
+              eSetValueWithOverwrite);
+}
+
+void WiFiFastConnect::_fallbackTask(void *param) {
+  WiFiFastConnect *self = static_cast<WiFiFastConnect *>(param);
+  for (;;) {
+    uint32_t attemptId = 0;
+    xTaskNotifyWait(0, 0, &attemptId, portMAX_DELAY);
+    xSemaphoreTake(self->_lock, portMAX_DELAY);
+    if (self->_renewPending) {
+      self->_renewPending = false;
+      if (self->_onCachedLease) {
+        Serial.println("[ConfigManager] Renewing the cached lease via DHCP");
+        self->_onCachedLease = false;
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+      }
+    }
+    // GOT_IP or a disconnect may have ended the attempt meanwhile
+    if (attemptId == self->_attemptId && self->_attemptActive &&
+        self->_attemptFast) {
+      self->_fallBackToScan(0);
+    }
+    xSemaphoreGive(self->_lock);
+  }
+}
+
+void WiFiFastConnect::_fallBackToScan(uint8_t reason) {
+  _endAttempt(false, reason);
+  _stats.fastFailures++;
+  Serial.printf("[ConfigManager] Fast connect failed (reason %u), falling "
+                "back to a full scan\n",
+                reason);
+  _dropCache();
+  WiFi.disconnect();
+  _startAttempt(false);
+}
+
+void WiFiFastConnect::_endAttempt(bool ok, uint8_t reason) {
+  _attemptActive = false;
+  WiFiConnectAttempt attempt;
+  attempt.fast = _attemptFast;
+  attempt.cachedIp = _attemptCachedIp;
+  attempt.ok = ok;
+  attempt.reason = reason;
+  attempt.ms = millis() - _attemptStart;
+
+  if (_stats.historyCount == WiFiConnectStats::HISTORY_SIZE) {
+    memmove(_stats.history, _stats.history + 1,
+            sizeof(_stats.history) - sizeof(_stats.history[0]));
+    _stats.historyCount--;
+  }
+  _stats.history[_stats.historyCount++] = attempt;
+  if (ok) {
+    if (attempt.fast) {
+      _stats.fastConnects++;
+    } else {
+      _stats.scanConnects++;
+    }
+  }
+  Serial.printf("[ConfigManager] WiFi %s attempt %s in %u ms (%s)\n",
+                attempt.fast ? "fast" : "scan", ok ? "connected" : "failed",
+                attempt.ms, attempt.cachedIp ? "cached IP" : "DHCP");
+}
+
+// Elapsed time is only known while the RTC clock has run since the lease
+// was granted, which is why only the RTC copy carries one
+bool WiFiFastConnect::_leaseUsable() const {
+  if (_cache.ip == 0 || _cache.leaseSeconds == 0 ||
+      _cache.leaseReuses >= MAX_LEASE_REUSES) {
+    return false;
+  }
+  uint64_t now = esp_clk_rtc_time();
+  if (now < _cache.leaseStartUs) {
+    return false; // the clock was reset
+  }
+  return (now - _cache.leaseStartUs) / 1000000 < _cache.leaseSeconds / 2;
+}
+
+// Lease time of the address DHCP just bound, 0 if unknown
+uint32_t WiFiFastConnect::_dhcpLeaseSeconds() {
+  esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  struct netif *lwip =
+      netif ? static_cast<struct netif *>(esp_netif_get_netif_impl(netif))
+            : nullptr;
+  struct dhcp *dhcp = lwip ? netif_dhcp_data(lwip) : nullptr;
+  return dhcp && dhcp->state == DHCP_STATE_BOUND ? dhcp->offered_t0_lease : 0;
+}
+
+// cachedLease: the address is the cached lease, not one DHCP just bound
+void WiFiFastConnect::_saveCache(bool cachedLease) {
+  WiFiConnectCache fresh = {};
+  fresh.magic = CACHE_MAGIC;
+  const uint8_t *bssid = WiFi.BSSID();
+  if (bssid) {
+    memcpy(fresh.bssid, bssid, sizeof(fresh.bssid));
+  }
+  fresh.channel = WiFi.channel();
+  if (cachedLease && _cacheValid) {
+    // Same lease and clock; counts up once per boot until DHCP renews it
+    fresh.ip = _cache.ip;
+    fresh.gateway = _cache.gateway;
+    fresh.subnet = _cache.subnet;
+    fresh.dns = _cache.dns;
+    fresh.leaseSeconds = _cache.leaseSeconds;
+    fresh.leaseStartUs = _cache.leaseStartUs;
+    fresh.leaseReuses = _cache.leaseReuses + (_leaseCounted ? 0 : 1);
+    _leaseCounted = true;
+  } else if (!_hasStaticIP) {
+    fresh.leaseSeconds = _dhcpLeaseSeconds();
+    if (fresh.leaseSeconds != 0) {
+      fresh.ip = WiFi.localIP();
+      fresh.gateway = WiFi.gatewayIP();
+      fresh.subnet = WiFi.subnetMask();
+      fresh.dns = WiFi.dnsIP();
+      fresh.leaseStartUs = esp_clk_rtc_time();
+    }
+  }
+
+  // NVS only when the AP changed: it holds no lease, which would not be
+  // valid after a power cycle of unknown length
+  bool changed = !_cacheValid ||
+                 memcmp(_cache.bssid, fresh.bssid, sizeof(fresh.bssid)) != 0 ||
+                 _cache.channel != fresh.channel;
+
+  fresh.checksum = _checksum(fresh);
+  _cache = fresh;
+  _cacheValid = true;
+  rtcCache = fresh;
+  if (changed) {
+    WiFiConnectCache stored = {};
+    stored.magic = CACHE_MAGIC;
+    memcpy(stored.bssid, fresh.bssid, sizeof(stored.bssid));
+    stored.channel = fresh.channel;
+    stored.checksum = _checksum(stored);
+    Preferences prefs;
+    if (prefs.begin(WIFI_CACHE_NAMESPACE, false)) {
+      prefs.putBytes("cache", &stored, sizeof(stored));
+      prefs.end();
+    }
+  }
+}
+
+bool WiFiFastConnect::_loadCache() {
+  if (rtcCache.magic == CACHE_MAGIC &&
+      rtcCache.checksum == _checksum(rtcCache)) {
+    _cache = rtcCache;
+    return true;
+  }
+  WiFiConnectCache stored = {};
+  Preferences prefs;
+  bool found = false;
+  if (prefs.begin(WIFI_CACHE_NAMESPACE, true)) {
+    found = prefs.getBytesLength("cache") == sizeof(stored) &&
+            prefs.getBytes("cache", &stored, sizeof(stored)) ==
+                sizeof(stored) &&
+            stored.magic == CACHE_MAGIC &&
+            stored.checksum == _checksum(stored);
+    prefs.end();
+  }
+  if (found) {
+    // Only the AP; a lease is never taken over from NVS
+    stored.ip = 0;
+    stored.leaseSeconds = 0;
+    stored.checksum = _checksum(stored);
+    _cache = stored;
+    rtcCache = stored;
+  }
+  return found;
+}
+
+void WiFiFastConnect::clearCache() {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _dropCache();
+  xSemaphoreGive(_lock);
+}
+
+void WiFiFastConnect::_dropCache() {
+  memset(&rtcCache, 0, sizeof(rtcCache));
+  _cache = WiFiConnectCache();
+  _cacheValid = false;
+  Preferences prefs;
+  if (prefs.begin(WIFI_CACHE_NAMESPACE, false)) {
+    prefs.remove("cache");
+    prefs.end();
+  }
+}
+
+uint32_t WiFiFastConnect::_checksum(const WiFiConnectCache &cache) {
+  // FNV-1a over everything but the checksum itself
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&cache);
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(WiFiConnectCache, checksum); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+WiFiConnectStats WiFiFastConnect::getStats() const {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  WiFiConnectStats stats = _stats;
+  xSemaphoreGive(_lock);
+  return stats;
+}
+
+void WiFiFastConnect::toJson(JsonObject wifi) const {
+  WiFiConnectStats stats = getStats();
+  wifi["attempts"] = stats.attempts;
+  wifi["fast"] = stats.fastConnects;
+  wifi["fast_failures"] = stats.fastFailures;
+  wifi["scan"] = stats.scanConnects;
+  JsonArray history = wifi["history"].to<JsonArray>();
+  for (size_t i = 0; i < stats.historyCount; i++) {
+    const WiFiConnectAttempt &attempt = stats.history[i];
+    JsonObject entry = history.add<JsonObject>();
+    entry["fast"] = attempt.fast;
+    entry["cached_ip"] = attempt.cachedIp;
+    entry["ok"] = attempt.ok;
+    entry["ms"] = attempt.ms;
+    if (!attempt.ok) {
+      entry["reason"] = attempt.reason;
+    }
+  }
+}
+
+void WiFiFastConnect::printStats() const {
+  WiFiConnectStats stats = getStats();
+  Serial.printf("[ConfigManager] WiFi attempts: %u, fast: %u, fast failures: "
+                "%u, scan: %u\n",
+                stats.attempts, stats.fastConnects, stats.fastFailures,
+                stats.scanConnects);
+}
@@ -0,0 +1,125 @@
+#ifndef WIFI_FAST_CONNECT_H
+#define WIFI_FAST_CONNECT_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+
+// One connection attempt, from WiFi.begin to GOT_IP or failure
+struct WiFiConnectAttempt {
+  bool fast;       // targeted the cached BSSID and channel, no scan
+  bool cachedIp;   // used the cached lease or the static IP, no DHCP
+  bool ok;
+  uint8_t reason;  // disconnect reason on failure, 0 on timeout
+  uint32_t ms;
+};
+
+struct WiFiConnectStats {
+  static const size_t HISTORY_SIZE = 4;
+
+  uint32_t attempts;
+  uint32_t fastConnects;
+  uint32_t fastFailures;
+  uint32_t scanConnects;
+  // Most recent attempts, oldest first
+  WiFiConnectAttempt history[HISTORY_SIZE];
+  size_t historyCount;
+};
+
+// What a good connection leaves behind for the next one. Kept in RTC memory
+// and NVS.
+struct WiFiConnectCache {
+  uint32_t magic;
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t leaseReuses; // boots in a row that skipped DHCP with this lease
+  uint32_t ip;         // 0 when there is no lease to reuse
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint32_t leaseSeconds; // as granted by the DHCP server
+  uint64_t leaseStartUs; // RTC clock when it was granted
+  uint32_t checksum;
+};
+
+// Connects to the configured network using what the last good connection
+// left behind: the BSSID and channel (no scan) and the DHCP lease (no DHCP),
+// or a static IP when one is configured. The cache lives in RTC memory,
+// which survives resets, and in NVS for power cycles. If the fast attempt
+// fails or times out, the cache is dropped and the driver does a full scan
+// and DHCP as before.
+//
+// The lease is only reused from RTC memory, where the RTC clock that times
+// it keeps running across resets; the NVS copy keeps the BSSID and channel
+// only. It is reused until half the lease time has passed (T1, when a DHCP
+// client renews), and for at most MAX_LEASE_REUSES boots in a row. Once the
+// cached address is up, DHCP is started again so the server renews the
+// lease; until then the address stays in use.
+//
+// The state is shared by the WiFi event task, the task that falls back
+// after a timeout and callers of the stats, so it is kept under a lock.
+class WiFiFastConnect {
+public:
+  static const uint32_t FAST_TIMEOUT_MS = 3000;
+  static const uint8_t MAX_LEASE_REUSES = 8;
+
+  WiFiFastConnect();
+
+  // Optional static address; replaces the cached lease
+  void setStaticIP(IPAddress ip, IPAddress gateway, IPAddress subnet,
+                   IPAddress dns = IPAddress());
+  // Starts connecting and returns
+  void begin(const String &ssid, const String &password);
+  void clearCache();
+
+  WiFiConnectStats getStats() const;
+  void toJson(JsonObject wifi) const;
+  void printStats() const;
+
+private:
+  // The methods below run with _lock held
+  void _onEvent(arduino_event_id_t event, arduino_event_info_t info);
+  void _startAttempt(bool fast);
+  void _endAttempt(bool ok, uint8_t reason);
+  void _fallBackToScan(uint8_t reason);
+  bool _leaseUsable() const;
+  void _saveCache(bool cachedLease);
+  bool _loadCache();
+  void _dropCache();
+  static uint32_t _checksum(const WiFiConnectCache &cache);
+  static uint32_t _dhcpLeaseSeconds();
+  // The timer task has little stack and must not block: it only wakes the
+  // fallback task, which does the NVS write and the new WiFi.begin. The
+  // event task wakes it too to start DHCP after a cached lease.
+  static void _timeoutCallback(TimerHandle_t timer);
+  static void _fallbackTask(void *self);
+
+  String _ssid;
+  String _password;
+  bool _eventsRegistered;
+  bool _hasStaticIP;
+  IPAddress _staticIP;
+  IPAddress _staticGateway;
+  IPAddress _staticSubnet;
+  IPAddress _staticDns;
+  WiFiConnectCache _cache;
+  bool _cacheValid;
+  SemaphoreHandle_t _lock;
+  TimerHandle_t _timeoutTimer;
+  TaskHandle_t _fallbackTaskHandle;
+  uint32_t _attemptId; // tells a late timeout from one of this attempt
+  bool _attemptActive;
+  bool _attemptFast;
+  bool _attemptCachedIp;
+  uint32_t _attemptStart;
+  bool _onCachedLease; // the interface runs on the cached lease, no DHCP
+  bool _renewPending;  // DHCP is to be started by the fallback task
+  bool _leaseCounted;  // this boot's reuse of the lease is counted
+  WiFiConnectStats _stats;
+};
+
+#endif // WIFI_FAST_CONNECT_H
@@ -0,0 +1,145 @@
+#include "MqttCommandDispatcher.h"
+#include "../../../include/DebugUtils.h"
+
+MqttCommandDispatcher::MqttCommandDispatcher()
+    : _queue(nullptr), _lock(nullptr) {
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+size_t MqttCommandDispatcher::add(Handler handler) {
+  _handlers.push_back(handler);
+  return _handlers.size() - 1;
+}
+
+void MqttCommandDispatcher::begin(ReplyFn reply, size_t workers,
+                                  uint32_t stackSize, UBaseType_t priority) {
+  if (_queue) {
+    return;
+  }
+  _reply = reply;
+  _lock = xSemaphoreCreateMutex();
+  _queue = xQueueCreate(MQTT_COMMAND_QUEUE_DEPTH, sizeof(Entry *));
+  for (size_t i = 0; i < workers; i++) {
+    xTaskCreate(
+        [](void *dispatcher) {
+          static_cast<MqttCommandDispatcher *>(dispatcher)->_workerLoop();
+        },
+        "mqttCmd", stackSize, this, priority, NULL);
+  }
+}
+
+bool MqttCommandDispatcher::submit(size_t handler, const char *topic,
+                                   const char *payload, size_t length) {
+  size_t topicLength = strlen(topic);
+  Entry *entry = nullptr;
+  if (_queue && handler < _handlers.size()) {
+    entry = static_cast<Entry *>(
+        malloc(sizeof(Entry) + topicLength + 1 + length + 1));
+  }
+  bool queued = false;
+  if (entry) {
+    entry->receivedAt = millis();
+    entry->handler = handler;
+    entry->topicLength = topicLength;
+    entry->length = length;
+    char *data = reinterpret_cast<char *>(entry + 1);
+    memcpy(data, topic, topicLength + 1);
+    memcpy(data + topicLength + 1, payload, length);
+    data[topicLength + 1 + length] = '\0';
+    queued = xQueueSend(_queue, &entry, 0) == pdTRUE;
+    if (!queued) {
+      free(entry);
+    }
+  }
+
+  if (_lock) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    _stats.received++;
+    if (!queued) {
+      _stats.dropped++;
+    }
+    xSemaphoreGive(_lock);
+  }
+  if (!queued) {
+    DEBUG_PRINTF("[MqttController] Command on %s dropped\n", topic);
+  }
+  return queued;
+}
+
+void MqttCommandDispatcher::_workerLoop() {
+  for (;;) {
+    Entry *entry = nullptr;
+    if (xQueueReceive(_queue, &entry, portMAX_DELAY) == pdTRUE && entry) {
+      _run(entry);
+      free(entry);
+    }
+  }
+}
+
+void MqttCommandDispatcher::_run(Entry *entry) {
+  uint32_t startedAt = millis();
+  const char *topic = reinterpret_cast<const char *>(entry + 1);
+  const char *payload = topic + entry->topicLength + 1;
+
+  // Only the correlation fields; the handler parses the rest itself
+  JsonDocument filter;
+  filter["request_id"] = true;
+  filter["sent_at"] = true;
+  JsonDocument fields;
+  deserializeJson(fields, payload, entry->length,
+                  DeserializationOption::Filter(filter));
+  const char *requestId = fields["request_id"] | "";
+
+  MqttCommand command = {topic, payload, entry->length, requestId,
+                         entry->receivedAt};
+  JsonDocument reply;
+  JsonObject replyObject = reply.to<JsonObject>();
+  _handlers[entry->handler](command, replyObject);
+
+  uint32_t queuedMs = startedAt - entry->receivedAt;
+  uint32_t handledMs = millis() - startedAt;
+  bool replied = requestId[0] != '\0' && _reply;
+  if (replied) {
+    replyObject["request_id"] = requestId;
+    if (!fields["sent_at"].isNull()) {
+      replyObject["sent_at"] = fields["sent_at"];
+    }
+    replyObject["topic"] = topic;
+    replyObject["queued_ms"] = queuedMs;
+    replyObject["handled_ms"] = handledMs;
+    _reply(reply.as<String>().c_str());
+  }
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _stats.handled++;
+  if (replied) {
+    _stats.replied++;
+  }
+  if (queuedMs > _stats.queuedMaxMs) {
+    _stats.queuedMaxMs = queuedMs;
+  }
+  if (handledMs > _stats.handledMaxMs) {
+    _stats.handledMaxMs = handledMs;
+  }
+  xSemaphoreGive(_lock);
+}
+
+MqttCommandStats MqttCommandDispatcher::getStats() const {
+  if (!_lock) {
+    return _stats;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  MqttCommandStats stats = _stats;
+  xSemaphoreGive(_lock);
+  return stats;
+}
+
+void MqttCommandDispatcher::toJson(JsonObject commands) const {
+  MqttCommandStats stats = getStats();
+  commands["received"] = stats.received;
+  commands["handled"] = stats.handled;
+  commands["dropped"] = stats.dropped;
+  commands["replied"] = stats.replied;
+  commands["queued_max_ms"] = stats.queuedMaxMs;
+  commands["handled_max_ms"] = stats.handledMaxMs;
+}
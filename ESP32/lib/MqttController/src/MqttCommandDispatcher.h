@@ -0,0 +1,97 @@
+#ifndef MQTT_COMMAND_DISPATCHER_H
+#define MQTT_COMMAND_DISPATCHER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <functional>
+#include <vector>
+
+// Commands waiting for a worker; further ones are dropped
+#ifndef MQTT_COMMAND_QUEUE_DEPTH
+#define MQTT_COMMAND_QUEUE_DEPTH 8
+#endif
+#ifndef MQTT_COMMAND_WORKERS
+#define MQTT_COMMAND_WORKERS 1
+#endif
+#ifndef MQTT_COMMAND_STACK
+#define MQTT_COMMAND_STACK 6144
+#endif
+#ifndef MQTT_COMMAND_PRIORITY
+#define MQTT_COMMAND_PRIORITY 1
+#endif
+
+// A command as a handler sees it. topic and payload are NUL terminated and
+// valid during the call.
+struct MqttCommand {
+  const char *topic;
+  const char *payload;
+  size_t length;
+  const char *requestId; // empty when the sender did not ask for a reply
+  uint32_t receivedAt;   // millis() on the MQTT task
+};
+
+struct MqttCommandStats {
+  uint32_t received;
+  uint32_t handled;
+  uint32_t dropped; // queue full or no memory
+  uint32_t replied;
+  uint32_t queuedMaxMs; // received to picked up by a worker
+  uint32_t handledMaxMs;
+};
+
+// Runs command handlers on worker tasks instead of the MQTT client's task,
+// so a slow handler (JSON parsing, starting an update) does not hold up the
+// TCP stack and its keepalives.
+//
+// submit() is called on the MQTT task: it copies topic and payload into one
+// allocation and queues the pointer. A worker takes it, reads request_id
+// and sent_at from the payload, runs the handler and, if there was a
+// request_id, passes a reply to the reply function:
+//   {"request_id", "sent_at" (echoed), "topic", "queued_ms", "handled_ms",
+//    ...fields set by the handler}
+// so the backend can match it to the request and measure the round trip.
+class MqttCommandDispatcher {
+public:
+  // Sets result fields on reply, e.g. reply["result"] = "accepted"
+  using Handler =
+      std::function<void(const MqttCommand &command, JsonObject reply)>;
+  using ReplyFn = std::function<void(const char *payload)>;
+
+  MqttCommandDispatcher();
+
+  // Returns the handler's number for submit(). Add them before begin().
+  size_t add(Handler handler);
+  void begin(ReplyFn reply, size_t workers = MQTT_COMMAND_WORKERS,
+             uint32_t stackSize = MQTT_COMMAND_STACK,
+             UBaseType_t priority = MQTT_COMMAND_PRIORITY);
+  // False if the command was dropped
+  bool submit(size_t handler, const char *topic, const char *payload,
+              size_t length);
+
+  MqttCommandStats getStats() const;
+  void toJson(JsonObject commands) const;
+
+private:
+  // Header of the queued copy; topic and payload follow, each NUL
+  // terminated
+  struct Entry {
+    uint32_t receivedAt;
+    uint16_t handler;
+    uint16_t topicLength;
+    size_t length;
+  };
+
+  void _workerLoop();
+  void _run(Entry *entry);
+
+  std::vector<Handler> _handlers;
+  ReplyFn _reply;
+  QueueHandle_t _queue;
+  SemaphoreHandle_t _lock; // stats, updated by the MQTT task and workers
+  MqttCommandStats _stats;
+};
+
+#endif // MQTT_COMMAND_DISPATCHER_H
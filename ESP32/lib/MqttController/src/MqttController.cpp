@@ -1,18 +1,34 @@
 #include "MqttController.h"
+#include <Preferences.h>
+#include <time.h>
 
-MqttController::MqttController() { _commandCallback = nullptr; }
+static const char *SESSION_NAMESPACE = "mqtt";
+static const char *SUBSCRIBED_KEY = "subs";
+
+MqttController::MqttController()
+    : _cleanSession(MQTT_CLEAN_SESSION), _subscribedHash(0),
+      _heartbeatTimer(nullptr), _heartbeatS(MQTT_HEARTBEAT_S),
+      _senderTask(nullptr), _inFlight(0), _disconnectedAt(0),
+      _offlineLogPartition(nullptr),
+      _offlineLogLock(xSemaphoreCreateMutex()), _offlineLogEpoch(0),
+      _replayedAt(0), _replayPending(false) {
+  memset(_disconnects, 0, sizeof(_disconnects));
+}
 
 void MqttController::updateConfig(const String &host, uint16_t port,
-                                  const String &user, const String &password) {
+                                  const String &user, const String &password,
+                                  bool connect) {
 
   _host = host;
   _port = port;
   _user = user;
   _password = password;
 
-  // Disconnect if currently connected
+  // Disconnect if currently connected. Forced, without a DISCONNECT
+  // packet, so the broker publishes the will and the old broker does not
+  // keep "online" for a device that moved away.
   if (_mqttClient.connected()) {
-    _mqttClient.disconnect();
+    _mqttClient.disconnect(true);
   }
 
   // Update server configuration
@@ -32,7 +48,7 @@ void MqttController::updateConfig(const String &host, uint16_t port,
   }
 
   // Connect to MQTT if WiFi is connected
-  if (WiFi.status() == WL_CONNECTED) {
+  if (connect && WiFi.status() == WL_CONNECTED) {
     connectToMqtt();
   }
 }
@@ -44,7 +60,7 @@ void MqttController::setClientId(const String &clientId) {
   // If currently connected, disconnect and reconnect to apply new client ID
   if (_mqttClient.connected()) {
     DEBUG_PRINTLN("[MqttController] Disconnecting to apply new client ID");
-    _mqttClient.disconnect();
+    _mqttClient.disconnect(true);
   }
 }
 
@@ -56,63 +72,130 @@ void MqttController::connectToMqtt() {
     DEBUG_PRINTF("[MqttController] Connecting with client ID: %s\n",
                  _clientId.c_str());
     _mqttClient.setClientId(_clientId.c_str());
+    _presenceTopic = String(MQTT_TOPIC_PRESENCE "/") + _clientId;
+    _mqttClient.setWill(_presenceTopic.c_str(), 1, true,
+                        MQTT_PRESENCE_OFFLINE);
   } else {
     DEBUG_PRINTLN("[MqttController] Connecting with auto-generated client ID");
   }
+  // A generated ID changes on every boot, so a session would never be
+  // found again and only linger on the broker
+  _mqttClient.setCleanSession(_cleanSession || _clientId.length() == 0);
 
   _mqttClient.connect();
 }
 
 void MqttController::onMqttConnect(bool sessionPresent) {
   DEBUG_PRINTLN("Connected to MQTT.");
-  uint16_t packetIdSub1 = _mqttClient.subscribe(MQTT_TOPIC_COMMAND, 2);
-  DEBUG_PRINTF("Subscribing to %s\n", MQTT_TOPIC_COMMAND);
-  uint16_t packetIdSub2 =
-      _mqttClient.subscribe(MQTT_TOPIC_COMMAND "/" PLATFORMIO_BOARD_NAME, 2);
-  DEBUG_PRINTF("Subscribing to %s\n",
-               MQTT_TOPIC_COMMAND "/" PLATFORMIO_BOARD_NAME);
+  _reconnectPolicy.connected(millis());
+
+  // A resumed session still holds the subscriptions; subscribing again
+  // would make the broker resend every retained message on them
+  if (sessionPresent && _subscribedHash == 0) {
+    Preferences prefs;
+    if (prefs.begin(SESSION_NAMESPACE, true)) {
+      _subscribedHash = prefs.getUInt(SUBSCRIBED_KEY, 0);
+      prefs.end();
+    }
+  }
+  if (sessionPresent && _subscribedHash == subscriptionHash()) {
+    DEBUG_PRINTLN("[MqttController] Session resumed, subscriptions kept");
+  } else {
+    subscribeAll();
+  }
+
+  // Birth message, replacing the will the broker may have published
+  if (_presenceTopic.length() > 0) {
+    sendMessage(_presenceTopic.c_str(), MQTT_PRESENCE_ONLINE, true,
+                MQTT_PRIORITY_ALARM, 1);
+    if (_heartbeatS > 0) {
+      xTimerChangePeriod(_heartbeatTimer, pdMS_TO_TICKS(_heartbeatS * 1000),
+                         0);
+    }
+  }
 
   // Call user-provided custom callback if it exists
   if (_connectCallback != nullptr) {
     _connectCallback(sessionPresent);
   }
+
+  // Whatever queued up while disconnected
+  xTaskNotifyGive(_senderTask);
 }
 
 void MqttController::onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
-  DEBUG_PRINT("Disconnected from MQTT. Reason: ");
-  switch (reason) {
+  uint8_t code = static_cast<uint8_t>(reason);
+  if (code < MQTT_DISCONNECT_REASONS) {
+    _disconnects[code]++;
+  }
+  DEBUG_PRINTF("Disconnected from MQTT. Reason: %s\n",
+               disconnectReasonName(code));
+
+  // The client drops unacknowledged packets with the connection, and the
+  // rest of a payload it was receiving
+  _inFlight = 0;
+  _assembler.reset();
+  _disconnectedAt = millis();
+  xTimerStop(_heartbeatTimer, 0);
+
+  if (WiFi.isConnected()) {
+    uint32_t delay = _reconnectPolicy.nextDelay(millis(), esp_random());
+    DEBUG_PRINTF("[MqttController] Reconnecting in %u ms (attempt %u)\n",
+                 delay, _reconnectPolicy.attempts());
+    xTimerChangePeriod(_mqttReconnectTimer, pdMS_TO_TICKS(delay), 0);
+  }
+}
+
+const char *MqttController::disconnectReasonName(uint8_t reason) {
+  switch (static_cast<AsyncMqttClientDisconnectReason>(reason)) {
   case AsyncMqttClientDisconnectReason::TCP_DISCONNECTED:
-    DEBUG_PRINTLN("TCP Disconnected");
-    break;
+    return "tcp_disconnected";
   case AsyncMqttClientDisconnectReason::MQTT_UNACCEPTABLE_PROTOCOL_VERSION:
-    DEBUG_PRINTLN("Unacceptable Protocol Version");
-    break;
+    return "unacceptable_protocol_version";
   case AsyncMqttClientDisconnectReason::MQTT_IDENTIFIER_REJECTED:
-    DEBUG_PRINTLN("Identifier Rejected");
-    break;
+    return "identifier_rejected";
   case AsyncMqttClientDisconnectReason::MQTT_SERVER_UNAVAILABLE:
-    DEBUG_PRINTLN("Server Unavailable");
-    break;
+    return "server_unavailable";
   case AsyncMqttClientDisconnectReason::MQTT_MALFORMED_CREDENTIALS:
-    DEBUG_PRINTLN("Malformed Credentials");
-    break;
+    return "malformed_credentials";
   case AsyncMqttClientDisconnectReason::MQTT_NOT_AUTHORIZED:
-    DEBUG_PRINTLN("Not Authorized");
-    break;
+    return "not_authorized";
   case AsyncMqttClientDisconnectReason::ESP8266_NOT_ENOUGH_SPACE:
-    DEBUG_PRINTLN("Not Enough Space");
-    break;
+    return "not_enough_space";
   case AsyncMqttClientDisconnectReason::TLS_BAD_FINGERPRINT:
-    DEBUG_PRINTLN("TLS Bad Fingerprint");
-    break;
-  default:
-    DEBUG_PRINTLN("Unknown");
-    break;
+    return "tls_bad_fingerprint";
   }
+  return "unknown";
+}
 
-  if (WiFi.isConnected()) {
-    xTimerStart(_mqttReconnectTimer, 0);
+void MqttController::reconnectToJson(JsonObject reconnect) const {
+  JsonObject disconnects = reconnect["disconnects"].to<JsonObject>();
+  for (uint8_t i = 0; i < MQTT_DISCONNECT_REASONS; i++) {
+    if (_disconnects[i] > 0) {
+      disconnects[disconnectReasonName(i)] = _disconnects[i];
+    }
+  }
+  reconnect["attempts"] = _reconnectPolicy.attempts();
+  reconnect["last_delay_ms"] = _reconnectPolicy.lastDelay();
+}
+
+void MqttController::printReconnectStats() const {
+  Serial.printf("[MqttController] Reconnected after %u attempts, last delay "
+                "%u ms; disconnects:",
+                _reconnectPolicy.attempts(), _reconnectPolicy.lastDelay());
+  for (uint8_t i = 0; i < MQTT_DISCONNECT_REASONS; i++) {
+    if (_disconnects[i] > 0) {
+      Serial.printf(" %s %u", disconnectReasonName(i), _disconnects[i]);
+    }
+  }
+  Serial.println();
+}
+
+void MqttController::onMqttPublish(uint16_t packetId) {
+  if (_inFlight > 0) {
+    _inFlight--;
   }
+  xTaskNotifyGive(_senderTask);
 }
 
 void MqttController::onMqttSubscribe(uint16_t packetId, uint8_t qos) {
@@ -122,16 +205,330 @@ void MqttController::onMqttSubscribe(uint16_t packetId, uint8_t qos) {
 void MqttController::onMqttMessage(char *topic, char *payload,
                                    AsyncMqttClientMessageProperties properties,
                                    size_t len, size_t index, size_t total) {
-  char message[len + 1];
-  memcpy(message, payload, len);
-  message[len] = '\0';
-  DEBUG_PRINTF("Message received on topic %s: %s\n", topic, message);
+  const char *data;
+  size_t length;
+  if (!_assembler.feed(payload, len, index, total, data, length)) {
+    return;
+  }
+  DEBUG_PRINTF("Message received on topic %s: %.*s\n", topic, (int)length,
+               data);
+
+  if (_router.dispatch(topic, data, length) == 0) {
+    DEBUG_PRINTF("[MqttController] No handler for topic %s\n", topic);
+  }
+}
+
+bool MqttController::onCommand(const char *filter,
+                               MqttCommandDispatcher::Handler handler) {
+  size_t number = _commands.add(handler);
+  return _router.add(filter, [this, number](const char *topic,
+                                            const char *payload,
+                                            size_t length) {
+    _commands.submit(number, topic, payload, length);
+  });
+}
+
+void MqttController::addSubscription(const String &topic, uint8_t qos) {
+  _subscriptions.push_back(std::make_pair(topic, qos));
+  if (_mqttClient.connected()) {
+    _mqttClient.subscribe(topic.c_str(), qos);
+    storeSubscribedHash(subscriptionHash());
+  }
+}
+
+// On the timer task. Not queued while disconnected: a stale heartbeat
+// says nothing.
+void MqttController::sendHeartbeat() {
+  if (!_mqttClient.connected() || _presenceTopic.length() == 0) {
+    return;
+  }
+  MqttHeartbeat heartbeat = {
+      static_cast<uint32_t>(millis() / 1000),
+      static_cast<int8_t>(WiFi.RSSI()),
+      ESP.getFreeHeap() / 1024,
+  };
+  char payload[40];
+  if (mqttFormatHeartbeat(payload, sizeof(payload), heartbeat)) {
+    sendMessage(_presenceTopic.c_str(), payload, false,
+                MQTT_PRIORITY_TELEMETRY);
+  }
+}
+
+void MqttController::subscribeAll() {
+  _mqttClient.subscribe(MQTT_TOPIC_COMMAND, 2);
+  DEBUG_PRINTF("Subscribing to %s\n", MQTT_TOPIC_COMMAND);
+  _mqttClient.subscribe(MQTT_TOPIC_COMMAND "/" PLATFORMIO_BOARD_NAME, 2);
+  DEBUG_PRINTF("Subscribing to %s\n",
+               MQTT_TOPIC_COMMAND "/" PLATFORMIO_BOARD_NAME);
+  for (const auto &subscription : _subscriptions) {
+    _mqttClient.subscribe(subscription.first.c_str(), subscription.second);
+    DEBUG_PRINTF("Subscribing to %s\n", subscription.first.c_str());
+  }
+  storeSubscribedHash(subscriptionHash());
+}
+
+// FNV-1a over every topic and QoS subscribeAll() sends. Never 0, which
+// stands for unknown.
+uint32_t MqttController::subscriptionHash() const {
+  uint32_t hash = 2166136261u;
+  auto mix = [&hash](const char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+      hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    }
+  };
+  auto add = [&mix](const char *topic, uint8_t qos) {
+    mix(topic, strlen(topic) + 1);
+    mix(reinterpret_cast<const char *>(&qos), 1);
+  };
+  add(MQTT_TOPIC_COMMAND, 2);
+  add(MQTT_TOPIC_COMMAND "/" PLATFORMIO_BOARD_NAME, 2);
+  for (const auto &subscription : _subscriptions) {
+    add(subscription.first.c_str(), subscription.second);
+  }
+  return hash ? hash : 1;
+}
+
+// Kept in NVS so the first connect after a reboot can trust the session
+// too. Written only when it changes.
+void MqttController::storeSubscribedHash(uint32_t hash) {
+  if (hash == _subscribedHash) {
+    return;
+  }
+  _subscribedHash = hash;
+  Preferences prefs;
+  if (prefs.begin(SESSION_NAMESPACE, false)) {
+    prefs.putUInt(SUBSCRIBED_KEY, hash);
+    prefs.end();
+  }
+}
+
+bool MqttController::sendMessage(const char *topic, const char *payload,
+                                 bool retain, MqttPriority priority,
+                                 uint8_t qos) {
+  return sendMessage(topic, reinterpret_cast<const uint8_t *>(payload),
+                     strlen(payload), retain, priority, qos);
+}
+
+bool MqttController::sendMessage(const char *topic, const uint8_t *payload,
+                                 size_t length, bool retain,
+                                 MqttPriority priority, uint8_t qos) {
+  if (!_publishQueue.push(priority, topic,
+                          reinterpret_cast<const char *>(payload), length,
+                          qos, retain)) {
+    DEBUG_PRINTF("[MqttController] Could not queue message to %s\n", topic);
+    return false;
+  }
+  if (_senderTask) {
+    xTaskNotifyGive(_senderTask);
+  }
+  return true;
+}
+
+// The only task that publishes. Woken by a new message, a connect or an
+// acknowledgement; while messages wait on a refused publish, an outage or
+// the replay rate it polls every 100 ms.
+void MqttController::senderLoop() {
+  mountOfflineLog();
+  for (;;) {
+    bool idle = _publishQueue.empty() && !_replayPending;
+    ulTaskNotifyTake(pdTRUE, idle ? portMAX_DELAY : pdMS_TO_TICKS(100));
+    if (!_mqttClient.connected()) {
+      if (_offlineLog.ready() &&
+          millis() - _disconnectedAt >= MQTT_OFFLINE_SPILL_MS) {
+        spillToOfflineLog();
+      }
+      continue;
+    }
+
+    size_t batch = 0;
+    bool drained = false;
+    while (_mqttClient.connected() && _inFlight < MQTT_MAX_INFLIGHT) {
+      MqttPriority priority;
+      MqttOutMessage *message = _publishQueue.take(priority);
+      if (!message) {
+        drained = true;
+        break;
+      }
+      uint16_t packetId = _mqttClient.publish(
+          message->topic.c_str(), message->qos, message->retain,
+          message->payload.c_str(), message->payload.length());
+      if (packetId == 0) {
+        // Disconnected meanwhile, or too little heap for the packet
+        _publishQueue.requeue(priority, message);
+        break;
+      }
+      if (message->qos > 0) {
+        _inFlight++;
+      }
+      _publishQueue.sent(priority, message);
+      if (++batch == MQTT_SEND_BATCH) {
+        // Let async_tcp put the batch on the wire
+        batch = 0;
+        vTaskDelay(1);
+      }
+    }
+    if (drained && _replayPending) {
+      replayOfflineLog();
+    }
+  }
+}
+
+// Data subtypes the offline log must not erase: IDF system data (ota, phy,
+// nvs, coredump, nvs_keys, efuse) and filesystems (esphttpd, fat, spiffs,
+// littlefs). Written as numbers since littlefs is missing from older IDFs.
+static bool isReservedDataSubtype(esp_partition_subtype_t subtype) {
+  return subtype <= 0x05 || (subtype >= 0x80 && subtype <= 0x83);
+}
 
-  if (_commandCallback != nullptr) {
-    _commandCallback(topic, message); // 传递 topic 和 payload
+bool MqttController::enableOfflineLog(const char *partitionLabel) {
+  _offlineLogPartition = nullptr;
+  const esp_partition_t *partition = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partitionLabel);
+  if (!partition) {
+    DEBUG_PRINTF("[MqttController] No partition '%s' for the offline log\n",
+                 partitionLabel);
+    return false;
   }
+  if (isReservedDataSubtype(partition->subtype)) {
+    DEBUG_PRINTF("[MqttController] Partition '%s' has subtype 0x%02x, not "
+                 "using it for the offline log\n",
+                 partitionLabel, partition->subtype);
+    return false;
+  }
+  _offlineLogPartition = partition;
+  return true;
+}
+
+void MqttController::mountOfflineLog() {
+  const esp_partition_t *partition = _offlineLogPartition;
+  if (!partition) {
+    return;
+  }
+  xSemaphoreTake(_offlineLogLock, portMAX_DELAY);
+  bool mounted = _offlineLog.begin(
+      partition->size,
+      [partition](uint32_t offset, void *data, size_t len) {
+        return esp_partition_read(partition, offset, data, len) == ESP_OK;
+      },
+      [partition](uint32_t offset, size_t len) {
+        return esp_partition_erase_range(partition, offset, len) == ESP_OK;
+      },
+      [partition](uint32_t offset, const void *data, size_t len) {
+        return esp_partition_write(partition, offset, data, len) == ESP_OK;
+      });
+  if (mounted) {
+    _offlineLog.setRetention(MQTT_OFFLINE_MAX_BYTES, MQTT_OFFLINE_MAX_AGE_S);
+    _offlineLogEpoch = _offlineLog.newestTime();
+    _replayPending = _offlineLog.hasPending();
+  }
+  xSemaphoreGive(_offlineLogLock);
+  if (!mounted) {
+    DEBUG_PRINTLN("[MqttController] Offline log could not be mounted");
+    return;
+  }
+  DEBUG_PRINTF("[MqttController] Offline log: %u of %u bytes in use%s\n",
+               _offlineLog.usedBytes(), _offlineLog.capacity(),
+               _replayPending ? ", replay pending" : "");
+}
+
+// Seconds for record ages. Without a synced wall clock this continues from
+// the newest record, so time spent powered off is not counted.
+uint32_t MqttController::offlineLogClock() const {
+  time_t now = time(nullptr);
+  if (now > 1600000000) {
+    return now;
+  }
+  return _offlineLogEpoch + millis() / 1000;
+}
+
+void MqttController::spillToOfflineLog() {
+  uint32_t now = offlineLogClock();
+  size_t count = 0;
+  MqttPriority priority;
+  MqttOutMessage *message;
+  xSemaphoreTake(_offlineLogLock, portMAX_DELAY);
+  while ((message = _publishQueue.take(priority)) != nullptr) {
+    bool ok = _offlineLog.append(message->topic.c_str(),
+                                 message->payload.c_str(),
+                                 message->payload.length(), message->qos,
+                                 message->retain, now);
+    _publishQueue.stored(priority, message, ok);
+    _replayPending = _replayPending || ok;
+    count++;
+  }
+  if (count > 0) {
+    _offlineLog.compact(now);
+  }
+  xSemaphoreGive(_offlineLogLock);
+  if (count > 0) {
+    DEBUG_PRINTF("[MqttController] Moved %u messages to the offline log\n",
+                 (unsigned)count);
+  }
+}
+
+// Oldest first, at MQTT_REPLAY_PER_SECOND. Replayed messages are never
+// retained: they are history, and must not replace the retained state a
+// live message has published since.
+void MqttController::replayOfflineLog() {
+  uint32_t now = millis();
+  uint32_t budget = (now - _replayedAt) * MQTT_REPLAY_PER_SECOND / 1000;
+  if (budget == 0) {
+    return;
+  }
+  if (budget > MQTT_REPLAY_PER_SECOND) {
+    budget = MQTT_REPLAY_PER_SECOND;
+  }
+  _replayedAt = now;
+
+  xSemaphoreTake(_offlineLogLock, portMAX_DELAY);
+  _offlineLog.compact(offlineLogClock());
+  MqttOfflineLog::Record record;
+  while (budget > 0 && _mqttClient.connected() &&
+         _inFlight < MQTT_MAX_INFLIGHT) {
+    if (!_offlineLog.peek(record)) {
+      _replayPending = false;
+      DEBUG_PRINTLN("[MqttController] Offline log replayed");
+      break;
+    }
+    if (_mqttClient.publish(record.topic, record.qos, false, record.payload,
+                            record.payloadLength) == 0) {
+      break;
+    }
+    if (record.qos > 0) {
+      _inFlight++;
+    }
+    _offlineLog.consume();
+    budget--;
+  }
+  xSemaphoreGive(_offlineLogLock);
+}
+
+// Called from other tasks: the figures are copied under the lock
+void MqttController::offlineLogToJson(JsonObject log) const {
+  xSemaphoreTake(_offlineLogLock, portMAX_DELAY);
+  MqttOfflineLogStats stats = _offlineLog.getStats();
+  uint32_t used = _offlineLog.usedBytes();
+  uint32_t capacity = _offlineLog.capacity();
+  xSemaphoreGive(_offlineLogLock);
+  log["used"] = used;
+  log["capacity"] = capacity;
+  log["appended"] = stats.appended;
+  log["replayed"] = stats.replayed;
+  log["dropped"] = stats.dropped;
+  log["expired"] = stats.expired;
+  log["corrupt"] = stats.corrupt;
+  log["erases"] = stats.erases;
 }
 
-void MqttController::sendMessage(const char *topic, const char *payload) {
-  _mqttClient.publish(topic, 0, true, payload);
+void MqttController::printOfflineLogStats() const {
+  xSemaphoreTake(_offlineLogLock, portMAX_DELAY);
+  MqttOfflineLogStats stats = _offlineLog.getStats();
+  uint32_t used = _offlineLog.usedBytes();
+  uint32_t capacity = _offlineLog.capacity();
+  xSemaphoreGive(_offlineLogLock);
+  Serial.printf("[MqttController] Offline log: %u/%u bytes, appended: %u, "
+                "replayed: %u, dropped: %u, expired: %u, corrupt: %u, "
+                "erases: %u\n",
+                used, capacity, stats.appended, stats.replayed, stats.dropped,
+                stats.expired, stats.corrupt, stats.erases);
 }
\ No newline at end of file
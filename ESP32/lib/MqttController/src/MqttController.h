@@ -3,11 +3,81 @@
 
 #include "../../../include/DebugUtils.h"
 #include "../../../include/secrets.h" // 在头文件中包含，因为实现也在这里
+#include "MqttCommandDispatcher.h"
+#include "MqttMessageAssembler.h"
+#include "MqttOfflineLog.h"
+#include "MqttPresence.h"
+#include "MqttPublishQueue.h"
+#include "MqttReconnectPolicy.h"
+#include "MqttTopicRouter.h"
 #include <ArduinoJson.h>
 #include <AsyncMqttClient.h>
 #include <WiFi.h>
+#include <atomic>
+#include <esp_partition.h>
+#include <vector>
+
+// QoS 1/2 publishes handed to the client and not yet acknowledged. The
+// sender stops there, so a slow link does not pile packets up in the
+// client's own unbounded buffer.
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 4
+#endif
+// Publishes handed over before the sender yields to the network task
+#ifndef MQTT_SEND_BATCH
+#define MQTT_SEND_BATCH 8
+#endif
+
+// Store and forward: dedicated data partition holding the offline log (see
+// partitions.csv). Filesystem partitions are refused, never erased.
+#ifndef MQTT_OFFLINE_LOG_PARTITION
+#define MQTT_OFFLINE_LOG_PARTITION "mqttlog"
+#endif
+// Messages still queued this long into an outage are moved to flash
+#ifndef MQTT_OFFLINE_SPILL_MS
+#define MQTT_OFFLINE_SPILL_MS 10000
+#endif
+// Retention; 0 bytes means the whole partition
+#ifndef MQTT_OFFLINE_MAX_BYTES
+#define MQTT_OFFLINE_MAX_BYTES 0
+#endif
+#ifndef MQTT_OFFLINE_MAX_AGE_S
+#define MQTT_OFFLINE_MAX_AGE_S (7 * 24 * 3600)
+#endif
+// Replayed messages per second after reconnecting, after live ones
+#ifndef MQTT_REPLAY_PER_SECOND
+#define MQTT_REPLAY_PER_SECOND 20
+#endif
+
+// Persistent session: the broker keeps the subscriptions and queues QoS 1/2
+// messages for the client ID while the device is away. Needs a fixed client
+// ID (setClientId()); without one the session is always clean.
+#ifndef MQTT_CLEAN_SESSION
+#define MQTT_CLEAN_SESSION false
+#endif
+
+// Presence: MQTT_TOPIC_PRESENCE "/" <client ID> holds a retained "online"
+// (birth message) or "offline" (Last Will, published by the broker once
+// it has not heard from the device for 1.5 keepalives). Heartbeats go to
+// the same topic, not retained, every MQTT_HEARTBEAT_S; 0 disables them.
+#ifndef MQTT_TOPIC_PRESENCE
+#define MQTT_TOPIC_PRESENCE MQTT_TOPIC_STATUS "/presence"
+#endif
+#ifndef MQTT_KEEPALIVE_S
+#define MQTT_KEEPALIVE_S 60
+#endif
+#ifndef MQTT_HEARTBEAT_S
+#define MQTT_HEARTBEAT_S 300
+#endif
+
+// One counter per AsyncMqttClientDisconnectReason
+#define MQTT_DISCONNECT_REASONS 8
+
+// Replies to commands that carry a request_id
+#ifndef MQTT_TOPIC_COMMAND_REPLY
+#define MQTT_TOPIC_COMMAND_REPLY MQTT_TOPIC_COMMAND "/reply"
+#endif
 
-typedef void (*CommandCallback)(const char *topic, const char *commandPayload);
 typedef void (*MqttConnectCallback)(bool sessionPresent);
 
 class MqttController {
@@ -23,6 +93,14 @@ public:
                            ->connectToMqtt();
                      });
 
+    _heartbeatTimer = xTimerCreate(
+        "mqttBeat", pdMS_TO_TICKS(_heartbeatS ? _heartbeatS * 1000 : 1000),
+        pdTRUE, (void *)this, [](TimerHandle_t xTimer) {
+          static_cast<MqttController *>(pvTimerGetTimerID(xTimer))
+              ->sendHeartbeat();
+        });
+    _mqttClient.setKeepAlive(MQTT_KEEPALIVE_S);
+
     _mqttClient.onConnect(
         [this](bool sessionPresent) { this->onMqttConnect(sessionPresent); });
     _mqttClient.onDisconnect([this](AsyncMqttClientDisconnectReason reason) {
@@ -36,6 +114,19 @@ public:
                                  size_t len, size_t index, size_t total) {
       this->onMqttMessage(topic, payload, properties, len, index, total);
     });
+    _mqttClient.onPublish(
+        [this](uint16_t packetId) { this->onMqttPublish(packetId); });
+
+    _publishQueue.begin();
+    _commands.begin([this](const char *reply) {
+      sendMessage(MQTT_TOPIC_COMMAND_REPLY, reply, false,
+                  MQTT_PRIORITY_STATUS, 1);
+    });
+    xTaskCreate(
+        [](void *controller) {
+          static_cast<MqttController *>(controller)->senderLoop();
+        },
+        "mqttSend", 4096, this, 2, &_senderTask);
 
 // Use default configuration from secrets.h if available
 #ifdef MQTT_HOST
@@ -51,23 +142,80 @@ public:
     }
   }
 
-  // Dynamic configuration method
+  // Dynamic configuration method. With connect false the settings only
+  // take effect on the next connectToMqtt(), e.g. one the caller makes
+  // itself at boot.
   void updateConfig(const String &host, uint16_t port, const String &user = "",
-                    const String &password = "");
+                    const String &password = "", bool connect = true);
 
   // Set client ID method
   void setClientId(const String &clientId);
+  // Takes effect on the next connect
+  void setCleanSession(bool cleanSession) { _cleanSession = cleanSession; }
+  // Seconds between heartbeats, 0 for none; call before Begin()
+  void setHeartbeatInterval(uint16_t seconds) { _heartbeatS = seconds; }
+  // Empty until a client ID is set
+  const String &getPresenceTopic() const { return _presenceTopic; }
 
-  // Setter methods for callbacks
-  void setOnMqttMessage(CommandCallback callback) {
-    _commandCallback = callback;
+  // Calls handler for every message whose topic matches filter ('+' and
+  // '#' wildcards), with the whole payload once all its fragments are in.
+  // Register before Begin(); handlers run on the MQTT task and must not
+  // block. False if the filter is malformed.
+  bool onMessage(const char *filter, MqttTopicRouter::Handler handler) {
+    return _router.add(filter, handler);
+  }
+  // Like onMessage(), but the handler runs on a command worker task, off
+  // the MQTT task, and commands with a request_id get a reply on
+  // MQTT_TOPIC_COMMAND_REPLY. Register before Begin().
+  bool onCommand(const char *filter, MqttCommandDispatcher::Handler handler);
+  const MqttCommandDispatcher &getCommandDispatcher() const {
+    return _commands;
+  }
+  MqttReceiveStats getReceiveStats() const {
+    return _assembler.getStats();
   }
 
+  // Setter methods for callbacks
   void setOnMqttConnect(MqttConnectCallback callback) {
     _connectCallback = callback;
   }
 
-  void sendMessage(const char *topic, const char *payload);
+  // Queues the message for the sender task and returns; it waits there
+  // while MQTT is down. False only if it could not be queued at all.
+  bool sendMessage(const char *topic, const char *payload, bool retain = true,
+                   MqttPriority priority = MQTT_PRIORITY_STATUS,
+                   uint8_t qos = 0);
+  // Binary payloads, e.g. MessagePack
+  bool sendMessage(const char *topic, const uint8_t *payload, size_t length,
+                   bool retain = true,
+                   MqttPriority priority = MQTT_PRIORITY_STATUS,
+                   uint8_t qos = 0);
+
+  const MqttPublishQueue &getPublishQueue() const { return _publishQueue; }
+
+  // Keeps messages from long outages in a flash partition and replays them
+  // after reconnecting. The partition is erased raw, so one holding a
+  // filesystem or system data is refused. Call before Begin(); the log is
+  // mounted by the sender task.
+  bool
+  enableOfflineLog(const char *partitionLabel = MQTT_OFFLINE_LOG_PARTITION);
+  void offlineLogToJson(JsonObject log) const;
+  void printOfflineLogStats() const;
+
+  // Reconnect backoff (see MqttReconnectPolicy); call before Begin()
+  void setReconnectPolicy(uint32_t baseMs, uint32_t capMs, uint32_t stableMs) {
+    _reconnectPolicy.configure(baseMs, capMs, stableMs);
+  }
+  // Disconnects by reason and the attempts of the current backoff
+  void reconnectToJson(JsonObject reconnect) const;
+  void printReconnectStats() const;
+  static const char *disconnectReasonName(uint8_t reason);
+
+  // Subscribed on every connect, along with the command topics
+  void addSubscription(const String &topic, uint8_t qos = 1);
+
+  // MQTT连接函数（在WiFi获得IP后调用）
+  void connectToMqtt();
 
 private:
   AsyncMqttClient _mqttClient;
@@ -77,22 +225,52 @@ private:
   String _user;
   String _password;
   String _clientId;
+  bool _cleanSession;
+  std::vector<std::pair<String, uint8_t>> _subscriptions;
+  uint32_t _subscribedHash; // subscription set the broker's session holds
 
   TimerHandle_t _mqttReconnectTimer;
+  TimerHandle_t _heartbeatTimer;
+  uint16_t _heartbeatS;
+  String _presenceTopic; // the client keeps a pointer to it for the will
+  MqttReconnectPolicy _reconnectPolicy;
+  uint32_t _disconnects[MQTT_DISCONNECT_REASONS];
+
+  MqttPublishQueue _publishQueue;
+  TaskHandle_t _senderTask;
+  std::atomic<uint8_t> _inFlight;
+  volatile uint32_t _disconnectedAt;
+
+  const esp_partition_t *_offlineLogPartition;
+  MqttOfflineLog _offlineLog; // written by the sender task
+  SemaphoreHandle_t _offlineLogLock; // held while it is changed or read
+  uint32_t _offlineLogEpoch;
+  uint32_t _replayedAt;
+  bool _replayPending;
+
+  MqttMessageAssembler _assembler;
+  MqttTopicRouter _router;
+  MqttCommandDispatcher _commands;
 
-  CommandCallback _commandCallback;
   MqttConnectCallback _connectCallback;
 
   // MQTT事件处理函数
   void onMqttConnect(bool sessionPresent);
+  void subscribeAll();
+  uint32_t subscriptionHash() const;
+  void storeSubscribedHash(uint32_t hash);
   void onMqttDisconnect(AsyncMqttClientDisconnectReason reason);
   void onMqttSubscribe(uint16_t packetId, uint8_t qos);
+  void onMqttPublish(uint16_t packetId);
+  void sendHeartbeat();
+  void senderLoop();
+  void mountOfflineLog();
+  uint32_t offlineLogClock() const;
+  void spillToOfflineLog();
+  void replayOfflineLog();
   void onMqttMessage(char *topic, char *payload,
                      AsyncMqttClientMessageProperties properties, size_t len,
                      size_t index, size_t total);
-
-  // MQTT连接函数
-  void connectToMqtt();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,110 @@
+#include "MqttMessageAssembler.h"
+#include <stdlib.h>
+#include <string.h>
+
+MqttMessageAssembler::MqttMessageAssembler(size_t maxPayload)
+    : _maxPayload(maxPayload), _current(nullptr), _total(0), _received(0),
+      _skipping(false) {
+  const size_t classes[POOL_CLASSES] = {1024, 4096, maxPayload};
+  for (size_t i = 0; i < POOL_CLASSES; i++) {
+    _buffers[i] = nullptr;
+    _sizes[i] = classes[i] < maxPayload ? classes[i] : maxPayload;
+  }
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+MqttMessageAssembler::~MqttMessageAssembler() {
+  for (size_t i = 0; i < POOL_CLASSES; i++) {
+    free(_buffers[i]);
+  }
+}
+
+bool MqttMessageAssembler::feed(const char *fragment, size_t length,
+                                size_t index, size_t total, const char *&data,
+                                size_t &size) {
+  if (index == 0) {
+    if (_current != nullptr) {
+      // The previous payload never finished
+      _stats.incomplete++;
+    }
+    _current = nullptr;
+    _skipping = false;
+
+    if (length == total) {
+      _stats.messages++;
+      data = fragment;
+      size = length;
+      return true;
+    }
+    if (total > _maxPayload) {
+      _stats.oversized++;
+      _skipping = true;
+    } else if ((_current = _acquire(total)) == nullptr) {
+      _stats.noMemory++;
+      _skipping = true;
+    }
+    _total = total;
+    _received = 0;
+  }
+
+  if (_skipping) {
+    if (index + length >= _total) {
+      _skipping = false;
+    }
+    return false;
+  }
+  if (_current == nullptr || index != _received || total != _total ||
+      length > _total - _received) {
+    // A fragment of a payload whose start we missed, or out of order
+    if (_current != nullptr) {
+      _stats.incomplete++;
+      _current = nullptr;
+    }
+    return false;
+  }
+
+  memcpy(_current + _received, fragment, length);
+  _received += length;
+  if (_received < _total) {
+    return false;
+  }
+  _stats.messages++;
+  _stats.reassembled++;
+  data = _current;
+  size = _total;
+  _current = nullptr;
+  return true;
+}
+
+void MqttMessageAssembler::reset() {
+  if (_current != nullptr) {
+    _stats.incomplete++;
+  }
+  _current = nullptr;
+  _skipping = false;
+}
+
+size_t MqttMessageAssembler::pooledBytes() const {
+  size_t bytes = 0;
+  for (size_t i = 0; i < POOL_CLASSES; i++) {
+    if (_buffers[i] != nullptr) {
+      bytes += _sizes[i];
+    }
+  }
+  return bytes;
+}
+
+// Smallest size class the payload fits in. Payloads are gathered one at a
+// time, so each class needs a single buffer.
+char *MqttMessageAssembler::_acquire(size_t total) {
+  for (size_t i = 0; i < POOL_CLASSES; i++) {
+    if (total > _sizes[i]) {
+      continue;
+    }
+    if (_buffers[i] == nullptr) {
+      _buffers[i] = static_cast<char *>(malloc(_sizes[i]));
+    }
+    return _buffers[i];
+  }
+  return nullptr;
+}
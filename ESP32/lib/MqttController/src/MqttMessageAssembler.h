@@ -0,0 +1,64 @@
+#ifndef MQTT_MESSAGE_ASSEMBLER_H
+#define MQTT_MESSAGE_ASSEMBLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest incoming payload kept; larger messages are dropped
+#ifndef MQTT_RX_MAX_PAYLOAD
+#define MQTT_RX_MAX_PAYLOAD 16384
+#endif
+
+struct MqttReceiveStats {
+  uint32_t messages;    // complete messages handed on
+  uint32_t reassembled; // of those, received in more than one fragment
+  uint32_t oversized;   // larger than the limit, dropped
+  uint32_t incomplete;  // cut off by a disconnect or out of order, dropped
+  uint32_t noMemory;    // no pooled buffer could be allocated, dropped
+};
+
+// Puts incoming MQTT payloads back together. The client hands a payload
+// over in fragments as it comes off the socket (index is the offset of the
+// fragment, total the payload length), one message after the other.
+//
+// A payload that arrives in one fragment is passed on in the client's own
+// buffer. Larger ones are gathered into a pooled buffer: one buffer per size
+// class (1 KB, 4 KB, the limit), allocated the first time a message needs it
+// and kept, so receiving allocates nothing once the pool is warm and a large
+// message now and then does not pin a large buffer for small ones.
+//
+// Plain C++ so it can be built on the host. Not thread safe; used only on
+// the MQTT client's task.
+class MqttMessageAssembler {
+public:
+  static const size_t POOL_CLASSES = 3;
+
+  explicit MqttMessageAssembler(size_t maxPayload = MQTT_RX_MAX_PAYLOAD);
+  ~MqttMessageAssembler();
+
+  // Takes one fragment. True once the payload is complete, with data and
+  // length describing it; data is not NUL terminated and stays valid until
+  // the next call.
+  bool feed(const char *fragment, size_t length, size_t index, size_t total,
+            const char *&data, size_t &size);
+  // Forgets a partly received payload, when the connection drops
+  void reset();
+
+  MqttReceiveStats getStats() const { return _stats; }
+  // Bytes held by the pool
+  size_t pooledBytes() const;
+
+private:
+  char *_acquire(size_t total);
+
+  size_t _maxPayload;
+  char *_buffers[POOL_CLASSES];
+  size_t _sizes[POOL_CLASSES];
+  char *_current;    // buffer of the payload being gathered, if any
+  size_t _total;     // its length
+  size_t _received;  // bytes gathered so far
+  bool _skipping;    // dropping the rest of a payload
+  MqttReceiveStats _stats;
+};
+
+#endif // MQTT_MESSAGE_ASSEMBLER_H
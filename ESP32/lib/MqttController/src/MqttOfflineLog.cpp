@@ -0,0 +1,446 @@
+#include "MqttOfflineLog.h"
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint32_t SEGMENT_MAGIC = 0x474c514d; // "MQLG"
+static const size_t BLANK_CHUNK = 1024;
+
+// Record states, each reached from the previous one by clearing bits
+static const uint8_t RECORD_TORN = 0xff;
+static const uint8_t RECORD_COMMITTED = 0xfe;
+static const uint8_t RECORD_SENT = 0xfc;
+
+static const uint32_t SEGMENT_ACTIVE = 0xffffffff;
+static const uint32_t SEGMENT_RETIRED = 0;
+
+struct SegmentHeader {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t seqCheck; // ~seq
+  // Cleared when the segment leaves the log, so an erase cut short cannot
+  // bring back a header that still looks valid
+  uint32_t active;
+};
+
+static_assert(sizeof(SegmentHeader) == MqttOfflineLog::SEGMENT_HEADER_SIZE,
+              "segment header size");
+
+// CRC-32 (zlib), a nibble at a time so the table stays small
+static uint32_t crc32Update(uint32_t crc, const void *data, size_t size) {
+  static const uint32_t table[16] = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+      0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+      0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc = (crc >> 4) ^ table[(crc ^ bytes[i]) & 0x0f];
+    crc = (crc >> 4) ^ table[(crc ^ (bytes[i] >> 4)) & 0x0f];
+  }
+  return ~crc;
+}
+
+MqttOfflineLog::MqttOfflineLog()
+    : _read(nullptr), _erase(nullptr), _program(nullptr), _buffer(nullptr),
+      _state(nullptr), _segments(0), _maxBytes(0), _maxAge(0), _inUse(0),
+      _tail(0), _head(0), _headSeq(0), _writeOffset(0), _readSegment(0),
+      _readOffset(0), _peekSize(0), _newestTime(0) {
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+MqttOfflineLog::~MqttOfflineLog() { end(); }
+
+void MqttOfflineLog::end() {
+  free(_buffer);
+  _buffer = nullptr;
+  delete[] _state;
+  _state = nullptr;
+  _peekSize = 0;
+}
+
+void MqttOfflineLog::setRetention(uint32_t maxBytes, uint32_t maxAgeSeconds) {
+  _maxBytes = maxBytes;
+  _maxAge = maxAgeSeconds;
+}
+
+uint32_t MqttOfflineLog::_segmentLimit() const {
+  uint32_t limit = _maxBytes ? _maxBytes / SEGMENT_SIZE : _segments;
+  if (limit < 2) {
+    limit = 2;
+  }
+  return limit < _segments ? limit : _segments;
+}
+
+bool MqttOfflineLog::_write(uint32_t address, const void *data, size_t size) {
+  _stats.flashBytes += size;
+  return _program(address, data, size);
+}
+
+uint32_t MqttOfflineLog::_recordSize(const RecordHeader &header) {
+  return (RECORD_HEADER_SIZE + header.topicLength + header.payloadLength + 3) &
+         ~3u;
+}
+
+uint32_t MqttOfflineLog::_headerCrc(const RecordHeader &header) {
+  // flags through time; the state byte changes and the CRC follows
+  return crc32Update(0, &header.flags,
+                     offsetof(RecordHeader, crc) -
+                         offsetof(RecordHeader, flags));
+}
+
+bool MqttOfflineLog::_readSegmentSeq(uint32_t segment, uint32_t &seq) {
+  SegmentHeader header;
+  if (!_read(_address(segment, 0), &header, sizeof(header)) ||
+      header.magic != SEGMENT_MAGIC || header.seq != ~header.seqCheck ||
+      header.active != SEGMENT_ACTIVE) {
+    return false;
+  }
+  seq = header.seq;
+  return true;
+}
+
+MqttOfflineLog::Scan MqttOfflineLog::_readHeader(uint32_t segment,
+                                                 uint32_t offset,
+                                                 RecordHeader &header) {
+  if (offset + RECORD_HEADER_SIZE > SEGMENT_SIZE ||
+      !_read(_address(segment, offset), &header, sizeof(header))) {
+    return SCAN_END;
+  }
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&header);
+  bool erased = true;
+  for (size_t i = 0; i < sizeof(header) && erased; i++) {
+    erased = bytes[i] == 0xff;
+  }
+  if (erased) {
+    return SCAN_ERASED;
+  }
+  // A length torn by a power cut; nothing after it in this segment can be
+  // found again
+  if (header.topicLength == 0 ||
+      header.topicLength + header.payloadLength > MAX_RECORD_DATA ||
+      offset + _recordSize(header) > SEGMENT_SIZE) {
+    return SCAN_END;
+  }
+  return SCAN_RECORD;
+}
+
+bool MqttOfflineLog::begin(uint32_t capacity, ReadFn read, EraseFn erase,
+                           ProgramFn program) {
+  end();
+  _segments = capacity / SEGMENT_SIZE;
+  if (_segments < 2) {
+    return false;
+  }
+  _read = read;
+  _erase = erase;
+  _program = program;
+  _buffer = static_cast<uint8_t *>(malloc(MAX_RECORD_DATA + 2));
+  _state = new (std::nothrow) SegmentState[_segments];
+  if (!_buffer || !_state) {
+    end();
+    return false;
+  }
+  memset(&_stats, 0, sizeof(_stats));
+  _newestTime = 0;
+
+  // The head is the newest segment; the tail is as far back as the
+  // sequence numbers run without a gap
+  bool found = false;
+  for (uint32_t i = 0; i < _segments; i++) {
+    uint32_t seq;
+    _state[i] = SEGMENT_DIRTY;
+    if (_readSegmentSeq(i, seq)) {
+      _state[i] = SEGMENT_USED;
+      if (!found || seq > _headSeq) {
+        _head = i;
+        _headSeq = seq;
+        found = true;
+      }
+    }
+  }
+  if (!found) {
+    _inUse = 0;
+    _headSeq = 0;
+    _head = _segments - 1; // the first segment opened is 0
+    return true;
+  }
+
+  _tail = _head;
+  _inUse = 1;
+  for (uint32_t seq = _headSeq; _inUse < _segments; seq--) {
+    uint32_t previous = (_tail + _segments - 1) % _segments;
+    uint32_t previousSeq;
+    if (_state[previous] != SEGMENT_USED ||
+        !_readSegmentSeq(previous, previousSeq) || previousSeq != seq - 1) {
+      break;
+    }
+    _tail = previous;
+    _inUse++;
+  }
+  for (uint32_t i = 0; i < _segments; i++) {
+    if ((i + _segments - _tail) % _segments >= _inUse) {
+      _state[i] = SEGMENT_DIRTY; // left over from an older run
+    }
+  }
+
+  // Writing continues after the last record of the head
+  _writeOffset = SEGMENT_HEADER_SIZE;
+  for (;;) {
+    RecordHeader header;
+    Scan scan = _readHeader(_head, _writeOffset, header);
+    if (scan == SCAN_ERASED) {
+      break;
+    }
+    if (scan == SCAN_END) {
+      _writeOffset = SEGMENT_SIZE; // closed, the next record opens another
+      break;
+    }
+    if (header.state != RECORD_TORN) {
+      _newestTime = header.time;
+    }
+    _writeOffset += _recordSize(header);
+  }
+
+  // Replay starts at the tail and skips what was sent
+  _readSegment = _tail;
+  _readOffset = SEGMENT_HEADER_SIZE;
+  _peekSize = 0;
+  return true;
+}
+
+bool MqttOfflineLog::_isBlank(uint32_t segment) {
+  for (uint32_t offset = 0; offset < SEGMENT_SIZE; offset += BLANK_CHUNK) {
+    if (!_read(_address(segment, offset), _buffer, BLANK_CHUNK)) {
+      return false;
+    }
+    for (size_t i = 0; i < BLANK_CHUNK; i++) {
+      if (_buffer[i] != 0xff) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void MqttOfflineLog::_retireTail() {
+  uint32_t retired = SEGMENT_RETIRED;
+  _write(_address(_tail, offsetof(SegmentHeader, active)), &retired,
+         sizeof(retired));
+  _state[_tail] = SEGMENT_DIRTY;
+  _tail = _next(_tail);
+  _inUse--;
+}
+
+void MqttOfflineLog::_dropTail() {
+  uint32_t offset =
+      _readSegment == _tail ? _readOffset : (uint32_t)SEGMENT_HEADER_SIZE;
+  RecordHeader header;
+  while (_readHeader(_tail, offset, header) == SCAN_RECORD) {
+    if (header.state == RECORD_COMMITTED) {
+      _stats.dropped++;
+    }
+    offset += _recordSize(header);
+  }
+  if (_readSegment == _tail) {
+    _readSegment = _next(_tail);
+    _readOffset = SEGMENT_HEADER_SIZE;
+    _peekSize = 0;
+  }
+  _retireTail();
+}
+
+void MqttOfflineLog::_releaseReadSegment() {
+  // Everything before the read position is released, so replay is always
+  // in the tail
+  _retireTail();
+  _readSegment = _tail;
+  _readOffset = SEGMENT_HEADER_SIZE;
+}
+
+bool MqttOfflineLog::_openSegment() {
+  uint32_t next = _next(_head);
+  while (_inUse > 0 && (_inUse >= _segmentLimit() || next == _tail)) {
+    _dropTail();
+  }
+  if (_state[next] != SEGMENT_ERASED && !_isBlank(next)) {
+    if (!_erase(_address(next, 0), SEGMENT_SIZE)) {
+      return false;
+    }
+    _stats.erases++;
+  }
+  _state[next] = SEGMENT_ERASED;
+
+  SegmentHeader header = {SEGMENT_MAGIC, _headSeq + 1, ~(_headSeq + 1),
+                          SEGMENT_ACTIVE};
+  if (!_write(_address(next, 0), &header, sizeof(header))) {
+    _state[next] = SEGMENT_DIRTY;
+    return false;
+  }
+  _state[next] = SEGMENT_USED;
+  _head = next;
+  _headSeq++;
+  _writeOffset = SEGMENT_HEADER_SIZE;
+  if (_inUse == 0) {
+    _tail = next;
+    _readSegment = next;
+    _readOffset = SEGMENT_HEADER_SIZE;
+  }
+  _inUse++;
+  return true;
+}
+
+bool MqttOfflineLog::append(const char *topic, const char *payload,
+                            size_t payloadLength, uint8_t qos, bool retain,
+                            uint32_t time) {
+  if (!ready()) {
+    return false;
+  }
+  size_t topicLength = strlen(topic);
+  if (topicLength == 0 || topicLength + payloadLength > MAX_RECORD_DATA) {
+    _stats.dropped++;
+    return false;
+  }
+
+  RecordHeader header;
+  header.state = RECORD_TORN;
+  header.flags = (qos & 0x03) | (retain ? 0x04 : 0);
+  header.topicLength = topicLength;
+  header.payloadLength = payloadLength;
+  header.reserved = 0xffff;
+  header.time = time;
+  header.crc = crc32Update(_headerCrc(header), topic, topicLength);
+  header.crc = crc32Update(header.crc, payload, payloadLength);
+
+  uint32_t size = _recordSize(header);
+  if (_inUse == 0 || _writeOffset + size > SEGMENT_SIZE) {
+    if (!_openSegment()) {
+      return false;
+    }
+  }
+  uint32_t address = _address(_head, _writeOffset);
+  bool ok = _write(address, &header, sizeof(header)) &&
+            _write(address + sizeof(header), topic, topicLength) &&
+            (payloadLength == 0 ||
+             _write(address + sizeof(header) + topicLength, payload,
+                    payloadLength));
+  // Committed only once the data is in place
+  uint8_t committed = RECORD_COMMITTED;
+  ok = ok && _write(address, &committed, 1);
+  if (!ok) {
+    // Half written; close the segment so its length cannot hide later ones
+    _writeOffset = SEGMENT_SIZE;
+    return false;
+  }
+  _writeOffset += size;
+  _stats.appended++;
+  _stats.dataBytes += topicLength + payloadLength;
+  _newestTime = time;
+  return true;
+}
+
+bool MqttOfflineLog::peek(Record &record) {
+  _peekSize = 0;
+  if (!ready()) {
+    return false;
+  }
+  while (_inUse > 0) {
+    bool inHead = _readSegment == _head;
+    RecordHeader header;
+    Scan scan = inHead && _readOffset >= _writeOffset
+                    ? SCAN_ERASED
+                    : _readHeader(_readSegment, _readOffset, header);
+    if (scan != SCAN_RECORD) {
+      if (inHead) {
+        return false; // caught up with the writer
+      }
+      _releaseReadSegment();
+      continue;
+    }
+    uint32_t size = _recordSize(header);
+    if (header.state == RECORD_SENT) {
+      _readOffset += size;
+      continue;
+    }
+
+    uint32_t address = _address(_readSegment, _readOffset);
+    char *topic = reinterpret_cast<char *>(_buffer);
+    char *payload = topic + header.topicLength + 1;
+    bool ok = header.state == RECORD_COMMITTED &&
+              _read(address + sizeof(header), topic, header.topicLength) &&
+              _read(address + sizeof(header) + header.topicLength, payload,
+                    header.payloadLength);
+    if (ok) {
+      uint32_t crc = crc32Update(_headerCrc(header), topic,
+                                 header.topicLength);
+      ok = crc32Update(crc, payload, header.payloadLength) == header.crc;
+    }
+    if (!ok) {
+      _stats.corrupt++;
+      _readOffset += size;
+      continue;
+    }
+    topic[header.topicLength] = '\0';
+    payload[header.payloadLength] = '\0';
+    record.topic = topic;
+    record.payload = payload;
+    record.payloadLength = header.payloadLength;
+    record.qos = header.flags & 0x03;
+    record.retain = (header.flags & 0x04) != 0;
+    record.time = header.time;
+    _peekSize = size;
+    return true;
+  }
+  return false;
+}
+
+bool MqttOfflineLog::_markSent() {
+  if (_peekSize == 0) {
+    return false;
+  }
+  uint8_t sent = RECORD_SENT;
+  bool ok = _write(_address(_readSegment, _readOffset), &sent, 1);
+  _readOffset += _peekSize;
+  _peekSize = 0;
+  return ok;
+}
+
+bool MqttOfflineLog::consume() {
+  if (_peekSize == 0) {
+    return false;
+  }
+  _stats.replayed++;
+  return _markSent();
+}
+
+void MqttOfflineLog::compact(uint32_t now) {
+  if (!ready()) {
+    return;
+  }
+  if (_maxAge > 0 && now > _maxAge) {
+    Record record;
+    while (peek(record) && record.time < now - _maxAge) {
+      _stats.expired++;
+      _markSent();
+    }
+    _peekSize = 0;
+  }
+
+  // Erase ahead so append() does not wait for it
+  uint32_t next = _next(_head);
+  if (_state[next] == SEGMENT_DIRTY) {
+    if (_isBlank(next)) {
+      _state[next] = SEGMENT_ERASED;
+    } else if (_erase(_address(next, 0), SEGMENT_SIZE)) {
+      _stats.erases++;
+      _state[next] = SEGMENT_ERASED;
+    }
+  }
+}
+
+bool MqttOfflineLog::hasPending() {
+  Record record;
+  bool pending = peek(record);
+  _peekSize = 0;
+  return pending;
+}
@@ -0,0 +1,153 @@
+#ifndef MQTT_OFFLINE_LOG_H
+#define MQTT_OFFLINE_LOG_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+struct MqttOfflineLogStats {
+  uint32_t appended;
+  uint32_t replayed;
+  uint32_t dropped; // pushed out by the size limit, or too large to store
+  uint32_t expired; // older than the age limit when replay reached them
+  uint32_t corrupt; // torn by a power cut or failing their CRC, skipped
+  uint32_t erases;
+  uint64_t dataBytes;  // topic and payload bytes appended
+  uint64_t flashBytes; // bytes programmed: headers, data and state marks
+};
+
+// Append-only message log on a raw flash partition, for messages produced
+// while MQTT is down. Replayed oldest first and marked as sent one by one.
+//
+// The partition is split into segments of one erase sector. Each segment
+// starts with a header holding a sequence number, and the segments in use
+// form a contiguous run from the tail (oldest) to the head (being written).
+// The head moves through the partition in a circle, so every sector is
+// erased equally often whatever the retention.
+//
+// A record is its header, topic and payload, padded to 4 bytes. Its state
+// byte is programmed last, after the data: erased means torn, then
+// committed, then sent. Flash can only clear bits, so marking a record
+// sent is a one-byte write, and a power cut at any point leaves either the
+// old or the new state; a record cut while being written is skipped.
+// Replay is at least once: a cut between publishing a record and marking
+// it sent publishes it again.
+//
+// Records are consumed in order, so the only partly consumed segment is
+// the one replay is in. Compaction does not copy anything: a segment is
+// retired once replay leaves it (or the size limit drops it), and retired
+// segments are erased ahead of the writer by compact().
+//
+// Flash access goes through callbacks so the same code can be built on the
+// host (see tools/offline_log_host.cpp). Not thread safe; the caller keeps
+// to one task.
+class MqttOfflineLog {
+public:
+  using ReadFn = std::function<bool(uint32_t, void *, size_t)>;
+  using EraseFn = std::function<bool(uint32_t, size_t)>;
+  using ProgramFn = std::function<bool(uint32_t, const void *, size_t)>;
+
+  static const size_t SEGMENT_SIZE = 4096;
+  static const size_t SEGMENT_HEADER_SIZE = 16;
+  static const size_t RECORD_HEADER_SIZE = 16;
+  // Topic and payload of one record
+  static const size_t MAX_RECORD_DATA =
+      SEGMENT_SIZE - SEGMENT_HEADER_SIZE - RECORD_HEADER_SIZE;
+
+  // A record read by peek(). topic and payload are NUL terminated and stay
+  // valid until the next call on the log.
+  struct Record {
+    const char *topic;
+    const char *payload;
+    size_t payloadLength;
+    uint8_t qos;
+    bool retain;
+    uint32_t time;
+  };
+
+  MqttOfflineLog();
+  ~MqttOfflineLog();
+
+  // Mounts the log in [0, capacity): finds the head and tail segments and
+  // where replay stopped. Anything unreadable is treated as free space.
+  bool begin(uint32_t capacity, ReadFn read, EraseFn erase,
+             ProgramFn program);
+  void end();
+  bool ready() const { return _buffer != nullptr; }
+
+  // Oldest records are dropped beyond maxBytes (rounded down to segments,
+  // at least two), and skipped by compact() once older than maxAgeSeconds.
+  // 0 means no limit.
+  void setRetention(uint32_t maxBytes, uint32_t maxAgeSeconds);
+
+  // time is the caller's clock in seconds, only compared with itself
+  bool append(const char *topic, const char *payload, size_t payloadLength,
+              uint8_t qos, bool retain, uint32_t time);
+  // The oldest record not yet sent, without removing it
+  bool peek(Record &record);
+  // Marks the record from the last peek() as sent
+  bool consume();
+  // Applies the age limit and erases the segment the writer needs next.
+  // At most one erase per call.
+  void compact(uint32_t now);
+
+  bool hasPending();
+  uint32_t usedBytes() const { return _inUse * SEGMENT_SIZE; }
+  uint32_t capacity() const { return _segments * SEGMENT_SIZE; }
+  // Time of the newest record, 0 if the log is empty
+  uint32_t newestTime() const { return _newestTime; }
+  MqttOfflineLogStats getStats() const { return _stats; }
+
+private:
+  enum SegmentState : uint8_t { SEGMENT_ERASED, SEGMENT_DIRTY, SEGMENT_USED };
+
+  struct RecordHeader {
+    uint8_t state;
+    uint8_t flags; // bits 0-1 QoS, bit 2 retain
+    uint16_t topicLength;
+    uint16_t payloadLength;
+    uint16_t reserved;
+    uint32_t time;
+    uint32_t crc; // over flags..time, topic and payload
+  };
+
+  enum Scan { SCAN_RECORD, SCAN_ERASED, SCAN_END };
+
+  uint32_t _address(uint32_t segment, uint32_t offset) const {
+    return segment * SEGMENT_SIZE + offset;
+  }
+  uint32_t _next(uint32_t segment) const { return (segment + 1) % _segments; }
+  Scan _readHeader(uint32_t segment, uint32_t offset, RecordHeader &header);
+  static uint32_t _recordSize(const RecordHeader &header);
+  static uint32_t _headerCrc(const RecordHeader &header);
+  bool _readSegmentSeq(uint32_t segment, uint32_t &seq);
+  bool _openSegment();
+  void _retireTail();
+  void _dropTail();
+  void _releaseReadSegment();
+  bool _isBlank(uint32_t segment);
+  bool _markSent();
+  uint32_t _segmentLimit() const;
+  bool _write(uint32_t address, const void *data, size_t size);
+
+  ReadFn _read;
+  EraseFn _erase;
+  ProgramFn _program;
+  uint8_t *_buffer; // one record, for peek()
+  SegmentState *_state;
+  uint32_t _segments;
+  uint32_t _maxBytes;
+  uint32_t _maxAge;
+  uint32_t _inUse;
+  uint32_t _tail;
+  uint32_t _head;
+  uint32_t _headSeq;
+  uint32_t _writeOffset;
+  uint32_t _readSegment;
+  uint32_t _readOffset;
+  uint32_t _peekSize; // 0 when there is no peeked record
+  uint32_t _newestTime;
+  MqttOfflineLogStats _stats;
+};
+
+#endif // MQTT_OFFLINE_LOG_H
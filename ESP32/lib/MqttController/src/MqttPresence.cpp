@@ -0,0 +1,52 @@
+#include "MqttPresence.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t mqttFormatHeartbeat(char *out, size_t size,
+                           const MqttHeartbeat &heartbeat) {
+  int length = snprintf(out, size, "hb %lu %d %lu",
+                        (unsigned long)heartbeat.uptimeS, heartbeat.rssi,
+                        (unsigned long)heartbeat.freeHeapKb);
+  if (length < 0 || (size_t)length >= size) {
+    return 0;
+  }
+  return length;
+}
+
+bool mqttParseHeartbeat(const char *payload, size_t length,
+                        MqttHeartbeat &heartbeat) {
+  char text[40];
+  if (length < 3 || length >= sizeof(text) || strncmp(payload, "hb ", 3)) {
+    return false;
+  }
+  memcpy(text, payload, length);
+  text[length] = '\0';
+  char *end;
+  unsigned long uptime = strtoul(text + 3, &end, 10);
+  if (*end != ' ') {
+    return false;
+  }
+  long rssi = strtol(end + 1, &end, 10);
+  if (*end != ' ' || rssi < -128 || rssi > 127) {
+    return false;
+  }
+  unsigned long heap = strtoul(end + 1, &end, 10);
+  if (*end != '\0') {
+    return false;
+  }
+  heartbeat.uptimeS = uptime;
+  heartbeat.rssi = rssi;
+  heartbeat.freeHeapKb = heap;
+  return true;
+}
+
+size_t mqttPublishPacketBytes(size_t topicLength, size_t payloadLength,
+                              uint8_t qos) {
+  size_t remaining = 2 + topicLength + (qos > 0 ? 2 : 0) + payloadLength;
+  size_t lengthBytes = 1;
+  for (size_t rest = remaining >> 7; rest; rest >>= 7) {
+    lengthBytes++;
+  }
+  return 1 + lengthBytes + remaining;
+}
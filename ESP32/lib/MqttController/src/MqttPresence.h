@@ -0,0 +1,33 @@
+#ifndef MQTT_PRESENCE_H
+#define MQTT_PRESENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Retained on the presence topic: the birth message on every connect, the
+// Last Will when the broker loses the device
+#define MQTT_PRESENCE_ONLINE "online"
+#define MQTT_PRESENCE_OFFLINE "offline"
+
+// What a heartbeat reports. Sent as text, "hb <uptime_s> <rssi> <heap_kb>",
+// e.g. "hb 86400 -61 182": about 20 bytes against several hundred for the
+// full status document.
+struct MqttHeartbeat {
+  uint32_t uptimeS;
+  int8_t rssi;
+  uint32_t freeHeapKb;
+};
+
+// Formats heartbeat into out. Returns the length, 0 if it did not fit.
+size_t mqttFormatHeartbeat(char *out, size_t size,
+                           const MqttHeartbeat &heartbeat);
+// False if payload is not a heartbeat
+bool mqttParseHeartbeat(const char *payload, size_t length,
+                        MqttHeartbeat &heartbeat);
+
+// Bytes of an MQTT 3.1.1 PUBLISH on the wire: fixed header, topic, packet
+// identifier for QoS 1/2, payload
+size_t mqttPublishPacketBytes(size_t topicLength, size_t payloadLength,
+                              uint8_t qos);
+
+#endif // MQTT_PRESENCE_H
@@ -0,0 +1,263 @@
+#include "MqttPublishQueue.h"
+#include "../../../include/DebugUtils.h"
+#include <new>
+
+MqttPublishQueue::MqttPublishQueue() : _lock(nullptr) {
+  static const size_t depths[MQTT_PRIORITY_COUNT] = {
+      MQTT_QUEUE_DEPTH_ALARM, MQTT_QUEUE_DEPTH_STATUS,
+      MQTT_QUEUE_DEPTH_TELEMETRY};
+  size_t offset = 0;
+  for (size_t i = 0; i < MQTT_PRIORITY_COUNT; i++) {
+    _rings[i].slots = _slots + offset;
+    _rings[i].capacity = depths[i];
+    _rings[i].head = 0;
+    _rings[i].count = 0;
+    offset += depths[i];
+  }
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+MqttPublishQueue::~MqttPublishQueue() {
+  for (Ring &ring : _rings) {
+    while (ring.count > 0) {
+      delete _popFront(ring);
+    }
+  }
+  if (_lock) {
+    vSemaphoreDelete(_lock);
+  }
+}
+
+void MqttPublishQueue::begin() {
+  if (!_lock) {
+    _lock = xSemaphoreCreateMutex();
+  }
+}
+
+const char *MqttPublishQueue::priorityName(MqttPriority priority) {
+  switch (priority) {
+  case MQTT_PRIORITY_ALARM:
+    return "alarm";
+  case MQTT_PRIORITY_STATUS:
+    return "status";
+  case MQTT_PRIORITY_TELEMETRY:
+    return "telemetry";
+  }
+  return "unknown";
+}
+
+MqttOutMessage *MqttPublishQueue::_popFront(Ring &ring) {
+  MqttOutMessage *message = ring.slots[ring.head];
+  ring.head = (ring.head + 1) % ring.capacity;
+  ring.count--;
+  return message;
+}
+
+void MqttPublishQueue::_pushBack(Ring &ring, MqttOutMessage *message) {
+  ring.slots[(ring.head + ring.count) % ring.capacity] = message;
+  ring.count++;
+}
+
+size_t MqttPublishQueue::_append(size_t priority, MqttOutMessage *message) {
+  Ring &ring = _rings[priority];
+  MqttPublishClassStats &stats = _stats.classes[priority];
+  size_t dropped = 0;
+  if (ring.count == ring.capacity) {
+    delete _popFront(ring);
+    stats.dropped++;
+    dropped++;
+  }
+  _pushBack(ring, message);
+  stats.depth = ring.count;
+  if (stats.depth > stats.highWater) {
+    stats.highWater = stats.depth;
+  }
+  return dropped;
+}
+
+// Queued messages of one topic are in push order from the highest class
+// down, so taking them class by class keeps that order
+size_t MqttPublishQueue::_promote(size_t priority, const String &topic) {
+  size_t dropped = 0;
+  for (size_t i = priority + 1; i < MQTT_PRIORITY_COUNT; i++) {
+    Ring &ring = _rings[i];
+    for (size_t n = ring.count; n > 0; n--) {
+      MqttOutMessage *message = _popFront(ring);
+      if (message->topic == topic) {
+        dropped += _append(priority, message);
+      } else {
+        _pushBack(ring, message);
+      }
+    }
+    _stats.classes[i].depth = ring.count;
+  }
+  return dropped;
+}
+
+size_t MqttPublishQueue::_firstClassOf(const String &topic) const {
+  for (size_t i = 0; i < MQTT_PRIORITY_COUNT; i++) {
+    const Ring &ring = _rings[i];
+    for (size_t n = 0; n < ring.count; n++) {
+      if (ring.slots[(ring.head + n) % ring.capacity]->topic == topic) {
+        return i;
+      }
+    }
+  }
+  return MQTT_PRIORITY_COUNT;
+}
+
+bool MqttPublishQueue::push(MqttPriority priority, const char *topic,
+                            const char *payload, size_t length, uint8_t qos,
+                            bool retain) {
+  if (!_lock) {
+    return false;
+  }
+  // Copied outside the lock; the sender should not wait on an allocation
+  MqttOutMessage *message = new (std::nothrow) MqttOutMessage;
+  if (!message) {
+    return false;
+  }
+  message->topic = topic;
+  message->payload = String(payload, length);
+  message->qos = qos;
+  message->retain = retain;
+  message->enqueuedAt = millis();
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  size_t dropped = _promote(priority, message->topic);
+  dropped += _append(priority, message);
+  _stats.classes[priority].enqueued++;
+  xSemaphoreGive(_lock);
+
+  if (dropped) {
+    DEBUG_PRINTF("[MqttController] %s queue full, dropped %u messages\n",
+                 priorityName(priority), (unsigned)dropped);
+  }
+  return true;
+}
+
+MqttOutMessage *MqttPublishQueue::take(MqttPriority &priority) {
+  if (!_lock) {
+    return nullptr;
+  }
+  MqttOutMessage *message = nullptr;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (size_t i = 0; i < MQTT_PRIORITY_COUNT; i++) {
+    if (_rings[i].count > 0) {
+      priority = static_cast<MqttPriority>(i);
+      message = _popFront(_rings[i]);
+      _stats.classes[i].depth = _rings[i].count;
+      break;
+    }
+  }
+  xSemaphoreGive(_lock);
+  return message;
+}
+
+void MqttPublishQueue::sent(MqttPriority priority, MqttOutMessage *message) {
+  uint32_t latency = millis() - message->enqueuedAt;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  MqttPublishClassStats &stats = _stats.classes[priority];
+  stats.sent++;
+  stats.latencyTotalMs += latency;
+  if (latency > stats.latencyMaxMs) {
+    stats.latencyMaxMs = latency;
+  }
+  xSemaphoreGive(_lock);
+  delete message;
+}
+
+void MqttPublishQueue::requeue(MqttPriority priority,
+                               MqttOutMessage *message) {
+  bool kept = false;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  // Messages to its topic pushed meanwhile must stay behind it
+  size_t first = _firstClassOf(message->topic);
+  if (first < priority) {
+    priority = static_cast<MqttPriority>(first);
+  }
+  Ring &ring = _rings[priority];
+  MqttPublishClassStats &stats = _stats.classes[priority];
+  stats.retried++;
+  if (ring.count < ring.capacity) {
+    ring.head = (ring.head + ring.capacity - 1) % ring.capacity;
+    ring.slots[ring.head] = message;
+    ring.count++;
+    stats.depth = ring.count;
+    kept = true;
+  } else {
+    // Newer messages filled the class; this one is the oldest
+    stats.dropped++;
+  }
+  xSemaphoreGive(_lock);
+  if (!kept) {
+    delete message;
+  }
+}
+
+void MqttPublishQueue::stored(MqttPriority priority, MqttOutMessage *message,
+                              bool ok) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if (ok) {
+    _stats.classes[priority].stored++;
+  } else {
+    _stats.classes[priority].dropped++;
+  }
+  xSemaphoreGive(_lock);
+  delete message;
+}
+
+bool MqttPublishQueue::empty() const {
+  if (!_lock) {
+    return true;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  bool empty = true;
+  for (const Ring &ring : _rings) {
+    empty = empty && ring.count == 0;
+  }
+  xSemaphoreGive(_lock);
+  return empty;
+}
+
+MqttPublishStats MqttPublishQueue::getStats() const {
+  if (!_lock) {
+    return _stats;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  MqttPublishStats stats = _stats;
+  xSemaphoreGive(_lock);
+  return stats;
+}
+
+void MqttPublishQueue::toJson(JsonObject publish) const {
+  MqttPublishStats stats = getStats();
+  for (size_t i = 0; i < MQTT_PRIORITY_COUNT; i++) {
+    const MqttPublishClassStats &c = stats.classes[i];
+    JsonObject entry =
+        publish[priorityName(static_cast<MqttPriority>(i))].to<JsonObject>();
+    entry["enqueued"] = c.enqueued;
+    entry["sent"] = c.sent;
+    entry["dropped"] = c.dropped;
+    entry["retried"] = c.retried;
+    entry["stored"] = c.stored;
+    entry["depth"] = c.depth;
+    entry["high_water"] = c.highWater;
+    entry["latency_avg_ms"] = c.sent ? c.latencyTotalMs / c.sent : 0;
+    entry["latency_max_ms"] = c.latencyMaxMs;
+  }
+}
+
+void MqttPublishQueue::printStats() const {
+  MqttPublishStats stats = getStats();
+  for (size_t i = 0; i < MQTT_PRIORITY_COUNT; i++) {
+    const MqttPublishClassStats &c = stats.classes[i];
+    Serial.printf("[MqttController] %-9s enqueued: %u, sent: %u, dropped: "
+                  "%u, retried: %u, stored: %u, depth: %u (max %u), latency "
+                  "avg/max: %u/%u ms\n",
+                  priorityName(static_cast<MqttPriority>(i)), c.enqueued,
+                  c.sent, c.dropped, c.retried, c.stored, c.depth,
+                  c.highWater,
+                  c.sent ? c.latencyTotalMs / c.sent : 0, c.latencyMaxMs);
+  }
+}
@@ -0,0 +1,117 @@
+#ifndef MQTT_PUBLISH_QUEUE_H
+#define MQTT_PUBLISH_QUEUE_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Messages each class holds while they wait for the sender. When a class is
+// full its oldest message is dropped.
+#ifndef MQTT_QUEUE_DEPTH_ALARM
+#define MQTT_QUEUE_DEPTH_ALARM 8
+#endif
+#ifndef MQTT_QUEUE_DEPTH_STATUS
+#define MQTT_QUEUE_DEPTH_STATUS 8
+#endif
+#ifndef MQTT_QUEUE_DEPTH_TELEMETRY
+#define MQTT_QUEUE_DEPTH_TELEMETRY 16
+#endif
+
+// Highest first: the sender always empties a class before the next one
+enum MqttPriority : uint8_t {
+  MQTT_PRIORITY_ALARM,
+  MQTT_PRIORITY_STATUS,
+  MQTT_PRIORITY_TELEMETRY,
+};
+
+static const size_t MQTT_PRIORITY_COUNT = 3;
+
+struct MqttOutMessage {
+  String topic;
+  String payload;
+  uint8_t qos;
+  bool retain;
+  uint32_t enqueuedAt; // millis()
+};
+
+struct MqttPublishClassStats {
+  uint32_t enqueued;
+  uint32_t sent;
+  uint32_t dropped;  // oldest messages pushed out of a full class
+  uint32_t retried;  // publishes the client refused, put back in the queue
+  uint32_t stored;   // moved to the offline log during an outage
+  uint16_t depth;
+  uint16_t highWater;
+  uint32_t latencyTotalMs; // enqueue to handed to the client, sent messages
+  uint32_t latencyMaxMs;
+};
+
+struct MqttPublishStats {
+  MqttPublishClassStats classes[MQTT_PRIORITY_COUNT];
+};
+
+// Bounded outbound queue with one ring per priority class. Any task may
+// push; one sender takes messages off in priority order and hands them
+// back with sent() or requeue(). Taking a message removes it, so dropping
+// the oldest one of a full class never frees what the sender is publishing.
+//
+// Messages to one topic leave in the order they were pushed: a message
+// moves the queued ones to its topic from lower classes up into its own
+// class, ahead of it. Otherwise a retained state queued at a low priority
+// could be published after a newer one of higher priority and replace it.
+class MqttPublishQueue {
+public:
+  MqttPublishQueue();
+  ~MqttPublishQueue();
+
+  void begin();
+
+  // Copies topic and payload. False if the copy could not be allocated.
+  bool push(MqttPriority priority, const char *topic, const char *payload,
+            uint8_t qos, bool retain) {
+    return push(priority, topic, payload, strlen(payload), qos, retain);
+  }
+  // payload may be binary
+  bool push(MqttPriority priority, const char *topic, const char *payload,
+            size_t length, uint8_t qos, bool retain);
+  // Oldest message of the highest non-empty class, nullptr if all are empty
+  MqttOutMessage *take(MqttPriority &priority);
+  // The client accepted it: counts it and frees it
+  void sent(MqttPriority priority, MqttOutMessage *message);
+  // The client refused it: back at the head of its class, unless the class
+  // filled up meanwhile
+  void requeue(MqttPriority priority, MqttOutMessage *message);
+  // Moved to the offline log (dropped if that failed); frees it
+  void stored(MqttPriority priority, MqttOutMessage *message, bool ok);
+
+  bool empty() const;
+  MqttPublishStats getStats() const;
+  void toJson(JsonObject publish) const;
+  void printStats() const;
+
+  static const char *priorityName(MqttPriority priority);
+
+private:
+  struct Ring {
+    MqttOutMessage **slots;
+    size_t capacity;
+    size_t head;
+    size_t count;
+  };
+
+  MqttOutMessage *_popFront(Ring &ring);
+  void _pushBack(Ring &ring, MqttOutMessage *message);
+  // Under _lock; returns how many messages a full class dropped
+  size_t _append(size_t priority, MqttOutMessage *message);
+  size_t _promote(size_t priority, const String &topic);
+  size_t _firstClassOf(const String &topic) const;
+
+  SemaphoreHandle_t _lock;
+  Ring _rings[MQTT_PRIORITY_COUNT];
+  MqttOutMessage *_slots[MQTT_QUEUE_DEPTH_ALARM + MQTT_QUEUE_DEPTH_STATUS +
+                         MQTT_QUEUE_DEPTH_TELEMETRY];
+  MqttPublishStats _stats;
+};
+
+#endif // MQTT_PUBLISH_QUEUE_H
@@ -0,0 +1,36 @@
+#include "MqttReconnectPolicy.h"
+
+MqttReconnectPolicy::MqttReconnectPolicy(uint32_t baseMs, uint32_t capMs,
+                                         uint32_t stableMs)
+    : _delay(0), _attempts(0), _connectedAt(0), _connected(false) {
+  configure(baseMs, capMs, stableMs);
+}
+
+void MqttReconnectPolicy::configure(uint32_t baseMs, uint32_t capMs,
+                                    uint32_t stableMs) {
+  _base = baseMs > 0 ? baseMs : 1;
+  _cap = capMs > _base ? capMs : _base;
+  _stable = stableMs;
+}
+
+void MqttReconnectPolicy::connected(uint32_t now) {
+  _connected = true;
+  _connectedAt = now;
+}
+
+uint32_t MqttReconnectPolicy::nextDelay(uint32_t now, uint32_t random) {
+  if (_connected && now - _connectedAt >= _stable) {
+    _delay = 0;
+    _attempts = 0;
+  }
+  _connected = false;
+
+  uint64_t upper = 3ull * (_delay > 0 ? _delay : _base);
+  if (upper > _cap) {
+    upper = _cap;
+  }
+  uint64_t delay = _base + random % (upper - _base + 1);
+  _delay = static_cast<uint32_t>(delay);
+  _attempts++;
+  return _delay;
+}
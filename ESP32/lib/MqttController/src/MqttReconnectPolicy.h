@@ -0,0 +1,54 @@
+#ifndef MQTT_RECONNECT_POLICY_H
+#define MQTT_RECONNECT_POLICY_H
+
+#include <stdint.h>
+
+// First reconnect delay is between this and three times it
+#ifndef MQTT_RECONNECT_BASE_MS
+#define MQTT_RECONNECT_BASE_MS 2000
+#endif
+#ifndef MQTT_RECONNECT_CAP_MS
+#define MQTT_RECONNECT_CAP_MS 120000
+#endif
+// A connection that stayed up this long starts the backoff over
+#ifndef MQTT_RECONNECT_STABLE_MS
+#define MQTT_RECONNECT_STABLE_MS 60000
+#endif
+
+// Reconnect delays: exponential backoff with decorrelated jitter, each
+// delay drawn between the base and three times the previous one, up to the
+// cap. After a broker restart the devices spread out over a growing window
+// instead of reconnecting in lockstep, and the window keeps growing while
+// attempts fail. A connection only resets the backoff once it has stayed
+// up for the stable time, so a broker that accepts and then drops
+// connections is not hammered either.
+//
+// Plain C++ so it can be built on the host (tools/reconnect_sim_host.cpp).
+class MqttReconnectPolicy {
+public:
+  explicit MqttReconnectPolicy(uint32_t baseMs = MQTT_RECONNECT_BASE_MS,
+                               uint32_t capMs = MQTT_RECONNECT_CAP_MS,
+                               uint32_t stableMs = MQTT_RECONNECT_STABLE_MS);
+
+  void configure(uint32_t baseMs, uint32_t capMs, uint32_t stableMs);
+  // The connection came up at now (ms)
+  void connected(uint32_t now);
+  // The connection went down or an attempt failed at now. Returns the delay
+  // before the next attempt; random is a uniformly distributed 32-bit value.
+  uint32_t nextDelay(uint32_t now, uint32_t random);
+
+  // Attempts since the backoff last started over
+  uint32_t attempts() const { return _attempts; }
+  uint32_t lastDelay() const { return _delay; }
+
+private:
+  uint32_t _base;
+  uint32_t _cap;
+  uint32_t _stable;
+  uint32_t _delay; // 0 when starting over
+  uint32_t _attempts;
+  uint32_t _connectedAt;
+  bool _connected;
+};
+
+#endif // MQTT_RECONNECT_POLICY_H
@@ -0,0 +1,120 @@
+#include "MqttTopicRouter.h"
+#include <string.h>
+
+bool MqttTopicRouter::add(const char *filter, Handler handler) {
+  size_t length = filter != nullptr ? strlen(filter) : 0;
+  if (length == 0 || length > UINT16_MAX || !handler) {
+    return false;
+  }
+
+  Route route;
+  route.filter.assign(filter, length);
+  route.handler = handler;
+  route.hash = 0;
+  route.wildcard = false;
+  route.prefixLength = 0;
+
+  size_t start = 0;
+  for (;;) {
+    const char *slash = static_cast<const char *>(
+        memchr(filter + start, '/', length - start));
+    size_t end = slash != nullptr ? slash - filter : length;
+    Level level = {static_cast<uint16_t>(start),
+                   static_cast<uint16_t>(end - start), LEVEL_LITERAL};
+    if (memchr(filter + start, '+', level.length) != nullptr ||
+        memchr(filter + start, '#', level.length) != nullptr) {
+      // A wildcard is a level of its own, and '#' only the last one
+      if (level.length != 1 || (filter[start] == '#' && slash != nullptr)) {
+        return false;
+      }
+      level.kind = filter[start] == '+' ? LEVEL_ONE : LEVEL_REST;
+      if (!route.wildcard) {
+        route.wildcard = true;
+        route.prefixLength = start;
+      }
+    }
+    if (route.wildcard) {
+      route.levels.push_back(level);
+    }
+    if (slash == nullptr) {
+      break;
+    }
+    start = end + 1;
+  }
+
+  if (!route.wildcard) {
+    route.hash = _hash(filter, length);
+  }
+  _routes.push_back(std::move(route));
+  return true;
+}
+
+size_t MqttTopicRouter::dispatch(const char *topic, const char *payload,
+                                 size_t length) const {
+  size_t topicLength = strlen(topic);
+  uint32_t hash = _hash(topic, topicLength);
+  size_t called = 0;
+  for (const Route &route : _routes) {
+    bool match;
+    if (route.wildcard) {
+      match = _matches(route, topic, topicLength);
+    } else {
+      match = route.hash == hash && route.filter.size() == topicLength &&
+              memcmp(route.filter.data(), topic, topicLength) == 0;
+    }
+    if (match) {
+      route.handler(topic, payload, length);
+      called++;
+    }
+  }
+  return called;
+}
+
+// FNV-1a
+uint32_t MqttTopicRouter::_hash(const char *data, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+  }
+  return hash;
+}
+
+bool MqttTopicRouter::_matches(const Route &route, const char *topic,
+                               size_t topicLength) {
+  const char *filter = route.filter.data();
+  if (topicLength < route.prefixLength) {
+    // "a/#" also matches its parent "a"
+    return route.levels[0].kind == LEVEL_REST && route.prefixLength > 0 &&
+           topicLength == route.prefixLength - 1 &&
+           memcmp(topic, filter, topicLength) == 0;
+  }
+  if (memcmp(topic, filter, route.prefixLength) != 0) {
+    return false;
+  }
+  if (route.prefixLength == 0 && topicLength > 0 && topic[0] == '$') {
+    return false;
+  }
+
+  const char *level = topic + route.prefixLength;
+  const char *end = topic + topicLength;
+  bool more = true; // the topic has a level left, possibly empty
+  for (const Level &part : route.levels) {
+    if (part.kind == LEVEL_REST) {
+      return true;
+    }
+    if (!more) {
+      return false;
+    }
+    const char *slash =
+        static_cast<const char *>(memchr(level, '/', end - level));
+    const char *levelEnd = slash != nullptr ? slash : end;
+    if (part.kind == LEVEL_LITERAL &&
+        (static_cast<size_t>(levelEnd - level) != part.length ||
+         memcmp(level, filter + part.offset, part.length) != 0)) {
+      return false;
+    }
+    more = slash != nullptr;
+    level = more ? slash + 1 : end;
+  }
+  return !more;
+}
@@ -0,0 +1,63 @@
+#ifndef MQTT_TOPIC_ROUTER_H
+#define MQTT_TOPIC_ROUTER_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Hands each incoming message to the handlers registered for its topic.
+//
+// Filters use MQTT syntax: '+' matches exactly one level, a trailing '#'
+// any number of levels including none ("a/#" matches "a"), and wildcards
+// at the first level do not match topics starting with '$'. Filters are
+// split into levels when they are added: one without wildcards is matched
+// by length, hash and a single compare; one with wildcards first compares
+// the literal levels in front of the first wildcard, then walks the rest.
+//
+// Plain C++ so it can be built on the host. Add every filter before
+// messages arrive; dispatch() does not lock.
+class MqttTopicRouter {
+public:
+  // payload is not NUL terminated and is only valid during the call
+  using Handler =
+      std::function<void(const char *topic, const char *payload,
+                         size_t length)>;
+
+  // False if the filter is not a valid MQTT topic filter
+  bool add(const char *filter, Handler handler);
+  // Calls every handler whose filter matches topic, in the order they were
+  // added, and returns how many were called
+  size_t dispatch(const char *topic, const char *payload,
+                  size_t length) const;
+  size_t size() const { return _routes.size(); }
+
+private:
+  enum LevelKind : uint8_t { LEVEL_LITERAL, LEVEL_ONE, LEVEL_REST };
+
+  struct Level {
+    uint16_t offset; // in the filter
+    uint16_t length;
+    LevelKind kind;
+  };
+
+  struct Route {
+    std::string filter;
+    Handler handler;
+    uint32_t hash;       // of the whole filter, when it has no wildcards
+    bool wildcard;
+    // With wildcards: the literal levels before the first one, including
+    // the '/' after them, and the levels from the first wildcard on
+    size_t prefixLength;
+    std::vector<Level> levels;
+  };
+
+  static uint32_t _hash(const char *data, size_t length);
+  static bool _matches(const Route &route, const char *topic,
+                       size_t topicLength);
+
+  std::vector<Route> _routes;
+};
+
+#endif // MQTT_TOPIC_ROUTER_H
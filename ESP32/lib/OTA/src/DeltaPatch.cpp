@@ -0,0 +1,184 @@
+#include "DeltaPatch.h"
+#include <string.h>
+
+DeltaPatchDecoder::DeltaPatchDecoder()
+    : _readBase(nullptr), _writeOutput(nullptr), _checkHeader(nullptr),
+      _state(STATE_HEADER), _status(OK), _header(), _fieldLen(0),
+      _fieldNeed(HEADER_SIZE), _opcode(0), _literalRemaining(0),
+      _outputSize(0) {}
+
+void DeltaPatchDecoder::begin(BaseReader readBase, OutputWriter writeOutput,
+                              HeaderCheck checkHeader) {
+  _readBase = readBase;
+  _writeOutput = writeOutput;
+  _checkHeader = checkHeader;
+  _state = STATE_HEADER;
+  _status = OK;
+  memset(&_header, 0, sizeof(_header));
+  _fieldLen = 0;
+  _fieldNeed = HEADER_SIZE;
+  _opcode = 0;
+  _literalRemaining = 0;
+  _outputSize = 0;
+}
+
+bool DeltaPatchDecoder::feed(const uint8_t *data, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    switch (_state) {
+    case STATE_HEADER:
+    case STATE_ARGS: {
+      size_t take = _fieldNeed - _fieldLen;
+      if (take > len - pos) {
+        take = len - pos;
+      }
+      memcpy(_field + _fieldLen, data + pos, take);
+      _fieldLen += take;
+      pos += take;
+      if (_fieldLen < _fieldNeed) {
+        break;
+      }
+
+      if (_state == STATE_HEADER) {
+        if (!_parseHeader()) {
+          return false;
+        }
+        _state = STATE_OPCODE;
+      } else if (_opcode == OP_COPY) {
+        if (!_runCopy(_readU32(_field), _readU32(_field + 4))) {
+          return false;
+        }
+        _state = STATE_OPCODE;
+      } else {
+        _literalRemaining = _readU32(_field);
+        if (_outputSize + (uint64_t)_literalRemaining > _header.targetSize) {
+          return _fail(ERR_RANGE);
+        }
+        _state = _literalRemaining > 0 ? STATE_LITERAL : STATE_OPCODE;
+      }
+      break;
+    }
+
+    case STATE_OPCODE:
+      _opcode = data[pos++];
+      _fieldLen = 0;
+      if (_opcode == OP_COPY) {
+        _fieldNeed = 8;
+        _state = STATE_ARGS;
+      } else if (_opcode == OP_ADD) {
+        _fieldNeed = 4;
+        _state = STATE_ARGS;
+      } else if (_opcode == OP_END) {
+        if (_outputSize != _header.targetSize) {
+          return _fail(ERR_RANGE);
+        }
+        _state = STATE_DONE;
+      } else {
+        return _fail(ERR_OPCODE);
+      }
+      break;
+
+    case STATE_LITERAL: {
+      size_t take = len - pos;
+      if (take > _literalRemaining) {
+        take = _literalRemaining;
+      }
+      if (!_emit(data + pos, take)) {
+        return false;
+      }
+      pos += take;
+      _literalRemaining -= take;
+      if (_literalRemaining == 0) {
+        _state = STATE_OPCODE;
+      }
+      break;
+    }
+
+    case STATE_DONE:
+      return _fail(ERR_TRAILING_DATA);
+
+    case STATE_ERROR:
+      return false;
+    }
+  }
+  return true;
+}
+
+const char *DeltaPatchDecoder::statusString() const {
+  switch (_status) {
+  case OK:
+    return "OK";
+  case ERR_MAGIC:
+    return "Not a delta patch";
+  case ERR_VERSION:
+    return "Unsupported delta patch version";
+  case ERR_BASE_REJECTED:
+    return "Delta patch does not apply to the running firmware";
+  case ERR_OPCODE:
+    return "Invalid delta patch opcode";
+  case ERR_RANGE:
+    return "Delta patch operation out of range";
+  case ERR_BASE_READ:
+    return "Failed to read base image";
+  case ERR_OUTPUT_WRITE:
+    return "Failed to write patched image";
+  case ERR_TRAILING_DATA:
+    return "Unexpected data after end of delta patch";
+  }
+  return "Unknown";
+}
+
+uint32_t DeltaPatchDecoder::_readU32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+bool DeltaPatchDecoder::_fail(Status status) {
+  _status = status;
+  _state = STATE_ERROR;
+  return false;
+}
+
+bool DeltaPatchDecoder::_parseHeader() {
+  if (memcmp(_field, "IOTD", 4) != 0) {
+    return _fail(ERR_MAGIC);
+  }
+  _header.version = _field[4];
+  if (_header.version != VERSION) {
+    return _fail(ERR_VERSION);
+  }
+  _header.baseSize = _readU32(_field + 8);
+  _header.targetSize = _readU32(_field + 12);
+  memcpy(_header.baseSha256, _field + 16, sizeof(_header.baseSha256));
+  if (_checkHeader && !_checkHeader(_header)) {
+    return _fail(ERR_BASE_REJECTED);
+  }
+  return true;
+}
+
+bool DeltaPatchDecoder::_runCopy(uint32_t offset, uint32_t length) {
+  if ((uint64_t)offset + length > _header.baseSize ||
+      _outputSize + (uint64_t)length > _header.targetSize) {
+    return _fail(ERR_RANGE);
+  }
+  while (length > 0) {
+    size_t chunk = length < COPY_BUFFER_SIZE ? length : COPY_BUFFER_SIZE;
+    if (!_readBase(offset, _copyBuffer, chunk)) {
+      return _fail(ERR_BASE_READ);
+    }
+    if (!_emit(_copyBuffer, chunk)) {
+      return false;
+    }
+    offset += chunk;
+    length -= chunk;
+  }
+  return true;
+}
+
+bool DeltaPatchDecoder::_emit(const uint8_t *data, size_t len) {
+  if (!_writeOutput(data, len)) {
+    return _fail(ERR_OUTPUT_WRITE);
+  }
+  _outputSize += len;
+  return true;
+}
@@ -0,0 +1,104 @@
+#ifndef DELTA_PATCH_H
+#define DELTA_PATCH_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming decoder for delta firmware images built by
+// tools/delta_patch.py. The new image is rebuilt from ranges of the running
+// (base) image plus literal bytes carried in the patch.
+//
+// Patch layout, all integers little-endian:
+//   header  "IOTD" | u8 version | u8[3] reserved | u32 base_size |
+//           u32 target_size | u8[32] base_sha256
+//   ops     'C' u32 base_offset u32 length   copy from the base image
+//           'A' u32 length <length bytes>    literal bytes
+//           'E'                              end of patch
+//
+// The decoder has no Arduino dependencies so the same code can be built on
+// the host (see tools/delta_apply_host.cpp).
+
+struct DeltaPatchHeader {
+  uint8_t version;
+  uint32_t baseSize;
+  uint32_t targetSize;
+  uint8_t baseSha256[32];
+};
+
+class DeltaPatchDecoder {
+public:
+  using BaseReader = std::function<bool(uint32_t, uint8_t *, size_t)>;
+  using OutputWriter = std::function<bool(const uint8_t *, size_t)>;
+  using HeaderCheck = std::function<bool(const DeltaPatchHeader &)>;
+
+  enum Status {
+    OK = 0,
+    ERR_MAGIC,
+    ERR_VERSION,
+    ERR_BASE_REJECTED,
+    ERR_OPCODE,
+    ERR_RANGE,
+    ERR_BASE_READ,
+    ERR_OUTPUT_WRITE,
+    ERR_TRAILING_DATA
+  };
+
+  static const uint8_t VERSION = 1;
+  static const size_t HEADER_SIZE = 48;
+
+  DeltaPatchDecoder();
+
+  void begin(BaseReader readBase, OutputWriter writeOutput,
+             HeaderCheck checkHeader = nullptr);
+
+  // Feeds the next piece of the patch stream. Returns false once the patch
+  // is found to be invalid; status() tells why.
+  bool feed(const uint8_t *data, size_t len);
+
+  bool finished() const { return _state == STATE_DONE; }
+  Status status() const { return _status; }
+  const char *statusString() const;
+  const DeltaPatchHeader &header() const { return _header; }
+  uint32_t outputSize() const { return _outputSize; }
+
+private:
+  enum State {
+    STATE_HEADER,
+    STATE_OPCODE,
+    STATE_ARGS,
+    STATE_LITERAL,
+    STATE_DONE,
+    STATE_ERROR
+  };
+
+  static const uint8_t OP_COPY = 'C';
+  static const uint8_t OP_ADD = 'A';
+  static const uint8_t OP_END = 'E';
+  static const size_t COPY_BUFFER_SIZE = 512;
+
+  static uint32_t _readU32(const uint8_t *p);
+  bool _fail(Status status);
+  bool _parseHeader();
+  bool _runCopy(uint32_t offset, uint32_t length);
+  bool _emit(const uint8_t *data, size_t len);
+
+  BaseReader _readBase;
+  OutputWriter _writeOutput;
+  HeaderCheck _checkHeader;
+
+  State _state;
+  Status _status;
+  DeltaPatchHeader _header;
+
+  uint8_t _field[HEADER_SIZE];
+  size_t _fieldLen;
+  size_t _fieldNeed;
+  uint8_t _opcode;
+  uint32_t _literalRemaining;
+  uint32_t _outputSize;
+
+  uint8_t _copyBuffer[COPY_BUFFER_SIZE];
+};
+
+#endif // DELTA_PATCH_H
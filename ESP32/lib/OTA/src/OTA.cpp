@@ -1,25 +1,142 @@
 #include "OTA.h"
+#include "OTAPipeline.h"
+#include "OTARollout.h"
 #include "certificate.h"
+#include <ESPmDNS.h>
 #include <HTTPClient.h>
-#include <StreamString.h>
-#include <Update.h>
+#include <Preferences.h>
+#include <SecureConnectionManager.h>
 #include <WiFi.h>
-#include <WiFiClientSecure.h>
+#include <esp_image_format.h>
 #include <esp_ota_ops.h>
 #include <mbedtls/sha256.h>
+#include <mbedtls/version.h>
+#include <mdns.h>
+
+// A checkpoint stores the SHA256 context as raw bytes, which only another
+// build of the same mbedtls can restore
+static_assert(sizeof(mbedtls_sha256_context) <=
+                  sizeof(OTAResumeProgress::hashState),
+              "SHA256 context does not fit into the checkpoint");
+static const uint32_t HASH_STATE_LAYOUT =
+    MBEDTLS_VERSION_NUMBER ^
+    static_cast<uint32_t>(sizeof(mbedtls_sha256_context));
 
 extern "C" bool verifyRollbackLater() { return true; }
 
 OTA *OTA::_instance = nullptr;
 
+#ifndef GIT_VERSION
+#define GIT_VERSION "unknown"
+#endif
+
 static const uint32_t DOWNLOAD_TIMEOUT_MS = 15000; // 15秒内无数据则超时
+static const char *CHECKPOINT_NAMESPACE = "ota_resume";
+static const char *APPLIED_NAMESPACE = "ota_applied";
+static const char *APPLIED_KEY = "record";
+static const char *REPLACED_KEY = "replaced"; // the record before it
+static const char *ROLLED_BACK_KEY = "rolled_back"; // image that failed
+static const uint32_t APPLIED_MAGIC = 0x4f544149; // "OTAI"
+static const char *PEER_TOKEN_KEY = "token"; // of the record's command
+// mDNS service of the firmware endpoint; TXT "image" is the tag of the image
+// served, "fetch" that of the one being downloaded from the origin
+static const char *PEER_SERVICE = "_iotota";
+static const char *PEER_PROTO = "_tcp";
+
+// What is announced for an image: hex of the first half of
+// SHA256(token ":" sha256), so only devices given the token can tell which
+// image a peer has
+static void peerTag(const char *token, const char *sha256, char *out) {
+  uint8_t digest[32];
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  mbedtls_sha256_update(&ctx, reinterpret_cast<const uint8_t *>(token),
+                        strlen(token));
+  mbedtls_sha256_update(&ctx, reinterpret_cast<const uint8_t *>(":"), 1);
+  mbedtls_sha256_update(&ctx, reinterpret_cast<const uint8_t *>(sha256),
+                        strlen(sha256));
+  mbedtls_sha256_finish(&ctx, digest);
+  mbedtls_sha256_free(&ctx);
+  for (size_t i = 0; i < 16; i++) {
+    snprintf(out + i * 2, 3, "%02x", digest[i]);
+  }
+}
+
+// A broadcast chunk on its way from the MQTT task to the update task
+struct OTAQueuedChunk {
+  uint32_t index;
+  uint32_t length;
+  uint8_t *data; // malloc'd, freed by the update task
+};
+
+// NVS storage for OTACheckpoint and the applied record. Each record is a
+// single blob, which NVS commits atomically.
+static bool loadRecord(const char *ns, const char *key, void *data,
+                       size_t len) {
+  Preferences prefs;
+  if (!prefs.begin(ns, true)) {
+    return false;
+  }
+  bool ok = prefs.getBytesLength(key) == len &&
+            prefs.getBytes(key, data, len) == len;
+  prefs.end();
+  return ok;
+}
+
+static bool storeRecord(const char *ns, const char *key, const void *data,
+                        size_t len) {
+  Preferences prefs;
+  if (!prefs.begin(ns, false)) {
+    return false;
+  }
+  bool ok = prefs.putBytes(key, data, len) == len;
+  prefs.end();
+  return ok;
+}
+
+static bool loadCheckpointRecord(const char *key, void *data, size_t len) {
+  return loadRecord(CHECKPOINT_NAMESPACE, key, data, len);
+}
+
+static bool storeCheckpointRecord(const char *key, const void *data,
+                                  size_t len) {
+  return storeRecord(CHECKPOINT_NAMESPACE, key, data, len);
+}
+
+static void removeCheckpointRecord(const char *key) {
+  Preferences prefs;
+  if (prefs.begin(CHECKPOINT_NAMESPACE, false)) {
+    if (prefs.isKey(key)) {
+      prefs.remove(key);
+    }
+    prefs.end();
+  }
+}
 
 OTA::OTA()
-    : _rollbackEnabled(true), _validationPerformed(false), _maxRetries(5),
-      _initialRetryDelayMs(5000), _progressCallback(nullptr),
-      _errorCallback(nullptr), _successCallback(nullptr),
-      _validationCallback(nullptr), _retryCallback(nullptr) {
+    : _updateRunning(false), _rollbackEnabled(true),
+      _validationPerformed(false), _maxRetries(5),
+      _initialRetryDelayMs(5000), _pipelineEnabled(false),
+      _pipelineBufferCount(4), _pipelineBufferSize(4096), _deltaMode(false),
+      _compressedMode(false), _basePartition(nullptr),
+      _partition(nullptr), _checkpointActive(false),
+      _sha256Enabled(false), _sha256OverDownload(false),
+      _written(0), _stats(),
+      _progressIntervalMs(OTA_PROGRESS_INTERVAL_MS), _progressTimer(nullptr),
+      _progressLock(xSemaphoreCreateMutex()), _progressStopped(true),
+      _updateTaskHandle(nullptr), _chunkQueue(nullptr),
+      _broadcastActive(false), _broadcastSession(0), _chunksDropped(0),
+      _broadcastStats(), _peerPort(0), _mdnsStarted(false),
+      _peerPartition(nullptr), _peerImage(), _peerToken(), _peerTag(),
+      _peerStats(),
+      _progressCallback(nullptr), _errorCallback(nullptr),
+      _successCallback(nullptr), _validationCallback(nullptr),
+      _retryCallback(nullptr) {
   _instance = this;
+  _progress.setStep(OTA_PROGRESS_STEP);
+  _checkpoint.begin(loadCheckpointRecord, storeCheckpointRecord,
+                    removeCheckpointRecord);
 }
 
 void OTA::onProgress(OTAProgressCallback callback) {
@@ -39,6 +156,657 @@ void OTA::setRetryPolicy(int maxRetries, int initialDelayMs) {
   _initialRetryDelayMs = initialDelayMs;
 }
 
+void OTA::setPipeline(bool enabled, size_t bufferCount, size_t bufferSize) {
+  _pipelineEnabled = enabled;
+  _pipelineBufferCount = bufferCount;
+  _pipelineBufferSize = bufferSize;
+}
+
+void OTA::setProgressReporting(uint32_t intervalMs, uint8_t stepPercent) {
+  _progressIntervalMs = intervalMs;
+  _progress.setStep(stepPercent);
+}
+
+void OTA::setAdmission(uint32_t jitterMs, OTALeasePublisher publisher) {
+  _leasePublisher = publisher;
+  _admission.configure(jitterMs, publisher != nullptr);
+}
+
+void OTA::onLeaseMessage(const char *payload, size_t length) {
+  JsonDocument doc;
+  if (deserializeJson(doc, payload, length)) {
+    Serial.println("[OTA] Ignoring unparsable lease reply");
+    return;
+  }
+  OTALeaseReply reply;
+  reply.ticket = doc["ticket"] | 0u;
+  reply.granted = doc["granted"] | false;
+  reply.leaseMs = doc["lease_ms"] | 60000u;
+  reply.retryMs = doc["retry_ms"] | 0u;
+  if (_admission.reply(millis(), reply) && _updateTaskHandle) {
+    xTaskNotifyGive(_updateTaskHandle);
+  }
+}
+
+void OTA::_sendLease(const char *op, const char *result) {
+  if (!_leasePublisher) {
+    return;
+  }
+  JsonDocument doc;
+  doc["op"] = op;
+  doc["id"] = _deviceId;
+  doc["ticket"] = _admission.ticket();
+  if (strcmp(op, "renew") == 0) {
+    doc["progress"] = OTAProgressChannel::percent(_progress.get());
+  }
+  if (result) {
+    doc["result"] = result;
+  }
+  _leasePublisher(doc.as<String>().c_str());
+}
+
+// Waits out the jitter and, with a coordinator, for a download slot. False
+// if the coordinator kept refusing for OTA_LEASE_MAX_WAIT_MS.
+bool OTA::_admit() {
+  _admission.begin(millis(), esp_random());
+  for (;;) {
+    uint32_t waitMs = 0;
+    switch (_admission.poll(millis(), esp_random(), waitMs)) {
+    case OTA_ADMISSION_WAIT:
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
+      break;
+    case OTA_ADMISSION_REQUEST:
+      _sendLease("request");
+      break;
+    case OTA_ADMISSION_START: {
+      if (!_admission.enabled()) {
+        return true;
+      }
+      OTAAdmissionStats stats = _admission.getStats();
+      Serial.printf("[OTA] Download admitted after %u ms (jitter %u ms, %u "
+                    "lease requests, %u denied)%s\n",
+                    stats.waitedMs, stats.jitterMs, stats.requests,
+                    stats.denials,
+                    _admission.coordinated() && !stats.leased
+                        ? ", no lease coordinator answered"
+                        : "");
+      return true;
+    }
+    case OTA_ADMISSION_GIVE_UP:
+      return false;
+    }
+  }
+}
+
+void OTA::_endAdmission(bool success) {
+  if (_admission.end()) {
+    _sendLease("release", success ? "success" : "error");
+  }
+}
+
+void OTA::setBroadcast(OTAGapPublisher publisher) {
+  _gapPublisher = publisher;
+  if (!_chunkQueue) {
+    _chunkQueue = xQueueCreate(OTA_BROADCAST_QUEUE, sizeof(OTAQueuedChunk));
+  }
+}
+
+void OTA::onBroadcastChunk(const uint8_t *payload, size_t length) {
+  uint32_t session;
+  uint32_t index;
+  if (!_broadcastActive ||
+      !OTABroadcastReceiver::parseHeader(payload, length, session, index) ||
+      session != _broadcastSession) {
+    return;
+  }
+  OTAQueuedChunk chunk;
+  chunk.index = index;
+  chunk.length = length - OTABroadcastReceiver::HEADER_SIZE;
+  chunk.data = static_cast<uint8_t *>(malloc(chunk.length));
+  if (!chunk.data) {
+    _chunksDropped++;
+    return;
+  }
+  memcpy(chunk.data, payload + OTABroadcastReceiver::HEADER_SIZE,
+         chunk.length);
+  if (xQueueSend(_chunkQueue, &chunk, 0) != pdTRUE) {
+    free(chunk.data);
+    _chunksDropped++;
+  }
+}
+
+// {"id":..., "session":..., "missing":[[first, last], ...], "left": n}
+void OTA::_sendGaps() {
+  uint32_t ranges[OTA_BROADCAST_MAX_RANGES][2];
+  size_t count = _broadcast.missingRanges(ranges, OTA_BROADCAST_MAX_RANGES);
+  JsonDocument doc;
+  doc["id"] = _deviceId;
+  doc["session"] = _broadcast.session();
+  JsonArray missing = doc["missing"].to<JsonArray>();
+  for (size_t i = 0; i < count; i++) {
+    JsonArray range = missing.add<JsonArray>();
+    range.add(ranges[i][0]);
+    range.add(ranges[i][1]);
+  }
+  doc["left"] = _broadcast.missing();
+  Serial.printf("[OTA] Asking for %u missing chunks of %u\n",
+                (unsigned)_broadcast.missing(),
+                (unsigned)_broadcast.chunkCount());
+  _gapPublisher(doc.as<String>().c_str());
+}
+
+void OTA::_drainChunks() {
+  OTAQueuedChunk chunk;
+  while (xQueueReceive(_chunkQueue, &chunk, 0) == pdTRUE) {
+    free(chunk.data);
+  }
+}
+
+// Chunks are whole sectors, so each one erases only its own
+bool OTA::_writeBroadcastChunk(uint32_t index, const uint8_t *data,
+                               size_t len) {
+  uint32_t offset = _broadcast.chunkOffset(index);
+  size_t sectors = (len + OTASectorWriter::SECTOR_SIZE - 1) /
+                   OTASectorWriter::SECTOR_SIZE;
+  return esp_partition_erase_range(_partition, offset,
+                                   sectors * OTASectorWriter::SECTOR_SIZE) ==
+             ESP_OK &&
+         _programSector(offset, data, len);
+}
+
+// Takes the chunks as they come, writes each where it belongs and asks for
+// the gaps until the image is complete, then checks it against SHA256
+bool OTA::_receiveBroadcast(uint32_t session, uint32_t size,
+                            uint32_t chunkSize, const String &sha256,
+                            int &errorCode, String &errorMessage) {
+  _partition = esp_ota_get_next_update_partition(NULL);
+  if (!_partition || size > _partition->size ||
+      !_broadcast.begin(session, size, chunkSize, millis())) {
+    errorCode = OTA_FATAL_NO_SPACE;
+    errorMessage = "Not enough space to begin OTA";
+    return false;
+  }
+  Serial.printf("[OTA] Receiving broadcast %u: %u bytes in %u chunks\n",
+                (unsigned)session, (unsigned)size,
+                (unsigned)_broadcast.chunkCount());
+  // The hash is taken over the partition at the end
+  _sha256Enabled = false;
+  _progress.begin(size, 0);
+  memset(&_stats, 0, sizeof(_stats));
+  _chunksDropped = 0;
+  _drainChunks();
+  _broadcastSession = session;
+  _broadcastActive = true;
+
+  unsigned long start = millis();
+  errorCode = 0;
+  while (!_broadcast.complete()) {
+    uint32_t waitMs = 0;
+    OTABroadcastAction action = _broadcast.poll(millis(), esp_random(), waitMs);
+    if (action == OTA_BROADCAST_REQUEST) {
+      _sendGaps();
+      continue;
+    }
+    if (action == OTA_BROADCAST_STALLED) {
+      errorCode = OTA_TRANSIENT_BROADCAST_STALLED;
+      errorMessage = "Broadcast stalled";
+      break;
+    }
+    OTAQueuedChunk chunk;
+    if (xQueueReceive(_chunkQueue, &chunk, pdMS_TO_TICKS(waitMs)) != pdTRUE) {
+      continue;
+    }
+    bool ok = true;
+    if (_broadcast.wanted(chunk.index, chunk.length)) {
+      unsigned long flashStart = millis();
+      ok = _writeBroadcastChunk(chunk.index, chunk.data, chunk.length);
+      _stats.flashMs += millis() - flashStart;
+      if (ok) {
+        _broadcast.received(chunk.index, millis());
+        _progress.update(_broadcast.bytesReceived());
+      }
+    }
+    free(chunk.data);
+    if (!ok) {
+      errorCode = OTA_FATAL_FLASH_WRITE_ERROR;
+      errorMessage = "Flash write error";
+      break;
+    }
+  }
+  _broadcastActive = false;
+  _drainChunks();
+
+  _broadcastStats = _broadcast.getStats();
+  _stats.elapsedMs = millis() - start;
+  _stats.bytes = _broadcast.bytesReceived();
+  _stats.bytesPerSec =
+      _stats.elapsedMs ? (uint64_t)_stats.bytes * 1000 / _stats.elapsedMs : 0;
+  Serial.printf("[OTA] Broadcast: %u of %u chunks in %u ms, %u duplicates, "
+                "%u invalid, %u gap requests, %u dropped\n",
+                (unsigned)_broadcastStats.chunks,
+                (unsigned)_broadcast.chunkCount(), (unsigned)_stats.elapsedMs,
+                (unsigned)_broadcastStats.duplicates,
+                (unsigned)_broadcastStats.invalid,
+                (unsigned)_broadcastStats.requests,
+                (unsigned)_chunksDropped.load());
+  bool complete = _broadcast.complete();
+  _broadcast.end();
+  if (!complete) {
+    return false;
+  }
+  if (!_verifyPartition(_partition, size, sha256)) {
+    errorCode = OTA_FATAL_SHA256_MISMATCH;
+    errorMessage = "SHA256 verification failed";
+    return false;
+  }
+  Serial.println("[OTA] SHA256 verification passed.");
+  return true;
+}
+
+// The chunks came in any order, so the image is hashed once it is whole
+bool OTA::_verifyPartition(const esp_partition_t *partition, uint32_t size,
+                           const String &sha256) {
+  uint8_t *buffer =
+      static_cast<uint8_t *>(malloc(OTASectorWriter::SECTOR_SIZE));
+  if (!buffer) {
+    return false;
+  }
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  bool ok = true;
+  for (uint32_t offset = 0; ok && offset < size;
+       offset += OTASectorWriter::SECTOR_SIZE) {
+    size_t len = size - offset < OTASectorWriter::SECTOR_SIZE
+                     ? size - offset
+                     : OTASectorWriter::SECTOR_SIZE;
+    ok = esp_partition_read(partition, offset, buffer, len) == ESP_OK;
+    if (ok) {
+      mbedtls_sha256_update(&ctx, buffer, len);
+    }
+  }
+  uint8_t calculated[32];
+  uint8_t expected[32];
+  mbedtls_sha256_finish(&ctx, calculated);
+  mbedtls_sha256_free(&ctx);
+  free(buffer);
+  _hexStringToBytes(sha256, expected, 32);
+  return ok && memcmp(calculated, expected, 32) == 0;
+}
+
+void OTA::setPeerSharing(uint16_t port) {
+  if (_peerPort || port == 0) {
+    return;
+  }
+  _peerPort = port;
+  if (xTaskCreate(_peerTask, "otaPeer", 4096, this, 1, NULL) != pdPASS) {
+    Serial.println("[OTA] Failed to create the peer task");
+    _peerPort = 0;
+  }
+}
+
+void OTA::_peerTask(void *pvParameters) {
+  static_cast<OTA *>(pvParameters)->_runPeerServer();
+  vTaskDelete(NULL);
+}
+
+// Announces the device over mDNS, then serves the running firmware once it
+// is known to be the verified image of the last update and was validated
+void OTA::_runPeerServer() {
+  while (WiFi.status() != WL_CONNECTED) {
+    vTaskDelay(pdMS_TO_TICKS(1000));
+  }
+  String host = "iot-";
+  if (_deviceId.isEmpty()) {
+    host += WiFi.macAddress();
+    host.replace(":", "");
+  } else {
+    host += _deviceId;
+  }
+  host.toLowerCase();
+  if (!MDNS.begin(host.c_str()) ||
+      mdns_service_add(nullptr, PEER_SERVICE, PEER_PROTO, _peerPort, nullptr,
+                       0) != ESP_OK) {
+    Serial.println("[OTA] Failed to start mDNS, not sharing firmware");
+    return;
+  }
+  _mdnsStarted = true;
+
+  uint32_t size = _servedImage();
+  if (size == 0) {
+    return;
+  }
+  WiFiServer server(_peerPort);
+  server.begin();
+  _announce("image", _peerTag);
+  Serial.printf("[OTA] Serving firmware %.16s... (%u bytes) on port %u\n",
+                _peerImage, (unsigned)size, (unsigned)_peerPort);
+  for (;;) {
+    WiFiClient client = server.available();
+    if (client) {
+      _servePeer(server, client, size);
+    } else {
+      vTaskDelay(pdMS_TO_TICKS(100));
+    }
+  }
+}
+
+// Size of the running image if the last update installed it, with a
+// SHA256 and a peer token, and it still hashes to that; 0 if there is
+// nothing to serve
+uint32_t OTA::_servedImage() {
+  OTAAppliedRecord record;
+  char token[OTA_PEER_TOKEN_MAX + 1];
+  if (!loadRecord(APPLIED_NAMESPACE, APPLIED_KEY, &record, sizeof(record)) ||
+      record.magic != APPLIED_MAGIC ||
+      !loadRecord(APPLIED_NAMESPACE, PEER_TOKEN_KEY, token, sizeof(token))) {
+    return 0;
+  }
+  token[sizeof(token) - 1] = '\0';
+  if (!OTAPeerHttp::validToken(token)) {
+    return 0;
+  }
+  record.sha256[sizeof(record.sha256) - 1] = '\0';
+  record.partition[sizeof(record.partition) - 1] = '\0';
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  if (!running || !record.sha256[0] ||
+      strcmp(running->label, record.partition) != 0) {
+    return 0;
+  }
+  // An image on trial may still be rolled back
+  esp_ota_img_states_t state;
+  while (esp_ota_get_state_partition(running, &state) == ESP_OK &&
+         state == ESP_OTA_IMG_PENDING_VERIFY) {
+    vTaskDelay(pdMS_TO_TICKS(1000));
+  }
+  // The download was the image file, which ends with the image's digest
+  esp_partition_pos_t position = {running->address, running->size};
+  esp_image_metadata_t metadata;
+  if (esp_image_get_metadata(&position, &metadata) != ESP_OK ||
+      !_verifyPartition(running, metadata.image_len, record.sha256)) {
+    Serial.println("[OTA] Running image does not match its SHA256, not "
+                   "serving it");
+    return 0;
+  }
+  _peerPartition = running;
+  memcpy(_peerImage, record.sha256, sizeof(_peerImage));
+  memcpy(_peerToken, token, sizeof(_peerToken));
+  peerTag(_peerToken, _peerImage, _peerTag);
+  return metadata.image_len;
+}
+
+// One request per connection. Others connecting meanwhile are told to come
+// back later, so the transfer keeps the whole link.
+void OTA::_servePeer(WiFiServer &server, WiFiClient &client, uint32_t size) {
+  char head[512];
+  size_t used = 0;
+  uint32_t start = millis();
+  while (used < sizeof(head) - 1 && client.connected() &&
+         millis() - start < 2000) {
+    int available = client.available();
+    if (available <= 0) {
+      vTaskDelay(pdMS_TO_TICKS(5));
+      continue;
+    }
+    size_t space = sizeof(head) - 1 - used;
+    used += client.read(reinterpret_cast<uint8_t *>(head) + used,
+                        (size_t)available < space ? available : space);
+    head[used] = '\0';
+    if (strstr(head, "\r\n\r\n")) {
+      break;
+    }
+  }
+  head[used] = '\0';
+
+  OTAPeerRequest request;
+  int status = 400;
+  if (OTAPeerHttp::parseRequest(head, request)) {
+    status = OTAPeerHttp::status(request, _peerImage, _peerToken, size);
+  }
+  char response[256];
+  client.write(reinterpret_cast<const uint8_t *>(response),
+               OTAPeerHttp::responseHead(response, sizeof(response), status,
+                                         request, size));
+  uint8_t *buffer =
+      static_cast<uint8_t *>(malloc(OTASectorWriter::SECTOR_SIZE));
+  if ((status == 200 || status == 206) && buffer) {
+    uint32_t offset = status == 206 ? request.first : 0;
+    uint32_t first = offset;
+    char busy[192];
+    size_t busyLength =
+        OTAPeerHttp::responseHead(busy, sizeof(busy), 503, request, size);
+    while (offset < size && client.connected()) {
+      size_t len = size - offset < OTASectorWriter::SECTOR_SIZE
+                       ? size - offset
+                       : OTASectorWriter::SECTOR_SIZE;
+      if (esp_partition_read(_peerPartition, offset, buffer, len) != ESP_OK ||
+          client.write(buffer, len) != len) {
+        break;
+      }
+      offset += len;
+      WiFiClient other = server.available();
+      if (other) {
+        other.write(reinterpret_cast<const uint8_t *>(busy), busyLength);
+        other.stop();
+      }
+    }
+    Serial.printf("[OTA] Served bytes %u-%u of the firmware to %s\n",
+                  (unsigned)first, (unsigned)offset,
+                  client.remoteIP().toString().c_str());
+  }
+  free(buffer);
+  client.stop();
+}
+
+// Sets or, with value nullptr, removes one of the device's TXT records
+void OTA::_announce(const char *key, const char *value) {
+  if (!_mdnsStarted) {
+    return;
+  }
+  if (value) {
+    mdns_service_txt_item_set(PEER_SERVICE, PEER_PROTO, key, value);
+  } else {
+    mdns_service_txt_item_remove(PEER_SERVICE, PEER_PROTO, key);
+  }
+}
+
+size_t OTA::_lookupPeers(const char *tag, OTAPeerInfo *peers) {
+  mdns_result_t *results = nullptr;
+  if (mdns_query_ptr(PEER_SERVICE, PEER_PROTO, OTA_PEER_LOOKUP_MS,
+                     OTA_PEER_MAX_PEERS, &results) != ESP_OK) {
+    return 0;
+  }
+  size_t count = 0;
+  for (mdns_result_t *result = results;
+       result && count < OTA_PEER_MAX_PEERS; result = result->next) {
+    OTAPeerInfo peer = {};
+    for (mdns_ip_addr_t *addr = result->addr; addr; addr = addr->next) {
+      if (addr->addr.type == ESP_IPADDR_TYPE_V4) {
+        peer.address = addr->addr.u_addr.ip4.addr;
+        break;
+      }
+    }
+    peer.port = result->port;
+    for (size_t i = 0; i < result->txt_count; i++) {
+      const char *value = result->txt[i].value;
+      bool match = value && result->txt_value_len[i] == 32 &&
+                   strncmp(value, tag, 32) == 0;
+      if (strcmp(result->txt[i].key, "image") == 0) {
+        peer.serving = match;
+      } else if (strcmp(result->txt[i].key, "fetch") == 0) {
+        peer.fetching = match;
+      }
+    }
+    if (peer.address && (peer.serving || peer.fetching)) {
+      peers[count++] = peer;
+    }
+  }
+  mdns_query_results_free(results);
+  return count;
+}
+
+// Downloads the image from a device on the network that serves it. False
+// if there is none and this device is to download it from the origin, in
+// which case it stays announced as doing so until the update ends.
+bool OTA::_downloadFromPeers(const String &sha256, const String &token) {
+  char image[65];
+  if (!_normalizeSha256(sha256.c_str(), image)) {
+    return false;
+  }
+  char wanted[33];
+  peerTag(token.c_str(), image, wanted);
+  // Peers serve the image as it is in flash
+  bool compressed = _compressedMode;
+  _compressedMode = false;
+  _sha256OverDownload = false;
+
+  OTAPeerInfo peers[OTA_PEER_MAX_PEERS];
+  size_t count = 0;
+  bool fetching = false;
+  bool done = false;
+  _peerSelector.begin(WiFi.localIP(), _peerPort, millis(), esp_random());
+  for (;;) {
+    OTAPeerInfo peer;
+    uint32_t waitMs = 0;
+    OTAPeerAction action =
+        _peerSelector.next(peers, count, millis(), esp_random(), peer, waitMs);
+    if (_peerSelector.fetching() != fetching) {
+      fetching = _peerSelector.fetching();
+      _announce("fetch", fetching ? wanted : nullptr);
+    }
+    if (action == OTA_PEER_WAIT) {
+      vTaskDelay(pdMS_TO_TICKS(waitMs));
+      count = _lookupPeers(wanted, peers);
+    } else if (action == OTA_PEER_CLAIM) {
+      count = _lookupPeers(wanted, peers);
+    } else if (action == OTA_PEER_DOWNLOAD) {
+      String url = "http://" + IPAddress(peer.address).toString() + ":" +
+                   String(peer.port) + "/ota/" + image;
+      int errorCode = 0;
+      String errorMessage;
+      if (_downloadImage(url, false, "", sha256, errorCode, errorMessage, 1,
+                         token)) {
+        _peerSelector.succeeded(millis());
+        done = true;
+        break;
+      }
+      // Transient errors, e.g. a 503 from a peer serving someone else, may
+      // clear up; a bad image or a refusal will not
+      _peerSelector.failed(peer, errorCode <= OTA_TRANSIENT_WIFI_DISCONNECTED,
+                           millis());
+    } else {
+      break;
+    }
+  }
+  _peerStats = _peerSelector.getStats();
+  Serial.printf("[OTA] Peers: %s after %u ms, %u lookups, %u downloads "
+                "(%u busy, %u failed)\n",
+                done ? "image from a peer" : "downloading it for the site",
+                (unsigned)_peerStats.waitedMs, (unsigned)_peerStats.lookups,
+                (unsigned)_peerStats.attempts, (unsigned)_peerStats.busy,
+                (unsigned)_peerStats.failures);
+  if (!done) {
+    _compressedMode = compressed;
+  }
+  return done;
+}
+
+void OTA::_progressTimerCallback(TimerHandle_t timer) {
+  OTA *ota = static_cast<OTA *>(pvTimerGetTimerID(timer));
+  // A sample that fired while _stopProgress() ran must not follow the
+  // final report
+  xSemaphoreTake(ota->_progressLock, portMAX_DELAY);
+  if (!ota->_progressStopped) {
+    ota->_reportProgress();
+  }
+  xSemaphoreGive(ota->_progressLock);
+}
+
+// Also renews the download lease, the renewal carrying the progress
+void OTA::_reportProgress() {
+  OTAProgress progress;
+  if (_progressIntervalMs && _progressCallback && _progress.sample(progress)) {
+    _progressCallback(progress.received, progress.total);
+  }
+  if (_admission.renewDue(millis())) {
+    _sendLease("renew");
+  }
+}
+
+void OTA::_startProgress() {
+  bool reporting = _progressIntervalMs && _progressCallback;
+  if (!reporting && !_leasePublisher) {
+    return;
+  }
+  TickType_t period =
+      pdMS_TO_TICKS(reporting ? _progressIntervalMs : OTA_PROGRESS_INTERVAL_MS);
+  if (period == 0) {
+    period = 1;
+  }
+  xSemaphoreTake(_progressLock, portMAX_DELAY);
+  _progressStopped = false;
+  xSemaphoreGive(_progressLock);
+  if (!_progressTimer) {
+    _progressTimer = xTimerCreate("otaProgress", period, pdTRUE, this,
+                                  _progressTimerCallback);
+    if (_progressTimer) {
+      xTimerStart(_progressTimer, 0);
+    }
+  } else {
+    // Also starts the timer
+    xTimerChangePeriod(_progressTimer, period, 0);
+  }
+}
+
+// Before the error or success callback: whatever the download reached is
+// reported first, and no timer sample runs after it
+void OTA::_stopProgress() {
+  if (_progressTimer) {
+    xTimerStop(_progressTimer, portMAX_DELAY);
+  }
+  // Waits for a sample the timer task is running on the other core
+  xSemaphoreTake(_progressLock, portMAX_DELAY);
+  if (_progressTimer && !_progressStopped) {
+    _reportProgress();
+  }
+  _progressStopped = true;
+  _progress.end();
+  xSemaphoreGive(_progressLock);
+}
+
+void OTA::setCheckpointInterval(uint32_t sectors) {
+  _checkpoint.setInterval(sectors);
+}
+
+bool OTA::resumeInterruptedUpdate() {
+  OTAResumeCommand command;
+  OTAResumeProgress progress;
+  if (!_checkpoint.enabled() || !_checkpoint.load(command, progress)) {
+    return false;
+  }
+  if (strcmp(command.firmware, GIT_VERSION) != 0) {
+    // The update finished, or other firmware was flashed in the meantime
+    Serial.printf("[OTA] Discarding checkpoint saved by firmware %s\n",
+                  command.firmware);
+    _checkpoint.clear();
+    return false;
+  }
+  Serial.printf("[OTA] Resuming interrupted update of %s at byte %u\n",
+                command.url[0] ? command.url : command.patchUrl,
+                (unsigned)progress.committed);
+
+  OTATaskParams *params = new OTATaskParams();
+  params->instance = this;
+  params->url = command.url;
+  params->patchUrl = command.patchUrl;
+  params->root_ca = root_ca;
+  params->sha256 = command.sha256;
+  params->compressed = command.compressed;
+  params->sha256OverCompressed = command.sha256OverCompressed;
+  params->resume = true;
+  return _startTask(params);
+}
+
 void OTA::enableRollbackProtection(bool enable) { _rollbackEnabled = enable; }
 
 bool OTA::isFirstBootAfterUpdate() {
@@ -56,6 +824,12 @@ bool OTA::isFirstBootAfterUpdate() {
 }
 
 void OTA::checkAndValidateApp() {
+  // The bootloader rolls back an image that restarts before it is marked
+  // valid, without markAppInvalid() running
+  const esp_partition_t *invalid = esp_ota_get_last_invalid_partition();
+  if (invalid) {
+    _recordRolledBack(invalid);
+  }
   if (!_rollbackEnabled) {
     Serial.println("[OTA] Rollback protection disabled, skipping validation");
     return;
@@ -65,13 +839,26 @@ void OTA::checkAndValidateApp() {
     return;
   }
   Serial.println("[OTA] First boot after OTA update, starting validation...");
-  if (!_performCustomValidation()) {
+  // The callback usually waits for the network, so keep setup() moving
+  if (xTaskCreate(_validationTask, "otaValidate", 4096, this, 1, NULL) !=
+      pdPASS) {
+    Serial.println("[OTA] Failed to create validation task, validating now");
+    _validationTask(nullptr);
+  }
+}
+
+void OTA::_validationTask(void *pvParameters) {
+  OTA *ota = pvParameters ? static_cast<OTA *>(pvParameters) : _instance;
+  if (!ota->_performCustomValidation()) {
     Serial.println("[OTA] Custom validation failed, marking app invalid");
-    markAppInvalid();
-    return;
+    ota->markAppInvalid();
+  } else {
+    Serial.println("[OTA] Custom validation passed, marking app valid");
+    ota->markAppValid();
+  }
+  if (pvParameters) {
+    vTaskDelete(NULL);
   }
-  Serial.println("[OTA] Custom validation passed, marking app valid");
-  markAppValid();
 }
 
 void OTA::markAppValid() {
@@ -84,6 +871,7 @@ void OTA::markAppValid() {
 }
 
 void OTA::markAppInvalid() {
+  _recordRolledBack(esp_ota_get_running_partition());
   if (esp_ota_mark_app_invalid_rollback_and_reboot() == ESP_OK) {
     Serial.println("[OTA] App marked as invalid, rollback initiated");
   } else {
@@ -103,7 +891,7 @@ bool OTA::_performCustomValidation() {
       Serial.println("[OTA] Custom validation passed");
       return true;
     }
-    delay(100);
+    vTaskDelay(pdMS_TO_TICKS(100));
   }
   Serial.println("[OTA] Custom validation failed or timed out");
   return false;
@@ -112,20 +900,156 @@ bool OTA::_performCustomValidation() {
 void OTA::_updateTask(void *pvParameters) {
   OTATaskParams *params = (OTATaskParams *)pvParameters;
   String url = params->url;
+  String patch_url = params->patchUrl;
   String root_ca_str = params->root_ca;
   String sha256_hash_str = params->sha256;
+  _compressedMode = params->compressed;
+  bool sha256_over_compressed = params->sha256OverCompressed;
+  String request_id = params->requestId;
+  String peer_token = params->peerToken;
+  bool resume = params->resume;
+  bool broadcast = params->broadcast;
+  uint32_t broadcast_session = params->broadcastSession;
+  uint32_t broadcast_size = params->broadcastSize;
+  uint32_t broadcast_chunk = params->broadcastChunk;
+  // After a reset a broadcast update resumes as a download of its fallback
+  if (!resume && (!broadcast || !url.isEmpty())) {
+    _startCheckpoint(*params);
+  }
   delete params;
+  _updateTaskHandle = xTaskGetCurrentTaskHandle();
+  _startProgress();
 
+  int error_code = 0;
+  String error_message = "";
   bool overall_success = false;
+  bool try_full_image = !url.isEmpty();
 
-  for (int attempt = 1; attempt <= _maxRetries; ++attempt) {
+  // The broadcast reaches the whole board at once, there is nothing to
+  // admit; its fallback download is admitted like any other
+  if (broadcast) {
+    overall_success =
+        _receiveBroadcast(broadcast_session, broadcast_size, broadcast_chunk,
+                          sha256_hash_str, error_code, error_message);
+    try_full_image = !overall_success && !url.isEmpty();
+    if (try_full_image) {
+      Serial.printf("[OTA] Broadcast update failed (%s), downloading the "
+                    "image\n",
+                    error_message.c_str());
+    }
+  }
+
+  // A device nearby that runs the image spares the site's uplink and needs
+  // no admission. Peers serve the image itself, so a SHA256 of the
+  // compressed file cannot check what they send.
+  if (!broadcast && !resume && _mdnsStarted && !sha256_hash_str.isEmpty() &&
+      !peer_token.isEmpty() && !(_compressedMode && sha256_over_compressed)) {
+    overall_success = _downloadFromPeers(sha256_hash_str, peer_token);
+  }
+
+  if (!overall_success && (!broadcast || try_full_image) && !_admit()) {
+    // The checkpoint stays: the same update can still be resumed
+    _announce("fetch", nullptr);
+    _stopProgress();
+    const char *message = "No download slot from the lease coordinator";
+    Serial.printf("[OTA] %s\n", message);
+    if (_errorCallback) {
+      _errorCallback(OTA_TRANSIENT_NO_LEASE, message);
+    }
+    _updateTaskHandle = nullptr;
+    _updateRunning = false;
+    vTaskDelete(NULL);
+    return;
+  }
+
+  // A full image can continue from what is already in flash
+  if (resume && patch_url.isEmpty() && !_compressedMode &&
+      _restoreCheckpoint()) {
+    _sha256OverDownload = false;
+    overall_success = _downloadImage(url, false, root_ca_str, sha256_hash_str,
+                                     error_code, error_message);
+    // Only a bad checkpoint is worth another download from the first byte
+    try_full_image =
+        !overall_success && error_code == OTA_FATAL_SHA256_MISMATCH;
+    if (try_full_image) {
+      Serial.println("[OTA] Resumed image failed verification, downloading "
+                     "it again");
+    }
+  } else if (!overall_success && !broadcast && !patch_url.isEmpty()) {
+    // The rebuilt image is always what SHA256 describes for a patch
+    _sha256OverDownload = false;
+    overall_success = _downloadImage(patch_url, true, root_ca_str,
+                                     sha256_hash_str, error_code,
+                                     error_message);
+    if (!overall_success && !url.isEmpty()) {
+      Serial.printf("[OTA] Delta update failed (%s), falling back to the "
+                    "full image\n",
+                    error_message.c_str());
+    }
+  }
+  if (!overall_success && try_full_image) {
+    _sha256OverDownload = _compressedMode && sha256_over_compressed;
+    overall_success = _downloadImage(url, false, root_ca_str, sha256_hash_str,
+                                     error_code, error_message);
+  }
+  _announce("fetch", nullptr);
+
+  if (!overall_success) {
+    _checkpoint.clear();
+    _stopProgress();
+    _endAdmission(false);
+    if (_errorCallback) {
+      _errorCallback(error_code, error_message.c_str());
+    }
+    _updateTaskHandle = nullptr;
+    _updateRunning = false;
+    vTaskDelete(NULL);
+    return;
+  }
+
+  String final_error_msg;
+  bool finished = _finishImage(final_error_msg);
+  _checkpoint.clear();
+  _stopProgress();
+  _endAdmission(finished);
+  if (!finished) {
+    int final_error_code = OTA_FATAL_UPDATE_END_FAILED;
+    Serial.printf("[OTA] FATAL ERROR: %s\n", final_error_msg.c_str());
+    if (_errorCallback) {
+      _errorCallback(final_error_code, final_error_msg.c_str());
+    }
+  } else {
+    _recordInstalled(sha256_hash_str, request_id, peer_token);
+    const char *success_msg = "Update successful! Rebooting...";
+    Serial.printf("[OTA] %s\n", success_msg);
+    if (_successCallback) {
+      _successCallback(success_msg);
+    }
+    delay(1000);
+    ESP.restart();
+  }
+
+  _updateTaskHandle = nullptr;
+  _updateRunning = false;
+  vTaskDelete(NULL);
+}
+
+bool OTA::_downloadImage(const String &url, bool delta, const String &rootCa,
+                         const String &sha256, int &errorCode,
+                         String &errorMessage, int attempts,
+                         const String &token) {
+  SecureConnectionManager &connections = SecureConnectionManager::shared();
+  int maxAttempts = attempts > 0 ? attempts : _maxRetries;
+  for (int attempt = 1; attempt <= maxAttempts; ++attempt) {
     bool attempt_succeeded = false;
+    bool connection_acquired = false;
     bool is_fatal_error = false;
     int error_code = 0;
     String error_message = "";
 
-    Serial.printf("[OTA] Starting update attempt %d/%d from %s\n", attempt,
-                  _maxRetries, url.c_str());
+    Serial.printf("[OTA] Starting %s attempt %d/%d from %s\n",
+                  delta ? "delta update" : "update", attempt, maxAttempts,
+                  url.c_str());
 
     do {
       if (WiFi.status() != WL_CONNECTED) {
@@ -134,27 +1058,34 @@ void OTA::_updateTask(void *pvParameters) {
         break;
       }
 
-      HTTPClient http;
-      WiFiClient *client = nullptr;
+      // The shared connection keeps its TLS session between retries, so
+      // only the first attempt pays for a full handshake
+      HTTPClient *request = connections.acquire(
+          SECURE_CHANNEL_OTA, url, rootCa.isEmpty() ? nullptr : rootCa.c_str());
+      if (!request) {
+        error_code = OTA_TRANSIENT_HTTP_GET_FAILED;
+        error_message = "Connection is busy";
+        break;
+      }
+      connection_acquired = true;
+      HTTPClient &http = *request;
 
-      if (url.startsWith("https://")) {
-        WiFiClientSecure *secure_client = new WiFiClientSecure;
-        if (!root_ca_str.isEmpty()) {
-          secure_client->setCACert(root_ca_str.c_str());
-        } else {
-          secure_client->setInsecure();
-          Serial.println("[OTA] WARNING: Certificate validation is DISABLED! "
-                         "This is insecure!");
-        }
-        client = secure_client;
-      } else {
-        client = new WiFiClient;
+      const char *headerKeys[] = {"Content-Range"};
+      http.collectHeaders(headerKeys, 1);
+      if (!token.isEmpty()) {
+        http.addHeader("Authorization", "Bearer " + token);
       }
 
-      http.begin(*client, url);
+      size_t rangeStart = _resume.rangeStart();
+      if (rangeStart > 0) {
+        http.addHeader("Range",
+                       "bytes=" + String((unsigned long)rangeStart) + "-");
+        Serial.printf("[OTA] Resuming download at byte %u of %u\n",
+                      (unsigned)rangeStart, (unsigned)_resume.total());
+      }
 
       int httpCode = http.GET();
-      if (httpCode != HTTP_CODE_OK) {
+      if (httpCode != HTTP_CODE_OK && httpCode != HTTP_CODE_PARTIAL_CONTENT) {
         if (httpCode >= 400 && httpCode < 500) {
           is_fatal_error = true;
           error_code = OTA_FATAL_HTTP_4XX_ERROR;
@@ -163,7 +1094,6 @@ void OTA::_updateTask(void *pvParameters) {
         }
         error_message = "HTTP GET failed: " + http.errorToString(httpCode);
         http.end();
-        delete client;
         break;
       }
 
@@ -172,88 +1102,119 @@ void OTA::_updateTask(void *pvParameters) {
         error_code = OTA_TRANSIENT_NO_CONTENT_LENGTH;
         error_message = "Content-Length header invalid or missing";
         http.end();
-        delete client;
         break;
       }
-      Serial.printf("[OTA] Firmware size: %d bytes\n", contentLength);
 
-      if (!Update.begin(contentLength)) {
-        is_fatal_error = true;
-        error_code = OTA_FATAL_NO_SPACE;
-        StreamString updateErrorStream;
-        Update.printError(updateErrorStream);
-        error_message = "Not enough space to begin OTA: " + updateErrorStream;
+      String contentRange = http.header("Content-Range");
+      OTAResumeAction action =
+          _resume.accept(httpCode == HTTP_CODE_PARTIAL_CONTENT,
+                         contentRange.isEmpty() ? nullptr
+                                                : contentRange.c_str());
+      if (action == OTA_RESUME_MISMATCH) {
+        // Can't trust what we already have, start over on the next attempt
+        _abortImage();
+        error_code = OTA_TRANSIENT_HTTP_GET_FAILED;
+        error_message = "Unexpected Content-Range in partial response";
         http.end();
-        delete client;
         break;
       }
+      if (action == OTA_RESUME_CONTINUE) {
+        Serial.printf("[OTA] Server accepted range, %d bytes remaining\n",
+                      contentLength);
+      } else {
+        if (action == OTA_RESUME_RESTART) {
+          Serial.println(
+              "[OTA] Server ignored Range request, restarting from byte 0");
+          _abortImage();
+        }
+        Serial.printf("[OTA] %s size: %d bytes\n", delta ? "Patch" : "Firmware",
+                      contentLength);
 
-      size_t written = 0;
-      uint8_t buff[4096] = {0};
-      Stream &stream = http.getStream();
-      bool sha256_verification_enabled = !sha256_hash_str.isEmpty();
-      mbedtls_sha256_context sha256_ctx;
-
-      if (sha256_verification_enabled) {
-        mbedtls_sha256_init(&sha256_ctx);
-        mbedtls_sha256_starts(&sha256_ctx, 0);
-      }
-
-      unsigned long lastDataTime = millis();
-      while (http.connected() && (written < contentLength)) {
-        if (millis() - lastDataTime > DOWNLOAD_TIMEOUT_MS) {
-          error_code = OTA_TRANSIENT_DOWNLOAD_TIMEOUT;
-          error_message = "Download timed out (no data received)";
+        if (!_beginImage(contentLength, delta, !sha256.isEmpty())) {
+          is_fatal_error = true;
+          error_code = OTA_FATAL_NO_SPACE;
+          error_message = "Not enough space to begin OTA";
+          http.end();
           break;
         }
+      }
 
-        size_t len = stream.readBytes(buff, sizeof(buff));
-        if (len > 0) {
-          lastDataTime = millis();
-          if (Update.write(buff, len) != len) {
-            is_fatal_error = true;
-            error_code = OTA_FATAL_FLASH_WRITE_ERROR;
-            error_message = "Flash write error";
-            break;
-          }
-          if (sha256_verification_enabled) {
-            mbedtls_sha256_update(&sha256_ctx, buff, len);
-          }
-          written += len;
-          if (_progressCallback) {
-            _progressCallback(written, contentLength);
-          }
-        }
-        vTaskDelay(1);
+      memset(&_stats, 0, sizeof(_stats));
+      _stats.resumeOffset = _resume.received();
+      _stats.admissionMs = _admission.getStats().waitedMs;
+      uint32_t reportsBefore = _progress.getReports();
+      unsigned long downloadStart = millis();
+      if (_pipelineEnabled) {
+        error_code = _downloadPipelined(http, error_message);
+      } else {
+        error_code = _downloadSequential(http, error_message);
       }
+      _stats.elapsedMs = millis() - downloadStart;
+      _stats.bytes = _resume.received() - _stats.resumeOffset;
+      _stats.progressReports = _progress.getReports() - reportsBefore;
+      _printStats();
 
-      if (error_code != 0 || is_fatal_error) {
+      if (error_code == OTA_FATAL_FLASH_WRITE_ERROR) {
+        is_fatal_error = true;
+        if (delta && _delta.status() != DeltaPatchDecoder::OK &&
+            _delta.status() != DeltaPatchDecoder::ERR_OUTPUT_WRITE) {
+          error_code = _delta.status() == DeltaPatchDecoder::ERR_BASE_REJECTED
+                           ? OTA_FATAL_PATCH_BASE_MISMATCH
+                           : OTA_FATAL_PATCH_INVALID;
+          error_message = _delta.statusString();
+        } else if (_compressedMode && !_inflater.outputFailed()) {
+          error_code = OTA_FATAL_DECOMPRESS_FAILED;
+          error_message = "Firmware decompression failed";
+        }
+      }
+      if (error_code != 0) {
         http.end();
-        delete client;
         break;
       }
 
-      if (written != contentLength) {
+      if (!_resume.complete()) {
         error_code = OTA_TRANSIENT_DOWNLOAD_INCOMPLETE;
         error_message = "Download incomplete";
         http.end();
-        delete client;
         break;
       }
 
-      if (sha256_verification_enabled) {
+      if (_compressedMode && !_inflater.finished()) {
+        is_fatal_error = true;
+        error_code = OTA_FATAL_DECOMPRESS_FAILED;
+        error_message = "Compressed stream ended before the image was complete";
+        http.end();
+        break;
+      }
+
+      if (delta && !_delta.finished()) {
+        is_fatal_error = true;
+        error_code = OTA_FATAL_PATCH_INVALID;
+        error_message = "Delta patch ended before the image was complete";
+        http.end();
+        break;
+      }
+
+      // The last sector is only hashed once it is programmed
+      if (!_flash.flush()) {
+        is_fatal_error = true;
+        error_code = OTA_FATAL_FLASH_WRITE_ERROR;
+        error_message = "Flash write error";
+        http.end();
+        break;
+      }
+
+      if (_sha256Enabled) {
         uint8_t calculated_hash[32];
         uint8_t expected_hash[32];
-        mbedtls_sha256_finish(&sha256_ctx, calculated_hash);
-        mbedtls_sha256_free(&sha256_ctx);
-        _hexStringToBytes(sha256_hash_str, expected_hash, 32);
+        mbedtls_sha256_finish(&_sha256Ctx, calculated_hash);
+        _hexStringToBytes(sha256, expected_hash, 32);
 
         if (memcmp(calculated_hash, expected_hash, 32) != 0) {
           is_fatal_error = true;
           error_code = OTA_FATAL_SHA256_MISMATCH;
           error_message = "SHA256 verification failed";
           http.end();
-          delete client;
           break;
         }
         Serial.println("[OTA] SHA256 verification passed.");
@@ -261,25 +1222,28 @@ void OTA::_updateTask(void *pvParameters) {
 
       attempt_succeeded = true;
       http.end();
-      delete client;
 
     } while (false);
 
-    if (attempt_succeeded) {
-      overall_success = true;
-      break;
+    if (connection_acquired) {
+      connections.release(SECURE_CHANNEL_OTA, attempt_succeeded);
+      connections.printStats();
     }
 
-    Update.abort();
+    if (attempt_succeeded) {
+      return true;
+    }
 
-    if (is_fatal_error || attempt == _maxRetries) {
+    // A transient failure keeps the partial image so the next attempt can
+    // continue with a Range request instead of starting from byte 0
+    if (!OTAResume::keepAfterFailure(is_fatal_error,
+                                     attempt == maxAttempts)) {
+      _abortImage();
       Serial.printf("[OTA] Final error after %d attempts: %s (Code: %d)\n",
                     attempt, error_message.c_str(), error_code);
-      if (_errorCallback) {
-        _errorCallback(error_code, error_message.c_str());
-      }
-      vTaskDelete(NULL);
-      return;
+      errorCode = error_code;
+      errorMessage = error_message;
+      return false;
     }
 
     unsigned long delay_ms = _initialRetryDelayMs * (1 << (attempt - 1));
@@ -287,34 +1251,373 @@ void OTA::_updateTask(void *pvParameters) {
                   attempt, error_message.c_str(), delay_ms);
 
     if (_retryCallback) {
-      _retryCallback(attempt, _maxRetries, error_message.c_str(), delay_ms);
+      _retryCallback(attempt, maxAttempts, error_message.c_str(), delay_ms);
     }
     vTaskDelay(pdMS_TO_TICKS(delay_ms));
   }
 
-  if (overall_success) {
-    if (!Update.end(true)) {
-      int final_error_code = OTA_FATAL_UPDATE_END_FAILED;
-      StreamString updateErrorStream;
-      Update.printError(updateErrorStream);
-      String final_error_msg =
-          "Update.end() failed. Error: " + updateErrorStream;
-      Serial.printf("[OTA] FATAL ERROR: %s\n", final_error_msg.c_str());
-      if (_errorCallback) {
-        _errorCallback(final_error_code, final_error_msg.c_str());
+  return false;
+}
+
+bool OTA::_beginImage(size_t downloadSize, bool delta, bool verifySha256) {
+  _partition = esp_ota_get_next_update_partition(NULL);
+  // Patches and compressed images only tell the image size once decoded
+  bool sizeKnown = !delta && !_compressedMode;
+  if (!_partition || (sizeKnown && downloadSize > _partition->size) ||
+      !_beginFlash(0)) {
+    return false;
+  }
+  if (_compressedMode) {
+    if (!_inflater.begin([this](const uint8_t *data, size_t len) {
+          return _writeDecoded(data, len);
+        })) {
+      Serial.println("[OTA] Failed to allocate the decompressor");
+      _flash.end();
+      return false;
+    }
+    Serial.printf("[OTA] Decompressing on the fly (%u bytes of RAM)\n",
+                  (unsigned)_inflater.memoryUsage());
+  }
+  _resume.begin(downloadSize);
+  _deltaMode = delta;
+  _written = 0;
+  _progress.begin(downloadSize, 0);
+  if (_deltaMode) {
+    _basePartition = esp_ota_get_running_partition();
+    _delta.begin(
+        [this](uint32_t offset, uint8_t *buf, size_t len) {
+          return esp_partition_read(_basePartition, offset, buf, len) ==
+                 ESP_OK;
+        },
+        [this](const uint8_t *data, size_t len) {
+          return _writeImage(data, len);
+        },
+        [this](const DeltaPatchHeader &header) {
+          return _verifyDeltaBase(header);
+        });
+  }
+  _sha256Enabled = verifySha256;
+  if (_sha256Enabled) {
+    mbedtls_sha256_init(&_sha256Ctx);
+    mbedtls_sha256_starts(&_sha256Ctx, 0);
+  }
+  // Decoder state is not saved, so only full images can resume after a
+  // reset; the others still restart from the saved command
+  _checkpointActive = !delta && !_compressedMode && _checkpoint.enabled();
+#if CONFIG_IDF_TARGET_ESP32
+  // The original ESP32 keeps a running digest inside the SHA engine rather
+  // than in the context, so there is nothing to snapshot
+  _checkpointActive = _checkpointActive && !_sha256Enabled;
+#endif
+  _checkpoint.discardProgress();
+  return true;
+}
+
+bool OTA::_beginFlash(uint32_t startOffset) {
+  return _flash.begin(
+      _partition->size,
+      [this](uint32_t offset, size_t len) {
+        return esp_partition_erase_range(_partition, offset, len) == ESP_OK;
+      },
+      [this](uint32_t offset, const uint8_t *data, size_t len) {
+        return _programSector(offset, data, len);
+      },
+      [this](uint32_t committed) { _saveCheckpoint(committed); },
+      startOffset);
+}
+
+bool OTA::_finishImage(String &errorMessage) {
+  if (_sha256Enabled) {
+    mbedtls_sha256_free(&_sha256Ctx);
+  }
+  _inflater.end();
+  _flash.end();
+  _resume.reset();
+  _checkpointActive = false;
+  // Verifies the whole image before switching to it
+  esp_err_t err = esp_ota_set_boot_partition(_partition);
+  if (err != ESP_OK) {
+    errorMessage = "Failed to activate the new image: ";
+    errorMessage += esp_err_to_name(err);
+    return false;
+  }
+  return true;
+}
+
+void OTA::_abortImage() {
+  if (_resume.started()) {
+    _flash.end();
+    if (_sha256Enabled) {
+      mbedtls_sha256_free(&_sha256Ctx);
+    }
+    _inflater.end();
+    _checkpoint.discardProgress();
+  }
+  _resume.reset();
+  _checkpointActive = false;
+  _written = 0;
+}
+
+void OTA::_startCheckpoint(const OTATaskParams &params) {
+  if (!_checkpoint.enabled()) {
+    return;
+  }
+  OTAResumeCommand command;
+  memset(&command, 0, sizeof(command));
+  bool fits =
+      OTACheckpoint::copyField(command.firmware, sizeof(command.firmware),
+                               GIT_VERSION) &&
+      OTACheckpoint::copyField(command.url, sizeof(command.url),
+                               params.url.c_str()) &&
+      OTACheckpoint::copyField(command.patchUrl, sizeof(command.patchUrl),
+                               params.patchUrl.c_str()) &&
+      OTACheckpoint::copyField(command.sha256, sizeof(command.sha256),
+                               params.sha256.c_str());
+  command.compressed = params.compressed;
+  command.sha256OverCompressed = params.sha256OverCompressed;
+  if (!fits) {
+    Serial.println("[OTA] Update command too long to checkpoint");
+    _checkpoint.clear();
+    return;
+  }
+  if (!_checkpoint.start(command)) {
+    Serial.println("[OTA] Failed to save the update command to NVS");
+  }
+}
+
+bool OTA::_restoreCheckpoint() {
+  OTAResumeCommand command;
+  OTAResumeProgress progress;
+  if (!_checkpoint.load(command, progress) || progress.committed == 0) {
+    return false;
+  }
+  // The digest state is only restorable into the same kind of context
+  size_t hashStateSize = command.sha256[0] ? sizeof(_sha256Ctx) : 0;
+  _partition = esp_ota_get_next_update_partition(NULL);
+  if (!_partition || _partition->address != progress.partitionAddress ||
+      progress.totalSize > _partition->size ||
+      progress.hashStateSize != hashStateSize ||
+      (hashStateSize > 0 && progress.hashLayout != HASH_STATE_LAYOUT) ||
+      !_beginFlash(progress.committed)) {
+    Serial.println("[OTA] Checkpoint does not match this device, starting "
+                   "over");
+    _checkpoint.discardProgress();
+    return false;
+  }
+
+  _resume.restore(progress.committed, progress.totalSize);
+  _deltaMode = false;
+  _written = progress.committed;
+  _progress.begin(progress.totalSize, progress.committed);
+  _sha256Enabled = hashStateSize > 0;
+  if (_sha256Enabled) {
+    mbedtls_sha256_init(&_sha256Ctx);
+    memcpy(&_sha256Ctx, progress.hashState, hashStateSize);
+  }
+  _checkpointActive = true;
+  Serial.printf("[OTA] Restored checkpoint: %u of %u bytes already in %s\n",
+                (unsigned)_resume.received(), (unsigned)_resume.total(),
+                _partition->label);
+  return true;
+}
+
+void OTA::_saveCheckpoint(uint32_t committed) {
+  if (!_checkpointActive || !_checkpoint.due(committed, _resume.total())) {
+    return;
+  }
+  OTAResumeProgress progress;
+  memset(&progress, 0, sizeof(progress));
+  progress.partitionAddress = _partition->address;
+  progress.totalSize = _resume.total();
+  progress.committed = committed;
+  if (_sha256Enabled) {
+    // Sector boundaries are block aligned, so the context holds no pending
+    // input and is a plain snapshot of the digest state
+    progress.hashStateSize = sizeof(_sha256Ctx);
+    progress.hashLayout = HASH_STATE_LAYOUT;
+    memcpy(progress.hashState, &_sha256Ctx, sizeof(_sha256Ctx));
+  }
+  if (!_checkpoint.save(progress)) {
+    Serial.println("[OTA] Failed to save OTA checkpoint");
+  }
+}
+
+bool OTA::_verifyDeltaBase(const DeltaPatchHeader &header) {
+  if (!_basePartition || header.baseSize > _basePartition->size) {
+    Serial.println("[OTA] Delta base is larger than the running partition");
+    return false;
+  }
+  Serial.printf("[OTA] Checking delta base (%u bytes, target %u bytes)...\n",
+                header.baseSize, header.targetSize);
+
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  uint8_t buf[1024];
+  bool readOk = true;
+  for (uint32_t offset = 0; offset < header.baseSize; offset += sizeof(buf)) {
+    size_t len = min((size_t)(header.baseSize - offset), sizeof(buf));
+    if (esp_partition_read(_basePartition, offset, buf, len) != ESP_OK) {
+      readOk = false;
+      break;
+    }
+    mbedtls_sha256_update(&ctx, buf, len);
+  }
+  uint8_t hash[32];
+  mbedtls_sha256_finish(&ctx, hash);
+  mbedtls_sha256_free(&ctx);
+
+  if (!readOk || memcmp(hash, header.baseSha256, sizeof(hash)) != 0) {
+    Serial.println("[OTA] Running firmware does not match the delta base");
+    return false;
+  }
+  return true;
+}
+
+int OTA::_downloadSequential(HTTPClient &http, String &errorMessage) {
+  uint8_t buff[4096] = {0};
+  Stream &stream = http.getStream();
+
+  unsigned long lastDataTime = millis();
+  while (http.connected() && _resume.received() < _resume.total()) {
+    if (millis() - lastDataTime > DOWNLOAD_TIMEOUT_MS) {
+      errorMessage = "Download timed out (no data received)";
+      return OTA_TRANSIENT_DOWNLOAD_TIMEOUT;
+    }
+
+    unsigned long readStart = millis();
+    size_t len = stream.readBytes(buff, sizeof(buff));
+    _stats.networkMs += millis() - readStart;
+    if (len > 0) {
+      lastDataTime = millis();
+      unsigned long writeStart = millis();
+      if (!_writeChunk(buff, len)) {
+        errorMessage = "Flash write error";
+        return OTA_FATAL_FLASH_WRITE_ERROR;
       }
+      _stats.flashMs += millis() - writeStart;
     } else {
-      const char *success_msg = "Update successful! Rebooting...";
-      Serial.printf("[OTA] %s\n", success_msg);
-      if (_successCallback) {
-        _successCallback(success_msg);
-      }
-      delay(1000);
-      ESP.restart();
+      vTaskDelay(1);
     }
   }
+  return 0;
+}
 
-  vTaskDelete(NULL);
+int OTA::_downloadPipelined(HTTPClient &http, String &errorMessage) {
+  OTAPipeline pipeline(_pipelineBufferCount, _pipelineBufferSize);
+  if (!pipeline.begin(
+          [this](const uint8_t *data, size_t len) {
+            return _writeChunk(data, len);
+          },
+          uxTaskPriorityGet(NULL))) {
+    Serial.println("[OTA] Pipeline setup failed, falling back to sequential "
+                   "download");
+    return _downloadSequential(http, errorMessage);
+  }
+
+  int error_code = 0;
+  size_t received = _resume.received();
+  size_t total = _resume.total();
+  Stream &stream = http.getStream();
+
+  unsigned long lastDataTime = millis();
+  while (http.connected() && (received < total) && !pipeline.failed()) {
+    if (millis() - lastDataTime > DOWNLOAD_TIMEOUT_MS) {
+      error_code = OTA_TRANSIENT_DOWNLOAD_TIMEOUT;
+      errorMessage = "Download timed out (no data received)";
+      break;
+    }
+
+    int slot = pipeline.acquire(DOWNLOAD_TIMEOUT_MS);
+    if (slot < 0) {
+      // A writer that failed is reported by finish() below; one that is
+      // only slow leaves the checkpoint for the retry to resume from
+      error_code = OTA_TRANSIENT_DOWNLOAD_TIMEOUT;
+      errorMessage = "Flash writer stalled";
+      break;
+    }
+
+    size_t want = min(pipeline.bufferSize(), total - received);
+    unsigned long readStart = millis();
+    size_t len = stream.readBytes(pipeline.buffer(slot), want);
+    _stats.networkMs += millis() - readStart;
+    pipeline.submit(slot, len);
+
+    if (len > 0) {
+      received += len;
+      lastDataTime = millis();
+    } else {
+      vTaskDelay(1);
+    }
+  }
+
+  bool writerOk = pipeline.finish();
+  _stats.flashMs = pipeline.consumeMs();
+  _stats.readStallMs = pipeline.readStallMs();
+  _stats.writeStallMs = pipeline.writeStallMs();
+
+  if (!writerOk) {
+    errorMessage = "Flash write error";
+    return OTA_FATAL_FLASH_WRITE_ERROR;
+  }
+  return error_code;
+}
+
+bool OTA::_writeChunk(const uint8_t *data, size_t len) {
+  bool ok = _compressedMode ? _inflater.feed(data, len)
+                            : _writeDecoded(data, len);
+  if (!ok) {
+    return false;
+  }
+  if (_sha256Enabled && _sha256OverDownload) {
+    mbedtls_sha256_update(&_sha256Ctx, data, len);
+  }
+  _resume.advance(len);
+  _progress.update(_resume.received());
+  return true;
+}
+
+bool OTA::_writeDecoded(const uint8_t *data, size_t len) {
+  return _deltaMode ? _delta.feed(data, len) : _writeImage(data, len);
+}
+
+bool OTA::_writeImage(const uint8_t *data, size_t len) {
+  if (!_flash.write(data, len)) {
+    return false;
+  }
+  _written += len;
+  return true;
+}
+
+bool OTA::_programSector(uint32_t offset, const uint8_t *data, size_t len) {
+  if (offset == 0 && data[0] != ESP_IMAGE_HEADER_MAGIC) {
+    Serial.println("[OTA] Not a firmware image (bad magic byte)");
+    return false;
+  }
+  if (esp_partition_write(_partition, offset, data, len) != ESP_OK) {
+    return false;
+  }
+  // Hashing what was programmed keeps the digest in step with committed(),
+  // which is what a checkpoint stores
+  if (_sha256Enabled && !_sha256OverDownload) {
+    mbedtls_sha256_update(&_sha256Ctx, data, len);
+  }
+  return true;
+}
+
+void OTA::_printStats() {
+  _stats.bytesPerSec =
+      _stats.elapsedMs > 0 ? (uint64_t)_stats.bytes * 1000 / _stats.elapsedMs
+                           : 0;
+  Serial.printf("[OTA] %s download: %u bytes from offset %u in %u ms (%u "
+                "B/s, %u progress reports)\n",
+                _pipelineEnabled ? "Pipelined" : "Sequential", _stats.bytes,
+                _stats.resumeOffset, _stats.elapsedMs, _stats.bytesPerSec,
+                _stats.progressReports);
+  Serial.printf("[OTA] Stage time: network %u ms, flash %u ms, read stall %u "
+                "ms, write stall %u ms\n",
+                _stats.networkMs, _stats.flashMs, _stats.readStallMs,
+                _stats.writeStallMs);
 }
 
 void OTA::_updateTaskTrampoline(void *pvParameters) {
@@ -322,19 +1625,226 @@ void OTA::_updateTaskTrampoline(void *pvParameters) {
   params->instance->_updateTask(pvParameters);
 }
 
-void OTA::updateFromURL(const String &url, const char *root_ca,
-                        const char *sha256) {
+bool OTA::updateFromURL(const String &url, const char *root_ca,
+                        const char *sha256, bool compressed,
+                        bool sha256OverCompressed, const String &requestId,
+                        const String &peerToken) {
   OTATaskParams *params = new OTATaskParams();
   params->instance = this;
   params->url = url;
+  params->requestId = requestId;
+  params->peerToken = peerToken;
+  params->compressed = compressed;
+  params->sha256OverCompressed = sha256OverCompressed;
   if (root_ca) {
     params->root_ca = root_ca;
   }
   if (sha256) {
     params->sha256 = sha256;
   }
-  xTaskCreate(_updateTaskTrampoline, "OTA_Update_Task", 12288, params, 10,
-              NULL);
+  return _startTask(params);
+}
+
+bool OTA::updateFromPatch(const String &patchUrl, const String &fallbackUrl,
+                          const char *root_ca, const char *sha256,
+                          bool compressed, const String &requestId,
+                          const String &peerToken) {
+  OTATaskParams *params = new OTATaskParams();
+  params->instance = this;
+  params->url = fallbackUrl;
+  params->requestId = requestId;
+  params->peerToken = peerToken;
+  params->patchUrl = patchUrl;
+  params->compressed = compressed;
+  if (root_ca) {
+    params->root_ca = root_ca;
+  }
+  if (sha256) {
+    params->sha256 = sha256;
+  }
+  return _startTask(params);
+}
+
+bool OTA::updateFromBroadcast(uint32_t session, uint32_t size,
+                              uint32_t chunkSize, const char *sha256,
+                              const String &fallbackUrl, const char *root_ca,
+                              const String &requestId) {
+  if (!_chunkQueue || !sha256 ||
+      chunkSize % OTASectorWriter::SECTOR_SIZE != 0) {
+    return false;
+  }
+  OTATaskParams *params = new OTATaskParams();
+  params->instance = this;
+  params->url = fallbackUrl;
+  params->requestId = requestId;
+  params->sha256 = sha256;
+  params->broadcast = true;
+  params->broadcastSession = session;
+  params->broadcastSize = size;
+  params->broadcastChunk = chunkSize;
+  if (root_ca) {
+    params->root_ca = root_ca;
+  }
+  return _startTask(params);
+}
+
+// Single flight: a second update, or a redelivered command, would start
+// another task writing the same partition
+bool OTA::_startTask(OTATaskParams *params) {
+  bool idle = false;
+  if (!_updateRunning.compare_exchange_strong(idle, true)) {
+    Serial.println("[OTA] An update is already running, ignoring");
+    delete params;
+    return false;
+  }
+  if (xTaskCreate(_updateTaskTrampoline, "OTA_Update_Task", 12288, params, 10,
+                  NULL) != pdPASS) {
+    Serial.println("[OTA] Failed to create update task");
+    delete params;
+    _updateRunning = false;
+    return false;
+  }
+  return true;
+}
+
+// SHA256 as received (separators allowed) to 64 lower case hex digits
+bool OTA::_normalizeSha256(const char *sha256, char *out) {
+  size_t length = 0;
+  for (const char *c = sha256 ? sha256 : ""; *c; c++) {
+    if (*c == ' ' || *c == ':') {
+      continue;
+    }
+    if (!isxdigit((unsigned char)*c) || length == 64) {
+      return false;
+    }
+    out[length++] = tolower((unsigned char)*c);
+  }
+  out[length] = '\0';
+  return length == 64;
+}
+
+static bool loadApplied(const char *key, OTAAppliedRecord &record) {
+  if (!loadRecord(APPLIED_NAMESPACE, key, &record, sizeof(record)) ||
+      record.magic != APPLIED_MAGIC) {
+    return false;
+  }
+  record.sha256[sizeof(record.sha256) - 1] = '\0';
+  record.requestId[sizeof(record.requestId) - 1] = '\0';
+  record.partition[sizeof(record.partition) - 1] = '\0';
+  return true;
+}
+
+static bool isRunning(const OTAAppliedRecord &record) {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  return running && strcmp(running->label, record.partition) == 0;
+}
+
+// sha256 is normalized, or empty when the command's one was not valid
+static bool matchesCommand(const OTAAppliedRecord &record, const char *sha256,
+                           const char *requestId) {
+  if (sha256[0] && record.sha256[0] && strcmp(sha256, record.sha256) == 0) {
+    return true;
+  }
+  return requestId && requestId[0] && strcmp(requestId, record.requestId) == 0;
+}
+
+// The record only counts while the partition it names is the one running:
+// after a rollback the same image may be installed again
+bool OTA::_isInstalled(const char *sha256, const char *requestId) {
+  char normalized[65];
+  if (!_normalizeSha256(sha256, normalized)) {
+    normalized[0] = '\0';
+  }
+  OTAAppliedRecord record;
+  return loadApplied(APPLIED_KEY, record) && isRunning(record) &&
+         matchesCommand(record, normalized, requestId);
+}
+
+// The command of an older release can stay retained on the board topic
+// after a newer one was installed; a device that reconnects must not go
+// back to it. After a rollback the replaced image runs again and this no
+// longer applies.
+bool OTA::_isReplaced(const char *sha256, const char *requestId) {
+  char normalized[65];
+  if (!_normalizeSha256(sha256, normalized)) {
+    normalized[0] = '\0';
+  }
+  OTAAppliedRecord current;
+  OTAAppliedRecord replaced;
+  return loadApplied(APPLIED_KEY, current) && isRunning(current) &&
+         loadApplied(REPLACED_KEY, replaced) &&
+         matchesCommand(replaced, normalized, requestId);
+}
+
+// The command for an image that was rolled back stays retained, and with a
+// persistent session is redelivered on every reconnect; without this record
+// the device would install the same bad image again each time
+bool OTA::_isRolledBack(const char *sha256, const char *requestId) {
+  char normalized[65];
+  if (!_normalizeSha256(sha256, normalized)) {
+    normalized[0] = '\0';
+  }
+  OTAAppliedRecord record;
+  return loadApplied(ROLLED_BACK_KEY, record) &&
+         matchesCommand(record, normalized, requestId);
+}
+
+// Keeps the record of the image in partition, if an update installed it
+// there, as the one that was rolled back
+void OTA::_recordRolledBack(const esp_partition_t *partition) {
+  OTAAppliedRecord record;
+  if (!partition || !loadApplied(APPLIED_KEY, record) ||
+      strcmp(partition->label, record.partition) != 0) {
+    return;
+  }
+  OTAAppliedRecord saved;
+  if (loadApplied(ROLLED_BACK_KEY, saved) &&
+      memcmp(&saved, &record, sizeof(record)) == 0) {
+    return; // checked on every boot, so keep NVS writes to the first
+  }
+  Serial.printf("[OTA] Firmware %s was rolled back, refusing it from now on\n",
+                record.sha256[0] ? record.sha256 : record.requestId);
+  if (!storeRecord(APPLIED_NAMESPACE, ROLLED_BACK_KEY, &record,
+                   sizeof(record))) {
+    Serial.println("[OTA] Failed to save the rolled back firmware record");
+  }
+}
+
+void OTA::_recordInstalled(const String &sha256, const String &requestId,
+                           const String &peerToken) {
+  // The record of the running image, if an update installed it, describes
+  // the image this one replaces
+  OTAAppliedRecord previous;
+  Preferences prefs;
+  if (loadApplied(APPLIED_KEY, previous) && isRunning(previous)) {
+    storeRecord(APPLIED_NAMESPACE, REPLACED_KEY, &previous, sizeof(previous));
+  } else if (prefs.begin(APPLIED_NAMESPACE, false)) {
+    if (prefs.isKey(REPLACED_KEY)) {
+      prefs.remove(REPLACED_KEY);
+    }
+    prefs.end();
+  }
+
+  OTAAppliedRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = APPLIED_MAGIC;
+  if (!_normalizeSha256(sha256.c_str(), record.sha256)) {
+    record.sha256[0] = '\0';
+  }
+  OTACheckpoint::copyField(record.requestId, sizeof(record.requestId),
+                           requestId.c_str());
+  if (_partition) {
+    OTACheckpoint::copyField(record.partition, sizeof(record.partition),
+                             _partition->label);
+  }
+  // Without a token the image is not served; an empty one replaces the
+  // token of the image before
+  char token[OTA_PEER_TOKEN_MAX + 1] = {};
+  OTACheckpoint::copyField(token, sizeof(token), peerToken.c_str());
+  if (!storeRecord(APPLIED_NAMESPACE, APPLIED_KEY, &record, sizeof(record)) ||
+      !storeRecord(APPLIED_NAMESPACE, PEER_TOKEN_KEY, token, sizeof(token))) {
+    Serial.println("[OTA] Failed to save the applied firmware record");
+  }
 }
 
 void OTA::printFirmwareInfo() {
@@ -436,40 +1946,188 @@ void OTA::_hexStringToBytes(const String &hexString, uint8_t *bytes,
   }
 }
 
-void OTA::otaCommand(const char *topic, const char *payload) {
+// Registered for MQTT_TOPIC_COMMAND "/" PLATFORMIO_BOARD_NAME, so the
+// topic needs no checking here
+OTACommandResult OTA::otaCommand(const char *topic, const char *payload,
+                                 size_t length) {
   if (_instance == nullptr) {
     Serial.println(
         "[OTA] Error: No OTA instance available for command handling");
-    return;
+    return OTA_COMMAND_INVALID;
   }
-  // Check if the topic matches the expected command topic
-  String expectedTopic = String(MQTT_TOPIC_COMMAND "/" PLATFORMIO_BOARD_NAME);
-  if (strcmp(topic, expectedTopic.c_str()) != 0) {
-    Serial.println("[OTA] Ignoring command - topic does not match");
-    return;
+  Serial.printf("[OTA] Received MQTT command: %.*s\n", (int)length, payload);
+  return _instance->_parseOtaCommand(payload, length);
+}
+
+const char *OTA::commandResultName(OTACommandResult result) {
+  switch (result) {
+  case OTA_COMMAND_STARTED:
+    return "accepted";
+  case OTA_COMMAND_INVALID:
+    return "rejected";
+  case OTA_COMMAND_BUSY:
+    return "busy";
+  case OTA_COMMAND_INSTALLED:
+    return "installed";
+  case OTA_COMMAND_SKIPPED:
+    return "skipped";
+  case OTA_COMMAND_REPLACED:
+    return "replaced";
+  case OTA_COMMAND_ROLLED_BACK:
+    return "rolled_back";
   }
-  Serial.printf("[OTA] Received MQTT command: %s\n", payload);
-  _instance->_parseOtaCommand(payload);
+  return "unknown";
 }
 
-void OTA::_parseOtaCommand(const char *payload) {
+OTACommandResult OTA::_parseOtaCommand(const char *payload, size_t length) {
+  // The server clears the retained command with an empty message; it has
+  // no request_id, so nothing is replied
+  if (length == 0) {
+    Serial.println("[OTA] Retained command cleared, nothing to do");
+    return OTA_COMMAND_INVALID;
+  }
   JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, payload);
+  DeserializationError error = deserializeJson(doc, payload, length);
 
   if (error) {
     Serial.printf("[OTA] JSON parsing failed: %s\n", error.c_str());
-    return;
+    return OTA_COMMAND_INVALID;
   }
 
+  const char *firmwareUrl = nullptr;
+  const char *sha256 = doc["OTA"]["SHA256"]; // Can be null
   if (doc["OTA"]["firmwareUrl"].is<const char *>()) {
-    const char *firmwareUrl = doc["OTA"]["firmwareUrl"];
-    const char *sha256 = doc["OTA"]["SHA256"]; // Can be null
-    Serial.printf("[OTA] Received firmware URL: %s\n", firmwareUrl);
-    if (sha256) {
-      Serial.printf("[OTA] Received SHA256: %s\n", sha256);
+    firmwareUrl = doc["OTA"]["firmwareUrl"];
+  }
+
+  // Optional zlib compression of the downloads, with SHA256 describing
+  // either the compressed file or the decompressed image
+  bool compressed = false;
+  bool sha256OverCompressed = false;
+  if (doc["OTA"]["compression"].is<const char *>()) {
+    const char *compression = doc["OTA"]["compression"];
+    if (strcmp(compression, "zlib") != 0) {
+      Serial.printf("[OTA] Unsupported compression: %s\n", compression);
+      return OTA_COMMAND_INVALID;
     }
-    updateFromURL(firmwareUrl, root_ca, sha256);
-  } else {
+    compressed = true;
+    if (doc["OTA"]["SHA256Scope"].is<const char *>()) {
+      sha256OverCompressed =
+          strcmp(doc["OTA"]["SHA256Scope"].as<const char *>(), "compressed") ==
+          0;
+    }
+  }
+
+  // A delta patch is only usable when it was built against the firmware we
+  // are running, and the rebuilt image can be checked against SHA256
+  bool deltaUsable = false;
+  if (doc["OTA"]["patchUrl"].is<const char *>() &&
+      doc["OTA"]["baseVersion"].is<const char *>()) {
+    const char *baseVersion = doc["OTA"]["baseVersion"];
+    deltaUsable = sha256 != nullptr && !sha256OverCompressed &&
+                  strcmp(baseVersion, GIT_VERSION) == 0;
+    Serial.printf("[OTA] Delta patch for base %s %s\n", baseVersion,
+                  deltaUsable ? "applies to this firmware"
+                              : "does not apply, ignoring");
+  }
+
+  // The image published in chunks to the whole board, with firmwareUrl
+  // (uncompressed) as the fallback
+  bool broadcastUsable = false;
+  uint32_t broadcastSession = 0;
+  uint32_t broadcastSize = 0;
+  uint32_t broadcastChunk = 0;
+  if (!doc["OTA"]["broadcast"].isNull()) {
+    JsonVariant broadcast = doc["OTA"]["broadcast"];
+    broadcastSession = broadcast["session"] | 0u;
+    broadcastSize = broadcast["size"] | 0u;
+    broadcastChunk = broadcast["chunk"] | (uint32_t)OTA_BROADCAST_CHUNK_SIZE;
+    broadcastUsable = _gapPublisher && sha256 != nullptr && !compressed &&
+                      broadcastSize > 0 && broadcastChunk > 0 &&
+                      broadcastChunk % OTASectorWriter::SECTOR_SIZE == 0;
+    Serial.printf("[OTA] Broadcast %u %s\n", (unsigned)broadcastSession,
+                  broadcastUsable ? "offered" : "not usable, ignoring");
+  }
+
+  if (!firmwareUrl && !deltaUsable && !broadcastUsable) {
     Serial.println("[OTA] Invalid or missing OTA parameters in MQTT message");
+    return OTA_COMMAND_INVALID;
+  }
+
+  // Secret of this update that devices present to get the image from each
+  // other; without it the image is downloaded from the origin only
+  const char *peerToken = doc["OTA"]["peerToken"] | "";
+  if (peerToken[0] && !OTAPeerHttp::validToken(peerToken)) {
+    Serial.println("[OTA] Invalid peer token");
+    return OTA_COMMAND_INVALID;
+  }
+
+  // A staged rollout reaches the devices whose bucket is below the
+  // percentage. The salt defaults to the image's SHA256, so every wave of
+  // one release keeps the same buckets.
+  if (!doc["OTA"]["rollout"].isNull()) {
+    JsonVariant rollout = doc["OTA"]["rollout"];
+    double percent = rollout["percent"] | -1.0;
+    const char *salt = rollout["salt"] | (sha256 ? sha256 : "");
+    int32_t threshold = OTARollout::threshold(percent);
+    if (threshold < 0) {
+      Serial.println("[OTA] Invalid rollout percentage");
+      return OTA_COMMAND_INVALID;
+    }
+    uint32_t bucket = OTARollout::bucket(_deviceId.c_str(), salt);
+    if (static_cast<int32_t>(bucket) >= threshold) {
+      Serial.printf("[OTA] Bucket %u is outside the %.2f%% rollout\n",
+                    bucket, percent);
+      return OTA_COMMAND_SKIPPED;
+    }
+    Serial.printf("[OTA] Bucket %u is in the %.2f%% rollout\n", bucket,
+                  percent);
+  }
+
+  // Retained and redelivered commands come again; neither may start a
+  // second download
+  const char *requestId = doc["request_id"] | "";
+  if (_updateRunning) {
+    Serial.println("[OTA] An update is already running, ignoring command");
+    return OTA_COMMAND_BUSY;
+  }
+  if (_isInstalled(sha256, requestId)) {
+    Serial.println("[OTA] That firmware is already installed, ignoring");
+    return OTA_COMMAND_INSTALLED;
+  }
+  if (_isReplaced(sha256, requestId)) {
+    Serial.println("[OTA] That firmware was replaced by the running one, "
+                   "ignoring");
+    return OTA_COMMAND_REPLACED;
+  }
+  if (_isRolledBack(sha256, requestId)) {
+    Serial.println("[OTA] That firmware failed validation and was rolled "
+                   "back, ignoring");
+    return OTA_COMMAND_ROLLED_BACK;
+  }
+
+  if (firmwareUrl) {
+    Serial.printf("[OTA] Received firmware URL: %s\n", firmwareUrl);
+  }
+  if (sha256) {
+    Serial.printf("[OTA] Received SHA256: %s\n", sha256);
+  }
+  if (broadcastUsable) {
+    if (!updateFromBroadcast(broadcastSession, broadcastSize, broadcastChunk,
+                             sha256, firmwareUrl ? firmwareUrl : "", root_ca,
+                             requestId)) {
+      return OTA_COMMAND_BUSY;
+    }
+  } else if (deltaUsable) {
+    const char *patchUrl = doc["OTA"]["patchUrl"];
+    Serial.printf("[OTA] Received patch URL: %s\n", patchUrl);
+    if (!updateFromPatch(patchUrl, firmwareUrl ? firmwareUrl : "", root_ca,
+                         sha256, compressed, requestId, peerToken)) {
+      return OTA_COMMAND_BUSY;
+    }
+  } else if (!updateFromURL(firmwareUrl, root_ca, sha256, compressed,
+                            sha256OverCompressed, requestId, peerToken)) {
+    return OTA_COMMAND_BUSY;
   }
+  return OTA_COMMAND_STARTED;
 }
\ No newline at end of file
@@ -2,11 +2,44 @@
 #define OTA_H
 
 #include "../../../include/secrets.h"
+#include "DeltaPatch.h"
+#include "OTAAdmission.h"
+#include "OTABroadcast.h"
+#include "OTACheckpoint.h"
+#include "OTAInflater.h"
+#include "OTAPeer.h"
+#include "OTAProgress.h"
+#include "OTAResume.h"
+#include "OTASectorWriter.h"
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include <atomic>
 #include <esp_ota_ops.h>
 #include <functional>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
 #include <mbedtls/sha256.h>
+
+// How often the progress callback samples the download, and the smallest
+// change of percentage it reports
+#ifndef OTA_PROGRESS_INTERVAL_MS
+#define OTA_PROGRESS_INTERVAL_MS 1000
+#endif
+#ifndef OTA_PROGRESS_STEP
+#define OTA_PROGRESS_STEP 1
+#endif
+// Broadcast chunks waiting between the MQTT task and the update task; a
+// chunk arriving while all are taken is dropped and becomes a gap
+#ifndef OTA_BROADCAST_QUEUE
+#define OTA_BROADCAST_QUEUE 8
+#endif
+// How long one mDNS lookup collects answers from peers
+#ifndef OTA_PEER_LOOKUP_MS
+#define OTA_PEER_LOOKUP_MS 1000
+#endif
+
 // Callback function types
 using OTAProgressCallback = std::function<void(unsigned int, unsigned int)>;
 using OTAErrorCallback = std::function<void(int, const char *)>;
@@ -15,15 +48,68 @@ using OTAValidationCallback = std::function<bool()>;
 // New callback for retry attempts
 using OTARetryCallback =
     std::function<void(int, int, const char *, unsigned long)>;
+// Sends a JSON message to the lease coordinator
+using OTALeasePublisher = std::function<void(const char *)>;
+// Sends a JSON gap request of a broadcast update
+using OTAGapPublisher = std::function<void(const char *)>;
 
 class OTA;
+class HTTPClient;
+class WiFiClient;
+class WiFiServer;
+
+// Throughput counters for the most recent download attempt
+struct OTAStats {
+  uint32_t bytes;        // bytes written to flash by this attempt
+  uint32_t resumeOffset; // image offset the attempt started from
+  uint32_t elapsedMs;    // wall time of the download loop
+  uint32_t bytesPerSec;  // bytes / elapsed
+  uint32_t networkMs;    // time spent in stream reads
+  uint32_t flashMs;      // time spent in Update.write + SHA256
+  uint32_t readStallMs;  // reader waiting for a free buffer (pipelined only)
+  uint32_t writeStallMs; // writer waiting for a filled buffer (pipelined only)
+  uint32_t progressReports; // progress callbacks made during the attempt
+  uint32_t admissionMs;     // command to download start (jitter, lease)
+};
 
 // Structure for passing parameters to FreeRTOS task
 struct OTATaskParams {
   OTA *instance;
   String url;
+  String patchUrl; // Delta patch, with url as the full-image fallback
   String root_ca;
   String sha256;
+  String requestId;          // of the command, recorded once installed
+  String peerToken;          // for peers' images; empty: no peers
+  bool compressed;           // zlib stream, decompressed on the fly
+  bool sha256OverCompressed; // SHA256 describes the compressed file
+  bool resume;               // continue from the saved checkpoint
+  bool broadcast;            // chunks over MQTT, with url as the fallback
+  uint32_t broadcastSession;
+  uint32_t broadcastSize;  // of the image
+  uint32_t broadcastChunk; // bytes per chunk
+};
+
+// Firmware installed by the last successful update, kept in NVS so a
+// command for the same image (retained, or redelivered by the broker) does
+// not download it again
+struct OTAAppliedRecord {
+  uint32_t magic;
+  char sha256[65];    // lower case hex, empty if the command had none
+  char requestId[40]; // of the command that installed it, may be empty
+  char partition[17]; // label of the partition it was written to
+};
+
+// What an OTA command led to
+enum OTACommandResult {
+  OTA_COMMAND_STARTED,
+  OTA_COMMAND_INVALID,     // unparsable or missing parameters
+  OTA_COMMAND_BUSY,        // an update is already running
+  OTA_COMMAND_INSTALLED,   // that firmware is the one running
+  OTA_COMMAND_SKIPPED,     // this device is not in the rollout yet
+  OTA_COMMAND_REPLACED,    // that firmware is the one the running one replaced
+  OTA_COMMAND_ROLLED_BACK, // that firmware failed validation and was rolled
+                           // back
 };
 
 class OTA {
@@ -36,16 +122,23 @@ public:
     OTA_FATAL_FLASH_WRITE_ERROR = -103,
     OTA_FATAL_SHA256_MISMATCH = -104,
     OTA_FATAL_UPDATE_END_FAILED = -105,
+    OTA_FATAL_PATCH_INVALID = -106,
+    OTA_FATAL_PATCH_BASE_MISMATCH = -107,
+    OTA_FATAL_DECOMPRESS_FAILED = -108,
 
     // --- Transient Errors (Will be retried) ---
     OTA_TRANSIENT_WIFI_DISCONNECTED = -201,
     OTA_TRANSIENT_HTTP_GET_FAILED = -202,
     OTA_TRANSIENT_NO_CONTENT_LENGTH = -203,
     OTA_TRANSIENT_DOWNLOAD_INCOMPLETE = -204,
-    OTA_TRANSIENT_DOWNLOAD_TIMEOUT = -205
+    OTA_TRANSIENT_DOWNLOAD_TIMEOUT = -205,
+    OTA_TRANSIENT_NO_LEASE = -206,
+    OTA_TRANSIENT_BROADCAST_STALLED = -207
   };
 
   OTA();
+  // Called with (received, total) bytes from a timer task, never from the
+  // download loop; see setProgressReporting
   void onProgress(OTAProgressCallback callback);
   void onError(OTAErrorCallback callback);
   void onSuccess(OTASuccessCallback callback);
@@ -56,13 +149,103 @@ public:
   // Configure the retry policy
   void setRetryPolicy(int maxRetries, int initialDelayMs);
 
-  // Public function to start OTA update
-  void updateFromURL(const String &url, const char *root_ca = nullptr,
-                     const char *sha256 = nullptr);
+  // Overlap network reads with flash writes using a ring of buffers drained
+  // by a separate writer task
+  void setPipeline(bool enabled, size_t bufferCount = 4,
+                   size_t bufferSize = 4096);
+  OTAStats getLastStats() const { return _stats; }
+
+  // The download loop only records how far it got. Every intervalMs a
+  // timer samples that and calls the progress callback when the percentage
+  // advanced by stepPercent, and once more at 100%. 0 turns the callback
+  // off; getProgress() works either way. Takes effect with the next update.
+  void setProgressReporting(uint32_t intervalMs,
+                            uint8_t stepPercent = OTA_PROGRESS_STEP);
+  OTAProgress getProgress() const { return _progress.get(); }
+
+  // Names the device in lease messages and places it in staged rollouts
+  // (see OTARollout)
+  void setDeviceId(const String &deviceId) { _deviceId = deviceId; }
+
+  // Every update, resumed ones included, first waits a random delay of up
+  // to jitterMs. With a publisher it then asks the lease coordinator for a
+  // download slot and downloads once granted (see OTAAdmission); replies
+  // are passed to onLeaseMessage(). jitterMs 0 without a publisher starts
+  // at once. Images taken from a peer (setPeerSharing) skip all this.
+  void setAdmission(uint32_t jitterMs, OTALeasePublisher publisher = nullptr);
+  // A coordinator reply for this device, from any task
+  void onLeaseMessage(const char *payload, size_t length);
+  OTAAdmissionStats getAdmissionStats() const {
+    return _admission.getStats();
+  }
+
+  // Lets commands with a "broadcast" object take the image from chunks
+  // published once for the whole board (see OTABroadcastReceiver). Chunk
+  // payloads are passed to onBroadcastChunk(); gap requests go to the
+  // publisher. Without it such commands use their firmwareUrl.
+  void setBroadcast(OTAGapPublisher publisher);
+  // A chunk payload, from the MQTT task. Copied and queued for the update
+  // task; ignored unless it belongs to the broadcast being received.
+  void onBroadcastChunk(const uint8_t *payload, size_t length);
+  OTABroadcastStats getBroadcastStats() const { return _broadcastStats; }
+
+  // Serves the running firmware on port to devices on the same network,
+  // once it passed validation, and announces it over mDNS (host name
+  // "iot-<device id>"). Updates with a SHA256 and a peer token then first
+  // look for a device serving that image and download it from there, so a
+  // site fetches it from the firmwareUrl about once (see OTAPeerSelector).
+  // The image holds the device's credentials: it is served only to requests
+  // with the token of the command that installed it, and announced as a
+  // hash of both, not by its SHA256. Call once, after setDeviceId().
+  void setPeerSharing(uint16_t port = OTA_PEER_PORT);
+  OTAPeerStats getPeerStats() const { return _peerStats; }
+
+  // Save download progress to NVS every `sectors` flash sectors so an
+  // update interrupted by a reset can continue with resumeInterruptedUpdate.
+  // 0 disables checkpoints.
+  void setCheckpointInterval(uint32_t sectors);
+
+  // Restarts an update that was still running when the device lost power.
+  // Full images continue from the last checkpoint, patches and compressed
+  // images start over. Returns false if there was nothing to resume.
+  bool resumeInterruptedUpdate();
+
+  // Public function to start OTA update. A compressed image is a zlib
+  // stream with a 4 KB window; sha256 then describes the decompressed image
+  // unless sha256OverCompressed is set.
+  // Both return false if an update is already running; only one runs at a
+  // time. With peerToken (see setPeerSharing) the image may come from a
+  // device nearby and is then served to those presenting the same token.
+  bool updateFromURL(const String &url, const char *root_ca = nullptr,
+                     const char *sha256 = nullptr, bool compressed = false,
+                     bool sha256OverCompressed = false,
+                     const String &requestId = "",
+                     const String &peerToken = "");
+
+  // Rebuild the new image from the running partition and a delta patch.
+  // sha256 is the hash of the rebuilt image; fallbackUrl (may be empty) is
+  // downloaded in full if the patch cannot be applied.
+  bool updateFromPatch(const String &patchUrl, const String &fallbackUrl,
+                       const char *root_ca = nullptr,
+                       const char *sha256 = nullptr, bool compressed = false,
+                       const String &requestId = "",
+                       const String &peerToken = "");
+  // Receive the image from broadcast session `session`: size bytes in
+  // chunks of chunkSize, a multiple of the flash sector size. sha256 is
+  // required; fallbackUrl (may be empty) is downloaded if the broadcast
+  // stalls.
+  bool updateFromBroadcast(uint32_t session, uint32_t size,
+                           uint32_t chunkSize, const char *sha256,
+                           const String &fallbackUrl = "",
+                           const char *root_ca = nullptr,
+                           const String &requestId = "");
+  bool isUpdateRunning() const { return _updateRunning; }
 
   void printFirmwareInfo();
 
   // Rollback management functions
+  // Returns right away; on the first boot after an update the validation
+  // callback is polled from its own task for up to VALIDATION_TIMEOUT
   void checkAndValidateApp();
   void markAppValid();
   void markAppInvalid();
@@ -71,13 +254,67 @@ public:
   bool isRollbackProtectionEnabled() const { return _rollbackEnabled; }
 
   // Static MQTT command handler
-  static void otaCommand(const char *topic, const char *payload);
+  static OTACommandResult otaCommand(const char *topic, const char *payload,
+                                     size_t length);
+  static const char *commandResultName(OTACommandResult result);
 
 private:
   void _updateTask(void *pvParameters);
   static void _updateTaskTrampoline(void *pvParameters);
+  // attempts 0 for the retry policy's; token, if any, is sent as a bearer
+  // token
+  bool _downloadImage(const String &url, bool delta, const String &rootCa,
+                      const String &sha256, int &errorCode,
+                      String &errorMessage, int attempts = 0,
+                      const String &token = "");
+  bool _receiveBroadcast(uint32_t session, uint32_t size, uint32_t chunkSize,
+                         const String &sha256, int &errorCode,
+                         String &errorMessage);
+  bool _writeBroadcastChunk(uint32_t index, const uint8_t *data, size_t len);
+  void _sendGaps();
+  void _drainChunks();
+  bool _verifyPartition(const esp_partition_t *partition, uint32_t size,
+                        const String &sha256);
+  bool _downloadFromPeers(const String &sha256, const String &token);
+  size_t _lookupPeers(const char *tag, OTAPeerInfo *peers);
+  void _announce(const char *key, const char *value);
+  static void _peerTask(void *pvParameters);
+  void _runPeerServer();
+  uint32_t _servedImage();
+  void _servePeer(WiFiServer &server, WiFiClient &client, uint32_t size);
+  bool _beginImage(size_t downloadSize, bool delta, bool verifySha256);
+  bool _beginFlash(uint32_t startOffset);
+  bool _finishImage(String &errorMessage);
+  void _abortImage();
+  void _startCheckpoint(const OTATaskParams &params);
+  bool _restoreCheckpoint();
+  void _saveCheckpoint(uint32_t committed);
+  bool _verifyDeltaBase(const DeltaPatchHeader &header);
+  int _downloadSequential(HTTPClient &http, String &errorMessage);
+  int _downloadPipelined(HTTPClient &http, String &errorMessage);
+  bool _writeChunk(const uint8_t *data, size_t len);
+  bool _writeDecoded(const uint8_t *data, size_t len);
+  bool _writeImage(const uint8_t *data, size_t len);
+  bool _programSector(uint32_t offset, const uint8_t *data, size_t len);
+  void _printStats();
+  bool _admit();
+  void _sendLease(const char *op, const char *result = nullptr);
+  void _endAdmission(bool success);
+  void _startProgress();
+  void _reportProgress();
+  void _stopProgress();
+  static void _progressTimerCallback(TimerHandle_t timer);
+  bool _startTask(OTATaskParams *params);
+  bool _isInstalled(const char *sha256, const char *requestId);
+  bool _isReplaced(const char *sha256, const char *requestId);
+  bool _isRolledBack(const char *sha256, const char *requestId);
+  void _recordRolledBack(const esp_partition_t *partition);
+  void _recordInstalled(const String &sha256, const String &requestId,
+                        const String &peerToken);
+  static bool _normalizeSha256(const char *sha256, char *out);
   bool _performCustomValidation();
-  void _parseOtaCommand(const char *payload);
+  static void _validationTask(void *pvParameters);
+  OTACommandResult _parseOtaCommand(const char *payload, size_t length);
   void _hexStringToBytes(const String &hexString, uint8_t *bytes,
                          size_t length);
 
@@ -92,6 +329,64 @@ private:
   int _maxRetries;
   int _initialRetryDelayMs;
 
+  // Pipelined download configuration
+  bool _pipelineEnabled;
+  size_t _pipelineBufferCount;
+  size_t _pipelineBufferSize;
+
+  // State of the image currently being written, kept across retries so a
+  // transient failure can resume with a Range request
+  OTAResume _resume; // position in the download stream
+  bool _deltaMode;
+  bool _compressedMode;
+  DeltaPatchDecoder _delta;
+  OTAInflater _inflater;
+  const esp_partition_t *_basePartition;
+  const esp_partition_t *_partition; // partition the new image goes to
+  OTASectorWriter _flash;
+  OTACheckpoint _checkpoint;
+  bool _checkpointActive; // this image saves resumable progress
+  mbedtls_sha256_context _sha256Ctx;
+  bool _sha256Enabled;
+  bool _sha256OverDownload; // hash the downloaded bytes, not the image
+  size_t _written; // bytes of the image passed to the flash writer
+  OTAStats _stats;
+
+  // Progress reporting, off the download loop
+  OTAProgressChannel _progress;
+  uint32_t _progressIntervalMs;
+  TimerHandle_t _progressTimer;
+  SemaphoreHandle_t _progressLock; // held by a timer sample while it runs
+  bool _progressStopped;           // under _progressLock
+
+  // Admission to the download
+  OTAAdmission _admission;
+  String _deviceId;
+  OTALeasePublisher _leasePublisher;
+  TaskHandle_t _updateTaskHandle; // woken by lease replies
+
+  // Broadcast reception
+  OTABroadcastReceiver _broadcast;
+  OTAGapPublisher _gapPublisher;
+  QueueHandle_t _chunkQueue;
+  std::atomic<bool> _broadcastActive;
+  std::atomic<uint32_t> _broadcastSession;
+  std::atomic<uint32_t> _chunksDropped; // queue full
+  OTABroadcastStats _broadcastStats;    // of the last broadcast
+
+  // Distribution between devices
+  OTAPeerSelector _peerSelector;
+  uint16_t _peerPort; // 0 while sharing is off
+  std::atomic<bool> _mdnsStarted;
+  const esp_partition_t *_peerPartition; // the running one, once served
+  char _peerImage[65];                   // its SHA256
+  char _peerToken[OTA_PEER_TOKEN_MAX + 1]; // required to get it
+  char _peerTag[33];                     // announced for it
+  OTAPeerStats _peerStats;               // of the last update
+
+  // Set while the update task runs
+  std::atomic<bool> _updateRunning;
+
   // Rollback configuration
   bool _rollbackEnabled;
   bool _validationPerformed;
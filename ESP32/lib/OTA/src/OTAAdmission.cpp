@@ -0,0 +1,133 @@
+#include "OTAAdmission.h"
+
+OTAAdmission::OTAAdmission()
+    : _jitterMs(0), _coordinated(false), _retryMs(OTA_LEASE_RETRY_MS),
+      _noCoordinatorMs(OTA_LEASE_NO_COORDINATOR_MS),
+      _maxWaitMs(OTA_LEASE_MAX_WAIT_MS), _state(IDLE), _ticket(0),
+      _beganAt(0), _requestAt(0), _requestedAt(0), _leaseMs(0), _renewAt(0),
+      _answered(false), _stats() {}
+
+void OTAAdmission::configure(uint32_t jitterMs, bool coordinated,
+                             uint32_t retryMs, uint32_t noCoordinatorMs,
+                             uint32_t maxWaitMs) {
+  std::lock_guard<std::mutex> lock(_lock);
+  _jitterMs = jitterMs;
+  _coordinated = coordinated;
+  _retryMs = retryMs > 0 ? retryMs : 1;
+  _noCoordinatorMs = noCoordinatorMs;
+  _maxWaitMs = maxWaitMs;
+}
+
+uint32_t OTAAdmission::begin(uint32_t now, uint32_t random) {
+  std::lock_guard<std::mutex> lock(_lock);
+  _state = JITTER;
+  // Never 0, so a reply can not match an unset ticket
+  _ticket = (random * 2654435761u) | 1;
+  _beganAt = now;
+  _stats = OTAAdmissionStats();
+  _stats.jitterMs =
+      _jitterMs ? static_cast<uint32_t>(random % (uint64_t(_jitterMs) + 1))
+                : 0;
+  _requestAt = now + _stats.jitterMs;
+  _answered = false;
+  return _ticket;
+}
+
+OTAAdmissionAction OTAAdmission::poll(uint32_t now, uint32_t random,
+                                      uint32_t &waitMs) {
+  std::lock_guard<std::mutex> lock(_lock);
+  waitMs = 0;
+  switch (_state) {
+  case IDLE:
+  case LEASED:
+  case UNCOORDINATED:
+    return OTA_ADMISSION_START;
+  case JITTER:
+    if (!_reached(now, _requestAt)) {
+      waitMs = _requestAt - now;
+      return OTA_ADMISSION_WAIT;
+    }
+    if (!_coordinated) {
+      _state = UNCOORDINATED;
+      _stats.waitedMs = now - _beganAt;
+      return OTA_ADMISSION_START;
+    }
+    _state = REQUESTING;
+    _requestedAt = now;
+    break;
+  case REQUESTING:
+    if (!_answered && now - _requestedAt >= _noCoordinatorMs) {
+      _state = UNCOORDINATED;
+      _stats.waitedMs = now - _beganAt;
+      return OTA_ADMISSION_START;
+    }
+    if (now - _beganAt >= _maxWaitMs) {
+      _state = IDLE;
+      return OTA_ADMISSION_GIVE_UP;
+    }
+    if (!_reached(now, _requestAt)) {
+      waitMs = _requestAt - now;
+      return OTA_ADMISSION_WAIT;
+    }
+    break;
+  }
+  // Up to half an interval later, so devices denied together do not all
+  // come back together
+  _requestAt = now + _retryMs + random % (_retryMs / 2 + 1);
+  _stats.requests++;
+  return OTA_ADMISSION_REQUEST;
+}
+
+bool OTAAdmission::reply(uint32_t now, const OTALeaseReply &reply) {
+  std::lock_guard<std::mutex> lock(_lock);
+  if (reply.ticket != _ticket || (_state != REQUESTING && _state != LEASED)) {
+    return false;
+  }
+  _answered = true;
+  bool pending = _state == REQUESTING;
+  if (!reply.granted) {
+    // A lease already held stays: the download is not stopped halfway
+    if (pending) {
+      _stats.denials++;
+      if (reply.retryMs > 0) {
+        _requestAt = now + reply.retryMs;
+      }
+    }
+    return pending;
+  }
+  _leaseMs = reply.leaseMs;
+  _renewAt = now + _leaseMs / 3;
+  if (pending) {
+    _state = LEASED;
+    _stats.leased = true;
+    _stats.waitedMs = now - _beganAt;
+  }
+  return pending;
+}
+
+bool OTAAdmission::renewDue(uint32_t now) {
+  std::lock_guard<std::mutex> lock(_lock);
+  if (_state != LEASED || !_reached(now, _renewAt)) {
+    return false;
+  }
+  _renewAt = now + _leaseMs / 3;
+  _stats.renewals++;
+  return true;
+}
+
+bool OTAAdmission::end() {
+  std::lock_guard<std::mutex> lock(_lock);
+  bool leased = _state == LEASED;
+  _state = IDLE;
+  return leased;
+}
+
+bool OTAAdmission::holdsLease() const {
+  std::lock_guard<std::mutex> lock(_lock);
+  return _state == LEASED;
+}
+
+OTAAdmissionStats OTAAdmission::getStats() const {
+  std::lock_guard<std::mutex> lock(_lock);
+  return _stats;
+}
@@ -0,0 +1,126 @@
+#ifndef OTA_ADMISSION_H
+#define OTA_ADMISSION_H
+
+#include <mutex>
+#include <stdint.h>
+
+// A command reaches every device of the board at once. Each waits a random
+// delay within this window before it asks for a download slot, or before
+// it downloads if there is no lease coordinator.
+#ifndef OTA_ADMISSION_JITTER_MS
+#define OTA_ADMISSION_JITTER_MS 30000
+#endif
+// Lease requests are repeated this often until the coordinator answers;
+// a denial may ask for another interval
+#ifndef OTA_LEASE_RETRY_MS
+#define OTA_LEASE_RETRY_MS 5000
+#endif
+// No answer at all for this long: there is no coordinator, download anyway
+#ifndef OTA_LEASE_NO_COORDINATOR_MS
+#define OTA_LEASE_NO_COORDINATOR_MS 30000
+#endif
+// Denied for this long: give the update up
+#ifndef OTA_LEASE_MAX_WAIT_MS
+#define OTA_LEASE_MAX_WAIT_MS (60 * 60 * 1000)
+#endif
+
+enum OTAAdmissionAction {
+  OTA_ADMISSION_WAIT,    // nothing to do for waitMs, or until a reply
+  OTA_ADMISSION_REQUEST, // send a lease request, then poll again
+  OTA_ADMISSION_START,   // download now
+  OTA_ADMISSION_GIVE_UP, // denied for too long
+};
+
+// The coordinator's answer to a request or renewal
+struct OTALeaseReply {
+  uint32_t ticket;
+  bool granted;
+  uint32_t leaseMs; // granted: renew well within this
+  uint32_t retryMs; // denied: ask again after this, 0 for the default
+};
+
+struct OTAAdmissionStats {
+  uint32_t jitterMs; // random delay drawn for this update
+  uint32_t waitedMs; // command to download start
+  uint32_t requests; // lease requests sent
+  uint32_t denials;  // of them refused
+  uint32_t renewals; // renewals sent while downloading
+  bool leased;       // started with a lease, not because nobody answered
+};
+
+// Admission of one update at a time to the download, so a command to the
+// whole fleet does not make every device hit the firmware host at once.
+//
+// begin() draws a delay within the jitter window. After it, without a
+// coordinator the download starts; with one the device sends a lease
+// request (a random ticket identifies this update) and waits. A grant
+// starts the download, a denial makes it ask again later; a coordinator
+// may also grant a waiting device on its own when a slot frees up. While
+// downloading the lease is renewed every third of its length, the renewals
+// carrying the progress; the coordinator takes a lease back when they
+// stop. If nobody ever answers the device downloads anyway, so a fleet
+// without a coordinator still updates.
+//
+// Times are milliseconds on any clock that wraps at 2^32. reply() and
+// renewDue() may be called from other tasks than poll(). Plain C++ so it
+// can be built on the host (tools/ota_admission_sim_host.cpp).
+class OTAAdmission {
+public:
+  OTAAdmission();
+
+  // coordinated: ask a lease coordinator, not only wait out the jitter
+  void configure(uint32_t jitterMs, bool coordinated,
+                 uint32_t retryMs = OTA_LEASE_RETRY_MS,
+                 uint32_t noCoordinatorMs = OTA_LEASE_NO_COORDINATOR_MS,
+                 uint32_t maxWaitMs = OTA_LEASE_MAX_WAIT_MS);
+  // Whether begin() has anything to wait for
+  bool enabled() const { return _jitterMs > 0 || _coordinated; }
+  bool coordinated() const { return _coordinated; }
+
+  // A new update at now; random is a uniformly distributed 32-bit value.
+  // Returns the ticket of its lease requests.
+  uint32_t begin(uint32_t now, uint32_t random);
+  OTAAdmissionAction poll(uint32_t now, uint32_t random, uint32_t &waitMs);
+  // True if it answers a pending request, and poll() has something new
+  bool reply(uint32_t now, const OTALeaseReply &reply);
+  // True, once per renewal period, while a lease is held
+  bool renewDue(uint32_t now);
+  // The update finished; true if a lease is to be released
+  bool end();
+
+  uint32_t ticket() const { return _ticket; }
+  bool holdsLease() const;
+  OTAAdmissionStats getStats() const;
+
+private:
+  enum State : uint8_t {
+    IDLE,
+    JITTER,
+    REQUESTING,
+    LEASED,
+    UNCOORDINATED, // downloading, nobody answered
+  };
+
+  static bool _reached(uint32_t now, uint32_t at) {
+    return static_cast<int32_t>(now - at) >= 0;
+  }
+
+  uint32_t _jitterMs;
+  bool _coordinated;
+  uint32_t _retryMs;
+  uint32_t _noCoordinatorMs;
+  uint32_t _maxWaitMs;
+
+  mutable std::mutex _lock;
+  State _state;
+  uint32_t _ticket;
+  uint32_t _beganAt;
+  uint32_t _requestAt;   // jitter end, then next request
+  uint32_t _requestedAt; // first request
+  uint32_t _leaseMs;
+  uint32_t _renewAt;
+  bool _answered;
+  OTAAdmissionStats _stats;
+};
+
+#endif // OTA_ADMISSION_H
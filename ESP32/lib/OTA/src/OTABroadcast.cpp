@@ -0,0 +1,146 @@
+#include "OTABroadcast.h"
+
+OTABroadcastReceiver::OTABroadcastReceiver()
+    : _idleMs(OTA_BROADCAST_IDLE_MS), _spreadMs(OTA_BROADCAST_SPREAD_MS),
+      _stallMs(OTA_BROADCAST_STALL_MS), _session(0), _imageSize(0),
+      _chunkSize(0), _chunkCount(0), _missing(0), _bytesReceived(0),
+      _lastChunkAt(0), _quietSince(0), _backoffMs(0), _requestAt(0),
+      _requestScheduled(false), _stats() {}
+
+void OTABroadcastReceiver::configure(uint32_t idleMs, uint32_t spreadMs,
+                                     uint32_t stallMs) {
+  _idleMs = idleMs > 0 ? idleMs : 1;
+  _spreadMs = spreadMs;
+  _stallMs = stallMs;
+}
+
+bool OTABroadcastReceiver::begin(uint32_t session, uint32_t imageSize,
+                                 uint32_t chunkSize, uint32_t now) {
+  end();
+  if (imageSize == 0 || chunkSize == 0) {
+    return false;
+  }
+  _session = session;
+  _imageSize = imageSize;
+  _chunkSize = chunkSize;
+  _chunkCount = (imageSize + chunkSize - 1) / chunkSize;
+  _missing = _chunkCount;
+  _bitmap.assign((_chunkCount + 7) / 8, 0);
+  _lastChunkAt = now;
+  _quietSince = now;
+  _backoffMs = _idleMs;
+  return true;
+}
+
+void OTABroadcastReceiver::end() {
+  _bitmap.clear();
+  _bitmap.shrink_to_fit();
+  _chunkCount = 0;
+  _missing = 0;
+  _bytesReceived = 0;
+  _requestScheduled = false;
+  _stats = OTABroadcastStats();
+}
+
+bool OTABroadcastReceiver::parseHeader(const uint8_t *payload, size_t length,
+                                       uint32_t &session, uint32_t &index) {
+  if (length < HEADER_SIZE) {
+    return false;
+  }
+  session = payload[0] | payload[1] << 8 | payload[2] << 16 |
+            static_cast<uint32_t>(payload[3]) << 24;
+  index = payload[4] | payload[5] << 8 | payload[6] << 16 |
+          static_cast<uint32_t>(payload[7]) << 24;
+  return true;
+}
+
+size_t OTABroadcastReceiver::chunkLength(uint32_t index) const {
+  if (index >= _chunkCount) {
+    return 0;
+  }
+  uint32_t offset = index * _chunkSize;
+  return _imageSize - offset < _chunkSize ? _imageSize - offset : _chunkSize;
+}
+
+bool OTABroadcastReceiver::wanted(uint32_t index, size_t length) {
+  if (index >= _chunkCount || length != chunkLength(index)) {
+    _stats.invalid++;
+    return false;
+  }
+  if (_has(index)) {
+    _stats.duplicates++;
+    return false;
+  }
+  return true;
+}
+
+void OTABroadcastReceiver::received(uint32_t index, uint32_t now) {
+  if (index >= _chunkCount || _has(index)) {
+    return;
+  }
+  _bitmap[index >> 3] |= 1u << (index & 7);
+  _missing--;
+  _bytesReceived += chunkLength(index);
+  _stats.chunks++;
+  _lastChunkAt = now;
+  _quietSince = now;
+  _backoffMs = _idleMs;
+  _requestScheduled = false;
+}
+
+OTABroadcastAction OTABroadcastReceiver::poll(uint32_t now, uint32_t random,
+                                              uint32_t &waitMs) {
+  waitMs = _idleMs;
+  if (_chunkCount == 0 || _missing == 0) {
+    return OTA_BROADCAST_WAIT;
+  }
+  uint32_t stallAt = _lastChunkAt + _stallMs;
+  if (_reached(now, stallAt)) {
+    return OTA_BROADCAST_STALLED;
+  }
+  if (!_requestScheduled) {
+    _requestAt = _quietSince + _backoffMs +
+                 static_cast<uint32_t>(random % (uint64_t(_spreadMs) + 1));
+    _requestScheduled = true;
+  }
+  if (_reached(now, _requestAt)) {
+    _stats.requests++;
+    _quietSince = now;
+    // Repairs may be on their way; ask less often while nothing comes
+    if (_backoffMs < 8 * _idleMs) {
+      _backoffMs *= 2;
+    }
+    _requestScheduled = false;
+    return OTA_BROADCAST_REQUEST;
+  }
+  waitMs = _requestAt - now;
+  if (stallAt - now < waitMs) {
+    waitMs = stallAt - now;
+  }
+  return OTA_BROADCAST_WAIT;
+}
+
+size_t OTABroadcastReceiver::missingRanges(uint32_t (*ranges)[2],
+                                           size_t maxRanges) const {
+  size_t count = 0;
+  uint32_t index = 0;
+  while (count < maxRanges && index < _chunkCount) {
+    // Whole bytes of the bitmap at a time while everything is in
+    if ((index & 7) == 0 && _bitmap[index >> 3] == 0xff) {
+      index += 8;
+      continue;
+    }
+    if (_has(index)) {
+      index++;
+      continue;
+    }
+    uint32_t first = index;
+    while (index < _chunkCount && !_has(index)) {
+      index++;
+    }
+    ranges[count][0] = first;
+    ranges[count][1] = index - 1;
+    count++;
+  }
+  return count;
+}
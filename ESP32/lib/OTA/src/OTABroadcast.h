@@ -0,0 +1,125 @@
+#ifndef OTA_BROADCAST_H
+#define OTA_BROADCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Chunk payload size the sender uses unless the command says otherwise. A
+// chunk is a whole number of flash sectors, and it must fit the MQTT
+// receive limit (MQTT_RX_MAX_PAYLOAD) with its header.
+#ifndef OTA_BROADCAST_CHUNK_SIZE
+#define OTA_BROADCAST_CHUNK_SIZE 4096
+#endif
+// No new chunk for this long: the pass is over, ask for the gaps
+#ifndef OTA_BROADCAST_IDLE_MS
+#define OTA_BROADCAST_IDLE_MS 3000
+#endif
+// Gap requests are spread over this window, so repairs another device
+// asked for can fill the gaps first
+#ifndef OTA_BROADCAST_SPREAD_MS
+#define OTA_BROADCAST_SPREAD_MS 2000
+#endif
+// No new chunk for this long: the sender is gone
+#ifndef OTA_BROADCAST_STALL_MS
+#define OTA_BROADCAST_STALL_MS 60000
+#endif
+// Runs of missing chunks named in one gap request
+#ifndef OTA_BROADCAST_MAX_RANGES
+#define OTA_BROADCAST_MAX_RANGES 16
+#endif
+
+enum OTABroadcastAction {
+  OTA_BROADCAST_WAIT,    // nothing to do for waitMs, or until a chunk
+  OTA_BROADCAST_REQUEST, // send a gap request (missingRanges())
+  OTA_BROADCAST_STALLED, // nothing arrived for too long
+};
+
+struct OTABroadcastStats {
+  uint32_t chunks;     // new chunks taken
+  uint32_t duplicates; // chunks already there, e.g. repairs for others
+  uint32_t invalid;    // out of range or of the wrong length
+  uint32_t requests;   // gap requests sent
+};
+
+// Reception of one firmware image published once for the whole board as
+// numbered chunks on a shared MQTT topic.
+//
+// Each chunk payload starts with an 8-byte header, the session and the
+// chunk index as little endian 32-bit values, followed by bytes
+// [index * chunkSize, ...) of the image. Chunks may come in any order and
+// more than once; a bitmap records which ones are in. Once no new chunk
+// came for the idle time the device asks for the missing runs, after a
+// random part of the spread window and with the interval doubling while
+// the requests bring nothing. A chunk taken in the meantime, e.g. a repair
+// another device asked for, postpones the request.
+//
+// Times are milliseconds on any clock that wraps at 2^32. Not thread
+// safe; used only by the update task. Plain C++ so it can be built on the
+// host (tools/ota_broadcast_fleet_host.cpp).
+class OTABroadcastReceiver {
+public:
+  static const size_t HEADER_SIZE = 8;
+
+  OTABroadcastReceiver();
+
+  void configure(uint32_t idleMs = OTA_BROADCAST_IDLE_MS,
+                 uint32_t spreadMs = OTA_BROADCAST_SPREAD_MS,
+                 uint32_t stallMs = OTA_BROADCAST_STALL_MS);
+
+  // False for an empty image or chunk size
+  bool begin(uint32_t session, uint32_t imageSize, uint32_t chunkSize,
+             uint32_t now);
+  void end();
+
+  // Splits a payload into header and data; false if it is too short
+  static bool parseHeader(const uint8_t *payload, size_t length,
+                          uint32_t &session, uint32_t &index);
+
+  // True if the chunk is new and of the right length; the caller writes it
+  // and then calls received()
+  bool wanted(uint32_t index, size_t length);
+  void received(uint32_t index, uint32_t now);
+
+  OTABroadcastAction poll(uint32_t now, uint32_t random, uint32_t &waitMs);
+  // The first runs of missing chunks, as first and last index
+  size_t missingRanges(uint32_t (*ranges)[2], size_t maxRanges) const;
+
+  uint32_t session() const { return _session; }
+  uint32_t chunkCount() const { return _chunkCount; }
+  uint32_t missing() const { return _missing; }
+  bool complete() const { return _chunkCount > 0 && _missing == 0; }
+  // Offset and length of a chunk in the image
+  uint32_t chunkOffset(uint32_t index) const { return index * _chunkSize; }
+  size_t chunkLength(uint32_t index) const;
+  uint32_t bytesReceived() const { return _bytesReceived; }
+  OTABroadcastStats getStats() const { return _stats; }
+
+private:
+  bool _has(uint32_t index) const {
+    return _bitmap[index >> 3] & (1u << (index & 7));
+  }
+  static bool _reached(uint32_t now, uint32_t at) {
+    return static_cast<int32_t>(now - at) >= 0;
+  }
+
+  uint32_t _idleMs;
+  uint32_t _spreadMs;
+  uint32_t _stallMs;
+
+  uint32_t _session;
+  uint32_t _imageSize;
+  uint32_t _chunkSize;
+  uint32_t _chunkCount;
+  uint32_t _missing;
+  uint32_t _bytesReceived;
+  std::vector<uint8_t> _bitmap;
+  uint32_t _lastChunkAt;
+  uint32_t _quietSince; // last chunk or gap request
+  uint32_t _backoffMs;
+  uint32_t _requestAt;
+  bool _requestScheduled;
+  OTABroadcastStats _stats;
+};
+
+#endif // OTA_BROADCAST_H
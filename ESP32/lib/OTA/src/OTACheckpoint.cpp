@@ -0,0 +1,88 @@
+#include "OTACheckpoint.h"
+#include "OTASectorWriter.h"
+#include <string.h>
+
+const char *const OTACheckpoint::COMMAND_KEY = "cmd";
+const char *const OTACheckpoint::PROGRESS_KEY = "progress";
+
+OTACheckpoint::OTACheckpoint()
+    : _load(nullptr), _store(nullptr), _remove(nullptr), _intervalSectors(0) {}
+
+void OTACheckpoint::begin(Load load, Store store, Remove remove) {
+  _load = load;
+  _store = store;
+  _remove = remove;
+}
+
+bool OTACheckpoint::due(uint32_t committed, uint32_t totalSize) const {
+  if (!enabled() || committed == 0 || committed >= totalSize) {
+    return false;
+  }
+  uint32_t interval = _intervalSectors * OTASectorWriter::SECTOR_SIZE;
+  return committed % interval == 0;
+}
+
+bool OTACheckpoint::start(const OTAResumeCommand &command) {
+  if (!enabled()) {
+    return false;
+  }
+  OTAResumeCommand record = command;
+  record.magic = COMMAND_MAGIC;
+  _remove(PROGRESS_KEY);
+  return _store(COMMAND_KEY, &record, sizeof(record));
+}
+
+bool OTACheckpoint::save(const OTAResumeProgress &progress) {
+  if (!enabled()) {
+    return false;
+  }
+  OTAResumeProgress record = progress;
+  record.magic = PROGRESS_MAGIC;
+  return _store(PROGRESS_KEY, &record, sizeof(record));
+}
+
+void OTACheckpoint::discardProgress() {
+  if (_remove) {
+    _remove(PROGRESS_KEY);
+  }
+}
+
+void OTACheckpoint::clear() {
+  if (_remove) {
+    _remove(PROGRESS_KEY);
+    _remove(COMMAND_KEY);
+  }
+}
+
+bool OTACheckpoint::load(OTAResumeCommand &command,
+                         OTAResumeProgress &progress) const {
+  memset(&progress, 0, sizeof(progress));
+  if (!_load || !_load(COMMAND_KEY, &command, sizeof(command)) ||
+      command.magic != COMMAND_MAGIC) {
+    return false;
+  }
+  // Strings come from flash, never trust their terminators
+  command.firmware[sizeof(command.firmware) - 1] = '\0';
+  command.url[sizeof(command.url) - 1] = '\0';
+  command.patchUrl[sizeof(command.patchUrl) - 1] = '\0';
+  command.sha256[sizeof(command.sha256) - 1] = '\0';
+
+  if (!_load(PROGRESS_KEY, &progress, sizeof(progress)) ||
+      progress.magic != PROGRESS_MAGIC ||
+      progress.committed % OTASectorWriter::SECTOR_SIZE != 0 ||
+      progress.committed >= progress.totalSize ||
+      progress.hashStateSize > sizeof(progress.hashState)) {
+    memset(&progress, 0, sizeof(progress));
+  }
+  return true;
+}
+
+bool OTACheckpoint::copyField(char *dst, size_t size, const char *src) {
+  size_t len = src ? strlen(src) : 0;
+  if (len >= size) {
+    dst[0] = '\0';
+    return false;
+  }
+  memcpy(dst, src ? src : "", len + 1);
+  return true;
+}
@@ -0,0 +1,79 @@
+#ifndef OTA_CHECKPOINT_H
+#define OTA_CHECKPOINT_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// OTA state that survives a reset, kept in two records so the large one is
+// written once per update and only the small one is rewritten as the
+// download advances. Both are stored as single NVS blobs, which NVS writes
+// atomically, so a power cut leaves either the old or the new record.
+
+// The update command, saved when the update starts
+struct OTAResumeCommand {
+  uint32_t magic;
+  char firmware[32]; // GIT_VERSION of the firmware that started the update
+  char url[256];
+  char patchUrl[256];
+  char sha256[100]; // as received, separators allowed
+  uint8_t compressed;
+  uint8_t sha256OverCompressed;
+};
+
+// How far the image got, saved at sector boundaries
+struct OTAResumeProgress {
+  uint32_t magic;
+  uint32_t partitionAddress; // update partition the image is written to
+  uint32_t totalSize;        // size of the download stream
+  uint32_t committed;        // bytes programmed into the partition
+  uint32_t hashStateSize;    // 0 when the image is not hashed
+  uint32_t hashLayout;       // what built the context, see OTA.cpp
+  uint8_t hashState[256];    // SHA256 context over [0, committed)
+};
+
+// Checkpoint policy and (de)serialization. Storage goes through callbacks
+// so the same code runs against NVS on the device and files on the host
+// (see tools/ota_power_loss_host.cpp).
+class OTACheckpoint {
+public:
+  using Load = std::function<bool(const char *, void *, size_t)>;
+  using Store = std::function<bool(const char *, const void *, size_t)>;
+  using Remove = std::function<void(const char *)>;
+
+  static const char *const COMMAND_KEY;
+  static const char *const PROGRESS_KEY;
+
+  OTACheckpoint();
+
+  void begin(Load load, Store store, Remove remove);
+
+  // Save progress every `sectors` committed sectors; 0 disables checkpoints
+  void setInterval(uint32_t sectors) { _intervalSectors = sectors; }
+  bool enabled() const { return _intervalSectors > 0 && _store; }
+  bool due(uint32_t committed, uint32_t totalSize) const;
+
+  // Records a new update and drops any progress from an earlier one
+  bool start(const OTAResumeCommand &command);
+  bool save(const OTAResumeProgress &progress);
+  void discardProgress();
+  void clear();
+
+  // Returns false if no update was in progress. progress.committed is 0
+  // when the update has to start over from the first byte.
+  bool load(OTAResumeCommand &command, OTAResumeProgress &progress) const;
+
+  // Copies src into a fixed-size record field, false if it does not fit
+  static bool copyField(char *dst, size_t size, const char *src);
+
+private:
+  static const uint32_t COMMAND_MAGIC = 0x4f544143;  // "OTAC"
+  static const uint32_t PROGRESS_MAGIC = 0x4f544150; // "OTAP"
+
+  Load _load;
+  Store _store;
+  Remove _remove;
+  uint32_t _intervalSectors;
+};
+
+#endif // OTA_CHECKPOINT_H
@@ -0,0 +1,89 @@
+#include "OTAInflater.h"
+#include <stdlib.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#if CONFIG_IDF_TARGET_ESP32C3
+#include "esp32c3/rom/miniz.h"
+#elif CONFIG_IDF_TARGET_ESP32S3
+#include "esp32s3/rom/miniz.h"
+#else
+#include "esp32/rom/miniz.h"
+#endif
+#else
+#include "miniz.h" // host build, see tools/inflate_host.cpp
+#endif
+
+OTAInflater::OTAInflater()
+    : _decompressor(nullptr), _window(nullptr), _windowPos(0),
+      _writeOutput(nullptr), _finished(false), _outputFailed(false),
+      _outputSize(0) {}
+
+OTAInflater::~OTAInflater() { end(); }
+
+bool OTAInflater::begin(OutputWriter writeOutput) {
+  if (!_decompressor) {
+    _decompressor = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+  }
+  if (!_window) {
+    _window = (uint8_t *)malloc(WINDOW_SIZE);
+  }
+  if (!_decompressor || !_window) {
+    end();
+    return false;
+  }
+  tinfl_init(_decompressor);
+  _windowPos = 0;
+  _writeOutput = writeOutput;
+  _finished = false;
+  _outputFailed = false;
+  _outputSize = 0;
+  return true;
+}
+
+void OTAInflater::end() {
+  free(_decompressor);
+  free(_window);
+  _decompressor = nullptr;
+  _window = nullptr;
+}
+
+size_t OTAInflater::memoryUsage() const {
+  return sizeof(tinfl_decompressor) + WINDOW_SIZE;
+}
+
+bool OTAInflater::feed(const uint8_t *data, size_t len) {
+  if (!_decompressor || _finished) {
+    return len == 0;
+  }
+
+  size_t pos = 0;
+  for (;;) {
+    size_t inBytes = len - pos;
+    size_t outBytes = WINDOW_SIZE - _windowPos;
+    tinfl_status status = tinfl_decompress(
+        _decompressor, data + pos, &inBytes, _window, _window + _windowPos,
+        &outBytes, TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+    pos += inBytes;
+
+    if (outBytes > 0) {
+      if (!_writeOutput(_window + _windowPos, outBytes)) {
+        _outputFailed = true;
+        return false;
+      }
+      _outputSize += outBytes;
+      _windowPos = (_windowPos + outBytes) & (WINDOW_SIZE - 1);
+    }
+
+    if (status == TINFL_STATUS_DONE) {
+      _finished = true;
+      return pos == len;
+    }
+    if (status < 0) {
+      return false;
+    }
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT && pos == len) {
+      return true;
+    }
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef OTA_INFLATER_H
+#define OTA_INFLATER_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+struct tinfl_decompressor_tag;
+
+// Streaming zlib decompressor between the download and the flash writer,
+// backed by the miniz inflater in ROM. Images must be compressed with a
+// 4 KB window (tools/compress_firmware.py) so the whole history fits in
+// WINDOW_SIZE bytes of RAM. Plain C++, so tools/inflate_host.cpp builds it
+// on the host against the single-file miniz.
+class OTAInflater {
+public:
+  using OutputWriter = std::function<bool(const uint8_t *, size_t)>;
+
+  static const size_t WINDOW_SIZE = 4096;
+
+  OTAInflater();
+  ~OTAInflater();
+
+  // Allocates the decompressor state and resets it for a new stream
+  bool begin(OutputWriter writeOutput);
+  void end();
+
+  // Returns false on corrupt input or when the output writer fails
+  bool feed(const uint8_t *data, size_t len);
+
+  bool finished() const { return _finished; }
+  bool outputFailed() const { return _outputFailed; }
+  size_t outputSize() const { return _outputSize; }
+  size_t memoryUsage() const;
+
+private:
+  tinfl_decompressor_tag *_decompressor;
+  uint8_t *_window;
+  size_t _windowPos;
+  OutputWriter _writeOutput;
+  bool _finished;
+  bool _outputFailed;
+  size_t _outputSize;
+};
+
+#endif // OTA_INFLATER_H
@@ -0,0 +1,308 @@
+#include "OTAPeer.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+OTAPeerSelector::OTAPeerSelector()
+    : _spreadMs(OTA_PEER_SPREAD_MS), _retryMs(OTA_PEER_RETRY_MS),
+      _rebootMs(OTA_PEER_REBOOT_MS), _maxWaitMs(OTA_PEER_MAX_WAIT_MS),
+      _address(0), _port(0), _beganAt(0), _startAt(0), _started(false),
+      _claimed(false), _fetcherSeen(false), _fetcherSeenAt(0), _failed(),
+      _failedCount(0), _stats() {}
+
+void OTAPeerSelector::configure(uint32_t spreadMs, uint32_t retryMs,
+                                uint32_t rebootMs, uint32_t maxWaitMs) {
+  _spreadMs = spreadMs;
+  _retryMs = retryMs > 0 ? retryMs : 1;
+  _rebootMs = rebootMs;
+  _maxWaitMs = maxWaitMs;
+}
+
+void OTAPeerSelector::begin(uint32_t address, uint16_t port, uint32_t now,
+                            uint32_t random) {
+  _address = address;
+  _port = port;
+  _beganAt = now;
+  _startAt =
+      now + static_cast<uint32_t>(random % (uint64_t(_spreadMs) + 1));
+  _started = false;
+  _claimed = false;
+  _fetcherSeen = false;
+  _failedCount = 0;
+  _stats = OTAPeerStats();
+}
+
+OTAPeerSelector::Failed *OTAPeerSelector::_find(const OTAPeerInfo &peer) {
+  size_t count =
+      _failedCount < OTA_PEER_MAX_PEERS ? _failedCount : OTA_PEER_MAX_PEERS;
+  for (size_t i = 0; i < count; i++) {
+    if (_failed[i].address == peer.address && _failed[i].port == peer.port) {
+      return &_failed[i];
+    }
+  }
+  return nullptr;
+}
+
+uint32_t OTAPeerSelector::_wait(uint32_t now) const {
+  uint32_t left = _beganAt + _maxWaitMs - now;
+  return left < _retryMs ? left : _retryMs;
+}
+
+OTAPeerAction OTAPeerSelector::next(const OTAPeerInfo *peers, size_t count,
+                                    uint32_t now, uint32_t random,
+                                    OTAPeerInfo &peer, uint32_t &waitMs) {
+  waitMs = 0;
+  if (!_started) {
+    _started = true;
+    if (!_reached(now, _startAt)) {
+      waitMs = _startAt - now;
+    }
+    return OTA_PEER_WAIT;
+  }
+  _stats.lookups++;
+
+  size_t candidates[OTA_PEER_MAX_PEERS];
+  size_t candidateCount = 0;
+  bool busy = false;
+  bool fetcher = false;
+  bool fetcherBelow = false;
+  for (size_t i = 0; i < count; i++) {
+    const OTAPeerInfo &info = peers[i];
+    if (_isSelf(info)) {
+      continue;
+    }
+    if (info.fetching) {
+      fetcher = true;
+      fetcherBelow = fetcherBelow || _ranksBelow(info);
+    }
+    if (!info.serving) {
+      continue;
+    }
+    // A busy peer will serve again, a bad one is as good as absent
+    const Failed *entry = _find(info);
+    if (entry && !entry->busy) {
+      continue;
+    }
+    if (entry && !_reached(now, entry->until)) {
+      busy = true;
+    } else if (candidateCount < OTA_PEER_MAX_PEERS) {
+      candidates[candidateCount++] = i;
+    }
+  }
+
+  if (candidateCount > 0) {
+    peer = peers[candidates[random % candidateCount]];
+    _claimed = false;
+    _stats.attempts++;
+    return OTA_PEER_DOWNLOAD;
+  }
+  if (fetcher) {
+    _fetcherSeen = true;
+    _fetcherSeenAt = now;
+  }
+  if (_reached(now, _beganAt + _maxWaitMs)) {
+    _claimed = true;
+  } else if (_claimed) {
+    // Both claimed: the lower ranking device downloads
+    if (fetcherBelow) {
+      _claimed = false;
+      waitMs = _wait(now);
+      return OTA_PEER_WAIT;
+    }
+  } else if (fetcher || busy ||
+             (_fetcherSeen && !_reached(now, _fetcherSeenAt + _rebootMs))) {
+    waitMs = _wait(now);
+    return OTA_PEER_WAIT;
+  } else {
+    _claimed = true;
+    return OTA_PEER_CLAIM;
+  }
+  _stats.claimed = true;
+  _stats.waitedMs = now - _beganAt;
+  return OTA_PEER_ORIGIN;
+}
+
+void OTAPeerSelector::failed(const OTAPeerInfo &peer, bool busy,
+                             uint32_t now) {
+  if (busy) {
+    _stats.busy++;
+  } else {
+    _stats.failures++;
+  }
+  Failed *entry = _find(peer);
+  if (!entry) {
+    // Once full, the oldest entries make room
+    entry = &_failed[_failedCount++ % OTA_PEER_MAX_PEERS];
+    entry->address = peer.address;
+    entry->port = peer.port;
+  }
+  entry->busy = busy;
+  entry->until = now + _retryMs;
+}
+
+void OTAPeerSelector::succeeded(uint32_t now) {
+  _stats.waitedMs = now - _beganAt;
+}
+
+bool OTAPeerHttp::parseRequest(const char *head, OTAPeerRequest &request) {
+  static const char prefix[] = "GET /ota/";
+  memset(&request, 0, sizeof(request));
+  if (strncmp(head, prefix, sizeof(prefix) - 1) != 0) {
+    return false;
+  }
+  const char *hash = head + sizeof(prefix) - 1;
+  for (size_t i = 0; i < 64; i++) {
+    char c = hash[i];
+    if (c >= 'A' && c <= 'F') {
+      c = c - 'A' + 'a';
+    }
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+      return false;
+    }
+    request.sha256[i] = c;
+  }
+  if (hash[64] != ' ') {
+    return false;
+  }
+
+  // Only "bytes=<first>-" is honoured; any other range gets the whole image
+  for (const char *line = strstr(hash, "\r\n"); line;
+       line = strstr(line, "\r\n")) {
+    line += 2;
+    if (strncasecmp(line, "Authorization:", 14) == 0) {
+      const char *p = line + 14;
+      while (*p == ' ') {
+        p++;
+      }
+      if (strncasecmp(p, "Bearer ", 7) != 0) {
+        continue;
+      }
+      size_t length = strcspn(p + 7, " \r\n");
+      if (length <= OTA_PEER_TOKEN_MAX) {
+        memcpy(request.token, p + 7, length);
+        request.token[length] = '\0';
+      }
+      continue;
+    }
+    if (strncasecmp(line, "Range:", 6) != 0) {
+      continue;
+    }
+    const char *p = line + 6;
+    while (*p == ' ') {
+      p++;
+    }
+    if (strncmp(p, "bytes=", 6) != 0 || p[6] < '0' || p[6] > '9') {
+      continue;
+    }
+    uint64_t first = 0;
+    for (p += 6; *p >= '0' && *p <= '9' && first <= UINT32_MAX; p++) {
+      first = first * 10 + (*p - '0');
+    }
+    if (*p == '-' && (p[1] == '\r' || p[1] == '\0') && first <= UINT32_MAX) {
+      request.first = static_cast<uint32_t>(first);
+      request.ranged = true;
+    }
+  }
+  return true;
+}
+
+// Compares all of the token, so the time taken does not tell how much of
+// it was right
+static bool sameToken(const char *presented, const char *token) {
+  size_t length = strlen(token);
+  if (strlen(presented) != length) {
+    return false;
+  }
+  unsigned char difference = 0;
+  for (size_t i = 0; i < length; i++) {
+    difference |= presented[i] ^ token[i];
+  }
+  return difference == 0;
+}
+
+int OTAPeerHttp::status(const OTAPeerRequest &request, const char *sha256,
+                        const char *token, uint32_t size) {
+  if (!token || !validToken(token) || !sameToken(request.token, token)) {
+    return 401;
+  }
+  if (!sha256 || strcmp(request.sha256, sha256) != 0) {
+    return 404;
+  }
+  if (request.ranged) {
+    return request.first < size ? 206 : 416;
+  }
+  return 200;
+}
+
+size_t OTAPeerHttp::responseHead(char *out, size_t outSize, int status,
+                                 const OTAPeerRequest &request,
+                                 uint32_t size) {
+  int length;
+  switch (status) {
+  case 200:
+    length = snprintf(out, outSize,
+                      "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: application/octet-stream\r\n"
+                      "Content-Length: %lu\r\n"
+                      "Connection: close\r\n\r\n",
+                      (unsigned long)size);
+    break;
+  case 206:
+    length = snprintf(out, outSize,
+                      "HTTP/1.1 206 Partial Content\r\n"
+                      "Content-Type: application/octet-stream\r\n"
+                      "Content-Length: %lu\r\n"
+                      "Content-Range: bytes %lu-%lu/%lu\r\n"
+                      "Connection: close\r\n\r\n",
+                      (unsigned long)(size - request.first),
+                      (unsigned long)request.first,
+                      (unsigned long)(size - 1), (unsigned long)size);
+    break;
+  case 416:
+    length = snprintf(out, outSize,
+                      "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                      "Content-Range: bytes */%lu\r\n"
+                      "Content-Length: 0\r\n"
+                      "Connection: close\r\n\r\n",
+                      (unsigned long)size);
+    break;
+  case 503:
+    length = snprintf(out, outSize,
+                      "HTTP/1.1 503 Service Unavailable\r\n"
+                      "Retry-After: %lu\r\n"
+                      "Content-Length: 0\r\n"
+                      "Connection: close\r\n\r\n",
+                      (unsigned long)(OTA_PEER_RETRY_MS + 999) / 1000);
+    break;
+  default:
+    length = snprintf(out, outSize,
+                      "HTTP/1.1 %d %s\r\n"
+                      "Content-Length: 0\r\n"
+                      "Connection: close\r\n\r\n",
+                      status,
+                      status == 401   ? "Unauthorized"
+                      : status == 404 ? "Not Found"
+                                      : "Bad Request");
+    break;
+  }
+  return length > 0 && static_cast<size_t>(length) < outSize
+             ? static_cast<size_t>(length)
+             : 0;
+}
+
+bool OTAPeerHttp::validToken(const char *token) {
+  size_t length = 0;
+  for (; token[length]; length++) {
+    char c = token[length];
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+          (c >= 'A' && c <= 'Z') || c == '.' || c == '_' || c == '~' ||
+          c == '-')) {
+      return false;
+    }
+  }
+  return length >= OTA_PEER_TOKEN_MIN && length <= OTA_PEER_TOKEN_MAX;
+}
+
+void OTAPeerHttp::path(const char *sha256, char *out, size_t outSize) {
+  snprintf(out, outSize, "/ota/%s", sha256);
+}
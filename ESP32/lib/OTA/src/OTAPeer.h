@@ -0,0 +1,178 @@
+#ifndef OTA_PEER_H
+#define OTA_PEER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Port of the local endpoint serving the running firmware to other devices
+#ifndef OTA_PEER_PORT
+#define OTA_PEER_PORT 8266
+#endif
+// The first lookup happens at a random point of this window, so devices
+// that got the same command do not all claim the origin download at once
+#ifndef OTA_PEER_SPREAD_MS
+#define OTA_PEER_SPREAD_MS 3000
+#endif
+// Between lookups while a peer downloads the image or is busy serving it
+#ifndef OTA_PEER_RETRY_MS
+#define OTA_PEER_RETRY_MS 5000
+#endif
+// A peer that was downloading the image and is gone is likely rebooting
+// into it; wait this long for it to serve the image before downloading it
+#ifndef OTA_PEER_REBOOT_MS
+#define OTA_PEER_REBOOT_MS 90000
+#endif
+// Waited for peers this long: download from the origin anyway
+#ifndef OTA_PEER_MAX_WAIT_MS
+#define OTA_PEER_MAX_WAIT_MS (30 * 60 * 1000)
+#endif
+// Peers taken from one lookup, and peers remembered as failed
+#ifndef OTA_PEER_MAX_PEERS
+#define OTA_PEER_MAX_PEERS 16
+#endif
+// Length of the token a requester presents for the image, "peerToken" in
+// the command that installed it
+#define OTA_PEER_TOKEN_MIN 16
+#define OTA_PEER_TOKEN_MAX 64
+
+// A device found by a lookup, as it relates to the image being looked for
+struct OTAPeerInfo {
+  uint32_t address; // IPv4, as the network stack stores it
+  uint16_t port;
+  bool serving;  // serves the image
+  bool fetching; // is downloading it from the origin
+};
+
+enum OTAPeerAction {
+  OTA_PEER_WAIT,     // look up the peers again after waitMs
+  OTA_PEER_DOWNLOAD, // download the image from peer
+  OTA_PEER_CLAIM,    // announce the origin download, then look up again
+  OTA_PEER_ORIGIN,   // download the image from the origin
+};
+
+struct OTAPeerStats {
+  uint32_t lookups;  // peer lists passed to next()
+  uint32_t attempts; // downloads from peers
+  uint32_t busy;     // of them refused or interrupted, tried again later
+  uint32_t failures; // of them bad, that peer not tried again
+  uint32_t waitedMs; // begin() to the download that succeeded or ORIGIN
+  bool claimed;      // this device downloads from the origin for the site
+};
+
+// Picks where one update downloads its image from: a device on the same
+// network that already runs it, or the origin (the firmwareUrl).
+//
+// Devices announce the image they serve and the one they are downloading
+// from the origin (mDNS on the device), and give the image only to requests
+// carrying the token of the command that installed it. After a random part
+// of the spread window a device downloads from a random peer serving the
+// image. While a peer is downloading it from the origin, or has just done
+// so and is rebooting into it, or all peers serving it are busy, the
+// device waits and looks again. Otherwise it claims the origin download:
+// it announces it, looks once more, and backs off if another device
+// claimed it too and ranks lower (address, then port). So a site fetches
+// the image over its uplink about once, and devices that updated from it
+// serve it in turn.
+//
+// Times are milliseconds on any clock that wraps at 2^32. Not thread safe;
+// used only by the update task. Plain C++ so it can be built on the host
+// (tools/ota_peer_site_host.cpp).
+class OTAPeerSelector {
+public:
+  OTAPeerSelector();
+
+  void configure(uint32_t spreadMs = OTA_PEER_SPREAD_MS,
+                 uint32_t retryMs = OTA_PEER_RETRY_MS,
+                 uint32_t rebootMs = OTA_PEER_REBOOT_MS,
+                 uint32_t maxWaitMs = OTA_PEER_MAX_WAIT_MS);
+
+  // A new update at now by the device at address:port, which next() never
+  // picks; random is a uniformly distributed 32-bit value
+  void begin(uint32_t address, uint16_t port, uint32_t now, uint32_t random);
+
+  // peers is what the lookup after the previous WAIT or CLAIM found; the
+  // first call returns WAIT before any lookup
+  OTAPeerAction next(const OTAPeerInfo *peers, size_t count, uint32_t now,
+                     uint32_t random, OTAPeerInfo &peer, uint32_t &waitMs);
+  // The download from peer failed. A busy peer is tried again after the
+  // retry interval, one that sent a bad image or refused it is not.
+  void failed(const OTAPeerInfo &peer, bool busy, uint32_t now);
+  // The download from peer succeeded
+  void succeeded(uint32_t now);
+
+  // Whether to announce that this device downloads from the origin
+  bool fetching() const { return _claimed; }
+  OTAPeerStats getStats() const { return _stats; }
+
+private:
+  struct Failed {
+    uint32_t address;
+    uint16_t port;
+    bool busy;
+    uint32_t until; // busy: tried again from then
+  };
+
+  static bool _reached(uint32_t now, uint32_t at) {
+    return static_cast<int32_t>(now - at) >= 0;
+  }
+  bool _isSelf(const OTAPeerInfo &peer) const {
+    return peer.address == _address && peer.port == _port;
+  }
+  bool _ranksBelow(const OTAPeerInfo &peer) const {
+    return peer.address != _address ? peer.address < _address
+                                    : peer.port < _port;
+  }
+  Failed *_find(const OTAPeerInfo &peer);
+  uint32_t _wait(uint32_t now) const;
+
+  uint32_t _spreadMs;
+  uint32_t _retryMs;
+  uint32_t _rebootMs;
+  uint32_t _maxWaitMs;
+
+  uint32_t _address;
+  uint16_t _port;
+  uint32_t _beganAt;
+  uint32_t _startAt;
+  bool _started;
+  bool _claimed;
+  bool _fetcherSeen;
+  uint32_t _fetcherSeenAt;
+  Failed _failed[OTA_PEER_MAX_PEERS];
+  size_t _failedCount;
+  OTAPeerStats _stats;
+};
+
+// Head of a request for the image: "GET /ota/<sha256> HTTP/1.1", with
+// "Authorization: Bearer <token>" and an optional "Range: bytes=<first>-"
+// to continue an interrupted download
+struct OTAPeerRequest {
+  char sha256[65]; // lower case hex
+  char token[OTA_PEER_TOKEN_MAX + 1]; // empty if none was presented
+  uint32_t first;                     // first byte wanted
+  bool ranged;
+};
+
+// The HTTP/1.1 subset spoken between devices, one request per connection
+class OTAPeerHttp {
+public:
+  // head is the request up to the empty line, NUL terminated; false if it
+  // is not a GET of /ota/<sha256>
+  static bool parseRequest(const char *head, OTAPeerRequest &request);
+  // Status answering request for the image sha256 (lower case hex) of size
+  // bytes, given out only for token; sha256 nullptr if no image is served.
+  // A request without that token gets 401 whatever it asks for.
+  static int status(const OTAPeerRequest &request, const char *sha256,
+                    const char *token, uint32_t size);
+  // OTA_PEER_TOKEN_MIN to OTA_PEER_TOKEN_MAX of [A-Za-z0-9._~-]
+  static bool validToken(const char *token);
+  // Writes the response head for status into out; the body is bytes
+  // [request.first, size) of the image for 200 and 206. Returns the length,
+  // 0 if out is too small.
+  static size_t responseHead(char *out, size_t outSize, int status,
+                             const OTAPeerRequest &request, uint32_t size);
+  // The request path for sha256
+  static void path(const char *sha256, char *out, size_t outSize);
+};
+
+#endif // OTA_PEER_H
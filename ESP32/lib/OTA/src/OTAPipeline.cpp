@@ -0,0 +1,125 @@
+#include "OTAPipeline.h"
+
+OTAPipeline::OTAPipeline(size_t bufferCount, size_t bufferSize)
+    : _slots(nullptr), _bufferCount(constrain(bufferCount, 2, 16)),
+      _bufferSize(bufferSize > 0 ? bufferSize : 4096), _freeQueue(nullptr),
+      _filledQueue(nullptr), _doneSemaphore(nullptr), _running(false),
+      _consumer(nullptr), _failed(false), _readStallMs(0), _writeStallMs(0),
+      _consumeMs(0) {}
+
+OTAPipeline::~OTAPipeline() {
+  if (_running) {
+    finish();
+  }
+  _release();
+}
+
+bool OTAPipeline::begin(OTAChunkConsumer consumer, UBaseType_t priority) {
+  _consumer = consumer;
+  _slots = new Slot[_bufferCount]();
+  _freeQueue = xQueueCreate(_bufferCount, sizeof(uint8_t));
+  // One extra entry so the end-of-stream marker never blocks
+  _filledQueue = xQueueCreate(_bufferCount + 1, sizeof(uint8_t));
+  _doneSemaphore = xSemaphoreCreateBinary();
+  if (!_freeQueue || !_filledQueue || !_doneSemaphore) {
+    _release();
+    return false;
+  }
+
+  for (size_t i = 0; i < _bufferCount; i++) {
+    _slots[i].data = (uint8_t *)malloc(_bufferSize);
+    if (!_slots[i].data) {
+      Serial.printf("[OTA] Pipeline: failed to allocate buffer %u of %u\n",
+                    (unsigned)(i + 1), (unsigned)_bufferCount);
+      _release();
+      return false;
+    }
+    uint8_t slot = i;
+    xQueueSend(_freeQueue, &slot, 0);
+  }
+
+  if (xTaskCreate(_writerTrampoline, "OTA_Write_Task", WRITER_STACK_SIZE, this,
+                  priority, NULL) != pdPASS) {
+    _release();
+    return false;
+  }
+  _running = true;
+  return true;
+}
+
+int OTAPipeline::acquire(uint32_t timeoutMs) {
+  uint8_t slot;
+  unsigned long start = millis();
+  BaseType_t got = xQueueReceive(_freeQueue, &slot, pdMS_TO_TICKS(timeoutMs));
+  _readStallMs += millis() - start;
+  return got == pdTRUE ? slot : -1;
+}
+
+void OTAPipeline::submit(int slot, size_t len) {
+  _slots[slot].len = len;
+  uint8_t index = slot;
+  xQueueSend(_filledQueue, &index, portMAX_DELAY);
+}
+
+bool OTAPipeline::finish() {
+  if (!_running) {
+    return !_failed;
+  }
+  uint8_t marker = END_OF_STREAM;
+  xQueueSend(_filledQueue, &marker, portMAX_DELAY);
+  xSemaphoreTake(_doneSemaphore, portMAX_DELAY);
+  _running = false;
+  return !_failed;
+}
+
+void OTAPipeline::_writerTrampoline(void *pvParameters) {
+  static_cast<OTAPipeline *>(pvParameters)->_writerTask();
+}
+
+void OTAPipeline::_writerTask() {
+  for (;;) {
+    uint8_t slot;
+    unsigned long waitStart = millis();
+    xQueueReceive(_filledQueue, &slot, portMAX_DELAY);
+    _writeStallMs += millis() - waitStart;
+
+    if (slot == END_OF_STREAM) {
+      break;
+    }
+
+    // After a failure keep recycling buffers so the reader never deadlocks
+    if (!_failed && _slots[slot].len > 0) {
+      unsigned long consumeStart = millis();
+      if (!_consumer(_slots[slot].data, _slots[slot].len)) {
+        _failed = true;
+      }
+      _consumeMs += millis() - consumeStart;
+    }
+    xQueueSend(_freeQueue, &slot, portMAX_DELAY);
+  }
+
+  xSemaphoreGive(_doneSemaphore);
+  vTaskDelete(NULL);
+}
+
+void OTAPipeline::_release() {
+  if (_slots) {
+    for (size_t i = 0; i < _bufferCount; i++) {
+      free(_slots[i].data);
+    }
+    delete[] _slots;
+    _slots = nullptr;
+  }
+  if (_freeQueue) {
+    vQueueDelete(_freeQueue);
+    _freeQueue = nullptr;
+  }
+  if (_filledQueue) {
+    vQueueDelete(_filledQueue);
+    _filledQueue = nullptr;
+  }
+  if (_doneSemaphore) {
+    vSemaphoreDelete(_doneSemaphore);
+    _doneSemaphore = nullptr;
+  }
+}
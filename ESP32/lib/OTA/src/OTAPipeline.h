@@ -0,0 +1,72 @@
+#ifndef OTA_PIPELINE_H
+#define OTA_PIPELINE_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <functional>
+
+// Consumer run on the writer task for every filled buffer. Returning false
+// stops further consumption; the pipeline then only recycles buffers.
+using OTAChunkConsumer = std::function<bool(const uint8_t *, size_t)>;
+
+// Ring of download buffers shared between the network reader (the OTA task)
+// and a writer task that drains them into flash. The reader never waits on
+// a flash write unless every buffer is full.
+class OTAPipeline {
+public:
+  OTAPipeline(size_t bufferCount, size_t bufferSize);
+  ~OTAPipeline();
+
+  // Allocates the buffers and starts the writer task
+  bool begin(OTAChunkConsumer consumer, UBaseType_t priority);
+
+  // Reader side: take a free buffer (-1 on timeout), then hand it back filled
+  int acquire(uint32_t timeoutMs);
+  uint8_t *buffer(int slot) const { return _slots[slot].data; }
+  size_t bufferSize() const { return _bufferSize; }
+  void submit(int slot, size_t len);
+
+  // Drains all submitted buffers and stops the writer task. Returns false if
+  // the consumer rejected a chunk.
+  bool finish();
+
+  bool failed() const { return _failed; }
+
+  // Stage statistics in milliseconds
+  uint32_t readStallMs() const { return _readStallMs; }
+  uint32_t writeStallMs() const { return _writeStallMs; }
+  uint32_t consumeMs() const { return _consumeMs; }
+
+private:
+  struct Slot {
+    uint8_t *data;
+    size_t len;
+  };
+
+  static const uint8_t END_OF_STREAM = 0xFF;
+  static const uint32_t WRITER_STACK_SIZE = 8192;
+
+  static void _writerTrampoline(void *pvParameters);
+  void _writerTask();
+  void _release();
+
+  Slot *_slots;
+  size_t _bufferCount;
+  size_t _bufferSize;
+
+  QueueHandle_t _freeQueue;
+  QueueHandle_t _filledQueue;
+  SemaphoreHandle_t _doneSemaphore;
+  bool _running;
+
+  OTAChunkConsumer _consumer;
+  volatile bool _failed;
+
+  uint32_t _readStallMs;
+  volatile uint32_t _writeStallMs;
+  volatile uint32_t _consumeMs;
+};
+
+#endif // OTA_PIPELINE_H
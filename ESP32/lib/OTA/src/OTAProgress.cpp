@@ -0,0 +1,48 @@
+#include "OTAProgress.h"
+
+OTAProgressChannel::OTAProgressChannel()
+    : _received(0), _total(0), _reported(-1), _reports(0), _step(1) {}
+
+void OTAProgressChannel::begin(uint32_t total, uint32_t received) {
+  _received.store(received, std::memory_order_relaxed);
+  _reported.store(-1);
+  _total.store(total, std::memory_order_relaxed);
+}
+
+OTAProgress OTAProgressChannel::get() const {
+  OTAProgress progress;
+  progress.total = _total.load(std::memory_order_relaxed);
+  progress.received = _received.load(std::memory_order_relaxed);
+  if (progress.received > progress.total) {
+    progress.received = progress.total;
+  }
+  return progress;
+}
+
+uint8_t OTAProgressChannel::percent(const OTAProgress &progress) {
+  if (!progress.total) {
+    return 0;
+  }
+  return (uint64_t)progress.received * 100 / progress.total;
+}
+
+bool OTAProgressChannel::sample(OTAProgress &progress) {
+  progress = get();
+  if (!progress.total) {
+    return false;
+  }
+  int now = percent(progress);
+  int last = _reported.load();
+  for (;;) {
+    bool due = now == 100 ? last != 100 : now >= last + _step;
+    if (!due) {
+      return false;
+    }
+    // Another reporter may have taken this step already
+    if (_reported.compare_exchange_weak(last, now)) {
+      break;
+    }
+  }
+  _reports.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
@@ -0,0 +1,53 @@
+#ifndef OTA_PROGRESS_H
+#define OTA_PROGRESS_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Progress of the running update, readable from any task
+struct OTAProgress {
+  uint32_t received; // bytes of the download stream consumed
+  uint32_t total;    // size of the download stream, 0 when none runs
+};
+
+// Hands the download progress from the update task to whoever reports it.
+//
+// The download loop only stores the byte count (update(), one relaxed
+// atomic store per chunk). A reporter samples it on its own schedule;
+// sample() says whether the percentage moved far enough since the last
+// report to send another, and always lets 100% through once. Several
+// reporters may sample at the same time, each percentage is reported once.
+class OTAProgressChannel {
+public:
+  OTAProgressChannel();
+
+  // Report when the percentage advanced by at least step (1..100)
+  void setStep(uint8_t step) { _step = step ? step : 1; }
+  uint8_t getStep() const { return _step; }
+
+  // A new download of total bytes, received of them already done
+  void begin(uint32_t total, uint32_t received);
+  void update(uint32_t received) {
+    _received.store(received, std::memory_order_relaxed);
+  }
+  // No download any more; sample() reports nothing until begin()
+  void end() { _total.store(0, std::memory_order_relaxed); }
+
+  OTAProgress get() const;
+  // Fills progress and returns true if it should be reported
+  bool sample(OTAProgress &progress);
+  // Reports sample() has allowed, ever
+  uint32_t getReports() const { return _reports.load(); }
+
+  static uint8_t percent(const OTAProgress &progress);
+
+private:
+  std::atomic<uint32_t> _received;
+  std::atomic<uint32_t> _total;
+  std::atomic<int> _reported; // percentage last reported, -1 for none
+  std::atomic<uint32_t> _reports;
+  uint8_t _step;
+};
+
+#endif // OTA_PROGRESS_H
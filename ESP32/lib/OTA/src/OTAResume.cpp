@@ -0,0 +1,61 @@
+#include "OTAResume.h"
+#include <stdio.h>
+
+void OTAResume::begin(size_t total) {
+  _started = true;
+  _received = 0;
+  _total = total;
+}
+
+bool OTAResume::restore(size_t received, size_t total) {
+  if (received == 0 || received > total) {
+    reset();
+    return false;
+  }
+  _started = true;
+  _received = received;
+  _total = total;
+  return true;
+}
+
+void OTAResume::reset() {
+  _started = false;
+  _received = 0;
+  _total = 0;
+}
+
+OTAResumeAction OTAResume::accept(bool partial,
+                                  const char *contentRange) const {
+  size_t start = rangeStart();
+  if (!partial) {
+    // A server without Range support sends everything again
+    return start > 0 ? OTA_RESUME_RESTART : OTA_RESUME_BEGIN;
+  }
+  size_t first = 0;
+  size_t last = 0;
+  size_t total = 0;
+  // Partial content is only trusted if it is exactly the rest of the
+  // image already in flash
+  if (start == 0 || !contentRange ||
+      !parseContentRange(contentRange, first, last, total) ||
+      first != start || last + 1 != _total || total != _total) {
+    return OTA_RESUME_MISMATCH;
+  }
+  return OTA_RESUME_CONTINUE;
+}
+
+bool OTAResume::parseContentRange(const char *header, size_t &first,
+                                  size_t &last, size_t &total) {
+  unsigned long a = 0;
+  unsigned long b = 0;
+  unsigned long c = 0;
+  int consumed = 0;
+  if (sscanf(header, "bytes %lu-%lu/%lu%n", &a, &b, &c, &consumed) != 3 ||
+      header[consumed] != '\0' || a > b || b >= c) {
+    return false;
+  }
+  first = a;
+  last = b;
+  total = c;
+  return true;
+}
@@ -0,0 +1,67 @@
+#ifndef OTA_RESUME_H
+#define OTA_RESUME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// What to do with the body of a 200 or 206 response to a download request
+enum OTAResumeAction {
+  OTA_RESUME_BEGIN,    // the whole stream: start a new image from byte 0
+  OTA_RESUME_RESTART,  // the whole stream although a range was asked for:
+                       // drop the partial image, then begin a new one
+  OTA_RESUME_CONTINUE, // partial content continuing the image in flash
+  OTA_RESUME_MISMATCH, // partial content that does not fit the image in
+                       // flash: drop it and try again from byte 0
+};
+
+// Position in the download stream of the image being written, kept across
+// retries so a transient failure continues with "Range: bytes=N-" instead
+// of starting from byte 0.
+//
+// The update task asks rangeStart() before each request, hands the
+// response to accept(), and advances the position as the body is
+// consumed. A failed attempt keeps the position unless keepAfterFailure()
+// says otherwise. After a reset, restore() continues from a checkpoint.
+// Plain C++ so the same decisions run on the host (see
+// tools/ota_resume_host.cpp).
+class OTAResume {
+public:
+  OTAResume() : _started(false), _received(0), _total(0) {}
+
+  // A new image of total bytes, from byte 0
+  void begin(size_t total);
+  // An image of total bytes of which received are already in flash; false
+  // if that leaves nothing to resume
+  bool restore(size_t received, size_t total);
+  // No image any more
+  void reset();
+  void advance(size_t len) { _received += len; }
+
+  bool started() const { return _started; }
+  size_t received() const { return _received; }
+  size_t total() const { return _total; }
+  bool complete() const { return _started && _received == _total; }
+
+  // Byte to ask for with a Range header, 0 to ask for the whole stream
+  size_t rangeStart() const { return _started ? _received : 0; }
+  // Classifies a response to the request made after rangeStart(): partial
+  // for 206, contentRange its Content-Range header (nullptr if missing)
+  OTAResumeAction accept(bool partial, const char *contentRange) const;
+
+  // Whether a failed attempt leaves the partial image for the next one:
+  // only after a transient error with attempts left
+  static bool keepAfterFailure(bool fatal, bool lastAttempt) {
+    return !fatal && !lastAttempt;
+  }
+  // "bytes <first>-<last>/<total>"; false for anything else, including a
+  // range that does not fit in total
+  static bool parseContentRange(const char *header, size_t &first,
+                                size_t &last, size_t &total);
+
+private:
+  bool _started;
+  size_t _received; // bytes of the download stream consumed
+  size_t _total;    // size of the download stream
+};
+
+#endif // OTA_RESUME_H
@@ -0,0 +1,28 @@
+#include "OTARollout.h"
+
+// FNV-1a over the salt, a NUL and the ID, then the MurmurHash3 finalizer:
+// FNV alone leaves the low bits, which the modulo keeps, poorly mixed for
+// IDs that differ only in their last characters
+uint32_t OTARollout::bucket(const char *deviceId, const char *salt) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = salt ? salt : ""; *c; c++) {
+    hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619u;
+  }
+  hash *= 16777619u; // the separator
+  for (const char *c = deviceId ? deviceId : ""; *c; c++) {
+    hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash % BUCKETS;
+}
+
+int32_t OTARollout::threshold(double percent) {
+  if (!(percent >= 0 && percent <= 100)) {
+    return -1;
+  }
+  return static_cast<int32_t>(percent * (BUCKETS / 100) + 0.5);
+}
@@ -0,0 +1,31 @@
+#ifndef OTA_ROLLOUT_H
+#define OTA_ROLLOUT_H
+
+#include <stdint.h>
+
+// Staged rollouts of a command sent to the whole board.
+//
+// Every device hashes its ID with the rollout's salt into one of BUCKETS
+// buckets and takes part only while its bucket is below the rollout
+// percentage. The bucket of a device never changes for a salt, so raising
+// the percentage only adds devices, and the next wave is one retained
+// publish of the same command with a larger percentage. A new salt (e.g.
+// per release) picks different first waves.
+//
+// Plain C++ so the host tool tools/ota_rollout_host.cpp computes exactly
+// the same buckets, to predict which devices each wave reaches.
+class OTARollout {
+public:
+  // Resolution of the percentage: 0.01%
+  static const uint32_t BUCKETS = 10000;
+
+  static uint32_t bucket(const char *deviceId, const char *salt);
+  // Buckets in a rollout of percent (0..100); -1 if percent is out of range
+  static int32_t threshold(double percent);
+  static bool includes(const char *deviceId, const char *salt,
+                       double percent) {
+    return static_cast<int32_t>(bucket(deviceId, salt)) < threshold(percent);
+  }
+};
+
+#endif // OTA_ROLLOUT_H
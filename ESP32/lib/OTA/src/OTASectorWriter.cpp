@@ -0,0 +1,77 @@
+#include "OTASectorWriter.h"
+#include <stdlib.h>
+#include <string.h>
+
+OTASectorWriter::OTASectorWriter()
+    : _erase(nullptr), _program(nullptr), _commit(nullptr), _buffer(nullptr),
+      _fill(0), _committed(0), _capacity(0) {}
+
+OTASectorWriter::~OTASectorWriter() { end(); }
+
+bool OTASectorWriter::begin(uint32_t capacity, EraseFn erase,
+                            ProgramFn program, CommitFn commit,
+                            uint32_t startOffset) {
+  if (startOffset % SECTOR_SIZE != 0 || startOffset > capacity) {
+    return false;
+  }
+  if (!_buffer) {
+    _buffer = (uint8_t *)malloc(SECTOR_SIZE);
+    if (!_buffer) {
+      return false;
+    }
+  }
+  _erase = erase;
+  _program = program;
+  _commit = commit;
+  _fill = 0;
+  _committed = startOffset;
+  _capacity = capacity;
+  return true;
+}
+
+void OTASectorWriter::end() {
+  free(_buffer);
+  _buffer = nullptr;
+  _fill = 0;
+}
+
+bool OTASectorWriter::write(const uint8_t *data, size_t len) {
+  if (!_buffer || (uint64_t)size() + len > _capacity) {
+    return false;
+  }
+  while (len > 0) {
+    size_t take = SECTOR_SIZE - _fill;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(_buffer + _fill, data, take);
+    _fill += take;
+    data += take;
+    len -= take;
+    if (_fill == SECTOR_SIZE && !_programSector()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool OTASectorWriter::flush() {
+  if (!_buffer) {
+    return false;
+  }
+  return _fill == 0 || _programSector();
+}
+
+bool OTASectorWriter::_programSector() {
+  // Whatever a reset left in this sector is erased before programming
+  if (!_erase(_committed, SECTOR_SIZE) ||
+      !_program(_committed, _buffer, _fill)) {
+    return false;
+  }
+  _committed += _fill;
+  _fill = 0;
+  if (_commit) {
+    _commit(_committed);
+  }
+  return true;
+}
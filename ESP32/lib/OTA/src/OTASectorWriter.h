@@ -0,0 +1,52 @@
+#ifndef OTA_SECTOR_WRITER_H
+#define OTA_SECTOR_WRITER_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// Writes an image into a flash partition one whole sector at a time: each
+// sector is erased right before it is programmed, and committed() only
+// advances once a sector is fully programmed. Everything below committed()
+// therefore survives a reset, which is what an OTA checkpoint records.
+//
+// Flash access goes through callbacks so the same code can be built on the
+// host (see tools/ota_power_loss_host.cpp).
+class OTASectorWriter {
+public:
+  using EraseFn = std::function<bool(uint32_t, size_t)>;
+  using ProgramFn = std::function<bool(uint32_t, const uint8_t *, size_t)>;
+  // Called after each sector is programmed with the new committed offset
+  using CommitFn = std::function<void(uint32_t)>;
+
+  static const size_t SECTOR_SIZE = 4096;
+
+  OTASectorWriter();
+  ~OTASectorWriter();
+
+  // Starts writing at startOffset, which must be sector aligned (0 for a
+  // fresh image, a checkpoint's committed offset when resuming)
+  bool begin(uint32_t capacity, EraseFn erase, ProgramFn program,
+             CommitFn commit = nullptr, uint32_t startOffset = 0);
+  void end();
+
+  bool write(const uint8_t *data, size_t len);
+  // Programs the final, partially filled sector
+  bool flush();
+
+  uint32_t committed() const { return _committed; }
+  uint32_t size() const { return _committed + _fill; }
+
+private:
+  bool _programSector();
+
+  EraseFn _erase;
+  ProgramFn _program;
+  CommitFn _commit;
+  uint8_t *_buffer;
+  size_t _fill;
+  uint32_t _committed;
+  uint32_t _capacity;
+};
+
+#endif // OTA_SECTOR_WRITER_H
@@ -0,0 +1,426 @@
+#include "SecureClient.h"
+#include <esp_heap_caps.h>
+#include <mbedtls/error.h>
+#include <mbedtls/net_sockets.h>
+
+static const uint32_t DEFAULT_HANDSHAKE_TIMEOUT_MS = 15000;
+static const uint32_t WRITE_TIMEOUT_MS = 15000;
+
+// Identifies a trust anchor in the session cache
+static uint32_t anchorOf(const char *rootCA) {
+  if (!rootCA) {
+    return 0;
+  }
+  uint32_t hash = 2166136261u;
+  for (const char *p = rootCA; *p; ++p) {
+    hash = (hash ^ static_cast<uint8_t>(*p)) * 16777619u;
+  }
+  return hash ? hash : 1;
+}
+
+SecureSessionCache::SecureSessionCache() : _lock(xSemaphoreCreateMutex()) {
+  for (size_t i = 0; i < SIZE; i++) {
+    _entries[i].valid = false;
+    mbedtls_ssl_session_init(&_entries[i].session);
+  }
+}
+
+SecureSessionCache::~SecureSessionCache() {
+  clear();
+  vSemaphoreDelete(_lock);
+}
+
+SecureSessionCache::Entry *SecureSessionCache::_find(const char *host,
+                                                     uint16_t port,
+                                                     uint32_t anchor) {
+  for (size_t i = 0; i < SIZE; i++) {
+    if (_entries[i].valid && _entries[i].port == port &&
+        _entries[i].anchor == anchor && strcmp(_entries[i].host, host) == 0) {
+      return &_entries[i];
+    }
+  }
+  return nullptr;
+}
+
+bool SecureSessionCache::apply(const char *host, uint16_t port,
+                               uint32_t anchor, mbedtls_ssl_context *ssl,
+                               unsigned char *master) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  Entry *entry = _find(host, port, anchor);
+  bool applied = entry && mbedtls_ssl_set_session(ssl, &entry->session) == 0;
+  if (applied) {
+    memcpy(master, entry->session.master, sizeof(entry->session.master));
+  }
+  xSemaphoreGive(_lock);
+  return applied;
+}
+
+void SecureSessionCache::save(const char *host, uint16_t port,
+                              uint32_t anchor,
+                              const mbedtls_ssl_context *ssl) {
+  if (strlen(host) >= sizeof(_entries[0].host)) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  Entry *slot = _find(host, port, anchor);
+  if (!slot) {
+    // Replace the least recently used entry
+    slot = &_entries[0];
+    for (size_t i = 1; i < SIZE; i++) {
+      if (!_entries[i].valid ||
+          (slot->valid && _entries[i].lastUsed < slot->lastUsed)) {
+        slot = &_entries[i];
+      }
+    }
+  }
+  mbedtls_ssl_session_free(&slot->session);
+  mbedtls_ssl_session_init(&slot->session);
+  slot->valid = mbedtls_ssl_get_session(ssl, &slot->session) == 0;
+  if (slot->valid) {
+    strcpy(slot->host, host);
+    slot->port = port;
+    slot->anchor = anchor;
+    slot->lastUsed = millis();
+  }
+  xSemaphoreGive(_lock);
+}
+
+void SecureSessionCache::clear() {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (size_t i = 0; i < SIZE; i++) {
+    mbedtls_ssl_session_free(&_entries[i].session);
+    mbedtls_ssl_session_init(&_entries[i].session);
+    _entries[i].valid = false;
+  }
+  xSemaphoreGive(_lock);
+}
+
+SecureClient::SecureClient()
+    : _configReady(false), _sslReady(false), _connected(false),
+      _rootCA(nullptr), _anchor(0),
+      _handshakeTimeoutMs(DEFAULT_HANDSHAKE_TIMEOUT_MS), _port(0),
+      _peeked(-1), _attempts(0), _sessions(&_ownSessions), _last() {
+  _host[0] = '\0';
+}
+
+SecureClient::~SecureClient() { end(); }
+
+void SecureClient::setCACert(const char *rootCA) {
+  if (rootCA == _rootCA ||
+      (rootCA && _rootCA && strcmp(rootCA, _rootCA) == 0)) {
+    return;
+  }
+  // Cached sessions stay with the trust anchor they were verified against
+  stop();
+  _freeConfig();
+  free(_rootCA);
+  _rootCA = rootCA ? strdup(rootCA) : nullptr;
+  _anchor = anchorOf(_rootCA);
+}
+
+int SecureClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip.toString().c_str(), port, _handshakeTimeoutMs);
+}
+
+int SecureClient::connect(IPAddress ip, uint16_t port, int32_t timeout) {
+  return connect(ip.toString().c_str(), port, timeout);
+}
+
+int SecureClient::connect(const char *host, uint16_t port) {
+  return connect(host, port, _handshakeTimeoutMs);
+}
+
+int SecureClient::connect(const char *host, uint16_t port, int32_t timeout) {
+  stop();
+  memset(&_last, 0, sizeof(_last));
+  _attempts++;
+  if (!_setupConfig()) {
+    return 0;
+  }
+
+  unsigned long connectStart = millis();
+  if (!_tcp.connect(host, port, timeout)) {
+    Serial.printf("[TLS] TCP connect to %s:%u failed\n", host, port);
+    return 0;
+  }
+  _last.connectMs = millis() - connectStart;
+
+  if (!_handshake(host, port)) {
+    _tcp.stop();
+    return 0;
+  }
+  strncpy(_host, host, sizeof(_host) - 1);
+  _host[sizeof(_host) - 1] = '\0';
+  _port = port;
+  _connected = true;
+  _last.ok = true;
+  return 1;
+}
+
+bool SecureClient::_setupConfig() {
+  if (_configReady) {
+    return true;
+  }
+  mbedtls_entropy_init(&_entropy);
+  mbedtls_ctr_drbg_init(&_drbg);
+  mbedtls_ssl_config_init(&_conf);
+  mbedtls_x509_crt_init(&_caCert);
+  _configReady = true;
+
+  int ret = mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy,
+                                  nullptr, 0);
+  if (ret != 0) {
+    _logError("RNG seed", ret);
+    _freeConfig();
+    return false;
+  }
+  ret = mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT,
+                                    MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT);
+  if (ret != 0) {
+    _logError("SSL config", ret);
+    _freeConfig();
+    return false;
+  }
+  mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &_drbg);
+  mbedtls_ssl_conf_session_tickets(&_conf,
+                                   MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+  if (_rootCA) {
+    // PEM parsing needs the terminating NUL in the length
+    ret = mbedtls_x509_crt_parse(&_caCert, (const unsigned char *)_rootCA,
+                                 strlen(_rootCA) + 1);
+    if (ret != 0) {
+      _logError("CA certificate", ret);
+      _freeConfig();
+      return false;
+    }
+    mbedtls_ssl_conf_ca_chain(&_conf, &_caCert, nullptr);
+    mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  } else {
+    Serial.println("[TLS] WARNING: Certificate validation is DISABLED! This "
+                   "is insecure!");
+    mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_NONE);
+  }
+  return true;
+}
+
+bool SecureClient::_handshake(const char *host, uint16_t port) {
+  _last.heapBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  uint32_t heapLow = _last.heapBefore;
+
+  // Reusing the context keeps its 16 KB record buffers allocated
+  int ret;
+  if (_sslReady) {
+    ret = mbedtls_ssl_session_reset(&_ssl);
+  } else {
+    mbedtls_ssl_init(&_ssl);
+    ret = mbedtls_ssl_setup(&_ssl, &_conf);
+    _sslReady = ret == 0;
+    if (!_sslReady) {
+      mbedtls_ssl_free(&_ssl);
+    }
+  }
+  if (ret != 0) {
+    _logError("SSL setup", ret);
+    return false;
+  }
+  mbedtls_ssl_set_hostname(&_ssl, host);
+  mbedtls_ssl_set_bio(&_ssl, &_tcp, _send, _recv, nullptr);
+
+  unsigned char cachedMaster[sizeof(mbedtls_ssl_session::master)];
+  bool cached = _sessions->apply(host, port, _anchor, &_ssl, cachedMaster);
+
+  unsigned long start = millis();
+  while ((ret = mbedtls_ssl_handshake(&_ssl)) != 0) {
+    uint32_t freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (freeHeap < heapLow) {
+      heapLow = freeHeap;
+    }
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
+        ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      _logError("Handshake", ret);
+      return false;
+    }
+    if (millis() - start > _handshakeTimeoutMs) {
+      Serial.printf("[TLS] Handshake with %s timed out\n", host);
+      return false;
+    }
+    vTaskDelay(1);
+  }
+  _last.handshakeMs = millis() - start;
+  uint32_t freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  _last.heapPeak = _last.heapBefore - min(heapLow, freeHeap);
+
+  if (_rootCA && mbedtls_ssl_get_verify_result(&_ssl) != 0) {
+    Serial.printf("[TLS] Certificate of %s failed verification\n", host);
+    return false;
+  }
+
+  // Only a resumed session keeps the master secret of the cached one. The
+  // session ID can't tell: it is regenerated whenever a ticket is offered.
+  const mbedtls_ssl_session *current = mbedtls_ssl_get_session_pointer(&_ssl);
+  _last.resumed = cached && current &&
+                  memcmp(current->master, cachedMaster,
+                         sizeof(current->master)) == 0;
+  _sessions->save(host, port, _anchor, &_ssl);
+  return true;
+}
+
+void SecureClient::end() {
+  stop();
+  _ownSessions.clear();
+  _freeConfig();
+  free(_rootCA);
+  _rootCA = nullptr;
+}
+
+void SecureClient::_freeConfig() {
+  if (_sslReady) {
+    mbedtls_ssl_free(&_ssl);
+    _sslReady = false;
+  }
+  if (_configReady) {
+    mbedtls_x509_crt_free(&_caCert);
+    mbedtls_ssl_config_free(&_conf);
+    mbedtls_ctr_drbg_free(&_drbg);
+    mbedtls_entropy_free(&_entropy);
+    _configReady = false;
+  }
+}
+
+bool SecureClient::isConnectedTo(const char *host, uint16_t port) const {
+  return _connected && _port == port && strcmp(_host, host) == 0;
+}
+
+size_t SecureClient::write(uint8_t data) { return write(&data, 1); }
+
+size_t SecureClient::write(const uint8_t *buf, size_t size) {
+  if (!_connected) {
+    return 0;
+  }
+  size_t written = 0;
+  unsigned long start = millis();
+  while (written < size) {
+    int ret = mbedtls_ssl_write(&_ssl, buf + written, size - written);
+    if (ret > 0) {
+      written += ret;
+      continue;
+    }
+    if ((ret != MBEDTLS_ERR_SSL_WANT_READ &&
+         ret != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+        millis() - start > WRITE_TIMEOUT_MS) {
+      _logError("Write", ret);
+      stop();
+      break;
+    }
+    vTaskDelay(1);
+  }
+  return written;
+}
+
+int SecureClient::available() {
+  if (!_connected) {
+    return _peeked >= 0 ? 1 : 0;
+  }
+  int pending = mbedtls_ssl_get_bytes_avail(&_ssl);
+  if (pending == 0 && _tcp.available() > 0) {
+    // Decrypts the next record without consuming application data
+    int ret = mbedtls_ssl_read(&_ssl, nullptr, 0);
+    if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ &&
+        ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      if (ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+        _logError("Read", ret);
+      }
+      stop();
+      return _peeked >= 0 ? 1 : 0;
+    }
+    pending = mbedtls_ssl_get_bytes_avail(&_ssl);
+  }
+  return pending + (_peeked >= 0 ? 1 : 0);
+}
+
+int SecureClient::read() {
+  uint8_t data;
+  return read(&data, 1) == 1 ? data : -1;
+}
+
+int SecureClient::read(uint8_t *buf, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  size_t offset = 0;
+  if (_peeked >= 0) {
+    buf[offset++] = (uint8_t)_peeked;
+    _peeked = -1;
+  }
+  if (offset == size || !_connected || available() == 0) {
+    return offset > 0 ? (int)offset : -1;
+  }
+  int ret = mbedtls_ssl_read(&_ssl, buf + offset, size - offset);
+  if (ret < 0) {
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      stop();
+    }
+    return offset > 0 ? (int)offset : -1;
+  }
+  return (int)offset + ret;
+}
+
+int SecureClient::peek() {
+  if (_peeked < 0) {
+    uint8_t data;
+    if (read(&data, 1) == 1) {
+      _peeked = data;
+    }
+  }
+  return _peeked;
+}
+
+void SecureClient::flush() { _tcp.flush(); }
+
+void SecureClient::stop() {
+  if (_connected) {
+    mbedtls_ssl_close_notify(&_ssl);
+    _connected = false;
+  }
+  _peeked = -1;
+  _tcp.stop();
+}
+
+uint8_t SecureClient::connected() {
+  if (_peeked >= 0) {
+    return 1;
+  }
+  if (_connected && !_tcp.connected() &&
+      mbedtls_ssl_get_bytes_avail(&_ssl) == 0 && _tcp.available() == 0) {
+    _connected = false;
+  }
+  return _connected;
+}
+
+void SecureClient::_logError(const char *what, int ret) {
+  char message[100];
+  mbedtls_strerror(ret, message, sizeof(message));
+  Serial.printf("[TLS] %s failed: -0x%04x %s\n", what, -ret, message);
+}
+
+int SecureClient::_send(void *ctx, const unsigned char *buf, size_t len) {
+  WiFiClient *tcp = (WiFiClient *)ctx;
+  if (!tcp->connected()) {
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  size_t sent = tcp->write(buf, len);
+  return sent > 0 ? (int)sent : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+int SecureClient::_recv(void *ctx, unsigned char *buf, size_t len) {
+  WiFiClient *tcp = (WiFiClient *)ctx;
+  int ready = tcp->available();
+  if (ready <= 0) {
+    return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_READ
+                            : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  int got = tcp->read(buf, min(len, (size_t)ready));
+  return got > 0 ? got : MBEDTLS_ERR_SSL_WANT_READ;
+}
@@ -0,0 +1,139 @@
+#ifndef SECURE_CLIENT_H
+#define SECURE_CLIENT_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Measurements of the most recent connect()
+struct TlsHandshakeStats {
+  bool ok;              // connection established
+  bool resumed;         // server accepted the cached session
+  uint32_t connectMs;   // TCP connect
+  uint32_t handshakeMs; // TLS handshake
+  uint32_t heapBefore;  // free heap before the handshake
+  uint32_t heapPeak;    // largest drop in free heap during the handshake
+};
+
+// Recent TLS sessions, per server and trust anchor, that SecureClients can
+// share so one resumes a session another set up. A session is only offered
+// to a client validating against the same root CA (anchor, see
+// SecureClient::setCACert), as resuming skips the certificate check. Safe
+// to use from several tasks.
+class SecureSessionCache {
+public:
+  static const size_t SIZE = 2;
+
+  SecureSessionCache();
+  ~SecureSessionCache();
+
+  // Offers the session cached for host:port and anchor to ssl, copying its
+  // master secret into master; false if there is none
+  bool apply(const char *host, uint16_t port, uint32_t anchor,
+             mbedtls_ssl_context *ssl, unsigned char *master);
+  // Keeps the session ssl just established, replacing the least recently
+  // used entry
+  void save(const char *host, uint16_t port, uint32_t anchor,
+            const mbedtls_ssl_context *ssl);
+  void clear();
+
+private:
+  struct Entry {
+    char host[64];
+    uint16_t port;
+    uint32_t anchor;
+    bool valid;
+    uint32_t lastUsed;
+    mbedtls_ssl_session session;
+  };
+
+  Entry *_find(const char *host, uint16_t port, uint32_t anchor);
+
+  SemaphoreHandle_t _lock;
+  Entry _entries[SIZE];
+};
+
+// TLS client over a plain WiFiClient that, unlike WiFiClientSecure, keeps
+// its mbedtls state between connections:
+//  - the SSL config, RNG and parsed CA chain are built once
+//  - the SSL context and its record buffers are reset, not reallocated
+//  - the last session (ticket or session ID) per host is offered on the
+//    next connect, so the server can skip the certificate exchange
+// Sessions go to the client's own cache unless setSessionCache() hands it
+// one shared with other clients.
+// Derives from WiFiClient so it can be handed to HTTPClient::begin.
+class SecureClient : public WiFiClient {
+public:
+  SecureClient();
+  ~SecureClient();
+
+  // PEM root certificate, copied; nullptr disables certificate validation
+  void setCACert(const char *rootCA);
+  // cache must outlive the client; nullptr goes back to the own cache
+  void setSessionCache(SecureSessionCache *cache) {
+    _sessions = cache ? cache : &_ownSessions;
+  }
+  void setHandshakeTimeout(uint32_t timeoutMs) {
+    _handshakeTimeoutMs = timeoutMs;
+  }
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(IPAddress ip, uint16_t port, int32_t timeout) override;
+  int connect(const char *host, uint16_t port) override;
+  int connect(const char *host, uint16_t port, int32_t timeout) override;
+
+  size_t write(uint8_t data) override;
+  size_t write(const uint8_t *buf, size_t size) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buf, size_t size) override;
+  int peek() override;
+  void flush() override;
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override { return connected(); }
+
+  // Frees the SSL context and the own cached sessions, returning their
+  // heap; a shared cache is left to its other clients
+  void end();
+  void clearSessions() { _sessions->clear(); }
+
+  bool isConnectedTo(const char *host, uint16_t port) const;
+  const TlsHandshakeStats &lastHandshake() const { return _last; }
+  uint32_t connectAttempts() const { return _attempts; }
+
+private:
+  bool _setupConfig();
+  void _freeConfig();
+  bool _handshake(const char *host, uint16_t port);
+  void _logError(const char *what, int ret);
+  static int _send(void *ctx, const unsigned char *buf, size_t len);
+  static int _recv(void *ctx, unsigned char *buf, size_t len);
+
+  WiFiClient _tcp;
+  mbedtls_entropy_context _entropy;
+  mbedtls_ctr_drbg_context _drbg;
+  mbedtls_ssl_config _conf;
+  mbedtls_x509_crt _caCert;
+  mbedtls_ssl_context _ssl;
+  bool _configReady;
+  bool _sslReady;
+  bool _connected;
+  char *_rootCA;
+  uint32_t _anchor; // FNV-1a of _rootCA, 0 without one
+  uint32_t _handshakeTimeoutMs;
+  char _host[64];
+  uint16_t _port;
+  int _peeked;
+  uint32_t _attempts;
+  SecureSessionCache _ownSessions;
+  SecureSessionCache *_sessions;
+  TlsHandshakeStats _last;
+};
+
+#endif // SECURE_CLIENT_H
@@ -0,0 +1,177 @@
+#include "SecureConnectionManager.h"
+
+SecureConnectionManager &SecureConnectionManager::shared() {
+  static SecureConnectionManager manager;
+  return manager;
+}
+
+SecureConnectionManager::Connection::Connection()
+    : lock(xSemaphoreCreateMutex()), plainPort(0), secureInUse(false),
+      reused(false), attemptsAtAcquire(0) {}
+
+SecureConnectionManager::SecureConnectionManager()
+    : _statsLock(xSemaphoreCreateMutex()), _stats() {
+  for (Connection &connection : _connections) {
+    connection.secure.setSessionCache(&_sessions);
+  }
+}
+
+HTTPClient *SecureConnectionManager::acquire(SecureChannel channel,
+                                             const String &url,
+                                             const char *rootCA,
+                                             uint32_t timeoutMs) {
+  bool https = false;
+  String host;
+  uint16_t port = 0;
+  if (!_parseUrl(url, https, host, port)) {
+    Serial.printf("[TLS] Cannot parse URL: %s\n", url.c_str());
+    return nullptr;
+  }
+  Connection &connection = _connections[channel];
+  if (xSemaphoreTake(connection.lock, pdMS_TO_TICKS(timeoutMs)) != pdTRUE) {
+    Serial.println("[TLS] Connection is busy");
+    return nullptr;
+  }
+
+  // HTTPClient reuses whatever is connected, so only leave the connection
+  // open if it goes to the same server
+  connection.secureInUse = https;
+  WiFiClient *client;
+  if (https) {
+    SecureClient &secure = connection.secure;
+    secure.setCACert(rootCA);
+    if (!secure.isConnectedTo(host.c_str(), port)) {
+      secure.stop();
+    }
+    connection.plain.stop();
+    connection.reused = secure.connected();
+    connection.attemptsAtAcquire = secure.connectAttempts();
+    client = &secure;
+  } else {
+    if (host != connection.plainHost || port != connection.plainPort) {
+      connection.plain.stop();
+    }
+    connection.secure.stop();
+    connection.plainHost = host;
+    connection.plainPort = port;
+    connection.reused = connection.plain.connected();
+    client = &connection.plain;
+  }
+
+  connection.http.setReuse(true);
+  if (!connection.http.begin(*client, url)) {
+    xSemaphoreGive(connection.lock);
+    return nullptr;
+  }
+  return &connection.http;
+}
+
+void SecureConnectionManager::release(SecureChannel channel, bool keepAlive) {
+  Connection &connection = _connections[channel];
+  connection.http.end();
+  if (connection.secureInUse) {
+    if (connection.secure.connectAttempts() != connection.attemptsAtAcquire) {
+      _recordHandshake(connection);
+    } else if (connection.reused) {
+      xSemaphoreTake(_statsLock, portMAX_DELAY);
+      _stats.reusedConnections++;
+      xSemaphoreGive(_statsLock);
+    }
+    if (!keepAlive) {
+      connection.secure.stop();
+    }
+  } else {
+    if (connection.reused && keepAlive) {
+      xSemaphoreTake(_statsLock, portMAX_DELAY);
+      _stats.reusedConnections++;
+      xSemaphoreGive(_statsLock);
+    }
+    if (!keepAlive) {
+      connection.plain.stop();
+    }
+  }
+  xSemaphoreGive(connection.lock);
+}
+
+void SecureConnectionManager::_recordHandshake(const Connection &connection) {
+  const TlsHandshakeStats &last = connection.secure.lastHandshake();
+  xSemaphoreTake(_statsLock, portMAX_DELAY);
+  if (!last.ok) {
+    _stats.failedConnections++;
+  } else if (last.resumed) {
+    _stats.resumedHandshakes++;
+    _stats.resumedHandshakeMs += last.handshakeMs;
+    _stats.resumedHeapPeak = max(_stats.resumedHeapPeak, last.heapPeak);
+  } else {
+    _stats.fullHandshakes++;
+    _stats.fullHandshakeMs += last.handshakeMs;
+    _stats.fullHeapPeak = max(_stats.fullHeapPeak, last.heapPeak);
+  }
+  xSemaphoreGive(_statsLock);
+  if (!last.ok) {
+    return;
+  }
+  Serial.printf("[TLS] %s handshake: connect %u ms, handshake %u ms, heap "
+                "peak %u bytes (free before %u)\n",
+                last.resumed ? "Resumed" : "Full", last.connectMs,
+                last.handshakeMs, last.heapPeak, last.heapBefore);
+}
+
+SecureConnectionStats SecureConnectionManager::getStats() const {
+  xSemaphoreTake(_statsLock, portMAX_DELAY);
+  SecureConnectionStats stats = _stats;
+  xSemaphoreGive(_statsLock);
+  return stats;
+}
+
+void SecureConnectionManager::printStats() const {
+  SecureConnectionStats stats = getStats();
+  Serial.printf("[TLS] Full handshakes: %u, avg %u ms, heap peak %u bytes\n",
+                stats.fullHandshakes,
+                stats.fullHandshakes
+                    ? stats.fullHandshakeMs / stats.fullHandshakes
+                    : 0,
+                stats.fullHeapPeak);
+  Serial.printf("[TLS] Resumed handshakes: %u, avg %u ms, heap peak %u "
+                "bytes\n",
+                stats.resumedHandshakes,
+                stats.resumedHandshakes
+                    ? stats.resumedHandshakeMs / stats.resumedHandshakes
+                    : 0,
+                stats.resumedHeapPeak);
+  Serial.printf("[TLS] Reused connections: %u, failed connections: %u\n",
+                stats.reusedConnections, stats.failedConnections);
+}
+
+bool SecureConnectionManager::_parseUrl(const String &url, bool &https,
+                                        String &host, uint16_t &port) {
+  int schemeEnd = url.indexOf("://");
+  if (schemeEnd < 0) {
+    return false;
+  }
+  String scheme = url.substring(0, schemeEnd);
+  if (scheme == "https") {
+    https = true;
+    port = 443;
+  } else if (scheme == "http") {
+    https = false;
+    port = 80;
+  } else {
+    return false;
+  }
+  int hostStart = schemeEnd + 3;
+  int pathStart = url.indexOf('/', hostStart);
+  String authority = pathStart < 0 ? url.substring(hostStart)
+                                   : url.substring(hostStart, pathStart);
+  int at = authority.lastIndexOf('@');
+  if (at >= 0) {
+    authority = authority.substring(at + 1);
+  }
+  int colon = authority.indexOf(':');
+  if (colon >= 0) {
+    port = authority.substring(colon + 1).toInt();
+    authority = authority.substring(0, colon);
+  }
+  host = authority;
+  return !host.isEmpty() && port != 0;
+}
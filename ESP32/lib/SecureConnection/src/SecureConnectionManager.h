@@ -0,0 +1,95 @@
+#ifndef SECURE_CONNECTION_MANAGER_H
+#define SECURE_CONNECTION_MANAGER_H
+
+#include "SecureClient.h"
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Totals since boot, per kind of connection
+struct SecureConnectionStats {
+  uint32_t fullHandshakes;
+  uint32_t resumedHandshakes;
+  uint32_t reusedConnections; // keep-alive hits, no handshake at all
+  uint32_t failedConnections;
+  uint32_t fullHandshakeMs;    // summed, divide by fullHandshakes
+  uint32_t resumedHandshakeMs; // summed, divide by resumedHandshakes
+  uint32_t fullHeapPeak;       // largest heap drop of a full handshake
+  uint32_t resumedHeapPeak;    // largest heap drop of a resumed handshake
+};
+
+// Who a connection is for. Each channel has its own client, so a firmware
+// download holding its connection for minutes does not hold up a config
+// fetch.
+enum SecureChannel {
+  SECURE_CHANNEL_CONFIG,
+  SECURE_CHANNEL_OTA,
+  SECURE_CHANNEL_COUNT
+};
+
+// HTTP(S) clients for the config fetch and OTA, one per channel, sharing
+// one TLS session cache. The HTTPClients and their transports live as long
+// as the manager, so a kept-alive connection is reused by the next request
+// on the channel to the same server, and SecureClient resumes a TLS session
+// when a new connection is needed (after a failed attempt, after talking to
+// another server, or one the other channel set up).
+//
+//   SecureConnectionManager &connections = SecureConnectionManager::shared();
+//   HTTPClient *http = connections.acquire(SECURE_CHANNEL_OTA, url, ca);
+//   if (http) {
+//     int code = http->GET();
+//     ...
+//     connections.release(SECURE_CHANNEL_OTA, code == HTTP_CODE_OK);
+//   }
+//
+// acquire() takes the channel's lock that release() gives back, so only
+// one request uses a channel at a time.
+class SecureConnectionManager {
+public:
+  static SecureConnectionManager &shared();
+
+  // Returns the channel's HTTPClient, already begun for url, or nullptr if
+  // its lock was not obtained within timeoutMs. rootCA nullptr disables
+  // certificate validation for https URLs.
+  HTTPClient *acquire(SecureChannel channel, const String &url,
+                      const char *rootCA, uint32_t timeoutMs = 30000);
+  // keepAlive leaves the connection open for the next request to the same
+  // server. Pass false unless the whole response body was read.
+  void release(SecureChannel channel, bool keepAlive);
+
+  // Over both channels
+  SecureConnectionStats getStats() const;
+  void printStats() const;
+
+private:
+  struct Connection {
+    Connection();
+
+    SemaphoreHandle_t lock;
+    HTTPClient http;
+    SecureClient secure;
+    WiFiClient plain;
+    String plainHost;
+    uint16_t plainPort;
+    bool secureInUse;
+    bool reused;
+    uint32_t attemptsAtAcquire;
+  };
+
+  SecureConnectionManager();
+  SecureConnectionManager(const SecureConnectionManager &) = delete;
+  SecureConnectionManager &operator=(const SecureConnectionManager &) = delete;
+
+  static bool _parseUrl(const String &url, bool &https, String &host,
+                        uint16_t &port);
+  void _recordHandshake(const Connection &connection);
+
+  SecureSessionCache _sessions; // before the clients that use it
+  Connection _connections[SECURE_CHANNEL_COUNT];
+  SemaphoreHandle_t _statsLock;
+  SecureConnectionStats _stats;
+};
+
+#endif // SECURE_CONNECTION_MANAGER_H
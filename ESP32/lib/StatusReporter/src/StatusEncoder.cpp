@@ -0,0 +1,293 @@
+#include "StatusEncoder.h"
+#include <stdio.h>
+#include <string.h>
+
+// Keys of the StatusField values
+static const char *const FIELD_KEYS[STATUS_FIELD_COUNT] = {
+    "id",     "chip",           "board",           "git_version",
+    "status", "config_version", "boot_to_mqtt_ms", "config_source",
+    "progress", "error",        "errorString",
+};
+
+StatusEncoder::StatusEncoder()
+    : _format(STATUS_FORMAT_JSON), _resync(true), _seq(0), _data(_buffer) {}
+
+bool StatusEncoder::parseFormat(const char *name, StatusFormat &format) {
+  if (!name || !name[0] || strcmp(name, "json") == 0) {
+    format = STATUS_FORMAT_JSON;
+  } else if (strcmp(name, "msgpack") == 0) {
+    format = STATUS_FORMAT_MSGPACK;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *StatusEncoder::formatName(StatusFormat format) {
+  return format == STATUS_FORMAT_MSGPACK ? "msgpack" : "json";
+}
+
+void StatusEncoder::setFormat(StatusFormat format) {
+  if (format != _format) {
+    _format = format;
+    _resync = true;
+  }
+}
+
+size_t StatusEncoder::encode(const StatusSnapshot &status, uint32_t changed,
+                             JsonObjectConst reports, bool &snapshot) {
+  if (changed & STATUS_CHANGE_RESET) {
+    _resync = true;
+  }
+  snapshot = _format == STATUS_FORMAT_JSON || _resync;
+  if (_format == STATUS_FORMAT_JSON) {
+    return _encodeJson(status, reports);
+  }
+  if (snapshot) {
+    _seq = 0;
+  }
+  // "status" is in every message
+  uint32_t fields = snapshot ? status.present
+                             : (changed | STATUS_BIT(STATUS_FIELD_STATE)) &
+                                   status.present;
+  size_t length = _encodeMsgPack(status, fields, reports);
+  // The fields of a delta that did not fit are not changed any more: only
+  // a snapshot puts the receiver back in step
+  _resync = length == 0;
+  return length;
+}
+
+bool StatusEncoder::_writeRaw(const char *text, size_t length, size_t &pos) {
+  if (pos + length > sizeof(_buffer)) {
+    return false;
+  }
+  memcpy(_buffer + pos, text, length);
+  pos += length;
+  return true;
+}
+
+bool StatusEncoder::_writeString(const char *text, size_t &pos) {
+  size_t length = strlen(text);
+  if (_format == STATUS_FORMAT_MSGPACK) {
+    size_t header = length < 32 ? 1 : length < 256 ? 2 : 3;
+    if (pos + header > sizeof(_buffer)) {
+      return false;
+    }
+    if (header == 1) {
+      _buffer[pos++] = 0xa0 | length;
+    } else if (header == 2) {
+      _buffer[pos++] = 0xd9;
+      _buffer[pos++] = length;
+    } else {
+      _buffer[pos++] = 0xda;
+      _buffer[pos++] = length >> 8;
+      _buffer[pos++] = length & 0xff;
+    }
+    return _writeRaw(text, length, pos);
+  }
+
+  if (!_writeRaw("\"", 1, pos)) {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++) {
+    char c = text[i];
+    char escaped[7];
+    size_t escapedLength = 2;
+    escaped[0] = '\\';
+    switch (c) {
+    case '"':
+    case '\\':
+      escaped[1] = c;
+      break;
+    case '\b':
+      escaped[1] = 'b';
+      break;
+    case '\f':
+      escaped[1] = 'f';
+      break;
+    case '\n':
+      escaped[1] = 'n';
+      break;
+    case '\r':
+      escaped[1] = 'r';
+      break;
+    case '\t':
+      escaped[1] = 't';
+      break;
+    default:
+      if ((unsigned char)c >= 0x20) {
+        escaped[0] = c;
+        escapedLength = 1;
+      } else {
+        escapedLength = snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      }
+    }
+    if (!_writeRaw(escaped, escapedLength, pos)) {
+      return false;
+    }
+  }
+  return _writeRaw("\"", 1, pos);
+}
+
+bool StatusEncoder::_writeInt(int64_t value, size_t &pos) {
+  uint8_t bytes[9];
+  size_t length;
+  if (_format == STATUS_FORMAT_JSON) {
+    char text[24];
+    length = snprintf(text, sizeof(text), "%lld", (long long)value);
+    return _writeRaw(text, length, pos);
+  }
+  // The smallest MessagePack integer that holds value
+  uint8_t type;
+  if (value >= 0 && value < 128) {
+    bytes[0] = value;
+    length = 1;
+  } else if (value >= -32 && value < 0) {
+    bytes[0] = (uint8_t)(int8_t)value;
+    length = 1;
+  } else {
+    if (value >= 0) {
+      type = value <= 0xff ? 0xcc : value <= 0xffff ? 0xcd
+                                  : value <= 0xffffffffLL ? 0xce : 0xcf;
+    } else {
+      type = value >= -128 ? 0xd0 : value >= -32768 ? 0xd1
+                                  : value >= -2147483648LL ? 0xd2 : 0xd3;
+    }
+    size_t size = 1u << (type & 0x03);
+    bytes[0] = type;
+    for (size_t i = 0; i < size; i++) {
+      bytes[1 + i] = (uint64_t)value >> (8 * (size - 1 - i));
+    }
+    length = 1 + size;
+  }
+  return _writeRaw(reinterpret_cast<const char *>(bytes), length, pos);
+}
+
+bool StatusEncoder::_writeKey(const char *key, size_t &pos) {
+  if (!_writeString(key, pos)) {
+    return false;
+  }
+  return _format != STATUS_FORMAT_JSON || _writeRaw(":", 1, pos);
+}
+
+bool StatusEncoder::_writeField(const StatusSnapshot &status,
+                                StatusField field, size_t &pos) {
+  if (!_writeKey(FIELD_KEYS[field], pos)) {
+    return false;
+  }
+  switch (field) {
+  case STATUS_FIELD_ID:
+    return _writeString(status.id, pos);
+  case STATUS_FIELD_CHIP:
+    return _writeString(status.chip, pos);
+  case STATUS_FIELD_BOARD:
+    return _writeString(status.board, pos);
+  case STATUS_FIELD_GIT_VERSION:
+    return _writeString(status.gitVersion, pos);
+  case STATUS_FIELD_STATE:
+    return _writeString(statusStateName(status.state), pos);
+  case STATUS_FIELD_CONFIG_VERSION:
+    return _writeString(status.configVersion, pos);
+  case STATUS_FIELD_BOOT_TO_MQTT_MS:
+    return _writeInt(status.bootToMqttMs, pos);
+  case STATUS_FIELD_CONFIG_SOURCE:
+    return _writeString(status.configSource, pos);
+  case STATUS_FIELD_PROGRESS:
+    return _writeInt(status.progress, pos);
+  case STATUS_FIELD_ERROR:
+    return _writeInt(status.error, pos);
+  case STATUS_FIELD_ERROR_STRING:
+    return _writeString(status.errorString, pos);
+  default:
+    return false;
+  }
+}
+
+bool StatusEncoder::_writeReport(JsonVariantConst value, size_t &pos) {
+  size_t length = _format == STATUS_FORMAT_JSON ? measureJson(value)
+                                                : measureMsgPack(value);
+  // serializeJson() also wants room for a NUL
+  if (pos + length >= sizeof(_buffer)) {
+    return false;
+  }
+  if (_format == STATUS_FORMAT_JSON) {
+    serializeJson(value, reinterpret_cast<char *>(_buffer + pos),
+                  sizeof(_buffer) - pos);
+  } else {
+    serializeMsgPack(value, _buffer + pos, sizeof(_buffer) - pos);
+  }
+  pos += length;
+  return true;
+}
+
+size_t StatusEncoder::_encodeJson(const StatusSnapshot &status,
+                                  JsonObjectConst reports) {
+  size_t pos = 0;
+  bool first = true;
+  _buffer[pos++] = '{';
+  for (uint8_t field = 0; field < STATUS_FIELD_COUNT; field++) {
+    if (!(status.present & STATUS_BIT(field))) {
+      continue;
+    }
+    if ((!first && !_writeRaw(",", 1, pos)) ||
+        !_writeField(status, static_cast<StatusField>(field), pos)) {
+      return 0;
+    }
+    first = false;
+  }
+  for (JsonPairConst pair : reports) {
+    if ((!first && !_writeRaw(",", 1, pos)) ||
+        !_writeKey(pair.key().c_str(), pos) ||
+        !_writeReport(pair.value(), pos)) {
+      return 0;
+    }
+    first = false;
+  }
+  if (!_writeRaw("}", 2, pos)) { // with the NUL
+    return 0;
+  }
+  _data = _buffer;
+  return pos - 1;
+}
+
+size_t StatusEncoder::_encodeMsgPack(const StatusSnapshot &status,
+                                     uint32_t fields,
+                                     JsonObjectConst reports) {
+  // Entries go after room for a map16 header; a fixmap header, when the
+  // count allows, is written just in front of them instead
+  const size_t start = 3;
+  size_t pos = start;
+  size_t count = 0;
+  for (uint8_t field = 0; field < STATUS_FIELD_COUNT; field++) {
+    if (!(fields & STATUS_BIT(field))) {
+      continue;
+    }
+    if (!_writeField(status, static_cast<StatusField>(field), pos)) {
+      return 0;
+    }
+    count++;
+  }
+  for (JsonPairConst pair : reports) {
+    if (!_writeKey(pair.key().c_str(), pos) ||
+        !_writeReport(pair.value(), pos)) {
+      return 0;
+    }
+    count++;
+  }
+  if (!_writeKey("seq", pos) || !_writeInt(_seq, pos)) {
+    return 0;
+  }
+  count++;
+  _seq = _seq == 0xffff ? 1 : _seq + 1; // 0 is the snapshot
+
+  if (count < 16) {
+    _buffer[start - 1] = 0x80 | count;
+    _data = _buffer + start - 1;
+    return pos - start + 1;
+  }
+  _buffer[0] = 0xde;
+  _buffer[1] = count >> 8;
+  _buffer[2] = count & 0xff;
+  _data = _buffer;
+  return pos;
+}
@@ -0,0 +1,76 @@
+#ifndef STATUS_ENCODER_H
+#define STATUS_ENCODER_H
+
+#include "StatusModel.h"
+#include <ArduinoJson.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest encoded status message
+#ifndef STATUS_BUFFER_SIZE
+#define STATUS_BUFFER_SIZE 1536
+#endif
+
+enum StatusFormat : uint8_t {
+  STATUS_FORMAT_JSON,
+  STATUS_FORMAT_MSGPACK,
+};
+
+// Encodes StatusModel snapshots into one preallocated buffer.
+//
+// JSON, the default, is the whole status, as the backend has always
+// received it. MessagePack sends the whole status once after a reset or
+// resync() (the snapshot, on every connect) and then only the fields the
+// model reports as changed, so the device ID, chip, board and git version
+// go out once per connection. Every MessagePack message also carries
+// "status" and "seq", which counts messages since the snapshot (0), so the
+// receiver can tell it missed a delta.
+//
+// Reports (boot timeline, connection stats) are passed as the members of a
+// JSON object and sent once, in either format.
+//
+// Not thread safe: owned by the one task that publishes the status.
+class StatusEncoder {
+public:
+  StatusEncoder();
+
+  // "json" or "msgpack"; an empty name is JSON. False, and format
+  // unchanged, if name is not recognised.
+  static bool parseFormat(const char *name, StatusFormat &format);
+  static const char *formatName(StatusFormat format);
+  // A change of format resyncs
+  void setFormat(StatusFormat format);
+  StatusFormat getFormat() const { return _format; }
+
+  // The next encode() is a snapshot
+  void resync() { _resync = true; }
+
+  // Encodes status with changed as returned by StatusModel::take() (a
+  // STATUS_CHANGE_RESET resyncs) and the members of reports, which may be
+  // null. Returns the length of the message at data(), 0 if it did not
+  // fit. snapshot is set when the message holds the whole status. JSON
+  // messages are NUL terminated.
+  size_t encode(const StatusSnapshot &status, uint32_t changed,
+                JsonObjectConst reports, bool &snapshot);
+  const uint8_t *data() const { return _data; }
+
+private:
+  size_t _encodeJson(const StatusSnapshot &status, JsonObjectConst reports);
+  size_t _encodeMsgPack(const StatusSnapshot &status, uint32_t fields,
+                        JsonObjectConst reports);
+  bool _writeField(const StatusSnapshot &status, StatusField field,
+                   size_t &pos);
+  bool _writeKey(const char *key, size_t &pos);
+  bool _writeString(const char *text, size_t &pos);
+  bool _writeInt(int64_t value, size_t &pos);
+  bool _writeRaw(const char *text, size_t length, size_t &pos);
+  bool _writeReport(JsonVariantConst value, size_t &pos);
+
+  StatusFormat _format;
+  bool _resync;
+  uint16_t _seq;
+  const uint8_t *_data;
+  uint8_t _buffer[STATUS_BUFFER_SIZE];
+};
+
+#endif // STATUS_ENCODER_H
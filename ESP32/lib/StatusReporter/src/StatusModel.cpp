@@ -0,0 +1,171 @@
+#include "StatusModel.h"
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <thread>
+#endif
+
+// A writer waiting for another one. On one core a spinning higher
+// priority task would never let the other finish, so sleep a tick.
+static void waitForWriter() {
+#ifdef ESP_PLATFORM
+  vTaskDelay(1);
+#else
+  std::this_thread::yield();
+#endif
+}
+
+// Copies text into a field, returns whether the field changed
+template <size_t N> static bool copyField(char (&field)[N], const char *text) {
+  char value[N];
+  strncpy(value, text ? text : "", N - 1);
+  value[N - 1] = '\0';
+  if (strcmp(field, value) == 0) {
+    return false;
+  }
+  memcpy(field, value, N);
+  return true;
+}
+
+const char *statusStateName(StatusState state) {
+  switch (state) {
+  case STATUS_OTA_PROGRESS:
+    return "OTA Progress";
+  case STATUS_OTA_ERROR:
+    return "OTA Error";
+  case STATUS_OTA_SUCCESS:
+    return "OTA Success";
+  default:
+    return "Online";
+  }
+}
+
+StatusModel::StatusModel()
+    : _sequence(0), _changed(0), _writeWaits(0), _readRetries(0),
+      _onChange(nullptr), _onChangeArg(nullptr) {
+  memset(&_status, 0, sizeof(_status));
+}
+
+void StatusModel::setOnChange(ChangeCallback callback, void *arg) {
+  _onChange = callback;
+  _onChangeArg = arg;
+}
+
+void StatusModel::_beginWrite() {
+  for (bool waited = false;; waited = true) {
+    uint32_t sequence = _sequence.load(std::memory_order_relaxed);
+    if (!(sequence & 1) &&
+        _sequence.compare_exchange_weak(sequence, sequence + 1,
+                                        std::memory_order_acquire)) {
+      if (waited) {
+        _writeWaits.fetch_add(1, std::memory_order_relaxed);
+      }
+      break;
+    }
+    waitForWriter();
+  }
+  // The odd sequence is visible before any of the writes below
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void StatusModel::_endWrite(uint32_t changed) {
+  _status.present |= changed & STATUS_FIELDS_MASK;
+  if (changed) {
+    _changed.fetch_or(changed, std::memory_order_relaxed);
+  }
+  _sequence.fetch_add(1, std::memory_order_release);
+  if (changed && _onChange) {
+    _onChange(_onChangeArg);
+  }
+}
+
+uint32_t StatusModel::_setState(StatusState state) {
+  if (_status.state == state) {
+    return 0;
+  }
+  _status.state = state;
+  return STATUS_BIT(STATUS_FIELD_STATE);
+}
+
+void StatusModel::reset(const StatusIdentity &identity, uint32_t reports) {
+  _beginWrite();
+  copyField(_status.id, identity.id);
+  copyField(_status.chip, identity.chip);
+  copyField(_status.board, identity.board);
+  copyField(_status.gitVersion, identity.gitVersion);
+  copyField(_status.configVersion, identity.configVersion);
+  copyField(_status.configSource, identity.configSource);
+  copyField(_status.errorString, nullptr);
+  _status.bootToMqttMs = identity.bootToMqttMs;
+  _status.state = STATUS_ONLINE;
+  _status.progress = 0;
+  _status.error = 0;
+  _status.present = 0;
+  uint32_t changed =
+      STATUS_BIT(STATUS_FIELD_ID) | STATUS_BIT(STATUS_FIELD_CHIP) |
+      STATUS_BIT(STATUS_FIELD_BOARD) | STATUS_BIT(STATUS_FIELD_GIT_VERSION) |
+      STATUS_BIT(STATUS_FIELD_STATE) |
+      STATUS_BIT(STATUS_FIELD_BOOT_TO_MQTT_MS) |
+      STATUS_BIT(STATUS_FIELD_CONFIG_SOURCE) | STATUS_CHANGE_RESET |
+      (reports & STATUS_REPORTS_MASK);
+  if (identity.configVersion) {
+    changed |= STATUS_BIT(STATUS_FIELD_CONFIG_VERSION);
+  }
+  _endWrite(changed);
+}
+
+void StatusModel::setProgress(uint8_t percent) {
+  _beginWrite();
+  uint32_t changed = _setState(STATUS_OTA_PROGRESS);
+  if (_status.progress != percent ||
+      !(_status.present & STATUS_BIT(STATUS_FIELD_PROGRESS))) {
+    _status.progress = percent;
+    changed |= STATUS_BIT(STATUS_FIELD_PROGRESS);
+  }
+  _endWrite(changed);
+}
+
+void StatusModel::setError(int32_t error, const char *errorString) {
+  _beginWrite();
+  uint32_t changed = _setState(STATUS_OTA_ERROR);
+  if (_status.error != error ||
+      !(_status.present & STATUS_BIT(STATUS_FIELD_ERROR))) {
+    _status.error = error;
+    changed |= STATUS_BIT(STATUS_FIELD_ERROR);
+  }
+  if (copyField(_status.errorString, errorString) ||
+      !(_status.present & STATUS_BIT(STATUS_FIELD_ERROR_STRING))) {
+    changed |= STATUS_BIT(STATUS_FIELD_ERROR_STRING);
+  }
+  _endWrite(changed);
+}
+
+void StatusModel::setSuccess() {
+  _beginWrite();
+  _endWrite(_setState(STATUS_OTA_SUCCESS));
+}
+
+void StatusModel::request(uint32_t reports) {
+  _beginWrite();
+  _endWrite(reports & STATUS_REPORTS_MASK);
+}
+
+uint32_t StatusModel::take(StatusSnapshot &out) {
+  // Taken first: a write that lands after this is reported again next time
+  uint32_t changed = _changed.exchange(0, std::memory_order_acquire);
+  for (;;) {
+    uint32_t before = _sequence.load(std::memory_order_acquire);
+    if (!(before & 1)) {
+      memcpy(&out, &_status, sizeof(out));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (_sequence.load(std::memory_order_relaxed) == before) {
+        return changed;
+      }
+    }
+    _readRetries.fetch_add(1, std::memory_order_relaxed);
+    waitForWriter();
+  }
+}
@@ -0,0 +1,120 @@
+#ifndef STATUS_MODEL_H
+#define STATUS_MODEL_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fields of the status message, in the order they are sent
+enum StatusField : uint8_t {
+  STATUS_FIELD_ID,
+  STATUS_FIELD_CHIP,
+  STATUS_FIELD_BOARD,
+  STATUS_FIELD_GIT_VERSION,
+  STATUS_FIELD_STATE, // "status"
+  STATUS_FIELD_CONFIG_VERSION,
+  STATUS_FIELD_BOOT_TO_MQTT_MS,
+  STATUS_FIELD_CONFIG_SOURCE,
+  STATUS_FIELD_PROGRESS,
+  STATUS_FIELD_ERROR,
+  STATUS_FIELD_ERROR_STRING,
+  STATUS_FIELD_COUNT
+};
+
+#define STATUS_BIT(field) (1u << (field))
+#define STATUS_FIELDS_MASK ((1u << STATUS_FIELD_COUNT) - 1)
+// Set with every field by reset(): a new connection, send everything
+#define STATUS_CHANGE_RESET (1u << 16)
+// Up to 8 one-off reports (boot timeline, connection stats) the publisher
+// adds to the next message; their meaning is up to the application
+#define STATUS_REPORT(n) (1u << (24 + (n)))
+#define STATUS_REPORTS_MASK 0xff000000u
+
+enum StatusState : uint8_t {
+  STATUS_ONLINE,
+  STATUS_OTA_PROGRESS,
+  STATUS_OTA_ERROR,
+  STATUS_OTA_SUCCESS,
+};
+
+const char *statusStateName(StatusState state);
+
+// What one connection reports about the device
+struct StatusIdentity {
+  const char *id;
+  const char *chip;
+  const char *board;
+  const char *gitVersion;
+  const char *configVersion; // nullptr when there is no config
+  const char *configSource;
+  uint32_t bootToMqttMs;
+};
+
+// A consistent copy of the status. Strings are truncated to fit.
+struct StatusSnapshot {
+  char id[16];
+  char chip[24];
+  char board[40];
+  char gitVersion[48];
+  char configVersion[32];
+  char configSource[12];
+  char errorString[64];
+  uint32_t bootToMqttMs;
+  int32_t error;
+  uint8_t progress;
+  StatusState state;
+  uint32_t present; // STATUS_BIT of the fields that are set
+};
+
+// The device status, written from any task (MQTT connect, the OTA task,
+// config tasks) and read by one publisher.
+//
+// Writers are serialized by a sequence counter that is odd while a write is
+// in progress (a seqlock); a second writer waits for the first, which only
+// copies a few hundred bytes. take() never blocks a writer: it copies the
+// status and retries if a write overlapped. Every write records which
+// fields it actually changed, so the publisher can skip unchanged updates
+// and send only what changed.
+class StatusModel {
+public:
+  typedef void (*ChangeCallback)(void *arg);
+
+  StatusModel();
+
+  // Called after every write that changed something, on the writer's task.
+  // Set before the writers start.
+  void setOnChange(ChangeCallback callback, void *arg);
+
+  // A new connection: identity set, state online, progress and error
+  // cleared. reports are requested in the same write.
+  void reset(const StatusIdentity &identity, uint32_t reports = 0);
+  void setProgress(uint8_t percent);
+  void setError(int32_t error, const char *errorString);
+  void setSuccess();
+  // Ask for STATUS_REPORT bits to be added to the next message
+  void request(uint32_t reports);
+
+  // Copies the status into out and returns what changed since the last
+  // call (STATUS_BIT, STATUS_CHANGE_RESET and STATUS_REPORT bits), 0 if
+  // nothing did. For a single reader.
+  uint32_t take(StatusSnapshot &out);
+
+  // Writes that had to wait for another writer, reads that were retried
+  uint32_t getWriteWaits() const { return _writeWaits.load(); }
+  uint32_t getReadRetries() const { return _readRetries.load(); }
+
+private:
+  void _beginWrite();
+  void _endWrite(uint32_t changed);
+  uint32_t _setState(StatusState state);
+
+  StatusSnapshot _status;
+  std::atomic<uint32_t> _sequence;
+  std::atomic<uint32_t> _changed;
+  std::atomic<uint32_t> _writeWaits;
+  std::atomic<uint32_t> _readRetries;
+  ChangeCallback _onChange;
+  void *_onChangeArg;
+};
+
+#endif // STATUS_MODEL_H
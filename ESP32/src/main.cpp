@@ -1,18 +1,161 @@
 #include <ArduinoJson.h>
+#include <BootSequencer.h>
 #include <DeviceConfigManager.h>
 #include <MqttController.h>
 #include <NeoPixelBus.h>
 #include <OTA.h>
+#include <StatusEncoder.h>
+#include <StatusModel.h>
+#include <atomic>
 
 #define LED_PIN 8
 #define LED_COUNT 1
 
+// Reset to connected-and-reporting
+#define BOOT_TARGET_MS 2000
+
+#ifndef MQTT_TOPIC_CONFIG
+// Live config pushes: <topic>/<device id>, for a device change and for
+// each device a profile change affects; acks on <topic>/ack
+#define MQTT_TOPIC_CONFIG "iotplatform/esp32/config"
+#endif
+
+#ifndef MQTT_TOPIC_OTA_LEASE
+// OTA download slots: devices send lease requests, renewals and releases
+// to this topic, the coordinator answers on <topic>/<device id>
+#define MQTT_TOPIC_OTA_LEASE "iotplatform/esp32/ota/lease"
+#endif
+
+#ifndef MQTT_TOPIC_OTA_BROADCAST
+// Firmware broadcast: chunks on <topic>/data/<board>, repairs for one device
+// on <topic>/data/<board>/<device id>, gap requests to <topic>/gaps/<board>
+#define MQTT_TOPIC_OTA_BROADCAST "iotplatform/esp32/ota/broadcast"
+#endif
+
+// Status in MessagePack (STATUS_FORMAT "msgpack" in the device profile)
+// goes to <topic>/<device id>; the JSON status stays on MQTT_TOPIC_STATUS
+#define MQTT_TOPIC_STATUS_MSGPACK MQTT_TOPIC_STATUS "/msgpack"
+
+// A pushed config that changes the broker settings is undone if MQTT does
+// not connect with it within this time
+#define CONFIG_PUSH_CONNECT_TIMEOUT_MS 30000
+
 NeoPixelBus<NeoGrbFeature, Neo800KbpsMethod> strip(LED_COUNT, LED_PIN);
 MqttController mqttController;
 OTA myOta;
 DeviceConfigManager configManager;
+BootSequencer boot;
+
+// Written by any task, sent by statusTask alone
+StatusModel statusModel;
+StatusEncoder statusEncoder;
+TaskHandle_t statusTaskHandle;
+String statusMsgPackTopic;
+// Set by the config tasks, applied by statusTask
+std::atomic<StatusFormat> statusFormat(STATUS_FORMAT_JSON);
+
+// Reports added once to the next status message
+#define REPORT_CONNECT_STATS STATUS_REPORT(0)
+#define REPORT_BOOT_TIMELINE STATUS_REPORT(1)
+
+// Where the MQTT settings used at boot came from
+const char *bootConfigSource = "defaults";
+
+// Pushed configs are applied on their own task, not the MQTT one, since
+// applying one may reconnect. A nullptr message means the reconnect timed
+// out.
+QueueHandle_t configPushQueue;
+TimerHandle_t configPushTimer;
+// Ack of a push that changed the broker settings, sent once MQTT is back
+SemaphoreHandle_t configAckLock;
+String pendingConfigAck;
+String pendingConfigVersion;
+
+// Objects of the reports asked for, gathered on the status task
+void buildReports(uint32_t changed, JsonObject reports) {
+  if (changed & REPORT_CONNECT_STATS) {
+    mqttController.getPublishQueue().toJson(
+        reports["publish"].to<JsonObject>());
+    mqttController.offlineLogToJson(reports["offline_log"].to<JsonObject>());
+    mqttController.getCommandDispatcher().toJson(
+        reports["commands"].to<JsonObject>());
+    mqttController.reconnectToJson(reports["reconnect"].to<JsonObject>());
+  }
+  if (changed & REPORT_BOOT_TIMELINE) {
+    boot.toJson(reports["boot"].to<JsonObject>());
+    configManager.getWiFiConnect().toJson(reports["wifi"].to<JsonObject>());
+  }
+}
+
+// Sends what changed in the status, in the format the device profile asks
+// for
+void publishStatus(const StatusSnapshot &status, uint32_t changed) {
+  JsonDocument reports;
+  if (changed & STATUS_REPORTS_MASK) {
+    buildReports(changed, reports.to<JsonObject>());
+  }
+  bool snapshot = false;
+  size_t length = statusEncoder.encode(status, changed,
+                                       reports.as<JsonObjectConst>(), snapshot);
+  if (length == 0) {
+    Serial.println("[Main] Status message does not fit the buffer");
+    return;
+  }
+
+  MqttPriority priority = MQTT_PRIORITY_STATUS;
+  uint8_t qos = 0;
+  if (status.state == STATUS_OTA_ERROR &&
+      (changed & STATUS_BIT(STATUS_FIELD_STATE))) {
+    priority = MQTT_PRIORITY_ALARM;
+    qos = 1;
+  } else if (status.state == STATUS_OTA_PROGRESS ||
+             !(changed & ~REPORT_BOOT_TIMELINE)) {
+    priority = MQTT_PRIORITY_TELEMETRY;
+  }
+  if (statusEncoder.getFormat() == STATUS_FORMAT_MSGPACK) {
+    // A delta means nothing to a later subscriber, only the snapshot is
+    // retained
+    mqttController.sendMessage(statusMsgPackTopic.c_str(),
+                               statusEncoder.data(), length, snapshot,
+                               priority, qos);
+  } else {
+    mqttController.sendMessage(
+        MQTT_TOPIC_STATUS,
+        reinterpret_cast<const char *>(statusEncoder.data()), true,
+        priority, qos);
+  }
+}
+
+void onStatusChange(void *arg) { xTaskNotifyGive(statusTaskHandle); }
+
+// The only task that encodes and sends the status. Updates that arrive
+// while it is busy are sent together, as one message.
+void statusTask(void *pvParameters) {
+  static StatusSnapshot status;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    statusEncoder.setFormat(statusFormat.load());
+    uint32_t changed = statusModel.take(status);
+    if (!changed) {
+      continue;
+    }
+    publishStatus(status, changed);
+    if (changed & STATUS_CHANGE_RESET) {
+      boot.mark(BOOT_STAGE_REPORTED);
+    }
+  }
+}
 
-JsonDocument device_info_JSON;
+void applyStatusFormat() {
+  String name = configManager.getStatusFormat();
+  StatusFormat format;
+  if (!StatusEncoder::parseFormat(name.c_str(), format)) {
+    Serial.printf("[Main] Unknown status format %s, using JSON\n",
+                  name.c_str());
+    format = STATUS_FORMAT_JSON;
+  }
+  statusFormat.store(format);
+}
 
 // Custom validation function - remains the same
 bool customValidation() {
@@ -27,51 +170,282 @@ bool customValidation() {
 }
 
 void onMqttConnect(bool sessionPresent) {
-  device_info_JSON.clear();
-  device_info_JSON["id"] = configManager.getDeviceId();
-  device_info_JSON["chip"] = configManager.getChipType();
-  device_info_JSON["board"] = configManager.getBoardType();
-  device_info_JSON["git_version"] = configManager.getGitVersion();
-  device_info_JSON["status"] = "Online";
-  if (configManager.isConfigLoaded()) {
-    device_info_JSON["config_version"] = configManager.getConfigVersion();
+  if (boot.mark(BOOT_STAGE_MQTT_CONNECTED)) {
+    Serial.printf("[Main] Boot to MQTT connected: %u ms (config from %s)\n",
+                  boot.at(BOOT_STAGE_MQTT_CONNECTED), bootConfigSource);
+  }
+  String id = configManager.getDeviceId();
+  String chip = configManager.getChipType();
+  String board = configManager.getBoardType();
+  String gitVersion = configManager.getGitVersion();
+  String configVersion = configManager.getConfigVersion();
+  StatusIdentity identity = {
+      id.c_str(),
+      chip.c_str(),
+      board.c_str(),
+      gitVersion.c_str(),
+      configManager.isConfigLoaded() ? configVersion.c_str() : nullptr,
+      bootConfigSource,
+      boot.at(BOOT_STAGE_MQTT_CONNECTED)};
+  uint32_t reports = 0;
+  if (boot.reached(BOOT_STAGE_REPORTED)) {
+    // What the outage did to the publish queue
+    mqttController.getPublishQueue().printStats();
+    mqttController.printOfflineLogStats();
+    mqttController.printReconnectStats();
+    reports = REPORT_CONNECT_STATS;
+  }
+  // Whole status first on every connection
+  statusModel.reset(identity, reports);
+
+  xSemaphoreTake(configAckLock, portMAX_DELAY);
+  String ack = pendingConfigAck;
+  pendingConfigAck = "";
+  xSemaphoreGive(configAckLock);
+  if (!ack.isEmpty()) {
+    xTimerStop(configPushTimer, 0);
+    mqttController.sendMessage(MQTT_TOPIC_CONFIG "/ack", ack.c_str(), false);
   }
-  mqttController.sendMessage(MQTT_TOPIC_STATUS,
-                             device_info_JSON.as<String>().c_str());
 }
 
-void onOtaProgress(unsigned int progress, unsigned int total) {
-  // To avoid spamming serial, only print every 10%
-  static int last_percent = -1;
-  int percent = (progress * 100) / total;
+// Sent once per boot, when MQTT is reporting and the config check is done
+void publishBootTimeline() {
+  uint32_t reported = boot.at(BOOT_STAGE_REPORTED);
+  Serial.printf("[Main] Connected and reporting in %u ms (target %u ms)%s\n",
+                reported, BOOT_TARGET_MS,
+                reported > BOOT_TARGET_MS ? ", SLOW" : "");
+  boot.printTimeline();
+  configManager.getWiFiConnect().printStats();
+  statusModel.request(REPORT_BOOT_TIMELINE);
+}
+
+void onWiFiGotIp(WiFiEvent_t event, WiFiEventInfo_t info) {
+  Serial.printf("[Main] WiFi connected, IP address: %s\n",
+                WiFi.localIP().toString().c_str());
+  if (!boot.mark(BOOT_STAGE_WIFI_CONNECTED) &&
+      boot.reached(BOOT_STAGE_CONFIG_READY)) {
+    // Back after a drop; MQTT stops retrying while WiFi is down
+    mqttController.connectToMqtt();
+  }
+}
+
+void applyMqttConfig() {
+  Serial.println("[Main] Updating MQTT configuration...");
+  Serial.printf("[Main] MQTT Host: %s\n", configManager.getMqttHost().c_str());
+  Serial.printf("[Main] MQTT Port: %d\n", configManager.getMqttPort());
+  Serial.printf("[Main] MQTT User: %s\n", configManager.getMqttUser().c_str());
+  Serial.printf("[Main] MQTT Password: %s\n",
+                configManager.getMqttPassword().c_str());
+  // Until the config is ready the boot sequence makes the first connect
+  mqttController.updateConfig(
+      configManager.getMqttHost(), configManager.getMqttPort(),
+      configManager.getMqttUser(), configManager.getMqttPassword(),
+      boot.reached(BOOT_STAGE_CONFIG_READY));
+}
 
-  if (percent > last_percent) {
-    Serial.printf("OTA Progress: %d%%\n", percent);
-    device_info_JSON["status"] = "OTA Progress";
-    device_info_JSON["progress"] = percent;
-    mqttController.sendMessage(MQTT_TOPIC_STATUS,
-                               device_info_JSON.as<String>().c_str());
-    last_percent = percent;
-    if (last_percent >= 100)
-      last_percent = -1; // Reset for next time
+// Broker address and credentials, to tell whether a new config needs a
+// reconnect
+String mqttSettings() {
+  return configManager.getMqttHost() + ":" +
+         String(configManager.getMqttPort()) + " " +
+         configManager.getMqttUser() + ":" + configManager.getMqttPassword();
+}
+
+void useLoadedConfig() {
+  // Set custom client ID based on device ID
+  mqttController.setClientId("ESP32-" + configManager.getDeviceId());
+  Serial.printf("[Main] Set MQTT client ID to: %s\n",
+                configManager.getDeviceId().c_str());
+  applyStatusFormat();
+  applyMqttConfig();
+}
+
+// Started once WiFi is up. Without a cached config this is the first fetch
+// and MQTT waits for it; with one, MQTT is already connecting and the
+// server is only asked whether the cached version is still current.
+void configTask(void *pvParameters) {
+  bool fromCache = configManager.isConfigFromCache();
+  String settings = mqttSettings();
+  bool loaded = false;
+  for (int attempt = 1; attempt <= 3 && !loaded; attempt++) {
+    loaded = configManager.loadDeviceConfig();
+    if (loaded) {
+      if (!fromCache) {
+        Serial.println("[Main] Configuration loaded successfully");
+        bootConfigSource = "server";
+        useLoadedConfig();
+      } else if (configManager.wasConfigChanged()) {
+        Serial.printf("[Main] Configuration changed to version %s\n",
+                      configManager.getConfigVersion().c_str());
+        applyStatusFormat();
+        if (mqttSettings() != settings) {
+          applyMqttConfig();
+        }
+      } else {
+        Serial.println("[Main] Cached configuration is up to date");
+      }
+    } else {
+      Serial.printf("[Main] Configuration load attempt %d failed\n", attempt);
+      if (attempt < 3) {
+        vTaskDelay(pdMS_TO_TICKS(2000 * attempt));
+      }
+    }
   }
+  if (!loaded && !fromCache) {
+    Serial.println(
+        "[Main] Failed to load configuration after 3 attempts, using defaults");
+  }
+  boot.mark(BOOT_STAGE_CONFIG_READY);
+  boot.mark(BOOT_STAGE_CONFIG_CHECKED);
+  vTaskDelete(NULL);
+}
+
+String configAck(const char *result, const ConfigPushResult &push,
+                 bool reconnected) {
+  JsonDocument ack;
+  ack["id"] = configManager.getDeviceId();
+  ack["config_version"] = configManager.getConfigVersion();
+  ack["result"] = result;
+  JsonArray changed = ack["changed"].to<JsonArray>();
+  for (size_t i = 0; i < DEVICE_CONFIG_FIELD_COUNT; i++) {
+    if (push.changed & (1u << i)) {
+      changed.add(DEVICE_CONFIG_FIELDS[i].key);
+    }
+  }
+  ack["reconnected"] = reconnected;
+  if (push.status == CONFIG_PUSH_INVALID) {
+    ack["error"] = configParseStatusString(push.error);
+    if (push.field) {
+      ack["field"] = push.field;
+    }
+  }
+  return ack.as<String>();
+}
+
+void sendConfigAck(const String &ack) {
+  mqttController.sendMessage(MQTT_TOPIC_CONFIG "/ack", ack.c_str(), false);
+}
+
+// OTA commands for this board, on the command worker task
+void onOtaCommand(const MqttCommand &command, JsonObject reply) {
+  OTACommandResult result =
+      OTA::otaCommand(command.topic, command.payload, command.length);
+  reply["result"] = OTA::commandResultName(result);
+}
+
+// Lease coordinator replies, called on the MQTT task
+void onOtaLease(const char *topic, const char *payload, size_t length) {
+  myOta.onLeaseMessage(payload, length);
+}
+
+// Firmware broadcast chunks, called on the MQTT task
+void onOtaChunk(const char *topic, const char *payload, size_t length) {
+  myOta.onBroadcastChunk(reinterpret_cast<const uint8_t *>(payload), length);
+}
+
+// Config pushes for this chip or this device, called on the MQTT task
+void onConfigMessage(const char *topic, const char *payload, size_t length) {
+  String *message = new String(payload, length);
+  if (xQueueSend(configPushQueue, &message, 0) != pdTRUE) {
+    Serial.println("[Main] Config push queue full, dropping message");
+    delete message;
+  }
+}
+
+void onConfigPushTimeout(TimerHandle_t timer) {
+  String *timeout = nullptr;
+  xQueueSend(configPushQueue, &timeout, 0);
+}
+
+void handleConfigPush(const String &message) {
+  String settings = mqttSettings();
+  ConfigPushResult push =
+      configManager.applyConfigPush(message.c_str(), message.length());
+  applyStatusFormat();
+  switch (push.status) {
+  case CONFIG_PUSH_APPLIED:
+    if (mqttSettings() != settings) {
+      // Acked from onMqttConnect, once the new settings are proven
+      xSemaphoreTake(configAckLock, portMAX_DELAY);
+      pendingConfigAck = configAck("applied", push, true);
+      pendingConfigVersion = configManager.getConfigVersion();
+      xSemaphoreGive(configAckLock);
+      xTimerReset(configPushTimer, 0);
+      applyMqttConfig();
+    } else {
+      sendConfigAck(configAck("applied", push, false));
+    }
+    break;
+  case CONFIG_PUSH_STALE:
+    // A delta against a version we do not have: fetch the whole config
+    if (configManager.loadDeviceConfig() && mqttSettings() != settings) {
+      applyMqttConfig();
+      // The status message on the new connection carries the version
+      break;
+    }
+    sendConfigAck(configAck("refetched", push, false));
+    break;
+  case CONFIG_PUSH_CURRENT:
+    // Retained pushes come again on every connect
+    break;
+  case CONFIG_PUSH_INVALID:
+    sendConfigAck(configAck("rejected", push, false));
+    break;
+  }
+}
+
+void configPushTask(void *pvParameters) {
+  for (;;) {
+    String *message = nullptr;
+    if (xQueueReceive(configPushQueue, &message, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    if (message) {
+      handleConfigPush(*message);
+      delete message;
+      continue;
+    }
+
+    // MQTT did not come back with the pushed settings
+    xSemaphoreTake(configAckLock, portMAX_DELAY);
+    bool waiting = !pendingConfigAck.isEmpty();
+    String rejectedVersion = pendingConfigVersion;
+    pendingConfigAck = "";
+    xSemaphoreGive(configAckLock);
+    if (waiting && configManager.revertConfigPush()) {
+      applyStatusFormat();
+      Serial.printf("[Main] No MQTT connection with config version %s, "
+                    "reverting\n",
+                    rejectedVersion.c_str());
+      JsonDocument ack;
+      ack["id"] = configManager.getDeviceId();
+      ack["config_version"] = configManager.getConfigVersion();
+      ack["result"] = "reverted";
+      ack["rejected_version"] = rejectedVersion;
+      xSemaphoreTake(configAckLock, portMAX_DELAY);
+      pendingConfigAck = ack.as<String>();
+      xSemaphoreGive(configAckLock);
+      applyMqttConfig();
+    }
+  }
+}
+
+// Sampled by the OTA progress timer, not called from the download loop
+void onOtaProgress(unsigned int progress, unsigned int total) {
+  int percent = (uint64_t)progress * 100 / total;
+  Serial.printf("OTA Progress: %d%%\n", percent);
+  statusModel.setProgress(percent);
 }
 
 void onOtaError(int error, const char *errorString) {
   Serial.printf("OTA Final Error: %d, %s\n", error, errorString);
-  device_info_JSON["status"] = "OTA Error";
-  device_info_JSON["error"] = error;
-  device_info_JSON["errorString"] = errorString;
-  mqttController.sendMessage(MQTT_TOPIC_STATUS,
-                             device_info_JSON.as<String>().c_str());
+  statusModel.setError(error, errorString);
   // Maybe blink LED red rapidly to indicate permanent failure
 }
 
 void onOtaSuccess(const char *msg) {
   Serial.printf("OTA Success: %s\n", msg);
-  device_info_JSON["status"] = "OTA Success";
-  mqttController.sendMessage(MQTT_TOPIC_STATUS,
-                             device_info_JSON.as<String>().c_str());
+  statusModel.setSuccess();
   // Maybe solid green LED before reboot
 }
 
@@ -84,58 +458,65 @@ void onOtaRetry(int attempt, int maxRetries, const char *errorString,
   // You could implement a visual indicator, like a yellow blink
 }
 
+// Nothing in setup() waits on the network: it registers what should happen
+// when each boot stage is reached and returns. WiFi and MQTT events drive
+// the rest, so the config fetch, MQTT connect and OTA resume overlap.
 void setup() {
   Serial.begin(115200);
-  delay(1000);
+  boot.mark(BOOT_STAGE_SETUP);
   strip.Begin();
   strip.Show();
 
   Serial.println("[Main] Starting device initialization...");
 
-  // Load device configuration (includes WiFi connection)
-  Serial.println("[Main] Loading device configuration...");
-  bool configLoaded = false;
+  // Initialize MQTT controller; it connects once WiFi and a config are ready.
+  // Status from long outages is kept in flash and sent afterwards.
+  mqttController.enableOfflineLog();
+  mqttController.onCommand(MQTT_TOPIC_COMMAND "/" PLATFORMIO_BOARD_NAME,
+                           onOtaCommand);
+  mqttController.onMessage(MQTT_TOPIC_CONFIG "/+", onConfigMessage);
+  mqttController.onMessage(MQTT_TOPIC_OTA_LEASE "/+", onOtaLease);
+  mqttController.onMessage(
+      MQTT_TOPIC_OTA_BROADCAST "/data/" PLATFORMIO_BOARD_NAME "/#", onOtaChunk);
+  mqttController.Begin();
 
-  // Try to load configuration multiple times
-  for (int i = 0; i < 3; i++) {
-    if (configManager.loadDeviceConfig()) {
-      Serial.println("[Main] Configuration loaded successfully");
-      configLoaded = true;
-      break;
-    } else {
-      Serial.printf(
-          "[Main] Configuration load attempt %d failed, retrying...\n", i + 1);
-      delay(2000);
-    }
-  }
+  mqttController.setOnMqttConnect(onMqttConnect);
 
-  if (!configLoaded) {
-    Serial.println(
-        "[Main] Failed to load configuration after 3 attempts, using defaults");
+  statusMsgPackTopic =
+      String(MQTT_TOPIC_STATUS_MSGPACK "/") + configManager.getDeviceId();
+  xTaskCreate(statusTask, "status", 4096, NULL, 1, &statusTaskHandle);
+  statusModel.setOnChange(onStatusChange, nullptr);
+
+  // Live config: the server pushes changed keys to this device's own topic,
+  // its own edits and its share of a profile change alike
+  configPushQueue = xQueueCreate(4, sizeof(String *));
+  configAckLock = xSemaphoreCreateMutex();
+  configPushTimer =
+      xTimerCreate("configPush", pdMS_TO_TICKS(CONFIG_PUSH_CONNECT_TIMEOUT_MS),
+                   pdFALSE, NULL, onConfigPushTimeout);
+  xTaskCreate(configPushTask, "configPush", 6144, NULL, 1, NULL);
+  mqttController.addSubscription(String(MQTT_TOPIC_CONFIG "/") +
+                                 configManager.getDeviceId());
+
+  // Start from the config saved by an earlier boot, if any
+  if (configManager.loadCachedConfig()) {
+    bootConfigSource = "cache";
+    useLoadedConfig();
+    boot.mark(BOOT_STAGE_CONFIG_READY);
   }
-  // Update MQTT configuration if config was loaded
-  if (configLoaded) {
-    Serial.println("[Main] Updating MQTT configuration...");
-    Serial.printf("[Main] MQTT Host: %s\n", configManager.getMqttHost());
-    Serial.printf("[Main] MQTT Port: %d\n", configManager.getMqttPort());
-    Serial.printf("[Main] MQTT User: %s\n", configManager.getMqttUser());
-    Serial.printf("[Main] MQTT Password: %s\n",
-                  configManager.getMqttPassword());
-    mqttController.updateConfig(
-        configManager.getMqttHost(), configManager.getMqttPort(),
-        configManager.getMqttUser(), configManager.getMqttPassword());
-
-    // Set custom client ID based on device ID
-    mqttController.setClientId("ESP32-" + configManager.getDeviceId());
-    Serial.printf("[Main] Set MQTT client ID to: %s\n",
-                  configManager.getDeviceId());
-  }
-
-  // Initialize MQTT controller
-  mqttController.Begin();
 
-  mqttController.setOnMqttConnect(onMqttConnect);
-  mqttController.setOnMqttMessage(OTA::otaCommand);
+  boot.when(BootSequencer::bit(BOOT_STAGE_WIFI_CONNECTED) |
+                BootSequencer::bit(BOOT_STAGE_CONFIG_READY),
+            [] { mqttController.connectToMqtt(); });
+  boot.when(BootSequencer::bit(BOOT_STAGE_WIFI_CONNECTED), [] {
+    xTaskCreate(configTask, "configTask", 8192, NULL, 1, NULL);
+  });
+  // Continue an update that was cut short by a reset or power loss
+  boot.when(BootSequencer::bit(BOOT_STAGE_WIFI_CONNECTED),
+            [] { myOta.resumeInterruptedUpdate(); });
+  boot.when(BootSequencer::bit(BOOT_STAGE_REPORTED) |
+                BootSequencer::bit(BOOT_STAGE_CONFIG_CHECKED),
+            publishBootTimeline);
 
   myOta.printFirmwareInfo();
 
@@ -149,9 +530,53 @@ void setup() {
   // Configure the retry policy (e.g., 5 attempts, start with 5s delay)
   myOta.setRetryPolicy(5, 5000);
 
+  // Overlap network reads with flash writes (4 x 4 KB ring buffer)
+  myOta.setPipeline(true, 4, 4096);
+
+  // Report progress at most once a second, every 1% it advanced
+  myOta.setProgressReporting(OTA_PROGRESS_INTERVAL_MS, OTA_PROGRESS_STEP);
+
+  // A command reaches the whole board at once: spread the devices over the
+  // jitter window, then download only with a slot from the lease
+  // coordinator (or without one, if no coordinator answers)
+  myOta.setDeviceId(configManager.getDeviceId());
+  myOta.setAdmission(OTA_ADMISSION_JITTER_MS, [](const char *payload) {
+    mqttController.sendMessage(MQTT_TOPIC_OTA_LEASE, payload, false,
+                               MQTT_PRIORITY_STATUS, 1);
+  });
+  mqttController.addSubscription(String(MQTT_TOPIC_OTA_LEASE "/") +
+                                 configManager.getDeviceId());
+
+  // Commands may offer the image as chunks published once for the board.
+  // Chunks are QoS 0: a lost one is a gap the device asks for again.
+  myOta.setBroadcast([](const char *payload) {
+    mqttController.sendMessage(
+        MQTT_TOPIC_OTA_BROADCAST "/gaps/" PLATFORMIO_BOARD_NAME, payload,
+        false, MQTT_PRIORITY_STATUS, 0);
+  });
+  mqttController.addSubscription(
+      MQTT_TOPIC_OTA_BROADCAST "/data/" PLATFORMIO_BOARD_NAME, 0);
+  mqttController.addSubscription(
+      String(MQTT_TOPIC_OTA_BROADCAST "/data/" PLATFORMIO_BOARD_NAME "/") +
+          configManager.getDeviceId(),
+      0);
+
+  // Serve the running firmware to devices on the same network and take
+  // updates from them first, so a site downloads each image about once
+  myOta.setPeerSharing();
+
+  // Save download progress to NVS every 16 sectors (64 KB)
+  myOta.setCheckpointInterval(16);
+
+  // Validation runs in the background and passes once WiFi is up
   myOta.enableRollbackProtection(true);
   myOta.checkAndValidateApp();
 
+  // Last, so every action above is registered before the first event
+  WiFi.onEvent(onWiFiGotIp, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  configManager.beginWiFi();
+
+  boot.mark(BOOT_STAGE_SETUP_DONE);
   Serial.println("Setup completed.");
 }
 
@@ -0,0 +1,123 @@
+"""
+Building and skipping for the host tests
+
+Each host test builds a driver from tools/ with the library sources it
+checks and runs it on the development machine. Without a C++ compiler,
+or ArduinoJson or miniz for the tests that need them, a test is skipped:
+it prints SKIP and exits with status 77, which automake and ctest
+(SKIP_RETURN_CODE) report as skipped rather than passed.
+
+    binary = host_tool.build(workdir, "mqtt_router_host",
+                             [host_tool.lib_src("MqttController",
+                                                "MqttTopicRouter.cpp")])
+    if not binary:
+        return None  # __main__ calls host_tool.skip()
+"""
+
+import glob
+import os
+import shutil
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ESP32 = os.path.join(HERE, "..")
+TOOLS = os.path.join(ESP32, "tools")
+LIB = os.path.join(ESP32, "lib")
+
+SKIP_EXIT = 77  # automake convention for a skipped test
+
+
+def lib_src(library, *names):
+    """Path to lib/<library>/src, or to a file in it"""
+    return os.path.join(LIB, library, "src", *names)
+
+
+def find_compiler():
+    return shutil.which("c++") or shutil.which("g++") or shutil.which("clang++")
+
+
+def find_arduinojson():
+    """ArduinoJson include folder from $ARDUINOJSON_DIR or a PlatformIO build"""
+    candidates = []
+    if os.environ.get("ARDUINOJSON_DIR"):
+        candidates.append(os.environ["ARDUINOJSON_DIR"])
+    candidates += sorted(glob.glob(
+        os.path.join(ESP32, ".pio", "libdeps", "*", "ArduinoJson")))
+    for candidate in candidates:
+        for include in (os.path.join(candidate, "src"), candidate):
+            if os.path.isfile(os.path.join(include, "ArduinoJson.h")):
+                return include
+    return None
+
+
+def find_miniz():
+    """Folder with the single-file miniz (miniz.c and miniz.h) from
+    $MINIZ_DIR, the decompressor the device has in ROM"""
+    folder = os.environ.get("MINIZ_DIR")
+    if folder and all(os.path.isfile(os.path.join(folder, name))
+                      for name in ("miniz.c", "miniz.h")):
+        return folder
+    return None
+
+
+def build_inflater(workdir):
+    """tools/inflate_host with lib/OTA/src/OTAInflater.cpp, or None without
+    a compiler or miniz"""
+    miniz = find_miniz()
+    if not miniz:
+        print("miniz not found (set MINIZ_DIR to a folder with the "
+              "single-file miniz.c and miniz.h)")
+        return None
+    return build(workdir, "inflate_host", [
+        lib_src("OTA", "OTAInflater.cpp"),
+        os.path.join(miniz, "miniz.c"),
+    ])
+
+
+def build(workdir, name, sources, includes=(), std="c++11", threads=False):
+    """Builds tools/<name>.cpp with sources into workdir.
+
+    The folders of the sources are on the include path, with includes.
+    C sources (.c) are compiled as C. Returns the binary, or None without
+    a compiler.
+    """
+    compiler = find_compiler()
+    if not compiler:
+        print("No C++ compiler found, skipping host build")
+        return None
+    folders = []
+    for folder in list(includes) + [os.path.dirname(s) for s in sources]:
+        if folder not in folders:
+            folders.append(folder)
+    flags = []
+    for folder in folders:
+        flags += ["-I", folder]
+    objects = []
+    for source in sources:
+        if source.endswith(".c"):
+            c_compiler = shutil.which("cc") or shutil.which("gcc") or \
+                shutil.which("clang")
+            if not c_compiler:
+                print("No C compiler found, skipping host build")
+                return None
+            obj = os.path.join(workdir, os.path.basename(source) + ".o")
+            subprocess.check_call([c_compiler, "-O2", *flags, "-c", source,
+                                   "-o", obj])
+            objects.append(obj)
+        else:
+            objects.append(source)
+    binary = os.path.join(workdir, name)
+    command = [compiler, f"-std={std}", "-O2"]
+    if threads:
+        command.append("-pthread")
+    command += flags
+    command += [os.path.join(TOOLS, name + ".cpp"), *objects, "-o", binary]
+    subprocess.check_call(command)
+    return binary
+
+
+def skip(name):
+    """Ends a test that could not run, reporting it as skipped"""
+    print(f"\nSKIP: {name} did not run")
+    sys.exit(SKIP_EXIT)
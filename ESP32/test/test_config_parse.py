@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+"""
+Host test for the streaming config response parser
+
+Builds tools/config_parse_host.cpp with lib/DeviceConfigManager/src/
+DeviceConfigParser.cpp and ArduinoJson, then parses every response in
+config_responses/. Checks the outcome of each one (field values for the
+valid ones, status and offending key for the others) and reports the peak
+memory and parse time of the filtered parse against the previous
+String + unfiltered JsonDocument code. Then applies the config pushes in
+config_pushes/ in order, as MQTT would deliver them, and checks what each
+one changed.
+
+ArduinoJson is taken from $ARDUINOJSON_DIR, or from the PlatformIO library
+folder after a device build (.pio/libdeps/<env>/ArduinoJson). Without it,
+or without a C++ compiler, the test is skipped: it prints SKIP and exits
+with status 77, which automake and ctest (SKIP_RETURN_CODE) report as
+skipped rather than passed.
+
+    python test_config_parse.py [--iterations N]
+"""
+
+import argparse
+import glob
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import host_tool
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+CORPUS = os.path.join(HERE, "config_responses")
+PUSHES = os.path.join(HERE, "config_pushes")
+
+# file -> (status, offending key or "-")
+EXPECTED = {
+    "ok_typical.json": ("ok", "-"),
+    "ok_minimal.json": ("ok", "-"),
+    "ok_pretty_escaped.json": ("ok", "-"),
+    "ok_large.json": ("ok", "-"),
+    "err_missing_host.json": ("missing_field", "MQTT_HOST"),
+    "err_port_string.json": ("wrong_type", "MQTT_PORT"),
+    "err_host_too_long.json": ("too_long", "MQTT_HOST"),
+    "err_no_config.json": ("missing_field", "config"),
+    "err_truncated.json": ("invalid_json", "-"),
+    "err_error_response.json": ("missing_field", "version"),
+}
+
+EXPECTED_FIELDS = {
+    "ok_typical.json": {"version": "v20250712-0931",
+                        "host": "mqtt.example.com", "port": "8883",
+                        "user": "esp32-device", "password": "s3cr3t-pa55"},
+    "ok_minimal.json": {"version": "1", "host": "192.168.1.10",
+                        "port": "1883", "user": "", "password": ""},
+    "ok_pretty_escaped.json": {"version": "7", "host": "broker.local",
+                               "port": "1883", "user": "",
+                               "password": 'päss"w\\ord'},
+    "ok_large.json": {"version": "v20250712-0931",
+                      "host": "mqtt.example.com", "port": "8883",
+                      "user": "esp32-device", "password": "s3cr3t-pa55"},
+}
+
+
+# push file -> (result, changed keys, reconnect, port, user) after applying it
+EXPECTED_PUSHES = {
+    "01_port.json": ("applied", "MQTT_PORT", "1", "8883", "misaka"),
+    "02_same_again.json": ("current", "-", "0", "8883", "misaka"),
+    "03_unknown_keys.json": ("applied", "-", "0", "8883", "misaka"),
+    "04_stale_base.json": ("stale", "-", "0", "8883", "misaka"),
+    "05_clear_user.json": ("applied", "MQTT_USER,MQTT_PASSWORD", "1", "8883",
+                           ""),
+    "06_null_host.json": ("rejected", "-", "0", "8883", ""),
+    "07_port_string.json": ("rejected", "-", "0", "8883", ""),
+    "08_older.json": ("current", "-", "0", "8883", ""),
+    "09_truncated.json": ("rejected", "-", "0", "8883", ""),
+}
+
+
+def build_host_tool(workdir, arduinojson):
+    return host_tool.build(workdir, "config_parse_host", [
+        host_tool.lib_src("DeviceConfigManager", "DeviceConfigParser.cpp"),
+    ], includes=[arduinojson])
+
+
+def parse_output(stdout):
+    """file -> dict of key=value pairs, values of a valid config merged in"""
+    results = {}
+    current = None
+    for line in stdout.splitlines():
+        if line.startswith("  "):
+            key, _, value = line[2:].partition("=")
+            current[key] = value
+            continue
+        name, *pairs = line.split(" ")
+        current = dict(pair.split("=", 1) for pair in pairs)
+        results[name] = current
+    return results
+
+
+def test_corpus(binary, iterations):
+    files = sorted(glob.glob(os.path.join(CORPUS, "*.json")))
+    output = subprocess.run([binary, "--iterations", str(iterations), *files],
+                            capture_output=True, text=True, check=True).stdout
+    results = parse_output(output)
+
+    ok = True
+    print(f"{'response':<26}{'bytes':>7}  {'status':<14}"
+          f"{'peak':>7}{'us':>8}  {'old peak':>8}{'old us':>8}")
+    for path in files:
+        name = os.path.basename(path)
+        result = results.get(name)
+        if result is None:
+            print(f"ERROR: no result for {name}")
+            ok = False
+            continue
+        print(f"{name:<26}{os.path.getsize(path):>7}  {result['status']:<14}"
+              f"{result['stream_peak']:>7}{float(result['stream_us']):>8.1f}"
+              f"  {result['string_peak']:>8}"
+              f"{float(result['string_us']):>8.1f}")
+
+        expected = EXPECTED.get(name)
+        if expected and (result["status"], result["field"]) != expected:
+            print(f"ERROR: {name}: expected {expected}, got "
+                  f"({result['status']}, {result['field']})")
+            ok = False
+        for key, value in EXPECTED_FIELDS.get(name, {}).items():
+            if result.get(key) != value:
+                print(f"ERROR: {name}: {key} is {result.get(key)!r}, "
+                      f"expected {value!r}")
+                ok = False
+        if result["status"] == "ok":
+            if result["string_status"] != "ok":
+                print(f"ERROR: {name}: previous parser rejected it")
+                ok = False
+            if int(result["stream_peak"]) >= int(result["string_peak"]):
+                print(f"ERROR: {name}: filtered parse used more memory")
+                ok = False
+    return ok
+
+
+def test_pushes(binary):
+    files = sorted(glob.glob(os.path.join(PUSHES, "*.json")))
+    output = subprocess.run([binary, "--push", *files], capture_output=True,
+                            text=True, check=True).stdout
+    results = parse_output(output)
+
+    ok = True
+    for name, expected in EXPECTED_PUSHES.items():
+        result = results.get(name)
+        if result is None:
+            print(f"ERROR: no result for {name}")
+            ok = False
+            continue
+        got = (result["push"], result["changed"], result["reconnect"],
+               result["port"], result["user"])
+        print(f"{name:<24}{result['push']:<10}{result['changed']:<26}"
+              f"version {result['version']}")
+        if got != expected:
+            print(f"ERROR: {name}: expected {expected}, got {got}")
+            ok = False
+    # A rejected push must not leave anything behind
+    final = results.get("09_truncated.json", {})
+    if final.get("host") != "broker.local" or \
+            final.get("version") != "20250704T090000":
+        print(f"ERROR: unexpected final config {final}")
+        ok = False
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--iterations", type=int, default=2000)
+    args = parser.parse_args()
+
+    arduinojson = host_tool.find_arduinojson()
+    if not arduinojson:
+        print("ArduinoJson not found (set ARDUINOJSON_DIR or run a "
+              "PlatformIO build), skipping config parse test")
+        return None
+
+    workdir = tempfile.mkdtemp(prefix="config_parse_")
+    try:
+        binary = build_host_tool(workdir, arduinojson)
+        if not binary:
+            return None
+        print("Config Parse Test")
+        print("=" * 40)
+        results = [
+            test_corpus(binary, args.iterations),
+            test_pushes(binary),
+        ]
+        return all(results)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("config parse test")
+    if not result:
+        print("\nConfig parse test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
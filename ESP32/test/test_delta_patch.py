@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""
+Host test for delta OTA patches
+
+Builds patches with tools/delta_patch.py and applies them both with the
+Python reference implementation and with the device decoder
+(lib/OTA/src/DeltaPatch.cpp) compiled for the host.
+
+    python test_delta_patch.py                      # synthetic images
+    python test_delta_patch.py old.bin new.bin      # real firmware builds
+"""
+
+import hashlib
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+import host_tool
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TOOLS = os.path.join(HERE, "..", "tools")
+sys.path.insert(0, TOOLS)
+
+from delta_patch import apply_patch, make_patch, patch_info  # noqa: E402
+
+
+def synthetic_images(seed=0, size=1536 * 1024):
+    """Base image plus a target with the kinds of edits a rebuild causes"""
+    rng = random.Random(seed)
+    base = bytearray(rng.getrandbits(8) for _ in range(size))
+    target = bytearray(base)
+    # New code in the middle shifts everything after it
+    insert_at = size // 3
+    target[insert_at:insert_at] = bytes(rng.getrandbits(8) for _ in range(2048))
+    # Removed function
+    del target[size // 2 : size // 2 + 1024]
+    # Relocated pointers: scattered 4-byte changes
+    for _ in range(300):
+        pos = rng.randrange(0, len(target) - 4)
+        target[pos : pos + 4] = rng.getrandbits(32).to_bytes(4, "little")
+    return bytes(base), bytes(target)
+
+
+def build_host_decoder(workdir):
+    return host_tool.build(workdir, "delta_apply_host", [
+        host_tool.lib_src("OTA", "DeltaPatch.cpp"),
+    ], std="c++17")
+
+
+def run_host_decoder(binary, workdir, base, patch):
+    paths = [os.path.join(workdir, name) for name in ("base.bin", "patch.bin", "out.bin")]
+    for path, data in zip(paths, (base, patch)):
+        with open(path, "wb") as f:
+            f.write(data)
+    result = subprocess.run([binary] + paths, capture_output=True, text=True)
+    if result.returncode != 0:
+        return None
+    with open(paths[2], "rb") as f:
+        return f.read()
+
+
+def check_pair(base, target, binary, workdir):
+    expected = hashlib.sha256(target).hexdigest()
+    patch = make_patch(base, target)
+    info = patch_info(patch)
+    print(f"Target: {len(target)} bytes, patch: {len(patch)} bytes "
+          f"({100.0 * len(patch) / len(target):.2f}%), "
+          f"{info['copies']} copies, {info['literal_bytes']} literal bytes")
+
+    if hashlib.sha256(apply_patch(base, patch)).hexdigest() != expected:
+        print("ERROR: Python apply produced a different image")
+        return False
+    if binary:
+        out = run_host_decoder(binary, workdir, base, patch)
+        if out is None or hashlib.sha256(out).hexdigest() != expected:
+            print("ERROR: device decoder produced a different image")
+            return False
+        print("Device decoder: SHA256 OK")
+    return True
+
+
+def test_synthetic(binary, workdir):
+    base, target = synthetic_images()
+    if not check_pair(base, target, binary, workdir):
+        return False
+    patch = make_patch(base, target)
+    if len(patch) * 10 > len(target):
+        print("ERROR: patch is not an order of magnitude smaller than the image")
+        return False
+    return True
+
+
+def test_wrong_base_rejected(binary, workdir):
+    base, target = synthetic_images(size=64 * 1024)
+    patch = make_patch(base, target)
+    other = bytes(reversed(base))
+    try:
+        apply_patch(other, patch)
+        print("ERROR: Python apply accepted the wrong base")
+        return False
+    except ValueError:
+        pass
+    if binary and run_host_decoder(binary, workdir, base[:-1], patch) is not None:
+        print("ERROR: device decoder accepted a base of the wrong size")
+        return False
+    print("Wrong base: rejected")
+    return True
+
+
+def test_truncated_patch(binary, workdir):
+    if not binary:
+        return True
+    base, target = synthetic_images(size=64 * 1024)
+    patch = make_patch(base, target)
+    if run_host_decoder(binary, workdir, base, patch[:-1]) is not None:
+        print("ERROR: device decoder accepted a truncated patch")
+        return False
+    print("Truncated patch: rejected")
+    return True
+
+
+if __name__ == "__main__":
+    print("Delta Patch Test")
+    print("=" * 40)
+    with tempfile.TemporaryDirectory() as workdir:
+        binary = build_host_decoder(workdir)
+
+        if len(sys.argv) == 3:
+            with open(sys.argv[1], "rb") as f:
+                base = f.read()
+            with open(sys.argv[2], "rb") as f:
+                target = f.read()
+            ok = check_pair(base, target, binary, workdir)
+        else:
+            ok = all([
+                test_synthetic(binary, workdir),
+                test_wrong_base_rejected(binary, workdir),
+                test_truncated_patch(binary, workdir),
+            ])
+
+    if not ok:
+        print("\nDelta patch test FAILED")
+        sys.exit(1)
+    if not binary:
+        # The Python reference passed, but the device decoder was not checked
+        host_tool.skip("device decoder check")
+    print("\nTest completed!")
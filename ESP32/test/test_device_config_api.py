@@ -115,6 +115,54 @@ def test_multiple_devices():
             print(f"ERROR: {test_case['device_id']} - {e}")
 
 
+def test_conditional_request():
+    """A request carrying the current version as ETag should get a 304"""
+
+    base_url = "http://io-t-platform-git-web-misakaka10086s-projects.vercel.app"
+    endpoint = "/api/devices/register"
+    url = base_url + endpoint
+
+    payload = {"device_id": "TEST1234561", "chip": "ESP32-C3",
+               "board": "esp32-c3-devkitm-1", "git_version": "test"}
+    headers = {"Content-Type": "application/json"}
+
+    print("Testing conditional request...")
+    print("-" * 50)
+
+    try:
+        response = requests.post(url, json=payload, headers=headers, timeout=10)
+        if response.status_code != 200:
+            print(f"ERROR: first request failed with {response.status_code}")
+            return False
+        version = response.json().get("version")
+        etag = response.headers.get("ETag")
+        print(f"Config Version: {version}, ETag: {etag}")
+        if etag != f'"{version}"':
+            print("ERROR: ETag does not match the config version")
+            return False
+
+        cached = dict(headers, **{"If-None-Match": etag})
+        response = requests.post(url, json=payload, headers=cached, timeout=10)
+        print(f"Same version:   {response.status_code}")
+        if response.status_code != 304 or response.content:
+            print("ERROR: expected an empty 304 for the current version")
+            return False
+
+        stale = dict(headers, **{"If-None-Match": '"0"'})
+        response = requests.post(url, json=payload, headers=stale, timeout=10)
+        print(f"Stale version:  {response.status_code}")
+        if response.status_code != 200:
+            print("ERROR: expected the full config for a stale version")
+            return False
+
+        print("SUCCESS: conditional request works!")
+        return True
+
+    except requests.exceptions.RequestException as e:
+        print(f"ERROR: Request failed: {e}")
+        return False
+
+
 if __name__ == "__main__":
     print("Device Configuration API Test")
     print("=" * 40)
@@ -126,6 +174,10 @@ if __name__ == "__main__":
         print("\n" + "=" * 40)
         # Test multiple devices
         test_multiple_devices()
+
+        print("\n" + "=" * 40)
+        if not test_conditional_request():
+            sys.exit(1)
     else:
         print("\nBasic API test failed, skipping multiple device test")
         sys.exit(1)
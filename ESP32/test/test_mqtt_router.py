@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""
+Host test for incoming MQTT messages: topic routing and reassembly
+
+Builds tools/mqtt_router_host.cpp with lib/MqttController/src/
+MqttTopicRouter.cpp and MqttMessageAssembler.cpp. Checks the filters the
+device registers and the wildcard rules of the MQTT specification, then
+feeds random payloads in random fragments through the assembler.
+
+    python test_mqtt_router.py [--fragments N]
+"""
+
+import argparse
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import host_tool
+
+# (filter, valid)
+FILTERS = [
+    ("iotplatform/esp32/command/esp32-c3-devkitm-1", True),
+    ("iotplatform/esp32/config/+", True),
+    ("sport/tennis/player1/#", True),
+    ("sport/+/player1", True),
+    ("+/+", True),
+    ("/+", True),
+    ("#", True),
+    ("+", True),
+    ("$SYS/#", True),
+    ("a/+/c/#", True),
+    ("sport/tennis#", False),
+    ("sport/tennis/#/ranking", False),
+    ("sport+", False),
+    ("", False),
+]
+
+# (topic, numbers of the filters that match)
+TOPICS = [
+    ("iotplatform/esp32/command/esp32-c3-devkitm-1", [0, 6]),
+    ("iotplatform/esp32/command/esp32-s3-devkitc-1", [6]),
+    ("iotplatform/esp32/command", [6]),
+    ("iotplatform/esp32/config/esp32c3", [1, 6]),
+    ("iotplatform/esp32/config/", [1, 6]),
+    ("iotplatform/esp32/config/a/b", [6]),
+    ("sport/tennis/player1", [2, 3, 6]),
+    ("sport/tennis/player1/ranking", [2, 6]),
+    ("sport/tennis/player1/score/wimbledon", [2, 6]),
+    ("sport/tennis/player2", [6]),
+    ("sport/tennis", [4, 6]),
+    ("sport", [6, 7]),
+    ("/finance", [4, 5, 6]),
+    ("$SYS/broker/uptime", [8]),
+    ("$SYS", [8]),
+    ("a/b/c", [6, 9]),
+    ("a/b/c/d/e", [6, 9]),
+    ("a/b/d", [6]),
+]
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "mqtt_router_host", [
+        host_tool.lib_src("MqttController", "MqttTopicRouter.cpp"),
+        host_tool.lib_src("MqttController", "MqttMessageAssembler.cpp"),
+    ])
+
+
+def test_routing(binary):
+    cases = "".join(f"F {f}\n" for f, _ in FILTERS)
+    cases += "".join(f"T {t}\n" for t, _ in TOPICS)
+    process = subprocess.run([binary], input=cases, capture_output=True,
+                             text=True)
+    lines = process.stdout.splitlines()
+    ok = process.returncode == 0 and len(lines) == len(FILTERS) + len(TOPICS)
+    if not ok:
+        print("ERROR: host tool failed")
+        return False
+
+    for (pattern, valid), line in zip(FILTERS, lines):
+        accepted = line.split()[2] == "ok"
+        if accepted != valid:
+            print(f"ERROR: filter {pattern!r} "
+                  f"{'accepted' if accepted else 'rejected'}")
+            ok = False
+    for (topic, expected), line in zip(TOPICS, lines[len(FILTERS):]):
+        called = [int(n) for n in line.split()[2:]]
+        if called != expected:
+            print(f"ERROR: {topic}: handlers {called}, expected {expected}")
+            ok = False
+    print(f"Routing:            {len(FILTERS)} filters, {len(TOPICS)} topics")
+    return ok
+
+
+def test_fragments(binary, fragments):
+    ok = True
+    for seed in range(1, 4):
+        process = subprocess.run(
+            [binary, "--fragments", str(fragments), "--seed", str(seed)],
+            capture_output=True, text=True)
+        result = dict(pair.split("=", 1) for pair in process.stdout.split())
+        if process.returncode != 0:
+            print(f"ERROR: seed {seed}: {result.get('errors')} errors")
+            ok = False
+            continue
+        if seed == 1:
+            print(f"Reassembly:         {result['messages']} messages, "
+                  f"{result['reassembled']} from fragments, "
+                  f"{result['oversized']} oversized, "
+                  f"{result['incomplete']} cut off")
+            print(f"Pool:               {int(result['pooled_bytes']) // 1024}"
+                  f" KB")
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--fragments", type=int, default=20000)
+    args = parser.parse_args()
+
+    print("MQTT Router Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="mqtt_router_")
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+        results = [
+            test_routing(binary),
+            test_fragments(binary, args.fragments),
+        ]
+        return all(results)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("MQTT router test")
+    if not result:
+        print("\nMQTT router test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+"""
+Host test for the MQTT offline log (store and forward)
+
+Builds tools/offline_log_host.cpp with lib/MqttController/src/
+MqttOfflineLog.cpp and writes millions of records through a simulated NOR
+flash partition the size of the mqttlog partition, replaying each outage
+in full. Checks that nothing is lost or reordered, that programmed bytes
+stay close to the data written, and that every sector is erased equally
+often. Then checks both retention limits and cuts power at random points,
+remounting the log each time.
+
+    python test_offline_log.py [--records N]
+"""
+
+import argparse
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import host_tool
+
+# Record headers, padding, state marks and segment headers over the data
+MAX_PROGRAM_AMPLIFICATION = 1.15
+# A sector erased per 4 KB written, plus the partly filled ones
+MAX_ERASE_AMPLIFICATION = 1.2
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "offline_log_host", [
+        host_tool.lib_src("MqttController", "MqttOfflineLog.cpp"),
+    ])
+
+
+def run(binary, *options):
+    """key=value pairs of the tool's output line, plus its exit code"""
+    process = subprocess.run([binary, *map(str, options)],
+                             capture_output=True, text=True)
+    sys.stderr.write(process.stderr)
+    result = dict(pair.split("=", 1) for pair in process.stdout.split())
+    return result, process.returncode
+
+
+def test_throughput(binary, records):
+    result, code = run(binary, "--records", records)
+    print(f"Records:            {result['records']} "
+          f"({int(result['data_bytes']) // 1024 // 1024} MB)")
+    print(f"Append:             {float(result['append_per_s']):,.0f}/s")
+    print(f"Replay:             {float(result['replay_per_s']):,.0f}/s")
+    print(f"Program amp.:       {result['program_amplification']}")
+    print(f"Erase amp.:         {result['erase_amplification']}")
+    print(f"Erases per sector:  {result['erases_min']}-{result['erases_max']}")
+
+    ok = code == 0
+    if code != 0:
+        print(f"ERROR: lost {result['lost']}, order errors "
+              f"{result['order_errors']}, violations {result['violations']}")
+    if float(result["program_amplification"]) > MAX_PROGRAM_AMPLIFICATION:
+        print("ERROR: programmed bytes too far above the data written")
+        ok = False
+    if float(result["erase_amplification"]) > MAX_ERASE_AMPLIFICATION:
+        print("ERROR: too many erases for the data written")
+        ok = False
+    if int(result["erases_max"]) - int(result["erases_min"]) > 1:
+        print("ERROR: sectors are not erased evenly")
+        ok = False
+    return ok
+
+
+def test_retention(binary):
+    ok = True
+    result, code = run(binary, "--records", 200000, "--max-age", 3000)
+    print(f"Age limit:          {result['expired']} expired, "
+          f"{result['replayed']} replayed")
+    if code != 0 or int(result["expired"]) == 0:
+        print("ERROR: age limit not applied cleanly")
+        ok = False
+
+    result, code = run(binary, "--records", 200000, "--max-bytes", 65536)
+    print(f"Size limit:         {result['dropped']} dropped, "
+          f"{result['replayed']} replayed")
+    if code != 0 or int(result["dropped"]) == 0:
+        print("ERROR: size limit not applied cleanly")
+        ok = False
+    return ok
+
+
+def test_power_cuts(binary):
+    ok = True
+    totals = {"cuts": 0, "duplicates": 0, "dropped": 0}
+    for seed in range(1, 5):
+        for max_bytes in (0, 16384):
+            result, code = run(binary, "--power-cuts", 500, "--capacity",
+                               65536, "--max-bytes", max_bytes, "--seed", seed)
+            if code != 0:
+                print(f"ERROR: seed {seed}, max bytes {max_bytes}: "
+                      f"{result.get('errors')} errors")
+                ok = False
+                continue
+            for key in totals:
+                totals[key] += int(result[key])
+    print(f"Power cuts:         {totals['cuts']}, "
+          f"{totals['duplicates']} records sent twice, "
+          f"{totals['dropped']} dropped by the size limit")
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--records", type=int, default=2000000)
+    args = parser.parse_args()
+
+    print("Offline Log Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="offline_log_")
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+        started = time.time()
+        results = [
+            test_throughput(binary, args.records),
+            test_retention(binary),
+            test_power_cuts(binary),
+        ]
+        print(f"Elapsed:            {time.time() - started:.1f} s")
+        return all(results)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("offline log test")
+    if not result:
+        print("\nOffline log test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
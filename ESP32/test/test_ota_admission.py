@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""
+Fleet test for OTA admission control
+
+Builds tools/ota_admission_sim_host.cpp with lib/OTA/src/OTAAdmission.cpp
+and sends one OTA command to a fleet sharing one firmware host: without
+admission, with the jitter window only, and with the jitter plus leases
+from tools/ota_lease_coordinator.py (LeaseCoordinator, driven through the
+simulation's pipe in simulated time). Prints the peak concurrent downloads
+and connection attempts of each, and checks that with leases every device
+updates, never more than the coordinator's slots download at once and the
+host refuses no connection.
+
+    python test_ota_admission.py [--devices N] [--slots N]
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import host_tool
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TOOLS = os.path.join(HERE, "..", "tools")
+sys.path.insert(0, TOOLS)
+
+from ota_lease_coordinator import LeaseCoordinator  # noqa: E402
+
+MODES = ("none", "jitter", "lease")
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "ota_admission_sim_host", [
+        host_tool.lib_src("OTA", "OTAAdmission.cpp"),
+    ], threads=True)
+
+
+def parse_summary(line):
+    return dict(pair.split("=", 1) for pair in line.split())
+
+
+def simulate(binary, mode, devices, coordinator=None, extra=()):
+    """Summary of one run and its exit code"""
+    command = [binary, "--mode", mode, "--devices", str(devices), *extra]
+    if coordinator is None:
+        process = subprocess.run(command, capture_output=True, text=True)
+        sys.stderr.write(process.stderr)
+        return parse_summary(process.stdout.splitlines()[-1]), \
+            process.returncode
+
+    process = subprocess.Popen(command, stdin=subprocess.PIPE,
+                               stdout=subprocess.PIPE, text=True)
+    messages = []
+    summary = None
+    for line in process.stdout:
+        if line.startswith("msg "):
+            messages.append(json.loads(line[4:]))
+        elif line.startswith("tick "):
+            # The messages of a tick arrive at its time
+            now = int(line.split()[1])
+            replies = []
+            for message in messages:
+                replies += coordinator.handle(message, now)
+            replies += coordinator.expire(now)
+            for device, reply in replies:
+                process.stdin.write(
+                    f"reply {device} {reply['ticket']} "
+                    f"{int(reply['granted'])} {reply.get('lease_ms', 0)} "
+                    f"{reply.get('retry_ms', 0)}\n")
+            process.stdin.write("end\n")
+            process.stdin.flush()
+            messages = []
+        else:
+            summary = parse_summary(line)
+    process.stdin.close()
+    return summary, process.wait()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--devices", type=int, default=300)
+    parser.add_argument("--slots", type=int, default=25,
+                        help="coordinator's concurrent downloads")
+    args = parser.parse_args()
+
+    print("OTA Admission Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="ota_admission_")
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+
+        ok = True
+        results = {}
+        coordinator = LeaseCoordinator(args.slots)
+        for mode in MODES:
+            summary, code = simulate(
+                binary, mode, args.devices,
+                coordinator if mode == "lease" else None)
+            if summary is None:
+                print(f"ERROR: {mode} produced no summary ({code})")
+                return False
+            results[mode] = (summary, code)
+
+        print(f"{'mode':<8}{'done':>6}{'failed':>8}{'peak dl':>9}"
+              f"{'conn/s':>8}{'refused':>9}{'all done':>10}")
+        for mode in MODES:
+            summary, _ = results[mode]
+            makespan = float(summary["makespan_s"])
+            print(f"{mode:<8}{summary['completed']:>6}{summary['failed']:>8}"
+                  f"{summary['peak_downloads']:>9}"
+                  f"{summary['peak_connects']:>8}{summary['refused']:>9}"
+                  f"{f'{makespan:.0f} s' if makespan >= 0 else 'never':>10}")
+        lease, code = results["lease"]
+        print(f"lease: {lease['lease_requests']} requests, "
+              f"{coordinator.denials} denied, {coordinator.grants} granted, "
+              f"{lease['renewals']} renewals, {coordinator.expired} expired")
+
+        if code != 0 or lease["completed"] != str(args.devices):
+            print("ERROR: not every device updated with leases")
+            ok = False
+        if int(lease["peak_downloads"]) > args.slots or \
+                coordinator.peak > args.slots:
+            print("ERROR: more downloads than the coordinator has slots")
+            ok = False
+        if lease["refused"] != "0" or coordinator.expired:
+            print("ERROR: the host refused a leased download, or a lease "
+                  "expired while its device was downloading")
+            ok = False
+        none, _ = results["none"]
+        if int(none["peak_connects"]) <= int(lease["peak_connects"]):
+            print("ERROR: admission did not lower the connection peak")
+            ok = False
+
+        # Downloads longer than a third of the lease live on renewals
+        coordinator = LeaseCoordinator(args.slots)
+        slow, code = simulate(binary, "lease", args.devices // 3, coordinator,
+                              ("--device-kbps", "400"))
+        print(f"slow links: {slow['completed']} done, {slow['renewals']} "
+              f"renewals, {coordinator.expired} expired")
+        if code != 0 or slow["renewals"] == "0" or coordinator.expired:
+            print("ERROR: renewals did not keep the leases")
+            ok = False
+        return ok
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("OTA admission test")
+    if not result:
+        print("\nOTA admission test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
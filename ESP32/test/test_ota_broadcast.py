@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+"""
+Local-broker benchmark of the firmware broadcast over MQTT
+
+Builds tools/ota_broadcast_fleet_host.cpp with lib/OTA/src/OTABroadcast.cpp
+and updates fleets of 1, 100 and 1000 simulated devices through a local
+MQTT broker: tools/ota_broadcast.py publishes the image once, each device
+drops a share of the chunks and asks for the gaps. Prints the bytes moved
+by the publisher, to the devices and from them, next to what one HTTPS
+download per device costs the firmware host, and checks that every device
+got the whole image while the publisher sent a few images, not one per
+device.
+
+Runs its own minimal broker (exact topic filters, QoS 0) unless --broker
+points at a real one, e.g. a local mosquitto:
+
+    python test_ota_broadcast.py [--broker localhost:1883] [--image-kb K]
+"""
+
+import argparse
+import os
+import selectors
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+
+import host_tool
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TOOLS = os.path.join(HERE, "..", "tools")
+
+FLEETS = (1, 100, 1000)
+SESSION = 0x5EED
+
+
+class LocalBroker:
+    """Just enough of an MQTT broker for the benchmark, on its own thread"""
+
+    def __init__(self):
+        self.selector = selectors.DefaultSelector()
+        self.listener = socket.socket()
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(("127.0.0.1", 0))
+        self.listener.listen(1024)
+        self.listener.setblocking(False)
+        self.port = self.listener.getsockname()[1]
+        self.selector.register(self.listener, selectors.EVENT_READ)
+        self.subscribers = {}  # topic -> connections
+        self.running = True
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        self.running = False
+        self.thread.join()
+        for key in list(self.selector.get_map().values()):
+            key.fileobj.close()
+
+    def _run(self):
+        while self.running:
+            for key, events in self.selector.select(0.1):
+                if key.fileobj is self.listener:
+                    self._accept()
+                    continue
+                connection = key.data
+                if events & selectors.EVENT_READ:
+                    self._read(connection)
+                if events & selectors.EVENT_WRITE:
+                    self._flush(connection)
+
+    def _accept(self):
+        while True:
+            try:
+                sock, _ = self.listener.accept()
+            except BlockingIOError:
+                return
+            sock.setblocking(False)
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            connection = {"sock": sock, "in": bytearray(),
+                          "out": bytearray(), "topics": []}
+            self.selector.register(sock, selectors.EVENT_READ, connection)
+
+    def _close(self, connection):
+        self.selector.unregister(connection["sock"])
+        connection["sock"].close()
+        for topic in connection["topics"]:
+            self.subscribers[topic].remove(connection)
+
+    def _send(self, connection, data):
+        pending = bool(connection["out"])
+        connection["out"] += data
+        if not pending:
+            self._flush(connection)
+
+    def _flush(self, connection):
+        sock = connection["sock"]
+        try:
+            sent = sock.send(connection["out"])
+        except BlockingIOError:
+            sent = 0
+        except OSError:
+            return
+        del connection["out"][:sent]
+        self.selector.modify(
+            sock, selectors.EVENT_READ |
+            (selectors.EVENT_WRITE if connection["out"] else 0), connection)
+
+    def _read(self, connection):
+        try:
+            data = connection["sock"].recv(65536)
+        except (BlockingIOError, ConnectionResetError):
+            data = None
+        if not data:
+            if data is not None:
+                self._close(connection)
+            return
+        buffer = connection["in"]
+        buffer += data
+        while len(buffer) >= 2:
+            length, multiplier, pos = 0, 1, 1
+            while pos < len(buffer):
+                byte = buffer[pos]
+                length += (byte & 0x7F) * multiplier
+                multiplier *= 128
+                pos += 1
+                if not byte & 0x80:
+                    break
+            else:
+                return
+            if len(buffer) < pos + length:
+                return
+            first = buffer[0]
+            body = bytes(buffer[pos:pos + length])
+            del buffer[:pos + length]
+            self._packet(connection, first, body)
+
+    def _packet(self, connection, first, body):
+        kind = first & 0xF0
+        if kind == 0x10:
+            self._send(connection, b"\x20\x02\x00\x00")
+        elif kind == 0x80:
+            pos, granted = 2, b""
+            while pos < len(body):
+                length = struct.unpack(">H", body[pos:pos + 2])[0]
+                topic = body[pos + 2:pos + 2 + length].decode()
+                pos += 3 + length
+                self.subscribers.setdefault(topic, []).append(connection)
+                connection["topics"].append(topic)
+                granted += b"\x00"
+            self._send(connection, bytes([0x90, 2 + len(granted)]) +
+                       body[:2] + granted)
+        elif kind == 0x30:
+            length = struct.unpack(">H", body[:2])[0]
+            topic = body[2:2 + length].decode()
+            packet = bytes([0x30]) + self._length(len(body)) + body
+            for subscriber in self.subscribers.get(topic, ()):
+                self._send(subscriber, packet)
+        elif kind == 0xC0:
+            self._send(connection, b"\xD0\x00")
+        elif kind == 0xE0:
+            self._close(connection)
+
+    @staticmethod
+    def _length(length):
+        encoded = b""
+        while True:
+            byte = length % 128
+            length //= 128
+            encoded += bytes([byte | (0x80 if length else 0)])
+            if not length:
+                return encoded
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "ota_broadcast_fleet_host", [
+        host_tool.lib_src("OTA", "OTABroadcast.cpp"),
+    ])
+
+
+def parse_summary(line):
+    return dict(pair.split("=", 1) for pair in line.split())
+
+
+def broadcast(binary, host, port, image_path, devices, loss):
+    """Fleet and publisher summaries of one update, and the fleet's exit
+    code"""
+    fleet = subprocess.Popen(
+        [binary, "--host", host, "--port", str(port), "--devices",
+         str(devices), "--image", image_path, "--session", str(SESSION),
+         "--loss", str(loss), "--idle-ms", "500", "--spread-ms", "500",
+         "--timeout-s", "120"],
+        stdout=subprocess.PIPE, text=True)
+    if fleet.stdout.readline().strip() != "ready":
+        fleet.wait()
+        return None, None, fleet.returncode
+    sender = subprocess.Popen(
+        [sys.executable, os.path.join(TOOLS, "ota_broadcast.py"),
+         "--host", host, "--port", str(port),
+         "--board", "esp32-c3-devkitm-1", "--image", image_path,
+         "--session", str(SESSION), "--rate-kbps", "0",
+         "--holdoff-ms", "200", "--linger-s", "5"],
+        stdout=subprocess.PIPE, text=True)
+    fleet_summary = parse_summary(fleet.stdout.read())
+    code = fleet.wait()
+    sender_summary = parse_summary(sender.stdout.read())
+    sender.wait()
+    return fleet_summary, sender_summary, code
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--broker", help="host:port of a broker to use")
+    parser.add_argument("--image-kb", type=int, default=256)
+    parser.add_argument("--loss", type=float, default=0.01,
+                        help="share of chunks each device drops")
+    args = parser.parse_args()
+
+    print("OTA Broadcast Benchmark")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="ota_broadcast_")
+    broker = None
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+        if args.broker:
+            host, port = args.broker.rsplit(":", 1)
+            host = socket.gethostbyname(host)
+        else:
+            broker = LocalBroker()
+            host, port = "127.0.0.1", broker.port
+
+        image = bytearray(os.urandom(args.image_kb * 1024 - 123))
+        image[0] = 0xE9  # ESP_IMAGE_HEADER_MAGIC
+        image_path = os.path.join(workdir, "firmware.bin")
+        with open(image_path, "wb") as f:
+            f.write(image)
+        size = len(image)
+
+        ok = True
+        print(f"image {size} bytes, each device drops {args.loss:.0%} of "
+              f"the chunks")
+        print(f"{'devices':>7}{'done':>6}{'publisher':>11}{'to devices':>12}"
+              f"{'requests':>10}{'HTTPS':>10}{'repairs b/u':>13}"
+              f"{'time':>7}")
+        for devices in FLEETS:
+            fleet, sender, code = broadcast(binary, host, int(port),
+                                            image_path, devices, args.loss)
+            if fleet is None:
+                print(f"ERROR: the fleet of {devices} did not get ready")
+                ok = False
+                continue
+            published = int(sender["bytes_sent"])
+            print(f"{devices:>7}{fleet['completed']:>6}"
+                  f"{published / 2**20:>9.2f}MB"
+                  f"{int(fleet['bytes_in']) / 2**20:>10.1f}MB"
+                  f"{int(fleet['bytes_out']) / 2**10:>8.1f}KB"
+                  f"{devices * size / 2**20:>8.1f}MB"
+                  f"{sender['repairs_broadcast']:>7}/"
+                  f"{sender['repairs_unicast']:<5}"
+                  f"{float(fleet['elapsed_s']):>6.1f}s")
+            if code != 0 or fleet["completed"] != str(devices) or \
+                    fleet["corrupt"] != "0":
+                print(f"ERROR: not every device of {devices} got the image")
+                ok = False
+            # The publisher sends the image and the gaps, not an image per
+            # device, and the devices get little more than the image
+            gaps = args.loss * devices * size
+            if published > 1.5 * size + 2 * gaps:
+                print(f"ERROR: {published} bytes published for {devices} "
+                      f"devices")
+                ok = False
+            if int(fleet["bytes_in"]) > devices * (1.1 * size + 8192):
+                print(f"ERROR: {fleet['bytes_in']} bytes to {devices} "
+                      f"devices")
+                ok = False
+        return ok
+    finally:
+        if broker:
+            broker.stop()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("OTA broadcast test")
+    if not result:
+        print("\nOTA broadcast test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
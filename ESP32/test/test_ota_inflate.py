@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+"""
+Host test for compressed OTA images
+
+Compresses a firmware-like image with tools/compress_firmware.py and
+decodes it with tools/inflate_host.cpp: lib/OTA/src/OTAInflater.cpp, the
+decoder of compressed updates, built against the single-file miniz whose
+tinfl the device has in ROM. Checks the round trip at download chunk sizes
+from 1 byte up, runs of zeros that expand one chunk many times over the
+4 KB output window, a stream with a 32 KB window (rejected), truncated
+streams, data after the end of the stream and a failing flash write.
+Reports decoder throughput and the heap it takes. Skipped (exit status 77)
+without a C++ compiler or miniz ($MINIZ_DIR).
+"""
+
+import hashlib
+import os
+import random
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import zlib
+
+import host_tool
+
+COMPRESS = os.path.join(host_tool.TOOLS, "compress_firmware.py")
+# Allocation overhead allowed on top of OTAInflater::memoryUsage()
+HEAP_SLACK = 256
+
+
+def firmware_like(size, seed=1):
+    """Code-like blocks that repeat within 4 KB, random data and zero
+    padding, roughly the mix of an application image"""
+    rng = random.Random(seed)
+    words = [rng.randbytes(4) for _ in range(64)]
+    out = bytearray()
+    while len(out) < size:
+        kind = rng.random()
+        if kind < 0.6:
+            count = rng.randrange(16, 512)
+            out += b"".join(rng.choice(words) for _ in range(count))
+        elif kind < 0.9:
+            out += rng.randbytes(rng.randrange(64, 2048))
+        else:
+            out += bytes(rng.randrange(256, 16384))
+    return bytes(out[:size])
+
+
+def run(binary, image, *options):
+    """(result fields, exit status) of inflate_host"""
+    proc = subprocess.run([binary, image, *options], capture_output=True,
+                          text=True)
+    fields = dict(re.findall(r"(\w+)=(\S+)", proc.stdout))
+    if not fields:
+        print(proc.stdout + proc.stderr)
+    return fields, proc.returncode
+
+
+def write(workdir, name, data):
+    path = os.path.join(workdir, name)
+    with open(path, "wb") as f:
+        f.write(data)
+    return path
+
+
+def compress_file(workdir, name, image):
+    """Compressed with compress_firmware.py, as images are published"""
+    source = write(workdir, name, image)
+    packed = source + ".z"
+    subprocess.check_call([sys.executable, COMPRESS, "compress", source,
+                           "-o", packed], stdout=subprocess.DEVNULL)
+    return packed
+
+
+def check_round_trip(workdir, binary, name, image, chunks):
+    packed = compress_file(workdir, name, image)
+    expected = hashlib.sha256(image).hexdigest()
+    ok = True
+    for chunk in chunks:
+        out = os.path.join(workdir, f"{name}.{chunk}.out")
+        fields, status = run(binary, packed, "--chunk", str(chunk),
+                             "--out", out)
+        got = None
+        if status == 0:
+            with open(out, "rb") as f:
+                got = hashlib.sha256(f.read()).hexdigest()
+        if fields.get("result") != "ok" or got != expected:
+            print(f"ERROR: {name} in {chunk} byte chunks: {fields}")
+            ok = False
+    print(f"{name}: {len(image)} -> {os.path.getsize(packed)} bytes, "
+          f"round trip in {len(chunks)} chunk sizes "
+          f"{'ok' if ok else 'FAILED'}")
+    return ok
+
+
+def test_round_trip(workdir, binary):
+    """Image bytes come out unchanged however the download is split"""
+    image = firmware_like(384 * 1024)
+    return check_round_trip(workdir, binary, "firmware", image,
+                            [1, 7, 512, 4096, 65536, len(image)])
+
+
+def test_output_larger_than_window(workdir, binary):
+    """A chunk of zeros inflates to many windows: the HAS_MORE_OUTPUT loop
+    and the window wrap"""
+    image = bytes(1024 * 1024) + firmware_like(8192, seed=2)
+    return check_round_trip(workdir, binary, "zeros", image, [1, 4096])
+
+
+def test_wide_window_rejected(workdir, binary):
+    """A stream compressed with a 32 KB window does not fit the 4 KB one"""
+    image = firmware_like(64 * 1024, seed=3)
+    compressor = zlib.compressobj(9, zlib.DEFLATED, 15)
+    packed = write(workdir, "wide.z",
+                   compressor.compress(image) + compressor.flush())
+    fields, status = run(binary, packed)
+    print(f"wbits=15 stream: {fields.get('result')}, "
+          f"{fields.get('out')} bytes out")
+    if status == 0 or fields.get("result") != "corrupt":
+        print("ERROR: a 32 KB window stream must be rejected")
+        return False
+    return True
+
+
+def test_truncated(workdir, binary):
+    """A stream that stops early never reports finished"""
+    image = firmware_like(128 * 1024, seed=4)
+    with open(compress_file(workdir, "truncated", image), "rb") as f:
+        packed = f.read()
+    ok = True
+    for cut in (2, 4, len(packed) // 2, len(packed) - 1):
+        path = write(workdir, f"truncated.{cut}.z", packed[:cut])
+        fields, status = run(binary, path)
+        if status == 0 or fields.get("result") != "truncated":
+            print(f"ERROR: stream cut to {cut} bytes: {fields}")
+            ok = False
+    print(f"Truncated streams: {'not finished' if ok else 'FAILED'}")
+    return ok
+
+
+def test_trailing_data(workdir, binary):
+    """Bytes after the end of the stream are an error, not ignored"""
+    image = firmware_like(64 * 1024, seed=5)
+    with open(compress_file(workdir, "trailing", image), "rb") as f:
+        packed = f.read()
+    ok = True
+    for chunk in (4096, len(packed) + 16):
+        path = write(workdir, "trailing.extra.z", packed + b"\0" * 16)
+        fields, status = run(binary, path, "--chunk", str(chunk))
+        if status == 0 or fields.get("result") != "trailing":
+            print(f"ERROR: trailing data in {chunk} byte chunks: {fields}")
+            ok = False
+    print(f"Data after the stream: {'rejected' if ok else 'FAILED'}")
+    return ok
+
+
+def test_output_failure(workdir, binary):
+    """A failing flash write stops the decoder"""
+    image = firmware_like(64 * 1024, seed=6)
+    packed = compress_file(workdir, "write_fail", image)
+    fields, status = run(binary, packed, "--fail-after", "10000")
+    if status == 0 or fields.get("result") != "output_failed":
+        print(f"ERROR: writer failure not reported: {fields}")
+        return False
+    print("Failing writer: stops the decoder")
+    return True
+
+
+def test_throughput_and_heap(workdir, binary):
+    image = firmware_like(1024 * 1024, seed=7)
+    packed = compress_file(workdir, "bench", image)
+    fields, status = run(binary, packed, "--runs", "5")
+    if status != 0:
+        print(f"ERROR: bench decode failed: {fields}")
+        return False
+    memory = int(fields["memory"])
+    heap = int(fields["heap_peak"])
+    print(f"Throughput: {fields['mbps']} MB/s on this host")
+    print(f"Heap: {heap} bytes at peak, memoryUsage() {memory} bytes")
+    if not memory <= heap <= memory + HEAP_SLACK:
+        print("ERROR: the decoder must take only its state and window")
+        return False
+    return True
+
+
+def main():
+    print("OTA Inflate Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="ota_inflate_")
+    try:
+        binary = host_tool.build_inflater(workdir)
+        if not binary:
+            return None
+        return all([
+            test_round_trip(workdir, binary),
+            test_output_larger_than_window(workdir, binary),
+            test_wide_window_rejected(workdir, binary),
+            test_truncated(workdir, binary),
+            test_trailing_data(workdir, binary),
+            test_output_failure(workdir, binary),
+            test_throughput_and_heap(workdir, binary),
+        ])
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("OTA inflate test")
+    if not result:
+        print("\nOTA inflate test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+"""
+Site test of firmware distribution between devices on the same network
+
+Builds tools/ota_peer_site_host.cpp with lib/OTA/src/OTAPeer.cpp and sends
+one OTA command to several sites of simulated devices, each site behind
+its own uplink to the firmware origin (a local HTTP server that counts the
+bytes every site pulls and sends at --wan-kbps per connection). First
+every device downloads the image from the origin, then devices take it
+from a neighbour that already runs it. Prints the uplink (WAN) and local
+(LAN) bytes per site, and checks that with peers every device got the
+image while each site pulled it over its uplink about once, and that
+devices refuse the image to requests without the command's peer token.
+
+    python test_ota_peer.py [--sites S] [--devices N] [--image-kb K]
+"""
+
+import argparse
+import hashlib
+import http.server
+import os
+import secrets
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+
+import host_tool
+
+MODES = ("origin", "peers")
+
+
+class Origin(http.server.ThreadingHTTPServer):
+    """The firmware host: serves the image, counts bytes per site"""
+
+    daemon_threads = True
+    request_queue_size = 256
+
+    def __init__(self, image, wan_kbps):
+        super().__init__(("127.0.0.1", 0), OriginHandler)
+        self.image = image
+        self.wan_kbps = wan_kbps
+        self.lock = threading.Lock()
+        self.sent = {}  # site -> bytes
+        self.thread = threading.Thread(target=self.serve_forever, daemon=True)
+        self.thread.start()
+
+    def take_counts(self):
+        with self.lock:
+            sent, self.sent = self.sent, {}
+        return sent
+
+
+class OriginHandler(http.server.BaseHTTPRequestHandler):
+    def do_GET(self):
+        url = urllib.parse.urlparse(self.path)
+        site = urllib.parse.parse_qs(url.query).get("site", ["?"])[0]
+        image = self.server.image
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(image)))
+        self.send_header("Connection", "close")
+        self.end_headers()
+        piece = 16384
+        interval = piece * 8 / (self.server.wan_kbps * 1000)
+        for start in range(0, len(image), piece):
+            data = image[start:start + piece]
+            self.wfile.write(data)
+            with self.server.lock:
+                self.server.sent[site] = self.server.sent.get(site, 0) + \
+                    len(data)
+            time.sleep(interval)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "ota_peer_site_host", [
+        host_tool.lib_src("OTA", "OTAPeer.cpp"),
+    ], threads=True)
+
+
+def parse_summary(line):
+    return dict(pair.split("=", 1) for pair in line.split())
+
+
+def simulate(binary, origin, image_path, sha256, mode, sites, devices):
+    """Per-site summaries of one update, the bytes the origin sent each
+    site, and the exit code"""
+    command = [binary, "--image", image_path, "--sha256", sha256,
+               "--token", secrets.token_urlsafe(24),
+               "--origin-port", str(origin.server_address[1]),
+               "--sites", str(sites), "--devices", str(devices)]
+    if mode == "origin":
+        command.append("--no-peers")
+    process = subprocess.run(command, capture_output=True, text=True)
+    sys.stderr.write(process.stderr)
+    summaries = [parse_summary(line) for line in process.stdout.splitlines()
+                 if line.startswith("site=")]
+    return summaries, origin.take_counts(), process.returncode
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--sites", type=int, default=3)
+    parser.add_argument("--devices", type=int, default=20,
+                        help="devices per site")
+    parser.add_argument("--image-kb", type=int, default=256)
+    parser.add_argument("--wan-kbps", type=float, default=2000,
+                        help="origin rate per connection")
+    args = parser.parse_args()
+
+    print("OTA Peer Distribution Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="ota_peer_")
+    origin = None
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+
+        image = bytearray(os.urandom(args.image_kb * 1024 - 123))
+        image[0] = 0xE9  # ESP_IMAGE_HEADER_MAGIC
+        image = bytes(image)
+        image_path = os.path.join(workdir, "firmware.bin")
+        with open(image_path, "wb") as f:
+            f.write(image)
+        size = len(image)
+        sha256 = hashlib.sha256(image).hexdigest()
+        origin = Origin(image, args.wan_kbps)
+
+        ok = True
+        print(f"image {size} bytes, {args.sites} sites of {args.devices} "
+              f"devices")
+        print(f"{'mode':<8}{'site':>5}{'done':>6}{'origin':>8}{'peers':>7}"
+              f"{'WAN':>10}{'images':>8}{'LAN':>10}{'busy':>6}{'time':>7}")
+        for mode in MODES:
+            summaries, sent, code = simulate(
+                binary, origin, image_path, sha256, mode, args.sites,
+                args.devices)
+            if len(summaries) != args.sites:
+                print(f"ERROR: {mode}: the simulation failed ({code})")
+                ok = False
+                continue
+            for summary in summaries:
+                site = summary["site"]
+                wan = sent.get(site, 0)
+                print(f"{mode:<8}{site:>5}{summary['completed']:>6}"
+                      f"{summary['from_origin']:>8}"
+                      f"{summary['from_peers']:>7}"
+                      f"{wan / 2**20:>8.2f}MB{wan / size:>8.1f}"
+                      f"{int(summary['peer_bytes']) / 2**20:>8.2f}MB"
+                      f"{summary['busy']:>6}"
+                      f"{float(summary['elapsed_s']):>6.1f}s")
+                if summary["completed"] != str(args.devices) or \
+                        summary["corrupt"] != "0":
+                    print(f"ERROR: {mode}: not every device of site {site} "
+                          f"got the image")
+                    ok = False
+                # With peers a site pulls the image over its uplink about
+                # once; a second claim of the origin download may slip
+                # through, a download per device may not
+                if mode == "peers" and wan > 2 * size:
+                    print(f"ERROR: site {site} pulled {wan} bytes from the "
+                          f"origin")
+                    ok = False
+                if summary["refused"] != "2":
+                    print(f"ERROR: {mode}: a device of site {site} gave the "
+                          f"image out without the token")
+                    ok = False
+            if code != 0:
+                print(f"ERROR: {mode}: the simulation exited with {code}")
+                ok = False
+        return ok
+    finally:
+        if origin:
+            origin.shutdown()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("OTA peer test")
+    if not result:
+        print("\nOTA peer test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+"""
+Host test for OTA checkpoints across power loss
+
+Builds tools/ota_power_loss_host.cpp with the device checkpoint code
+(lib/OTA/src/OTASectorWriter.cpp, OTACheckpoint.cpp), then "downloads" an
+image while cutting power at random points: the process exits mid-piece,
+sometimes leaving a torn sector behind, or is killed with SIGKILL. Each
+restart resumes from the checkpoint in the simulated NVS, and the final
+image must match the expected SHA256.
+
+    python test_ota_power_loss.py
+"""
+
+import hashlib
+import os
+import random
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+import host_tool
+
+SECTOR_SIZE = 4096
+INTERVAL_SECTORS = 16
+EXIT_POWER_CUT = 3
+MAX_BOOTS = 100
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "ota_power_loss_host", [
+        host_tool.lib_src("OTA", "OTASectorWriter.cpp"),
+        host_tool.lib_src("OTA", "OTACheckpoint.cpp"),
+    ], std="c++17")
+
+
+class Device:
+    """One simulated device: a flash file and an NVS directory"""
+
+    def __init__(self, binary, workdir, image, name):
+        self.binary = binary
+        self.image_path = os.path.join(workdir, name + "-image.bin")
+        self.flash_path = os.path.join(workdir, name + "-flash.bin")
+        self.nvs_dir = os.path.join(workdir, name + "-nvs")
+        self.sha256 = hashlib.sha256(image).hexdigest()
+        with open(self.image_path, "wb") as f:
+            f.write(image)
+
+    def command(self, *options):
+        return [self.binary, self.image_path, self.flash_path, self.nvs_dir,
+                self.sha256, "--interval", str(INTERVAL_SECTORS), *options]
+
+    def boot(self, *options):
+        """Runs one boot; returns (exit code, start offset, bytes downloaded)"""
+        result = subprocess.run(self.command(*options), capture_output=True,
+                                text=True)
+        return (result.returncode,) + parse_output(result.stdout)
+
+
+def parse_output(stdout):
+    start = downloaded = 0
+    for line in stdout.splitlines():
+        key, _, value = line.partition(" ")
+        if key == "start":
+            start = int(value)
+        elif key == "downloaded":
+            downloaded = int(value)
+    return start, downloaded
+
+
+def test_random_power_cuts(binary, workdir):
+    """Power cuts at random byte offsets, resumed until the image is done"""
+    image_size = 1024 * 1024
+    total_cuts = 0
+    total_downloaded = 0
+    total_without_checkpoint = 0
+    for seed in range(20):
+        rng = random.Random(seed)
+        image = rng.randbytes(image_size)
+        device = Device(binary, workdir, image, f"cuts{seed}")
+        cuts = 0
+        for boot in range(MAX_BOOTS):
+            cut = rng.randrange(image_size // 2) if rng.random() < 0.8 else None
+            options = ["--seed", str(seed * MAX_BOOTS + boot)]
+            if cut is not None:
+                options += ["--cut-after", str(cut)]
+            code, start, downloaded = device.boot(*options)
+            total_downloaded += downloaded
+            if code == EXIT_POWER_CUT:
+                cuts += 1
+                total_without_checkpoint += downloaded + start
+                continue
+            if code != 0:
+                print(f"ERROR: seed {seed} boot {boot} failed with exit {code}")
+                return False
+            total_without_checkpoint += image_size
+            break
+        else:
+            print(f"ERROR: seed {seed} never finished")
+            return False
+        total_cuts += cuts
+
+    # Each cut may lose at most one checkpoint interval plus the sector
+    # that was still being filled
+    allowed = 20 * image_size + total_cuts * (INTERVAL_SECTORS + 1) * SECTOR_SIZE
+    print(f"Power cuts:         {total_cuts} over 20 updates of "
+          f"{image_size} bytes")
+    print(f"Downloaded:         {total_downloaded} bytes "
+          f"({total_downloaded / (20 * image_size):.2f}x image)")
+    print(f"Without checkpoint: {total_without_checkpoint} bytes "
+          f"({total_without_checkpoint / (20 * image_size):.2f}x image)")
+    if total_downloaded > allowed:
+        print(f"ERROR: more than {allowed} bytes downloaded")
+        return False
+    return True
+
+
+def test_sigkill(binary, workdir):
+    """Real SIGKILL at random times instead of a planned cut"""
+    rng = random.Random(42)
+    image = rng.randbytes(512 * 1024)
+    device = Device(binary, workdir, image, "kill")
+    kills = 0
+    for boot in range(MAX_BOOTS):
+        process = subprocess.Popen(
+            device.command("--delay-us", "3000", "--seed", str(boot)),
+            stdout=subprocess.PIPE, text=True)
+        try:
+            stdout, _ = process.communicate(timeout=rng.uniform(0.02, 0.3))
+        except subprocess.TimeoutExpired:
+            process.send_signal(signal.SIGKILL)
+            process.communicate()
+            kills += 1
+            continue
+        if process.returncode != 0 or "OK hash" not in stdout:
+            print(f"ERROR: boot {boot} after {kills} kills: {stdout.strip()}")
+            return False
+        print(f"SIGKILL:            image verified after {kills} kills")
+        return True
+    print("ERROR: update never finished under SIGKILL")
+    return False
+
+
+def test_corrupted_flash_detected(binary, workdir):
+    """Damage below the checkpoint must fail the final SHA256 check"""
+    image = random.Random(7).randbytes(512 * 1024)
+    device = Device(binary, workdir, image, "corrupt")
+    code, _, _ = device.boot("--cut-after", str(300 * 1024))
+    if code != EXIT_POWER_CUT:
+        print("ERROR: planned power cut did not happen")
+        return False
+    with open(device.flash_path, "r+b") as f:
+        f.seek(1000)
+        byte = f.read(1)
+        f.seek(1000)
+        f.write(bytes([byte[0] ^ 0x01]))
+    code, start, _ = device.boot()
+    if start == 0 or code != 1:
+        print(f"ERROR: resumed from {start}, exit {code}; expected a resume "
+              "that fails verification")
+        return False
+    print("Corrupted flash:    detected by SHA256 after resume")
+    return True
+
+
+def main():
+    print("OTA Power Loss Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="ota_power_loss_")
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+        started = time.time()
+        results = [
+            test_random_power_cuts(binary, workdir),
+            test_sigkill(binary, workdir),
+            test_corrupted_flash_detected(binary, workdir),
+        ]
+        print(f"Elapsed:            {time.time() - started:.1f} s")
+        return all(results)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("OTA power loss test")
+    if not result:
+        print("\nOTA power loss test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
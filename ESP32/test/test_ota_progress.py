@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""
+Host test of OTA progress reporting
+
+Builds tools/ota_progress_host.cpp with lib/OTA/src/OTAProgress.cpp and
+lib/StatusReporter/src/StatusModel.cpp, then downloads a simulated image
+without progress reports, with the previous per-percent reports on the
+download thread, and with the progress channel sampled by a reporter.
+Checks that every download reports 100%, that sampling reports at most
+once per step, and that it keeps the download faster than the per-percent
+reports did.
+
+    python test_ota_progress.py [--runs N]
+"""
+
+import argparse
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import host_tool
+
+MODES = ("off", "inline", "sampled")
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "ota_progress_host", [
+        host_tool.lib_src("OTA", "OTAProgress.cpp"),
+        host_tool.lib_src("StatusReporter", "StatusModel.cpp"),
+    ], threads=True)
+
+
+def run(binary, *args):
+    process = subprocess.run([binary, *args], capture_output=True, text=True)
+    sys.stderr.write(process.stderr)
+    result = None
+    if process.stdout.strip():
+        result = dict(pair.split("=", 1) for pair in process.stdout.split())
+    return process.returncode, result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--runs", type=int, default=3)
+    args = parser.parse_args()
+
+    workdir = tempfile.mkdtemp(prefix="ota_progress_")
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+        print("OTA Progress Test")
+        print("=" * 40)
+
+        ok = True
+        # Best of several runs, interleaved so that load hits all modes
+        best = {}
+        for _ in range(args.runs):
+            for mode in MODES:
+                code, result = run(binary, "--mode", mode)
+                if code != 0 or result is None:
+                    print(f"ERROR: {mode} failed ({code})")
+                    ok = False
+                    continue
+                previous = best.get(mode)
+                if (previous is None or float(result["bytes_per_sec"]) >
+                        float(previous["bytes_per_sec"])):
+                    best[mode] = result
+        if len(best) != len(MODES):
+            return False
+
+        print(f"{'mode':<9}{'MB/s':>8}{'reports':>9}{'bytes':>8}")
+        for mode in MODES:
+            result = best[mode]
+            print(f"{mode:<9}{float(result['bytes_per_sec']) / 1e6:>8.0f}"
+                  f"{result['reports']:>9}{result['queued_bytes']:>8}")
+        off = float(best["off"]["bytes_per_sec"])
+        for mode in ("inline", "sampled"):
+            rate = float(best[mode]["bytes_per_sec"])
+            print(f"{mode}: {rate / off:.0%} of the throughput without reports")
+
+        if float(best["sampled"]["bytes_per_sec"]) <= float(
+                best["inline"]["bytes_per_sec"]):
+            print("ERROR: sampled reports slow the download as much as "
+                  "per-percent reports")
+            ok = False
+
+        # A coarser step reports less, still ending at 100%
+        code, result = run(binary, "--mode", "sampled", "--step", "10",
+                           "--interval-us", "10")
+        if code != 0 or result is None:
+            print(f"ERROR: sampled with step 10 failed ({code})")
+            ok = False
+        else:
+            print(f"step 10: {result['reports']} reports per download")
+            if float(result["reports"]) > 11:
+                print("ERROR: more than one report per step")
+                ok = False
+        return ok
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("OTA progress test")
+    if not result:
+        print("\nOTA progress test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
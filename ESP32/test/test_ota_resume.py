@@ -0,0 +1,333 @@
+#!/usr/bin/env python3
+"""
+Host test for resumable OTA downloads (HTTP Range)
+
+Runs a local HTTP stand-in for the firmware CDN that drops connections at
+random offsets, then downloads the image with tools/ota_resume_host.cpp:
+the retry loop of OTA::_downloadImage around lib/OTA/src/OTAResume.cpp,
+which decides when to send "Range: bytes=N-", whether a response continues
+the image, restarts it (the server ignored Range) or cannot be trusted
+(wrong Content-Range), and resumes an image restored from a checkpoint.
+Reports how many bytes were transferred in total compared to restarting
+every attempt. Skipped (exit status 77) without a C++ compiler.
+
+The server can also be used against a real device:
+    python test_ota_resume.py --serve firmware.bin --port 8000 --drop 0.3
+"""
+
+import argparse
+import hashlib
+import os
+import random
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+import host_tool
+
+MAX_RETRIES = 5
+
+
+class FlakyFirmwareServer(ThreadingHTTPServer):
+    """Serves one image and cuts the connection at planned offsets.
+
+    The first range_lies partial responses claim to start a byte later than
+    they do; status, if set, answers every request instead of the image.
+    """
+
+    daemon_threads = True
+
+    def __init__(self, image, drop_plan=None, drop_rate=0.0, honor_range=True,
+                 range_lies=0, status=None, seed=0,
+                 address=("127.0.0.1", 0)):
+        super().__init__(address, FirmwareHandler)
+        self.image = image
+        self.drop_plan = list(drop_plan or [])
+        self.drop_rate = drop_rate
+        self.honor_range = honor_range
+        self.range_lies = range_lies
+        self.status = status
+        self.random = random.Random(seed)
+        self.bytes_sent = 0
+        self.requests = 0
+        self.lock = threading.Lock()
+
+    def next_cut(self, length):
+        """Number of bytes to send before dropping, or None for no drop"""
+        with self.lock:
+            self.requests += 1
+            if self.drop_plan:
+                fraction = self.drop_plan.pop(0)
+                return None if fraction is None else int(length * fraction)
+            if self.random.random() < self.drop_rate:
+                return self.random.randrange(length)
+            return None
+
+    def next_range_lie(self):
+        with self.lock:
+            if self.range_lies > 0:
+                self.range_lies -= 1
+                return 1
+            return 0
+
+
+class FirmwareHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        pass
+
+    def do_GET(self):
+        image = self.server.image
+        if self.server.status:
+            with self.server.lock:
+                self.server.requests += 1
+            self.send_response(self.server.status)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        start = 0
+        match = re.match(r"bytes=(\d+)-$", self.headers.get("Range", ""))
+        if match and self.server.honor_range:
+            start = int(match.group(1))
+            if start >= len(image):
+                self.send_response(416)
+                self.send_header("Content-Range", f"bytes */{len(image)}")
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            self.send_response(206)
+            claimed = start + self.server.next_range_lie()
+            self.send_header(
+                "Content-Range",
+                f"bytes {claimed}-{len(image) - 1}/{len(image)}"
+            )
+        else:
+            self.send_response(200)
+        body = image[start:]
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Accept-Ranges", "bytes")
+        self.end_headers()
+
+        cut = self.server.next_cut(len(body))
+        payload = body if cut is None else body[:cut]
+        try:
+            self.wfile.write(payload)
+            self.wfile.flush()
+        except (BrokenPipeError, ConnectionResetError):
+            return
+        finally:
+            with self.server.lock:
+                self.server.bytes_sent += len(payload)
+        if cut is not None:
+            self.close_connection = True
+            self.connection.shutdown(socket.SHUT_RDWR)
+
+
+def run_download(workdir, binary, image, resume=True, honor_range=True,
+                 drop_plan=None, range_lies=0, status=None, restore=None):
+    """Downloads image with the host tool; restore bytes are already in
+    flash. Returns the tool's summary, the image it wrote and the server."""
+    server = FlakyFirmwareServer(image, drop_plan=drop_plan,
+                                 honor_range=honor_range,
+                                 range_lies=range_lies, status=status)
+    thread = threading.Thread(target=server.serve_forever, args=(0.05,),
+                              daemon=True)
+    thread.start()
+    out = os.path.join(workdir, "image.bin")
+    if os.path.exists(out):
+        os.remove(out)
+    command = [binary, "--port", str(server.server_address[1]),
+               "--out", out, "--attempts", str(MAX_RETRIES)]
+    if not resume:
+        command.append("--no-resume")
+    if restore is not None:
+        checkpoint = os.path.join(workdir, "checkpoint.bin")
+        with open(checkpoint, "wb") as f:
+            f.write(restore)
+        command += ["--restore", checkpoint, "--total", str(len(image))]
+    try:
+        process = subprocess.run(command, capture_output=True, text=True,
+                                 timeout=120)
+    finally:
+        server.shutdown()
+        server.server_close()
+    sys.stderr.write(process.stderr)
+    summary = dict(pair.split("=", 1) for pair in process.stdout.split())
+    written = None
+    if os.path.exists(out):
+        with open(out, "rb") as f:
+            written = f.read()
+    return summary, written, server
+
+
+def test_resume_transfers_less(workdir, binary):
+    """Resume should move roughly one image, restart several"""
+    image = os.urandom(1536 * 1024)
+    rng = random.Random(1)
+    # Four drops at random offsets, then a clean transfer
+    plan = [rng.uniform(0.5, 0.95) for _ in range(4)] + [None]
+
+    summary, written, server = run_download(workdir, binary, image,
+                                            drop_plan=plan)
+    if written != image:
+        print(f"ERROR: resumed image does not match ({summary})")
+        return False
+    resumed_bytes, requests = server.bytes_sent, server.requests
+    _, _, server = run_download(workdir, binary, image, resume=False,
+                                drop_plan=plan)
+    restart_bytes = server.bytes_sent
+
+    print(f"Image size:       {len(image)} bytes")
+    print(f"Resume:           {resumed_bytes} bytes in {requests} requests, "
+          f"{summary['ranged']} with Range "
+          f"({resumed_bytes / len(image):.2f}x image)")
+    print(f"Restart each try: {restart_bytes} bytes "
+          f"({restart_bytes / len(image):.2f}x image)")
+    if resumed_bytes != len(image) or summary["ranged"] != "4":
+        print("ERROR: resumed download should transfer every byte exactly once")
+        return False
+    return resumed_bytes < restart_bytes
+
+
+def test_server_ignores_range(workdir, binary):
+    """A server without Range support must trigger a full restart"""
+    image = os.urandom(256 * 1024)
+    summary, written, server = run_download(
+        workdir, binary, image, honor_range=False, drop_plan=[0.6, None])
+    print(f"Range ignored:    {server.bytes_sent} bytes, "
+          f"{summary['restarts']} restart(s)")
+    if written != image or summary["restarts"] != "1":
+        print("ERROR: expected exactly one restart and a matching image")
+        return False
+    return True
+
+
+def test_content_range_mismatch(workdir, binary):
+    """Partial content at the wrong offset drops the image, then starts
+    over from byte 0"""
+    image = os.urandom(256 * 1024)
+    summary, written, server = run_download(
+        workdir, binary, image, drop_plan=[0.5, None, None], range_lies=1)
+    print(f"Wrong range:      {summary['mismatches']} rejected, "
+          f"{server.requests} requests")
+    if written != image or summary["mismatches"] != "1" or \
+            server.requests != 3:
+        print(f"ERROR: a wrong Content-Range was not handled ({summary})")
+        return False
+    return True
+
+
+def test_checkpoint_restore(workdir, binary):
+    """An image restored from a checkpoint asks only for the rest, or
+    starts over when the server ignores Range"""
+    image = os.urandom(256 * 1024)
+    committed = 40 * 4096
+    summary, written, server = run_download(workdir, binary, image,
+                                            restore=image[:committed])
+    print(f"Checkpoint:       {server.bytes_sent} bytes after "
+          f"{committed} restored")
+    if written != image or server.bytes_sent != len(image) - committed or \
+            summary["ranged"] != "1":
+        print(f"ERROR: restored download did not continue ({summary})")
+        return False
+    summary, written, _ = run_download(workdir, binary, image,
+                                       honor_range=False,
+                                       restore=image[:committed])
+    if written != image or summary["restarts"] != "1":
+        print(f"ERROR: restored image was kept for a full body ({summary})")
+        return False
+    return True
+
+
+def test_client_error_is_fatal(workdir, binary):
+    """A 4xx ends the update without retries"""
+    image = os.urandom(4096)
+    summary, written, server = run_download(workdir, binary, image,
+                                            status=404)
+    print(f"Not found:        {summary['result']} after "
+          f"{server.requests} request(s)")
+    if written is not None or summary["result"] != "fatal" or \
+            server.requests != 1:
+        print("ERROR: a 404 was retried")
+        return False
+    return True
+
+
+def test_random_drops(workdir, binary):
+    """Random drop offsets over many seeds never corrupt the image"""
+    image = os.urandom(128 * 1024)
+    for seed in range(20):
+        rng = random.Random(seed)
+        plan = [rng.random() for _ in range(rng.randrange(MAX_RETRIES))]
+        _, written, server = run_download(workdir, binary, image,
+                                          drop_plan=plan + [None])
+        if written != image or server.bytes_sent != len(image):
+            print(f"ERROR: seed {seed} produced a bad image or extra bytes")
+            return False
+    print("Random drops:     20 seeds OK")
+    return True
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "ota_resume_host", [
+        host_tool.lib_src("OTA", "OTAResume.cpp"),
+    ])
+
+
+def serve(path, port, drop_rate, honor_range):
+    with open(path, "rb") as f:
+        image = f.read()
+    server = FlakyFirmwareServer(image, drop_rate=drop_rate,
+                                 honor_range=honor_range,
+                                 address=("0.0.0.0", port))
+    print(f"Serving {path} ({len(image)} bytes) on port {port}, "
+          f"SHA256 {hashlib.sha256(image).hexdigest()}")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        print(f"\nTotal bytes sent: {server.bytes_sent} "
+              f"in {server.requests} requests")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--serve", metavar="FIRMWARE", help="serve a real image")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--drop", type=float, default=0.3,
+                        help="probability of dropping each response")
+    parser.add_argument("--no-range", action="store_true",
+                        help="ignore Range headers")
+    args = parser.parse_args()
+
+    if args.serve:
+        serve(args.serve, args.port, args.drop, not args.no_range)
+        sys.exit(0)
+
+    print("OTA Resume Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="ota_resume_")
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            host_tool.skip("OTA resume test")
+        results = [
+            test_resume_transfers_less(workdir, binary),
+            test_server_ignores_range(workdir, binary),
+            test_content_range_mismatch(workdir, binary),
+            test_checkpoint_restore(workdir, binary),
+            test_client_error_is_fatal(workdir, binary),
+            test_random_drops(workdir, binary),
+        ]
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+    if not all(results):
+        print("\nOTA resume test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
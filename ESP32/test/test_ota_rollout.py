@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""
+Host test of staged OTA rollouts
+
+Builds tools/ota_rollout_host.cpp with lib/OTA/src/OTARollout.cpp and
+places two fleets in rollout waves: random device IDs, and consecutive
+MAC addresses of one vendor, as a production batch has. Checks that every
+wave reaches its share of each fleet within statistical bounds, that a
+device in a wave stays in every wider one, that 100% reaches every device,
+that two salts pick nearly independent first waves, and that the buckets
+match the ones the firmware computed so far.
+
+    python test_ota_rollout.py [--devices N]
+"""
+
+import argparse
+import math
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import host_tool
+
+WAVES = (1, 5, 25, 50, 100)
+
+# Buckets must never change: devices already updated in a wave would be
+# left out of it and others added
+KNOWN_BUCKETS = {
+    ("A0B1C2D3E4F5", "abc"): 3879,
+    ("3C6105ABCDEF", "abc"): 1512,
+}
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "ota_rollout_host", [
+        host_tool.lib_src("OTA", "OTARollout.cpp"),
+    ])
+
+
+def plan(binary, devices, salt, waves=WAVES):
+    """({device: (bucket, wave)}, [wave summaries])"""
+    process = subprocess.run(
+        [binary, "--salt", salt, "--waves", ",".join(map(str, waves))],
+        input="".join(f"{device}\n" for device in devices),
+        capture_output=True, text=True, check=True)
+    placed = {}
+    summaries = []
+    for line in process.stdout.splitlines():
+        fields = dict(pair.split("=", 1) for pair in line.split())
+        if "device" in fields:
+            wave = None if fields["wave"] == "none" else float(fields["wave"])
+            placed[fields["device"]] = (int(fields["bucket"]), wave)
+        else:
+            summaries.append(fields)
+    return placed, summaries
+
+
+def in_wave(placed, percent):
+    return {device for device, (_, wave) in placed.items()
+            if wave is not None and wave <= percent}
+
+
+def check_fleet(binary, name, devices, salt):
+    ok = True
+    placed, summaries = plan(binary, devices, salt)
+    print(f"{name} ({len(devices)} devices, salt {salt}):")
+    for summary in summaries:
+        percent = float(summary["wave"])
+        reached = int(summary["devices"])
+        expected = len(devices) * percent / 100
+        # Four standard deviations of a binomial draw
+        bound = 4 * math.sqrt(len(devices) * percent / 100 *
+                              (1 - percent / 100)) + 1
+        print(f"  {percent:>5g}%  {reached:>6} devices  "
+              f"(expected {expected:.0f} +- {bound:.0f})")
+        if abs(reached - expected) > bound:
+            print(f"ERROR: the {percent:g}% wave is off its share")
+            ok = False
+    if len(in_wave(placed, 100)) != len(devices):
+        print("ERROR: 100% did not reach every device")
+        ok = False
+
+    # The waves any operator might pick nest: a device reached stays reached
+    fine, _ = plan(binary, devices, salt, (0.5, 2, 10, 33.3, 75, 99.99))
+    steps = sorted({0.5, 2, 10, 33.3, 75, 99.99})
+    for narrow, wide in zip(steps, steps[1:]):
+        if not in_wave(fine, narrow) <= in_wave(fine, wide):
+            print(f"ERROR: a device of the {narrow}% wave left at {wide}%")
+            ok = False
+    if any(fine[device][0] != placed[device][0] for device in devices):
+        print("ERROR: a bucket changed between runs")
+        ok = False
+    return ok, placed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--devices", type=int, default=10000)
+    args = parser.parse_args()
+
+    print("OTA Rollout Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="ota_rollout_")
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+
+        ok = True
+        rng = random.Random(1)
+        # DeviceConfigManager::getDeviceId(): the MAC as %04X%08X
+        fleets = {
+            "random IDs": [f"{rng.getrandbits(48):012X}"
+                           for _ in range(args.devices)],
+            "one batch": [f"{0x3C6105000000 + i:012X}"
+                          for i in range(args.devices)],
+        }
+        salt = "0f3a" * 16
+        placed = {}
+        for name, devices in fleets.items():
+            fleet_ok, placed[name] = check_fleet(binary, name, devices, salt)
+            ok = ok and fleet_ok
+
+        # Each release salts with its own SHA256: the devices of one first
+        # wave should not be the first again next time
+        devices = fleets["one batch"]
+        other, _ = plan(binary, devices, "9c1e" * 16)
+        first = in_wave(placed["one batch"], 25)
+        again = len(first & in_wave(other, 25))
+        expected = len(devices) * 0.25 * 0.25
+        print(f"25% waves of two salts share {again} devices "
+              f"(independent: {expected:.0f})")
+        if abs(again - expected) > 4 * math.sqrt(expected) + 1:
+            print("ERROR: the salts do not pick independent waves")
+            ok = False
+
+        known, _ = plan(binary, [device for device, _ in KNOWN_BUCKETS], "abc")
+        for (device, _), bucket in KNOWN_BUCKETS.items():
+            if known[device][0] != bucket:
+                print(f"ERROR: {device} moved from bucket {bucket} to "
+                      f"{known[device][0]}")
+                ok = False
+        return ok
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("OTA rollout test")
+    if not result:
+        print("\nOTA rollout test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Byte cost per device-hour of MQTT presence tracking
+
+Builds tools/presence_cost_host.cpp with lib/MqttController/src/
+MqttPresence.cpp and prints what keepalive pings and heartbeats cost an
+idle device per hour for the old settings and the new defaults. Checks
+that the compact heartbeat stays a small fraction of sending the status
+document, and that the new defaults cost less than the old keepalive.
+
+    python test_presence_cost.py
+"""
+
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import host_tool
+
+# (name, keepalive, heartbeat, payload)
+SCENARIOS = [
+    ("old: keepalive 15 s", 15, 0, "compact"),
+    ("status doc every 5 min", 60, 300, "status"),
+    ("default: hb every 5 min", 60, 300, "compact"),
+    ("hb every 1 min", 60, 60, "compact"),
+    ("keepalive 120 s, hb 5 min", 120, 300, "compact"),
+]
+# The compact heartbeat against the status document, per message
+MIN_PAYLOAD_RATIO = 5
+MAX_HEARTBEAT_PAYLOAD = 32
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "presence_cost_host", [
+        host_tool.lib_src("MqttController", "MqttPresence.cpp"),
+    ])
+
+
+def measure(binary, keepalive, heartbeat, payload):
+    process = subprocess.run(
+        [binary, "--keepalive", str(keepalive), "--heartbeat", str(heartbeat),
+         "--payload", payload], capture_output=True, text=True)
+    sys.stderr.write(process.stderr)
+    return dict(pair.split("=", 1) for pair in process.stdout.split()), \
+        process.returncode
+
+
+def main():
+    print("Presence Cost Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="presence_cost_")
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+
+        ok = True
+        results = {}
+        print(f"{'':26s} {'pings':>6s} {'beats':>6s} {'MQTT B/h':>9s} "
+              f"{'wire B/h':>9s} {'offline':>8s}")
+        for name, keepalive, heartbeat, payload in SCENARIOS:
+            result, code = measure(binary, keepalive, heartbeat, payload)
+            if code != 0:
+                print(f"ERROR: {name}: host tool failed ({code})")
+                ok = False
+                continue
+            results[name] = result
+            print(f"{name:26s} {result['pings']:>6s} {result['heartbeats']:>6s} "
+                  f"{result['mqtt_bytes']:>9s} {result['wire_bytes']:>9s} "
+                  f"{result['offline_after_s']:>6s} s")
+
+        default = results["default: hb every 5 min"]
+        status = results["status doc every 5 min"]
+        old = results["old: keepalive 15 s"]
+        print(f"Per connection: will {default['connect_will_bytes']} B in "
+              f"CONNECT, birth {default['birth_bytes']} B")
+        print(f"Heartbeat payload: {default['heartbeat_payload']} B, status "
+              f"document {status['heartbeat_payload']} B")
+
+        compact = int(default["heartbeat_payload"])
+        if compact > MAX_HEARTBEAT_PAYLOAD or \
+                compact * MIN_PAYLOAD_RATIO > int(status["heartbeat_payload"]):
+            print("ERROR: heartbeat payload is not compact")
+            ok = False
+        if int(default["wire_bytes"]) >= int(old["wire_bytes"]):
+            print("ERROR: defaults cost more than the old keepalive")
+            ok = False
+        return ok
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("presence cost test")
+    if not result:
+        print("\nPresence cost test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""
+Fleet reconnect test for the MQTT reconnect backoff
+
+Builds tools/reconnect_sim_host.cpp with lib/MqttController/src/
+MqttReconnectPolicy.cpp and restarts a modelled local broker under a
+fleet of devices, once with the old fixed 2 s reconnect timer and once
+with the backoff. Prints the connection-rate curve of both and checks that
+the backoff brings the whole fleet back without knocking the broker over.
+
+    python test_reconnect_backoff.py [--devices N] [--curve]
+"""
+
+import argparse
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import host_tool
+
+# Whole fleet back on the broker within this time after the restart
+MAX_RECOVERY_S = 120
+CURVE_WIDTH = 50
+
+
+def build_host_tool(workdir):
+    return host_tool.build(workdir, "reconnect_sim_host", [
+        host_tool.lib_src("MqttController", "MqttReconnectPolicy.cpp"),
+    ])
+
+
+def simulate(binary, policy, devices, seed=1):
+    """Summary and per-second curve of one run, plus the exit code"""
+    process = subprocess.run(
+        [binary, "--policy", policy, "--devices", str(devices),
+         "--accept-rate", str(devices // 10), "--overload", str(devices // 2),
+         "--duration", "300", "--seed", str(seed), "--curve"],
+        capture_output=True, text=True)
+    sys.stderr.write(process.stderr)
+    lines = [dict(pair.split("=", 1) for pair in line.split())
+             for line in process.stdout.splitlines()]
+    return lines[-1], lines[:-1], process.returncode
+
+
+def print_curve(curve, seconds=60, step=3):
+    """Connection attempts per second, # for accepted and . for refused"""
+    peak = max(int(point["attempts"]) for point in curve) or 1
+    for point in curve[:seconds:step]:
+        attempts = int(point["attempts"])
+        accepted = int(point["accepted"])
+        bar = ("#" * (accepted * CURVE_WIDTH // peak) +
+               "." * ((attempts - accepted) * CURVE_WIDTH // peak))
+        print(f"  {int(point['t']):4d}s {attempts:6d} {bar}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--devices", type=int, default=5000)
+    parser.add_argument("--curve", action="store_true",
+                        help="print the connection-rate curves")
+    args = parser.parse_args()
+
+    print("Reconnect Backoff Test")
+    print("=" * 40)
+    workdir = tempfile.mkdtemp(prefix="reconnect_sim_")
+    try:
+        binary = build_host_tool(workdir)
+        if not binary:
+            return None
+
+        ok = True
+        for policy in ("fixed", "backoff"):
+            summary, curve, code = simulate(binary, policy, args.devices)
+            recovered = int(summary["recovered_s"])
+            print(f"{policy:8s} recovered: "
+                  f"{f'{recovered} s' if recovered >= 0 else 'never'}, "
+                  f"broker crashes: {summary['crashes']}, "
+                  f"peak attempts/s: {summary['peak_attempts']}, "
+                  f"attempts: {summary['attempts']}")
+            if args.curve or policy == "backoff":
+                print_curve(curve)
+            if policy == "backoff" and (
+                    code != 0 or recovered < 0 or recovered > MAX_RECOVERY_S
+                    or int(summary["crashes"]) != 1):
+                print("ERROR: backoff did not bring the fleet back cleanly")
+                ok = False
+
+        # The jitter, not one lucky draw, spreads the fleet out
+        for seed in range(2, 6):
+            summary, _, code = simulate(binary, "backoff", args.devices, seed)
+            if code != 0 or int(summary["crashes"]) != 1:
+                print(f"ERROR: seed {seed}: {summary['crashes']} crashes, "
+                      f"{summary['violations']} delays out of bounds")
+                ok = False
+        return ok
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("reconnect backoff test")
+    if not result:
+        print("\nReconnect backoff test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
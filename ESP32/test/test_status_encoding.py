@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Host test of the status message encodings
+
+Builds tools/status_encode_host.cpp with lib/StatusReporter/src/
+StatusModel.cpp, StatusEncoder.cpp and ArduinoJson, then replays the status
+updates of one connection with an OTA update through the previous global
+JsonDocument and String serialization, and through StatusModel with
+StatusEncoder JSON and MessagePack. Checks that JSON sends the same status
+as before without heap allocations, that the MessagePack deltas merge back
+into the status, and that they cut the bytes sent. Then writes the model
+from three threads while reading it, and checks that no snapshot is torn.
+
+ArduinoJson is taken from $ARDUINOJSON_DIR, or from the PlatformIO library
+folder after a device build (.pio/libdeps/<env>/ArduinoJson). Without it,
+or without a C++ compiler, the test is skipped: it prints SKIP and exits
+with status 77, which automake and ctest (SKIP_RETURN_CODE) report as
+skipped rather than passed.
+
+    python test_status_encoding.py [--iterations N]
+"""
+
+import argparse
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import host_tool
+
+# MessagePack bytes of the whole connection against the previous JSON
+MAX_MSGPACK_RATIO = 0.3
+
+
+def build_host_tool(workdir, arduinojson):
+    return host_tool.build(workdir, "status_encode_host", [
+        host_tool.lib_src("StatusReporter", "StatusEncoder.cpp"),
+        host_tool.lib_src("StatusReporter", "StatusModel.cpp"),
+    ], includes=[arduinojson], threads=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--iterations", type=int, default=200)
+    args = parser.parse_args()
+
+    arduinojson = host_tool.find_arduinojson()
+    if not arduinojson:
+        print("ArduinoJson not found (set ARDUINOJSON_DIR or run a "
+              "PlatformIO build), skipping status encoding test")
+        return None
+
+    workdir = tempfile.mkdtemp(prefix="status_encode_")
+    try:
+        binary = build_host_tool(workdir, arduinojson)
+        if not binary:
+            return None
+        print("Status Encoding Test")
+        print("=" * 40)
+        process = subprocess.run(
+            [binary, "--iterations", str(args.iterations)],
+            capture_output=True, text=True)
+        sys.stderr.write(process.stderr)
+        results = {}
+        concurrency = None
+        for line in process.stdout.splitlines():
+            if line.startswith("concurrency "):
+                concurrency = dict(pair.split("=", 1)
+                                   for pair in line.split()[1:])
+                continue
+            result = dict(pair.split("=", 1) for pair in line.split())
+            results[result["format"]] = result
+
+        ok = process.returncode == 0
+        if not ok:
+            print(f"ERROR: host tool failed ({process.returncode})")
+        print(f"{'format':<9}{'messages':>9}{'bytes':>8}{'first':>7}"
+              f"{'max':>6}{'ns/msg':>8}{'allocs':>8}")
+        for name in ("string", "json", "msgpack"):
+            result = results.get(name)
+            if result is None:
+                print(f"ERROR: no result for {name}")
+                return False
+            print(f"{name:<9}{result['messages']:>9}{result['bytes']:>8}"
+                  f"{result['first_bytes']:>7}{result['max_bytes']:>6}"
+                  f"{result['ns_per_message']:>8}"
+                  f"{result['heap_allocations']:>8}")
+
+        previous = int(results["string"]["bytes"])
+        if int(results["json"]["bytes"]) != previous:
+            print("ERROR: JSON encoding differs from the previous payload")
+            ok = False
+        for name in ("json", "msgpack"):
+            if results[name]["heap_allocations"] != "0":
+                print(f"ERROR: {name} allocates per message")
+                ok = False
+        msgpack = int(results["msgpack"]["bytes"])
+        print(f"MessagePack: {msgpack / previous:.0%} of the previous bytes")
+        if msgpack > previous * MAX_MSGPACK_RATIO:
+            print("ERROR: MessagePack deltas do not save enough")
+            ok = False
+
+        if concurrency is None:
+            print("ERROR: no concurrency result")
+            return False
+        print(f"Concurrent writes: {concurrency['writes']}, snapshots "
+              f"{concurrency['snapshots']}, torn {concurrency['torn']} "
+              f"(writer waits {concurrency['write_waits']}, read retries "
+              f"{concurrency['read_retries']})")
+        if concurrency["torn"] != "0":
+            print("ERROR: a snapshot mixed two writes")
+            ok = False
+        return ok
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    result = main()
+    if result is None:
+        host_tool.skip("status encoding test")
+    if not result:
+        print("\nStatus encoding test FAILED")
+        sys.exit(1)
+    print("\nTest completed!")
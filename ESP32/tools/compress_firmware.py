@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""
+Compress firmware images for OTA and benchmark the decompressor
+
+The device inflates images with the ROM miniz decompressor into a 4 KB
+ring buffer (lib/OTA/src/OTAInflater.h), so images must be zlib streams
+with a 4 KB window (wbits=12).
+
+Usage:
+    python compress_firmware.py compress firmware.bin -o firmware.bin.z
+    python compress_firmware.py bench firmware.bin [--runs 20]
+
+bench decodes with the device's decoder, lib/OTA/src/OTAInflater.cpp built
+on the host against the single-file miniz (tools/inflate_host.cpp; needs a
+C++ compiler and MINIZ_DIR, see test/host_tool.py), and reports its
+throughput and the heap it actually allocates.
+
+The MQTT command for a compressed image:
+    {"OTA": {"firmwareUrl": ".../firmware.bin.z", "compression": "zlib",
+             "SHA256": "<hash>", "SHA256Scope": "decompressed"}}
+"""
+
+import argparse
+import hashlib
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                "..", "test"))
+import host_tool  # noqa: E402
+
+WINDOW_BITS = 12  # 4 KB history, matches OTAInflater::WINDOW_SIZE
+WINDOW_SIZE = 1 << WINDOW_BITS
+CHUNK_SIZE = 4096  # download buffer size on the device
+
+
+def compress(image, level=9):
+    compressor = zlib.compressobj(level, zlib.DEFLATED, WINDOW_BITS, 9)
+    return compressor.compress(image) + compressor.flush()
+
+
+def inflate_in_chunks(data):
+    """Decompress like the device: 4 KB input pieces, 4 KB output window"""
+    inflater = zlib.decompressobj(WINDOW_BITS)
+    out = bytearray()
+    for pos in range(0, len(data), CHUNK_SIZE):
+        pending = data[pos : pos + CHUNK_SIZE]
+        while pending:
+            out += inflater.decompress(pending, WINDOW_SIZE)
+            pending = inflater.unconsumed_tail
+    out += inflater.flush()
+    if not inflater.eof:
+        raise ValueError("compressed stream is truncated")
+    return bytes(out)
+
+
+def decode_on_host(inflater, packed, runs, workdir):
+    """Result fields of tools/inflate_host for one compressed image"""
+    path = os.path.join(workdir, "image.z")
+    with open(path, "wb") as f:
+        f.write(packed)
+    proc = subprocess.run([inflater, path, "--chunk", str(CHUNK_SIZE),
+                           "--runs", str(runs)], capture_output=True,
+                          text=True)
+    fields = dict(re.findall(r"(\w+)=(\S+)", proc.stdout))
+    if proc.returncode != 0:
+        raise ValueError("device decoder failed: "
+                         f"{proc.stdout}{proc.stderr}")
+    return fields
+
+
+def bench(image, runs):
+    workdir = tempfile.mkdtemp(prefix="compress_bench_")
+    try:
+        inflater = host_tool.build_inflater(workdir)
+        results = []
+        for level in (1, 6, 9):
+            start = time.perf_counter()
+            packed = compress(image, level)
+            compress_s = time.perf_counter() - start
+            if inflate_in_chunks(packed) != image:
+                raise ValueError("round trip mismatch at level %d" % level)
+            fields = (decode_on_host(inflater, packed, runs, workdir)
+                      if inflater else None)
+            results.append((level, len(packed), compress_s, fields))
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    print(f"Image: {len(image)} bytes, SHA256 {hashlib.sha256(image).hexdigest()}")
+    print(f"Window: {WINDOW_SIZE} bytes, input chunk: {CHUNK_SIZE} bytes")
+    print()
+    print(f"{'level':>5} {'compressed':>12} {'ratio':>7} {'saved':>7} "
+          f"{'compress s':>11} {'inflate MB/s':>13} {'heap':>7}")
+    for level, size, compress_s, fields in results:
+        rate = fields["mbps"] if fields else "-"
+        heap = fields["heap_peak"] if fields else "-"
+        print(f"{level:>5} {size:>12} {size / len(image):>7.3f} "
+              f"{100.0 * (1 - size / len(image)):>6.1f}% {compress_s:>11.3f} "
+              f"{rate:>13} {heap:>7}")
+    print()
+    if not inflater:
+        print("Device decoder not built: no throughput or heap figures")
+        return
+    print("Inflate throughput is OTAInflater with miniz tinfl on this host, "
+          "not the device clock.")
+    print(f"Heap is what begin() and feed() allocate at peak; "
+          f"memoryUsage() {results[0][3]['memory']} bytes on this host. "
+          f"The device logs its own figure when an update starts.")
+
+
+def _read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Compressed OTA image tool")
+    sub = parser.add_subparsers(dest="command", required=True)
+    p_compress = sub.add_parser("compress", help="write a zlib image")
+    p_compress.add_argument("image")
+    p_compress.add_argument("-o", "--output", required=True)
+    p_compress.add_argument("--level", type=int, default=9)
+    p_bench = sub.add_parser("bench", help="ratio, throughput and RAM")
+    p_bench.add_argument("image")
+    p_bench.add_argument("--runs", type=int, default=10)
+    args = parser.parse_args()
+
+    image = _read(args.image)
+    if args.command == "compress":
+        packed = compress(image, args.level)
+        if inflate_in_chunks(packed) != image:
+            print("ERROR: round trip check failed")
+            sys.exit(1)
+        with open(args.output, "wb") as f:
+            f.write(packed)
+        print(f"Compressed {len(image)} -> {len(packed)} bytes "
+              f"({100.0 * len(packed) / len(image):.1f}%)")
+        print(f"SHA256 (decompressed): {hashlib.sha256(image).hexdigest()}")
+        print(f"SHA256 (compressed):   {hashlib.sha256(packed).hexdigest()}")
+    else:
+        bench(image, args.runs)
@@ -0,0 +1,259 @@
+// Host build of the config response parser (DeviceConfigParser), used by
+// test/test_config_parse.py to measure peak memory and parse time on the
+// response corpus in test/config_responses.
+//
+//   c++ -std=c++11 -O2 -I<ArduinoJson>/src -I../lib/DeviceConfigManager/src
+//       -o config_parse_host config_parse_host.cpp
+//       ../lib/DeviceConfigManager/src/DeviceConfigParser.cpp
+//   ./config_parse_host [--iterations N] response.json...
+//   ./config_parse_host --push response.json push.json...
+//
+// Each response is parsed two ways, from a buffer standing in for the
+// socket:
+//   stream  the filtered parse into DeviceConfig, in a ConfigArena
+//   string  the previous code: the body copied into a string (getString),
+//           an unfiltered JsonDocument on the heap, a string per field
+// and one line is printed per file:
+//   <file> status=<s> field=<key|-> stream_peak=<bytes> stream_us=<us>
+//       string_status=<s> string_peak=<bytes> string_us=<us>
+// followed, for a valid response, by an indented key=value line per field.
+// Peaks are the bytes a parse holds at once, including the body copy. Slots
+// are twice as large on a 64-bit host as on the ESP32, so device numbers are
+// smaller; the ratio is what carries over.
+//
+// With --push, the first file is a config response and every following one
+// a config push (applyConfigPush), applied in order. One line per push:
+//   <file> push=<s> error=<s> field=<key|-> changed=<keys|-> reconnect=<0|1>
+// followed by the resulting config, as above.
+//
+// Exit status: 0 all parsed (valid or not), 2 usage or I/O error.
+
+#include "DeviceConfigParser.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+static const size_t HOST_ARENA_SIZE = 16384;
+
+// malloc with a running total, for the unfiltered document
+class CountingAllocator : public ArduinoJson::Allocator {
+public:
+  size_t current = 0;
+  size_t peak = 0;
+
+  void add(size_t size) {
+    current += size;
+    if (current > peak) {
+      peak = current;
+    }
+  }
+
+  void *allocate(size_t size) override {
+    size_t *block = static_cast<size_t *>(malloc(sizeof(size_t) + size));
+    if (!block) {
+      return nullptr;
+    }
+    *block = size;
+    add(size);
+    return block + 1;
+  }
+
+  void deallocate(void *ptr) override {
+    if (ptr) {
+      size_t *block = static_cast<size_t *>(ptr) - 1;
+      current -= *block;
+      free(block);
+    }
+  }
+
+  void *reallocate(void *ptr, size_t size) override {
+    if (!ptr) {
+      return allocate(size);
+    }
+    size_t *block = static_cast<size_t *>(ptr) - 1;
+    size_t oldSize = *block;
+    block = static_cast<size_t *>(realloc(block, sizeof(size_t) + size));
+    if (!block) {
+      return nullptr;
+    }
+    *block = size;
+    current -= oldSize;
+    add(size);
+    return block + 1;
+  }
+};
+
+struct StringConfig {
+  std::string version, mqttHost, mqttUser, mqttPassword;
+  int mqttPort;
+};
+
+// The previous DeviceConfigManager::parseConfigResponse, with std::string
+// for String. Returns a status name like configParseStatusString().
+static const char *parseAsString(const std::string &received,
+                                 CountingAllocator &heap,
+                                 StringConfig &out) {
+  std::string response(received); // http.getString()
+  heap.add(response.size() + 1);
+  const char *status = "ok";
+  {
+    JsonDocument doc(&heap);
+    DeserializationError error = deserializeJson(doc, response);
+    JsonObject config = doc["config"];
+    if (error) {
+      status = error == DeserializationError::NoMemory ? "no_memory"
+                                                       : "invalid_json";
+    } else if (!doc["version"].is<const char *>() || config.isNull() ||
+               !config["MQTT_HOST"].is<const char *>()) {
+      status = "missing_field";
+    } else if (!config["MQTT_PORT"].is<int>()) {
+      status = config["MQTT_PORT"].isNull() ? "missing_field" : "wrong_type";
+    } else {
+      out.mqttHost = config["MQTT_HOST"].as<const char *>();
+      out.mqttPort = config["MQTT_PORT"].as<int>();
+      out.mqttUser = config["MQTT_USER"] | "";
+      out.mqttPassword = config["MQTT_PASSWORD"] | "";
+      out.version = doc["version"].as<const char *>();
+      heap.add(out.mqttHost.size() + out.mqttUser.size() +
+               out.mqttPassword.size() + out.version.size() + 4);
+    }
+  }
+  return status;
+}
+
+static bool readFile(const char *path, std::string &body) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  body = contents.str();
+  return true;
+}
+
+static double microsSince(std::chrono::steady_clock::time_point start,
+                          int iterations) {
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: config_parse_host [--iterations N] response.json...\n"
+          "       config_parse_host --push response.json push.json...\n");
+}
+
+static const char *baseName(const char *path) {
+  const char *name = strrchr(path, '/');
+  return name ? name + 1 : path;
+}
+
+static void printConfig(const DeviceConfig &config) {
+  printf("  version=%s\n  host=%s\n  port=%d\n  user=%s\n  password=%s\n"
+         "  status_format=%s\n",
+         config.version, config.mqttHost, (int)config.mqttPort,
+         config.mqttUser, config.mqttPassword, config.statusFormat);
+}
+
+static int applyPushes(int argc, char **argv) {
+  static StaticConfigArena<HOST_ARENA_SIZE> arena;
+  std::string body;
+  if (!readFile(argv[0], body)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+  DeviceConfig config;
+  if (parseDeviceConfig(body, config, arena).status != CONFIG_PARSE_OK) {
+    fprintf(stderr, "%s is not a valid config response\n", argv[0]);
+    return 2;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    std::string push;
+    if (!readFile(argv[i], push)) {
+      fprintf(stderr, "cannot read %s\n", argv[i]);
+      return 2;
+    }
+    ConfigPushResult result =
+        applyConfigPush(push.data(), push.size(), config, arena);
+    std::string changed;
+    for (size_t f = 0; f < DEVICE_CONFIG_FIELD_COUNT; f++) {
+      if (result.changed & (1u << f)) {
+        changed += changed.empty() ? "" : ",";
+        changed += DEVICE_CONFIG_FIELDS[f].key;
+      }
+    }
+    printf("%s push=%s error=%s field=%s changed=%s reconnect=%d\n",
+           baseName(argv[i]), configPushStatusString(result.status),
+           configParseStatusString(result.error),
+           result.field ? result.field : "-",
+           changed.empty() ? "-" : changed.c_str(),
+           configChangeNeedsReconnect(result.changed) ? 1 : 0);
+    printConfig(config);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 3 && strcmp(argv[1], "--push") == 0) {
+    return applyPushes(argc - 2, argv + 2);
+  }
+
+  int iterations = 1000;
+  int first = 1;
+  if (argc > 2 && strcmp(argv[1], "--iterations") == 0) {
+    iterations = atoi(argv[2]);
+    first = 3;
+  }
+  if (first >= argc || iterations <= 0) {
+    usage();
+    return 2;
+  }
+
+  static StaticConfigArena<HOST_ARENA_SIZE> arena;
+  for (int i = first; i < argc; i++) {
+    std::string body;
+    if (!readFile(argv[i], body)) {
+      fprintf(stderr, "cannot read %s\n", argv[i]);
+      return 2;
+    }
+
+    DeviceConfig config;
+    ConfigParseResult result = {CONFIG_PARSE_OK, nullptr,
+                                DeserializationError::Ok, 0};
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; n++) {
+      std::istringstream received(body);
+      result = parseDeviceConfig(received, config, arena);
+    }
+    double streamUs = microsSince(start, iterations);
+
+    const char *stringStatus = nullptr;
+    size_t stringPeak = 0;
+    start = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; n++) {
+      CountingAllocator heap;
+      StringConfig stringConfig;
+      stringStatus = parseAsString(body, heap, stringConfig);
+      stringPeak = heap.peak;
+    }
+    double stringUs = microsSince(start, iterations);
+
+    printf("%s status=%s field=%s stream_peak=%zu stream_us=%.2f "
+           "string_status=%s string_peak=%zu string_us=%.2f\n",
+           baseName(argv[i]), configParseStatusString(result.status),
+           result.field ? result.field : "-", result.arenaPeak, streamUs,
+           stringStatus, stringPeak, stringUs);
+    if (result.status == CONFIG_PARSE_OK) {
+      printConfig(config);
+    }
+  }
+  return 0;
+}
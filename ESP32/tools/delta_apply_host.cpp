@@ -0,0 +1,79 @@
+// Host build of the on-device delta patch decoder, used by
+// test/test_delta_patch.py to check patches produced by delta_patch.py.
+//
+//   c++ -std=c++17 -I../lib/OTA/src -o delta_apply_host
+//       delta_apply_host.cpp ../lib/OTA/src/DeltaPatch.cpp
+//   ./delta_apply_host base.bin patch.bin out.bin
+
+#include "DeltaPatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static std::vector<uint8_t> readFile(const char *path) {
+  std::vector<uint8_t> data;
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return data;
+  }
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data.insert(data.end(), buf, buf + n);
+  }
+  fclose(f);
+  return data;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s base.bin patch.bin out.bin\n", argv[0]);
+    return 2;
+  }
+  std::vector<uint8_t> base = readFile(argv[1]);
+  std::vector<uint8_t> patch = readFile(argv[2]);
+  FILE *out = fopen(argv[3], "wb");
+  if (!out) {
+    fprintf(stderr, "cannot open %s\n", argv[3]);
+    return 2;
+  }
+
+  DeltaPatchDecoder decoder;
+  decoder.begin(
+      [&](uint32_t offset, uint8_t *buf, size_t len) {
+        if (offset + len > base.size()) {
+          return false;
+        }
+        memcpy(buf, base.data() + offset, len);
+        return true;
+      },
+      [&](const uint8_t *data, size_t len) {
+        return fwrite(data, 1, len, out) == len;
+      },
+      [&](const DeltaPatchHeader &header) {
+        return header.baseSize == base.size();
+      });
+
+  // Feed in uneven pieces, like TCP reads on the device
+  srand(1);
+  size_t pos = 0;
+  while (pos < patch.size()) {
+    size_t len = 1 + rand() % 4096;
+    if (len > patch.size() - pos) {
+      len = patch.size() - pos;
+    }
+    if (!decoder.feed(patch.data() + pos, len)) {
+      break;
+    }
+    pos += len;
+  }
+  fclose(out);
+
+  if (decoder.status() != DeltaPatchDecoder::OK || !decoder.finished()) {
+    fprintf(stderr, "decode failed: %s\n", decoder.statusString());
+    return 1;
+  }
+  printf("%u bytes written\n", (unsigned)decoder.outputSize());
+  return 0;
+}
@@ -0,0 +1,217 @@
+#!/usr/bin/env python3
+"""
+Build and apply delta firmware patches for OTA
+
+The patch format is decoded on the device by DeltaPatchDecoder
+(lib/OTA/src/DeltaPatch.h). A patch rebuilds the target image from ranges
+of the base image (the firmware currently running on the device) plus
+literal bytes.
+
+Usage:
+    python delta_patch.py diff base.bin target.bin -o patch.bin
+    python delta_patch.py apply base.bin patch.bin -o target.bin
+    python delta_patch.py info patch.bin
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"IOTD"
+VERSION = 1
+HEADER = struct.Struct("<4sB3xII32s")
+
+OP_COPY = b"C"
+OP_ADD = b"A"
+OP_END = b"E"
+
+BLOCK = 32  # bytes hashed per index entry
+STRIDE = 8  # base positions indexed every STRIDE bytes
+MIN_COPY = 24  # shorter matches are cheaper as literals (COPY costs 9 bytes)
+
+
+def _index_base(base):
+    index = {}
+    for pos in range(0, len(base) - BLOCK + 1, STRIDE):
+        index.setdefault(base[pos : pos + BLOCK], pos)
+    return index
+
+
+def _match_length(a, a_pos, b, b_pos):
+    """Length of the common run of a[a_pos:] and b[b_pos:]"""
+    length = 0
+    limit = min(len(a) - a_pos, len(b) - b_pos)
+    step = 256
+    while length < limit:
+        n = min(step, limit - length)
+        if a[a_pos + length : a_pos + length + n] == b[b_pos + length : b_pos + length + n]:
+            length += n
+            continue
+        if n == 1:
+            break
+        step = max(1, n // 4)
+    return length
+
+
+def make_patch(base, target):
+    index = _index_base(base)
+    ops = []
+    literal_start = 0
+    t = 0
+    # Expected base position of the next byte if the previous copy continues
+    next_base = None
+
+    def flush_literal(end):
+        if end > literal_start:
+            ops.append((OP_ADD, target[literal_start:end]))
+
+    while t + BLOCK <= len(target):
+        base_pos = None
+        # Prefer continuing the previous copy after a short mismatch, which
+        # is what relocated code looks like
+        if next_base is not None and next_base + BLOCK <= len(base):
+            if base[next_base : next_base + BLOCK] == target[t : t + BLOCK]:
+                base_pos = next_base
+        if base_pos is None:
+            base_pos = index.get(target[t : t + BLOCK])
+        if base_pos is None:
+            t += 1
+            if next_base is not None:
+                next_base += 1
+            continue
+
+        # Grow the match backwards into the pending literal run
+        while t > literal_start and base_pos > 0 and target[t - 1] == base[base_pos - 1]:
+            t -= 1
+            base_pos -= 1
+        length = _match_length(base, base_pos, target, t)
+        if length < MIN_COPY:
+            t += 1
+            continue
+
+        flush_literal(t)
+        ops.append((OP_COPY, (base_pos, length)))
+        t += length
+        literal_start = t
+        next_base = base_pos + length
+
+    flush_literal(len(target))
+
+    out = bytearray(
+        HEADER.pack(MAGIC, VERSION, len(base), len(target),
+                    hashlib.sha256(base).digest())
+    )
+    for op, arg in ops:
+        if op == OP_COPY:
+            out += OP_COPY + struct.pack("<II", *arg)
+        else:
+            out += OP_ADD + struct.pack("<I", len(arg)) + arg
+    out += OP_END
+    return bytes(out)
+
+
+def apply_patch(base, patch):
+    magic, version, base_size, target_size, base_sha = HEADER.unpack_from(patch)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a version %d delta patch" % VERSION)
+    if base_size != len(base) or hashlib.sha256(base).digest() != base_sha:
+        raise ValueError("patch does not apply to this base image")
+
+    out = bytearray()
+    pos = HEADER.size
+    while True:
+        op = patch[pos : pos + 1]
+        pos += 1
+        if op == OP_COPY:
+            offset, length = struct.unpack_from("<II", patch, pos)
+            pos += 8
+            if offset + length > base_size:
+                raise ValueError("copy out of range")
+            out += base[offset : offset + length]
+        elif op == OP_ADD:
+            (length,) = struct.unpack_from("<I", patch, pos)
+            pos += 4
+            out += patch[pos : pos + length]
+            pos += length
+        elif op == OP_END:
+            break
+        else:
+            raise ValueError("invalid opcode at offset %d" % (pos - 1))
+    if pos != len(patch) or len(out) != target_size:
+        raise ValueError("patch size mismatch")
+    return bytes(out)
+
+
+def patch_info(patch):
+    magic, version, base_size, target_size, base_sha = HEADER.unpack_from(patch)
+    copies = literals = literal_bytes = 0
+    pos = HEADER.size
+    while pos < len(patch):
+        op = patch[pos : pos + 1]
+        pos += 1
+        if op == OP_COPY:
+            copies += 1
+            pos += 8
+        elif op == OP_ADD:
+            (length,) = struct.unpack_from("<I", patch, pos)
+            literals += 1
+            literal_bytes += length
+            pos += 4 + length
+        else:
+            break
+    return {
+        "version": version,
+        "base_size": base_size,
+        "target_size": target_size,
+        "base_sha256": base_sha.hex(),
+        "patch_size": len(patch),
+        "copies": copies,
+        "literals": literals,
+        "literal_bytes": literal_bytes,
+    }
+
+
+def _read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def _write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Delta firmware patch tool")
+    sub = parser.add_subparsers(dest="command", required=True)
+    p_diff = sub.add_parser("diff", help="build a patch from two images")
+    p_diff.add_argument("base")
+    p_diff.add_argument("target")
+    p_diff.add_argument("-o", "--output", required=True)
+    p_apply = sub.add_parser("apply", help="rebuild the target image")
+    p_apply.add_argument("base")
+    p_apply.add_argument("patch")
+    p_apply.add_argument("-o", "--output", required=True)
+    p_info = sub.add_parser("info", help="describe a patch")
+    p_info.add_argument("patch")
+    args = parser.parse_args()
+
+    if args.command == "diff":
+        base, target = _read(args.base), _read(args.target)
+        patch = make_patch(base, target)
+        _write(args.output, patch)
+        print(f"Patch: {len(patch)} bytes for a {len(target)} byte image "
+              f"({100.0 * len(patch) / len(target):.1f}%)")
+        print(f"Target SHA256: {hashlib.sha256(target).hexdigest()}")
+    elif args.command == "apply":
+        try:
+            target = apply_patch(_read(args.base), _read(args.patch))
+        except ValueError as e:
+            print(f"ERROR: {e}")
+            sys.exit(1)
+        _write(args.output, target)
+        print(f"Target SHA256: {hashlib.sha256(target).hexdigest()}")
+    else:
+        for key, value in patch_info(_read(args.patch)).items():
+            print(f"{key}: {value}")
@@ -0,0 +1,236 @@
+// Compressed OTA image decoder (OTAInflater) on the host, against the
+// single-file miniz, used by test/test_ota_inflate.py and the bench of
+// tools/compress_firmware.py.
+//
+//   c++ -std=c++11 -O2 -I../lib/OTA/src -I$MINIZ_DIR -o inflate_host
+//       inflate_host.cpp ../lib/OTA/src/OTAInflater.cpp $MINIZ_DIR/miniz.c
+//   ./inflate_host IMAGE.z [options]
+//
+// Options:
+//   --out FILE        where the decompressed image goes
+//   --chunk N         bytes per feed(), as the download buffer (default 4096)
+//   --fail-after N    the output writer fails once N bytes were written, as
+//                     a failed flash write
+//   --runs N          decode N times and report the best throughput
+//                     (default 1)
+//
+// The image is fed in --chunk pieces the way OTA::_downloadImage feeds the
+// download. Prints one line:
+//   result= in= out= memory= heap_peak= mbps=
+// result is ok (stream complete, no data after it), corrupt (feed() failed
+// on the stream), output_failed (the writer failed), trailing (data after
+// the end of the stream) or truncated (input ended first). memory is
+// OTAInflater::memoryUsage(); heap_peak is the most heap that begin() and
+// feed() (OTAInflater and miniz) held at once, counted by replacing the
+// glibc malloc. The output writer, standing in for the flash, is not
+// counted.
+//
+// Exit status: 0 ok, 1 not, 2 usage error.
+
+#include "OTAInflater.h"
+#include <algorithm>
+#include <chrono>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+struct Config {
+  const char *image = nullptr;
+  const char *out = nullptr;
+  size_t chunk = 4096;
+  size_t failAfter = 0; // 0: never
+  int runs = 1;
+};
+
+struct Run {
+  const char *result;
+  size_t consumed;
+  size_t heapPeak;
+  double seconds;
+};
+
+// Heap held by the decoder while counting is on
+static bool counting = false;
+static size_t heapInUse = 0;
+static size_t heapPeak = 0;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+static void counted(void *ptr) {
+  if (counting && ptr) {
+    heapInUse += malloc_usable_size(ptr);
+    heapPeak = std::max(heapPeak, heapInUse);
+  }
+}
+
+static void uncounted(void *ptr) {
+  if (counting && ptr) {
+    heapInUse -= std::min(heapInUse, malloc_usable_size(ptr));
+  }
+}
+
+void *malloc(size_t size) {
+  void *ptr = __libc_malloc(size);
+  counted(ptr);
+  return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+  void *ptr = __libc_calloc(count, size);
+  counted(ptr);
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  uncounted(ptr);
+  void *moved = __libc_realloc(ptr, size);
+  counted(moved ? moved : ptr);
+  return moved;
+}
+
+void free(void *ptr) {
+  uncounted(ptr);
+  __libc_free(ptr);
+}
+}
+
+static bool parseArgs(int argc, char **argv, Config &config) {
+  for (int i = 1; i < argc; ++i) {
+    const char *name = argv[i];
+    if (name[0] != '-') {
+      config.image = name;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      return false;
+    }
+    const char *value = argv[++i];
+    if (strcmp(name, "--out") == 0) {
+      config.out = value;
+    } else if (strcmp(name, "--chunk") == 0) {
+      config.chunk = strtoul(value, nullptr, 10);
+    } else if (strcmp(name, "--fail-after") == 0) {
+      config.failAfter = strtoul(value, nullptr, 10);
+    } else if (strcmp(name, "--runs") == 0) {
+      config.runs = atoi(value);
+    } else {
+      return false;
+    }
+  }
+  return config.image && config.chunk > 0 && config.runs > 0;
+}
+
+static bool readFile(const char *path, std::vector<uint8_t> &data) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(file);
+  return true;
+}
+
+// One decode of the whole image, output collected in image
+static Run decode(const Config &config, const std::vector<uint8_t> &input,
+                  OTAInflater &inflater, std::vector<uint8_t> &image) {
+  Run run = {"truncated", 0, 0, 0};
+  image.clear();
+  heapInUse = 0;
+  heapPeak = 0;
+  auto started = std::chrono::steady_clock::now();
+  counting = true;
+  bool begun = inflater.begin([&](const uint8_t *data, size_t len) {
+    if (config.failAfter && image.size() + len > config.failAfter) {
+      return false;
+    }
+    counting = false;
+    image.insert(image.end(), data, data + len);
+    counting = true;
+    return true;
+  });
+  if (!begun) {
+    counting = false;
+    run.result = "no_memory";
+    return run;
+  }
+
+  size_t pos = 0;
+  while (pos < input.size()) {
+    size_t len = input.size() - pos;
+    if (len > config.chunk) {
+      len = config.chunk;
+    }
+    bool ok = inflater.feed(input.data() + pos, len);
+    pos += len;
+    if (!ok) {
+      run.result = inflater.outputFailed() ? "output_failed"
+                   : inflater.finished()   ? "trailing"
+                                           : "corrupt";
+      break;
+    }
+    if (inflater.finished()) {
+      run.result = pos == input.size() ? "ok" : "trailing";
+      break;
+    }
+  }
+  counting = false;
+  run.heapPeak = heapPeak;
+  run.consumed = pos;
+  run.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - started)
+                    .count();
+  return run;
+}
+
+int main(int argc, char **argv) {
+  Config config;
+  if (!parseArgs(argc, argv, config)) {
+    fprintf(stderr, "usage: inflate_host IMAGE.z [--out FILE] [--chunk N] "
+                    "[--fail-after N] [--runs N]\n");
+    return 2;
+  }
+  std::vector<uint8_t> input;
+  if (!readFile(config.image, input)) {
+    perror(config.image);
+    return 2;
+  }
+
+  OTAInflater inflater;
+  std::vector<uint8_t> image;
+  Run best = {"truncated", 0, 0, 0};
+  for (int i = 0; i < config.runs; ++i) {
+    Run run = decode(config, input, inflater, image);
+    if (i == 0 || run.seconds < best.seconds) {
+      best = run;
+    }
+    // end() frees the state, so every run measures begin() again
+    inflater.end();
+  }
+
+  bool ok = strcmp(best.result, "ok") == 0;
+  if (ok && config.out) {
+    FILE *file = fopen(config.out, "wb");
+    if (!file || fwrite(image.data(), 1, image.size(), file) != image.size()) {
+      perror(config.out);
+      ok = false;
+    }
+    if (file) {
+      fclose(file);
+    }
+  }
+  double mbps = best.seconds > 0 ? image.size() / best.seconds / 1e6 : 0;
+  printf("result=%s in=%zu out=%zu memory=%zu heap_peak=%zu mbps=%.1f\n",
+         best.result, best.consumed, image.size(), inflater.memoryUsage(),
+         best.heapPeak, mbps);
+  return ok ? 0 : 1;
+}
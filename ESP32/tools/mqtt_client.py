@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""
+Minimal MQTT 3.1.1 client for the OTA tools
+
+Just enough for the fleet-side services (tools/ota_lease_coordinator.py,
+tools/ota_broadcast.py) to run against any broker with nothing but the
+Python standard library: QoS 0 publishes, subscriptions, keepalive. Counts
+the bytes it moves so the tools can report what they cost on the wire.
+"""
+
+import select
+import socket
+import struct
+import time
+
+
+class MqttClient:
+    """QoS 0 publishing and subscribing over one connection"""
+
+    def __init__(self, host, port, client_id, username=None, password=None,
+                 keepalive=60):
+        self.keepalive = keepalive
+        self.sock = socket.create_connection((host, port), timeout=10)
+        self.buffer = b""
+        self.bytes_sent = 0
+        self.bytes_received = 0
+        self.packet_id = 0
+        flags = 0x02  # clean session
+        payload = self._string(client_id)
+        if username:
+            flags |= 0x80
+            payload += self._string(username)
+            if password:
+                flags |= 0x40
+                payload += self._string(password)
+        header = self._string("MQTT") + bytes([4, flags]) + struct.pack(
+            ">H", keepalive)
+        self._send(0x10, header + payload)
+        packet_type, body = self._read_packet(10)
+        if packet_type != 0x20 or len(body) < 2 or body[1] != 0:
+            raise ConnectionError(f"connection refused ({body[1:2].hex()})")
+        self.last_sent = time.monotonic()
+
+    @staticmethod
+    def _string(text):
+        data = text.encode()
+        return struct.pack(">H", len(data)) + data
+
+    def _send(self, first_byte, body):
+        length = len(body)
+        encoded = b""
+        while True:
+            byte = length % 128
+            length //= 128
+            encoded += bytes([byte | (0x80 if length else 0)])
+            if not length:
+                break
+        packet = bytes([first_byte]) + encoded + body
+        self.sock.sendall(packet)
+        self.bytes_sent += len(packet)
+        self.last_sent = time.monotonic()
+
+    def _parse(self):
+        """One whole packet from the buffer, or None"""
+        if len(self.buffer) < 2:
+            return None
+        length, multiplier, pos = 0, 1, 1
+        while True:
+            if pos >= len(self.buffer):
+                return None
+            byte = self.buffer[pos]
+            length += (byte & 0x7F) * multiplier
+            multiplier *= 128
+            pos += 1
+            if not byte & 0x80:
+                break
+        if len(self.buffer) < pos + length:
+            return None
+        first = self.buffer[0]
+        body = self.buffer[pos:pos + length]
+        self.buffer = self.buffer[pos + length:]
+        return first, body
+
+    def _receive(self, size):
+        data = self.sock.recv(size)
+        if not data:
+            raise ConnectionError("broker closed the connection")
+        self.bytes_received += len(data)
+        self.buffer += data
+
+    def _read_packet(self, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            packet = self._parse()
+            if packet:
+                return packet[0] & 0xF0, packet[1]
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                raise TimeoutError("no answer from the broker")
+            self.sock.settimeout(remaining)
+            self._receive(4096)
+
+    def subscribe(self, topic, qos=0):
+        self.packet_id = self.packet_id % 0xFFFF + 1
+        self._send(0x82, struct.pack(">H", self.packet_id) +
+                   self._string(topic) + bytes([qos]))
+
+    def publish(self, topic, payload, retain=False):
+        """QoS 0; payload is str or bytes"""
+        if isinstance(payload, str):
+            payload = payload.encode()
+        self._send(0x31 if retain else 0x30, self._string(topic) + payload)
+
+    def loop(self, timeout):
+        """Waits up to timeout seconds; returns the messages as (topic,
+        payload bytes)"""
+        if time.monotonic() - self.last_sent > self.keepalive / 2:
+            self._send(0xC0, b"")
+        messages = []
+        readable, _, _ = select.select([self.sock], [], [], timeout)
+        if readable:
+            self._receive(65536)
+        while True:
+            packet = self._parse()
+            if not packet:
+                break
+            first, body = packet
+            if first & 0xF0 != 0x30:
+                continue  # SUBACK, PINGRESP
+            topic_length = struct.unpack(">H", body[:2])[0]
+            topic = body[2:2 + topic_length].decode()
+            start = 2 + topic_length
+            qos = (first >> 1) & 3
+            if qos:
+                packet_id = body[start:start + 2]
+                start += 2
+                if qos == 1:
+                    self._send(0x40, packet_id)
+            messages.append((topic, body[start:]))
+        return messages
+
+    def close(self):
+        try:
+            self._send(0xE0, b"")
+        except OSError:
+            pass
+        self.sock.close()
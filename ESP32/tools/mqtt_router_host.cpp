@@ -0,0 +1,172 @@
+// Host build of the incoming MQTT path (MqttTopicRouter and
+// MqttMessageAssembler), used by test/test_mqtt_router.py.
+//
+//   c++ -std=c++11 -O2 -I../lib/MqttController/src -o mqtt_router_host
+//       mqtt_router_host.cpp ../lib/MqttController/src/MqttTopicRouter.cpp
+//       ../lib/MqttController/src/MqttMessageAssembler.cpp
+//   ./mqtt_router_host < cases
+//   ./mqtt_router_host --fragments N [--max-payload B] [--seed N]
+//
+// Default mode reads lines from stdin:
+//   F <filter>   adds a route, prints "filter <n> ok" or "filter <n> invalid"
+//   T <topic>    dispatches, prints "topic <topic>" and the numbers of the
+//                filters whose handlers were called
+//
+// With --fragments N, N random payloads (0 to 2 x the limit bytes) are
+// split into random fragments the way the client delivers them; now and
+// then one is cut off by a reset (a disconnect) or by the start of the next.
+// Every complete payload within the limit must come out byte for byte, in
+// the client's buffer when it was not split, and the pool must stop
+// growing. One line is printed:
+//   messages= passed_through= reassembled= oversized= incomplete=
+//   pooled_bytes= errors=
+//
+// Exit status: 0 checks passed, 1 a check failed, 2 usage error.
+
+#include "MqttMessageAssembler.h"
+#include "MqttTopicRouter.h"
+#include <iostream>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static int runCases() {
+  MqttTopicRouter router;
+  std::vector<size_t> called;
+  size_t filters = 0;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    if (line.size() < 2 || line[1] != ' ') {
+      continue;
+    }
+    std::string argument = line.substr(2);
+    if (line[0] == 'F') {
+      size_t number = filters++;
+      bool ok = router.add(argument.c_str(),
+                           [number, &called](const char *, const char *,
+                                             size_t) {
+                             called.push_back(number);
+                           });
+      printf("filter %zu %s\n", number, ok ? "ok" : "invalid");
+    } else if (line[0] == 'T') {
+      called.clear();
+      size_t count = router.dispatch(argument.c_str(), "", 0);
+      printf("topic %s", argument.c_str());
+      for (size_t number : called) {
+        printf(" %zu", number);
+      }
+      printf("\n");
+      if (count != called.size()) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int runFragments(long messages, size_t maxPayload, unsigned seed) {
+  std::mt19937 rng(seed);
+  MqttMessageAssembler assembler(maxPayload);
+  unsigned long errors = 0;
+  unsigned long passedThrough = 0;
+  size_t warmPool = 0;
+
+  for (long m = 0; m < messages; m++) {
+    std::uniform_int_distribution<size_t> lengths(0, 2 * maxPayload);
+    size_t total = lengths(rng);
+    if (rng() % 2) {
+      total %= 512; // mostly small ones, like commands
+    }
+    std::string payload(total, '\0');
+    for (char &c : payload) {
+      c = static_cast<char>(rng());
+    }
+
+    // Fragments of up to a TCP segment; a few messages stop part way
+    std::vector<size_t> cuts;
+    for (size_t at = 0; at < total;) {
+      size_t length = 1 + rng() % 1460;
+      at = at + length < total ? at + length : total;
+      cuts.push_back(at);
+    }
+    if (cuts.empty()) {
+      cuts.push_back(0);
+    }
+    bool abandoned = cuts.size() > 1 && rng() % 20 == 0;
+    size_t stopAt = abandoned ? 1 + rng() % (cuts.size() - 1) : cuts.size();
+
+    bool delivered = false;
+    size_t index = 0;
+    for (size_t i = 0; i < stopAt; i++) {
+      const char *data = nullptr;
+      size_t size = 0;
+      const char *fragment = payload.data() + index;
+      if (assembler.feed(fragment, cuts[i] - index, index, total, data,
+                         size)) {
+        if (delivered || i + 1 != cuts.size() || size != total ||
+            memcmp(data, payload.data(), total) != 0) {
+          errors++;
+        }
+        if (cuts.size() == 1) {
+          if (data != payload.data()) {
+            errors++;
+          }
+          passedThrough++;
+        }
+        delivered = true;
+      }
+      index = cuts[i];
+    }
+    if (abandoned && rng() % 2) {
+      assembler.reset();
+    }
+    bool expected = !abandoned && (cuts.size() == 1 || total <= maxPayload);
+    if (delivered != expected) {
+      errors++;
+    }
+
+    // Every size class has been needed by then
+    if (m == messages / 2) {
+      warmPool = assembler.pooledBytes();
+    }
+  }
+
+  MqttReceiveStats stats = assembler.getStats();
+  if (assembler.pooledBytes() != warmPool || stats.noMemory != 0) {
+    errors++;
+  }
+  printf("messages=%u passed_through=%lu reassembled=%u oversized=%u "
+         "incomplete=%u pooled_bytes=%zu errors=%lu\n",
+         stats.messages, passedThrough, stats.reassembled, stats.oversized,
+         stats.incomplete, assembler.pooledBytes(), errors);
+  return errors == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  long fragments = 0;
+  size_t maxPayload = MQTT_RX_MAX_PAYLOAD;
+  unsigned seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", option.c_str());
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (option == "--fragments") {
+      fragments = atol(value);
+    } else if (option == "--max-payload") {
+      maxPayload = strtoul(value, nullptr, 0);
+    } else if (option == "--seed") {
+      seed = strtoul(value, nullptr, 0);
+    } else {
+      fprintf(stderr, "unknown option %s\n", option.c_str());
+      return 2;
+    }
+  }
+  return fragments > 0 ? runFragments(fragments, maxPayload, seed)
+                       : runCases();
+}
@@ -0,0 +1,397 @@
+// Host build of the MQTT offline log (MqttOfflineLog), used by
+// test/test_offline_log.py to measure write amplification, wear spread and
+// replay throughput over a simulated flash partition, and to cut power at
+// random points.
+//
+//   c++ -std=c++11 -O2 -I../lib/MqttController/src -o offline_log_host
+//       offline_log_host.cpp ../lib/MqttController/src/MqttOfflineLog.cpp
+//   ./offline_log_host [options]
+//
+// The flash behaves like NOR flash: erase sets every bit of a 4 KB sector,
+// programming can only clear bits, and programming a 0 back to 1 is
+// counted as a violation.
+//
+// Default mode: records are appended in outages of random length (1 to
+// 2 x --outage records) and each outage is replayed in full before the
+// next, with compact() between appends as the sender task does when idle.
+// Record times advance one second per record. One line is printed:
+//   records=<n> data_bytes= flash_bytes= program_amplification=
+//   erase_amplification= erases_min= erases_max= append_per_s=
+//   replay_per_s= replayed= dropped= expired= corrupt= order_errors=
+//   violations=
+//
+// With --power-cuts N the log is remounted N times, each run ending with
+// power lost in the middle of a random erase or program (torn: a prefix of
+// the bytes, part of the bits of the next one). Every record whose append
+// returned true must be replayed once, in order, unless the size limit
+// dropped it; only the record being marked sent at a cut may come again.
+// A third of the runs append only, so the log fills up.
+//   cuts=<n> appended= replayed= duplicates= dropped= skipped= errors=
+//   violations=
+//
+// Options:
+//   --records N     records to append (default 2000000)
+//   --capacity B    partition size (default 0x100000, the mqttlog partition)
+//   --outage N      mean records per outage (default 2000)
+//   --payload A-B   payload length range (default 40-400)
+//   --max-bytes B   retention by size (default: the partition)
+//   --max-age S     retention by age in seconds (default: none)
+//   --seed N
+//
+// Exit status: 0 checks passed, 1 a check failed, 2 usage error.
+
+#include "MqttOfflineLog.h"
+#include <chrono>
+#include <deque>
+#include <random>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static const char *TOPIC = "iotplatform/esp32/status";
+
+struct PowerCut {};
+
+class SimFlash {
+public:
+  std::vector<uint8_t> data;
+  std::vector<uint32_t> erases;
+  uint64_t programmed = 0;
+  uint64_t erased = 0;
+  uint64_t violations = 0;
+  long opsUntilCut = -1; // -1 never
+  std::mt19937 *rng = nullptr;
+
+  explicit SimFlash(size_t size)
+      : data(size, 0xff),
+        erases(size / MqttOfflineLog::SEGMENT_SIZE, 0) {}
+
+  bool read(uint32_t address, void *out, size_t size) {
+    if (address + size > data.size()) {
+      return false;
+    }
+    memcpy(out, &data[address], size);
+    return true;
+  }
+
+  bool erase(uint32_t address, size_t size) {
+    if (address % MqttOfflineLog::SEGMENT_SIZE != 0 ||
+        address + size > data.size()) {
+      return false;
+    }
+    if (_cutNow()) {
+      // Some bits erased, which ones is anyone's guess
+      for (size_t i = 0; i < size; i++) {
+        data[address + i] |= (*rng)() & 0xff;
+      }
+      throw PowerCut();
+    }
+    memset(&data[address], 0xff, size);
+    erases[address / MqttOfflineLog::SEGMENT_SIZE]++;
+    erased += size;
+    return true;
+  }
+
+  bool program(uint32_t address, const void *source, size_t size) {
+    if (address + size > data.size()) {
+      return false;
+    }
+    const uint8_t *bytes = static_cast<const uint8_t *>(source);
+    size_t count = size;
+    if (_cutNow()) {
+      count = (*rng)() % size;
+    }
+    for (size_t i = 0; i < count; i++) {
+      if ((data[address + i] & bytes[i]) != bytes[i]) {
+        violations++;
+      }
+      data[address + i] &= bytes[i];
+    }
+    programmed += count;
+    if (count < size) {
+      data[address + count] &= bytes[count] | ((*rng)() & 0xff);
+      throw PowerCut();
+    }
+    return true;
+  }
+
+private:
+  bool _cutNow() {
+    if (opsUntilCut < 0) {
+      return false;
+    }
+    return opsUntilCut-- == 0;
+  }
+};
+
+struct Options {
+  uint64_t records = 2000000;
+  uint32_t capacity = 0x100000;
+  uint32_t outage = 2000;
+  size_t payloadMin = 40;
+  size_t payloadMax = 400;
+  uint32_t maxBytes = 0;
+  uint32_t maxAge = 0;
+  int powerCuts = 0;
+  uint32_t seed = 1;
+};
+
+static void mount(MqttOfflineLog &log, SimFlash &flash,
+                  const Options &options) {
+  using namespace std::placeholders;
+  log.begin(options.capacity,
+            std::bind(&SimFlash::read, &flash, _1, _2, _3),
+            std::bind(&SimFlash::erase, &flash, _1, _2),
+            std::bind(&SimFlash::program, &flash, _1, _2, _3));
+  log.setRetention(options.maxBytes, options.maxAge);
+}
+
+// "seq=<n> " then filler up to the length
+static std::string makePayload(uint64_t seq, size_t length) {
+  std::string payload = "seq=" + std::to_string(seq) + " ";
+  while (payload.size() < length) {
+    payload += (char)('a' + payload.size() % 26);
+  }
+  return payload;
+}
+
+static uint64_t payloadSeq(const char *payload) {
+  return strtoull(payload + 4, nullptr, 10);
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+static int throughput(const Options &options) {
+  std::mt19937 rng(options.seed);
+  SimFlash flash(options.capacity);
+  flash.rng = &rng;
+  MqttOfflineLog log;
+  mount(log, flash, options);
+
+  std::vector<std::string> payloads;
+  for (int i = 0; i < 64; i++) {
+    payloads.push_back(makePayload(
+        0, options.payloadMin +
+               rng() % (options.payloadMax - options.payloadMin + 1)));
+  }
+
+  uint64_t seq = 0;
+  uint64_t received = 0;
+  uint64_t lastSeq = 0;
+  uint64_t orderErrors = 0;
+  double appendSeconds = 0;
+  double replaySeconds = 0;
+  while (seq < options.records) {
+    uint64_t outage = 1 + rng() % (2 * options.outage);
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < outage && seq < options.records; i++) {
+      // The sequence number goes over the filler, same length
+      std::string &payload = payloads[seq % payloads.size()];
+      std::string prefix = "seq=" + std::to_string(++seq) + " ";
+      payload.replace(0, prefix.size(), prefix);
+      log.append(TOPIC, payload.c_str(), payload.size(), 0, true,
+                 (uint32_t)seq);
+      if (seq % 64 == 0) {
+        log.compact((uint32_t)seq);
+      }
+    }
+    appendSeconds += secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    log.compact((uint32_t)seq);
+    MqttOfflineLog::Record record;
+    while (log.peek(record)) {
+      uint64_t got = payloadSeq(record.payload);
+      if (got <= lastSeq || strcmp(record.topic, TOPIC) != 0) {
+        orderErrors++;
+      }
+      lastSeq = got;
+      received++;
+      log.consume();
+    }
+    replaySeconds += secondsSince(start);
+  }
+
+  MqttOfflineLogStats stats = log.getStats();
+  uint32_t erasesMin = flash.erases[0];
+  uint32_t erasesMax = flash.erases[0];
+  for (uint32_t count : flash.erases) {
+    erasesMin = count < erasesMin ? count : erasesMin;
+    erasesMax = count > erasesMax ? count : erasesMax;
+  }
+  // Every record is either replayed or counted as dropped or expired
+  uint64_t lost = seq - received - stats.dropped - stats.expired;
+  printf("records=%llu data_bytes=%llu flash_bytes=%llu "
+         "program_amplification=%.3f erase_amplification=%.3f "
+         "erases_min=%u erases_max=%u append_per_s=%.0f replay_per_s=%.0f "
+         "replayed=%llu dropped=%u expired=%u corrupt=%u lost=%llu "
+         "order_errors=%llu violations=%llu\n",
+         (unsigned long long)seq, (unsigned long long)stats.dataBytes,
+         (unsigned long long)flash.programmed,
+         (double)flash.programmed / stats.dataBytes,
+         (double)flash.erased / stats.dataBytes, erasesMin, erasesMax,
+         seq / appendSeconds, received / replaySeconds,
+         (unsigned long long)received, stats.dropped, stats.expired,
+         stats.corrupt, (unsigned long long)lost,
+         (unsigned long long)orderErrors,
+         (unsigned long long)flash.violations);
+  return orderErrors || lost || flash.violations ? 1 : 0;
+}
+
+static int powerCuts(const Options &options) {
+  std::mt19937 rng(options.seed);
+  SimFlash flash(options.capacity);
+  flash.rng = &rng;
+
+  std::deque<uint64_t> expected; // appended, not yet known to be sent
+  uint64_t nextSeq = 0;
+  uint64_t appending = 0;
+  std::set<uint64_t> maybeAppended; // appends cut short, may be there or not
+  uint64_t maybeSent = 0;     // consume cut short, may come again
+  uint64_t appended = 0, replayed = 0, duplicates = 0, dropped = 0;
+  uint64_t skipped = 0, errors = 0;
+
+  for (int run = 0; run <= options.powerCuts; run++) {
+    bool last = run == options.powerCuts;
+    MqttOfflineLog log;
+    flash.opsUntilCut = -1;
+    mount(log, flash, options);
+    if (!last) {
+      flash.opsUntilCut = 1 + rng() % 2000;
+    }
+    uint64_t sentThisRun = 0;
+    // Some runs are one long outage, to fill the log up
+    bool offline = !last && rng() % 3 == 0;
+    try {
+      for (int step = 0; last ? true : step < 100000; step++) {
+        bool replay = last || (!offline && rng() % 10 < 4);
+        if (!replay) {
+          std::string payload =
+              makePayload(++nextSeq, options.payloadMin +
+                                         rng() % (options.payloadMax -
+                                                  options.payloadMin + 1));
+          appending = nextSeq;
+          if (log.append(TOPIC, payload.c_str(), payload.size(), 1, false,
+                         (uint32_t)nextSeq)) {
+            expected.push_back(nextSeq);
+            appended++;
+          }
+          appending = 0;
+          log.compact((uint32_t)nextSeq);
+          continue;
+        }
+        int batch = last ? 1 << 30 : 1 + rng() % 50;
+        MqttOfflineLog::Record record;
+        for (int i = 0; i < batch && log.peek(record); i++) {
+          uint64_t seq = payloadSeq(record.payload);
+          if (seq == maybeSent && sentThisRun == 0) {
+            duplicates++; // marked sent when the power went
+          } else if (maybeAppended.erase(seq)) {
+            // committed just before the cut
+          } else {
+            while (!expected.empty() && expected.front() < seq) {
+              expected.pop_front();
+              skipped++;
+            }
+            if (expected.empty() || expected.front() != seq) {
+              fprintf(stderr, "run %d: unexpected record %llu\n", run,
+                      (unsigned long long)seq);
+              errors++;
+            } else {
+              expected.pop_front();
+            }
+          }
+          maybeSent = seq;
+          log.consume();
+          sentThisRun++;
+          replayed++;
+        }
+        if (last) {
+          break;
+        }
+      }
+    } catch (const PowerCut &) {
+      if (appending) {
+        maybeAppended.insert(appending);
+        appending = 0;
+      }
+    }
+    dropped += log.getStats().dropped;
+  }
+
+  // Whatever is still expected was never replayed
+  if (!expected.empty()) {
+    fprintf(stderr, "%zu records lost, first %llu\n", expected.size(),
+            (unsigned long long)expected.front());
+    errors += expected.size();
+  }
+  // Records skipped over must have been dropped by the size limit
+  if (skipped > dropped) {
+    fprintf(stderr, "%llu records skipped, only %llu dropped\n",
+            (unsigned long long)skipped, (unsigned long long)dropped);
+    errors++;
+  }
+  printf("cuts=%d appended=%llu replayed=%llu duplicates=%llu dropped=%llu "
+         "skipped=%llu errors=%llu violations=%llu\n",
+         options.powerCuts, (unsigned long long)appended,
+         (unsigned long long)replayed, (unsigned long long)duplicates,
+         (unsigned long long)dropped, (unsigned long long)skipped,
+         (unsigned long long)errors, (unsigned long long)flash.violations);
+  return errors ? 1 : 0;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: offline_log_host [--records N] [--capacity B] "
+          "[--outage N] [--payload A-B]\n"
+          "                        [--max-bytes B] [--max-age S] "
+          "[--power-cuts N] [--seed N]\n");
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      usage();
+      return 2;
+    }
+    const char *value = argv[++i];
+    const char *name = argv[i - 1];
+    if (strcmp(name, "--records") == 0) {
+      options.records = strtoull(value, nullptr, 0);
+    } else if (strcmp(name, "--capacity") == 0) {
+      options.capacity = strtoul(value, nullptr, 0);
+    } else if (strcmp(name, "--outage") == 0) {
+      options.outage = strtoul(value, nullptr, 0);
+    } else if (strcmp(name, "--payload") == 0 &&
+               sscanf(value, "%zu-%zu", &options.payloadMin,
+                      &options.payloadMax) == 2) {
+    } else if (strcmp(name, "--max-bytes") == 0) {
+      options.maxBytes = strtoul(value, nullptr, 0);
+    } else if (strcmp(name, "--max-age") == 0) {
+      options.maxAge = strtoul(value, nullptr, 0);
+    } else if (strcmp(name, "--power-cuts") == 0) {
+      options.powerCuts = atoi(value);
+    } else if (strcmp(name, "--seed") == 0) {
+      options.seed = strtoul(value, nullptr, 0);
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (options.outage == 0 || options.payloadMin < 12 ||
+      options.payloadMax < options.payloadMin ||
+      options.payloadMax > MqttOfflineLog::MAX_RECORD_DATA - strlen(TOPIC)) {
+    usage();
+    return 2;
+  }
+  return options.powerCuts > 0 ? powerCuts(options) : throughput(options);
+}
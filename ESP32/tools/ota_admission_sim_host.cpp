@@ -0,0 +1,304 @@
+// Fleet OTA admission simulation (OTAAdmission), used by
+// test/test_ota_admission.py.
+//
+//   c++ -std=c++11 -O2 -pthread -I../lib/OTA/src -o ota_admission_sim_host
+//       ota_admission_sim_host.cpp ../lib/OTA/src/OTAAdmission.cpp
+//   ./ota_admission_sim_host [options]
+//
+// One OTA command reaches every device of the board within 200 ms. Each
+// then goes through its OTAAdmission and downloads the image from one
+// firmware host. The host serves at most --server-connections downloads
+// and refuses the rest (503), and its --server-mbps are shared by the
+// downloads running, each getting at most --device-kbps. A refused device
+// retries like OTA::_downloadImage() with the retry policy of src/main.cpp
+// (5 attempts, 5 s doubling) and fails the update after the last one.
+//
+// Options:
+//   --mode M                none: start at once (admission off)
+//                           jitter: only the random delay, no coordinator
+//                           lease: jitter, then a lease from the
+//                           coordinator on the other end of the pipe
+//   --devices N             (default 300)
+//   --jitter-ms J           (default OTA_ADMISSION_JITTER_MS)
+//   --image-kb K            (default 1536)
+//   --device-kbps R         (default 4000)
+//   --server-mbps R         (default 100)
+//   --server-connections N  (default 50)
+//   --duration-s S          give up simulating after this (default 3600)
+//   --seed S
+//
+// In lease mode the devices' lease messages are written to stdout every
+// simulated 100 ms, followed by the time:
+//   msg {"op":"request","id":"dev0001","ticket":...}
+//   tick <ms>
+// and the coordinator's replies are read from stdin up to a line "end":
+//   reply <id> <ticket> <granted 0|1> <lease_ms> <retry_ms>
+//
+// Then one summary line:
+//   mode= devices= completed= failed= peak_downloads= peak_connects=
+//   makespan_s= mean_admission_s= p95_download_s= refused= lease_requests=
+//   renewals=
+// peak_connects is the most connection attempts the host saw in one
+// second, makespan_s the command to the last update done, -1 if not all
+// finished.
+//
+// Exit status: 0 done, 1 a device did not finish, 2 usage error.
+
+#include "OTAAdmission.h"
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static const uint32_t TICK_MS = 100;
+static const uint32_t DELIVERY_SPREAD_MS = 200;
+static const int MAX_ATTEMPTS = 5;
+static const uint32_t RETRY_DELAY_MS = 5000;
+
+enum Phase { ADMISSION, RETRY_WAIT, DOWNLOADING, DONE, FAILED };
+
+struct Device {
+  OTAAdmission admission;
+  Phase phase = ADMISSION;
+  uint32_t wakeAt = 0; // next poll or retry
+  int attempt = 0;
+  double received = 0;
+  uint32_t admittedAt = 0;
+  uint32_t downloadStartedAt = 0;
+  uint32_t finishedAt = 0;
+};
+
+static void deviceId(char *out, size_t size, size_t index) {
+  snprintf(out, size, "dev%04u", (unsigned)index);
+}
+
+static void sendLease(const char *op, size_t index, const Device &device,
+                      int progress, const char *result) {
+  char id[16];
+  deviceId(id, sizeof(id), index);
+  printf("msg {\"op\":\"%s\",\"id\":\"%s\",\"ticket\":%u", op, id,
+         device.admission.ticket());
+  if (progress >= 0) {
+    printf(",\"progress\":%d", progress);
+  }
+  if (result) {
+    printf(",\"result\":\"%s\"", result);
+  }
+  printf("}\n");
+}
+
+int main(int argc, char **argv) {
+  std::string mode = "lease";
+  uint32_t devices = 300;
+  uint32_t jitterMs = OTA_ADMISSION_JITTER_MS;
+  uint32_t imageKb = 1536;
+  uint32_t deviceKbps = 4000;
+  uint32_t serverMbps = 100;
+  uint32_t serverConnections = 50;
+  uint32_t durationS = 3600;
+  unsigned seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", option.c_str());
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (option == "--mode") {
+      mode = value;
+    } else if (option == "--devices") {
+      devices = strtoul(value, nullptr, 0);
+    } else if (option == "--jitter-ms") {
+      jitterMs = strtoul(value, nullptr, 0);
+    } else if (option == "--image-kb") {
+      imageKb = strtoul(value, nullptr, 0);
+    } else if (option == "--device-kbps") {
+      deviceKbps = strtoul(value, nullptr, 0);
+    } else if (option == "--server-mbps") {
+      serverMbps = strtoul(value, nullptr, 0);
+    } else if (option == "--server-connections") {
+      serverConnections = strtoul(value, nullptr, 0);
+    } else if (option == "--duration-s") {
+      durationS = strtoul(value, nullptr, 0);
+    } else if (option == "--seed") {
+      seed = strtoul(value, nullptr, 0);
+    } else {
+      fprintf(stderr, "unknown option %s\n", option.c_str());
+      return 2;
+    }
+  }
+  bool lease = mode == "lease";
+  if ((mode != "none" && mode != "jitter" && !lease) || devices == 0 ||
+      imageKb == 0 || deviceKbps == 0 || serverMbps == 0) {
+    fprintf(stderr, "usage error\n");
+    return 2;
+  }
+
+  std::mt19937 rng(seed);
+  double imageBytes = imageKb * 1024.0;
+  std::vector<Device> fleet(devices);
+  for (Device &device : fleet) {
+    device.admission.configure(mode == "none" ? 0 : jitterMs, lease);
+    uint32_t deliveredAt = rng() % DELIVERY_SPREAD_MS;
+    device.admission.begin(deliveredAt, rng());
+    device.wakeAt = deliveredAt;
+  }
+
+  uint32_t running = 0;
+  uint32_t peak = 0;
+  uint32_t refused = 0;
+  uint32_t connects = 0; // in the current second
+  uint32_t peakConnects = 0;
+  uint32_t requests = 0;
+  uint32_t renewals = 0;
+  uint32_t finished = 0;
+  uint32_t end = durationS * 1000;
+  uint32_t now = 0;
+  for (; now <= end && finished < devices; now += TICK_MS) {
+    // Admission, and connecting to the firmware host
+    for (size_t i = 0; i < fleet.size(); i++) {
+      Device &device = fleet[i];
+      if (device.phase == ADMISSION && now >= device.wakeAt) {
+        for (;;) {
+          uint32_t waitMs = 0;
+          OTAAdmissionAction action =
+              device.admission.poll(now, rng(), waitMs);
+          if (action == OTA_ADMISSION_REQUEST) {
+            sendLease("request", i, device, -1, nullptr);
+            requests++;
+            continue;
+          }
+          if (action == OTA_ADMISSION_WAIT) {
+            device.wakeAt = now + waitMs;
+          } else if (action == OTA_ADMISSION_START) {
+            device.phase = RETRY_WAIT;
+            device.wakeAt = now;
+            device.admittedAt = now;
+          } else {
+            device.phase = FAILED;
+            finished++;
+          }
+          break;
+        }
+      }
+      if (device.phase == RETRY_WAIT && now >= device.wakeAt) {
+        device.attempt++;
+        connects++;
+        if (running < serverConnections) {
+          device.phase = DOWNLOADING;
+          device.downloadStartedAt = now;
+          running++;
+        } else {
+          refused++;
+          if (device.attempt == MAX_ATTEMPTS) {
+            device.phase = FAILED;
+            device.finishedAt = now;
+            finished++;
+            if (device.admission.end()) {
+              sendLease("release", i, device, -1, "error");
+            }
+          } else {
+            device.wakeAt = now + (RETRY_DELAY_MS << (device.attempt - 1));
+          }
+        }
+      }
+    }
+    peak = std::max(peak, running);
+    if ((now + TICK_MS) % 1000 == 0) {
+      peakConnects = std::max(peakConnects, connects);
+      connects = 0;
+    }
+
+    // Downloads share the host's bandwidth
+    double kbps = running ? std::min<double>(deviceKbps,
+                                             serverMbps * 1000.0 / running)
+                          : 0;
+    double step = kbps * 1000 / 8 * TICK_MS / 1000;
+    uint32_t done = 0;
+    for (size_t i = 0; i < fleet.size(); i++) {
+      Device &device = fleet[i];
+      if (device.phase != DOWNLOADING) {
+        continue;
+      }
+      device.received += step;
+      if (device.received >= imageBytes) {
+        device.phase = DONE;
+        device.finishedAt = now;
+        done++;
+        finished++;
+        if (device.admission.end()) {
+          sendLease("release", i, device, -1, "success");
+        }
+      } else if (device.admission.renewDue(now)) {
+        sendLease("renew", i, device,
+                  static_cast<int>(device.received * 100 / imageBytes),
+                  nullptr);
+        renewals++;
+      }
+    }
+    running -= done;
+    for (size_t i = 0; i < fleet.size(); i++) {
+      // Retrying devices hold on to their lease
+      if (fleet[i].phase == RETRY_WAIT && fleet[i].admission.renewDue(now)) {
+        sendLease("renew", i, fleet[i], 0, nullptr);
+        renewals++;
+      }
+    }
+
+    if (!lease) {
+      continue;
+    }
+    printf("tick %u\n", now);
+    fflush(stdout);
+    char line[256];
+    while (fgets(line, sizeof(line), stdin)) {
+      if (strncmp(line, "end", 3) == 0) {
+        break;
+      }
+      unsigned index, ticket, granted, leaseMs, retryMs;
+      if (sscanf(line, "reply dev%u %u %u %u %u", &index, &ticket, &granted,
+                 &leaseMs, &retryMs) != 5 ||
+          index >= devices) {
+        fprintf(stderr, "bad reply: %s", line);
+        continue;
+      }
+      OTALeaseReply reply = {ticket, granted != 0, leaseMs, retryMs};
+      if (fleet[index].admission.reply(now, reply)) {
+        // Polled on the next tick, as the woken update task would
+        fleet[index].wakeAt = now;
+      }
+    }
+  }
+
+  std::vector<double> downloads;
+  double admission = 0;
+  uint32_t completed = 0;
+  uint32_t failed = 0;
+  uint32_t last = 0;
+  for (const Device &device : fleet) {
+    if (device.phase == DONE) {
+      completed++;
+      downloads.push_back((device.finishedAt - device.downloadStartedAt) /
+                          1000.0);
+      admission += device.admittedAt / 1000.0;
+      last = std::max(last, device.finishedAt);
+    } else if (device.phase == FAILED) {
+      failed++;
+    }
+  }
+  std::sort(downloads.begin(), downloads.end());
+  double p95 = downloads.empty() ? 0 : downloads[downloads.size() * 95 / 100];
+  bool all = completed == devices;
+  peakConnects = std::max(peakConnects, connects);
+  printf("mode=%s devices=%u completed=%u failed=%u peak_downloads=%u "
+         "peak_connects=%u makespan_s=%.1f mean_admission_s=%.1f "
+         "p95_download_s=%.1f refused=%u lease_requests=%u renewals=%u\n",
+         mode.c_str(), devices, completed, failed, peak, peakConnects,
+         all ? last / 1000.0 : -1.0, completed ? admission / completed : 0,
+         p95, refused, requests, renewals);
+  fflush(stdout);
+  return all ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""
+Firmware broadcast over MQTT chunks
+
+Publishes a firmware image once for every device of a board, instead of
+each device downloading it over its own HTTPS connection. Devices
+(OTABroadcastReceiver in lib/OTA/src) write the chunks as they come and ask
+for the ones they missed:
+
+    <topic>/data/<board>        chunks: session and index (little endian
+                                32-bit each), then the image bytes
+    <topic>/data/<board>/<id>   repairs for one device, the same format
+    <topic>/gaps/<board>        gap requests: {"id": ..., "session": ...,
+                                "missing": [[first, last], ...], "left": 12}
+
+With --command it first sends the OTA command that starts the devices:
+
+    {"request_id": ..., "OTA": {"SHA256": ..., "firmwareUrl": <fallback>,
+     "broadcast": {"session": ..., "size": ..., "chunk": 4096}}}
+
+then the chunks at --rate-kbps (keep it below what the devices write to
+flash, or they drop chunks), then it answers gap requests until none came
+for --linger-s. Requests arriving within --holdoff-ms are answered
+together: a chunk that more than --unicast-max devices asked for is
+published to the whole board once, the others to each device that asked.
+A repair to the board costs the broker one chunk per device, a repair to
+one device one chunk here and one at the broker, so only chunks a large
+share of the board lost are worth publishing to all of it.
+
+    python ota_broadcast.py --host localhost --board esp32-c3-devkitm-1 \\
+        --image firmware.bin --command --url https://.../firmware.bin
+
+BroadcastSender itself does not touch the network, so
+test/test_ota_broadcast.py uses the same code as this command line.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import struct
+import sys
+import time
+import uuid
+
+from mqtt_client import MqttClient
+
+DEFAULT_TOPIC = "iotplatform/esp32/ota/broadcast"
+DEFAULT_COMMAND_TOPIC = "iotplatform/esp32/command"
+CHUNK_SIZE = 4096  # OTA_BROADCAST_CHUNK_SIZE
+
+
+class BroadcastSender:
+    """Chunks of one image and the repairs the devices ask for"""
+
+    def __init__(self, image, session, chunk_size=CHUNK_SIZE, unicast_max=32):
+        self.image = image
+        self.session = session
+        self.chunk_size = chunk_size
+        self.unicast_max = unicast_max
+        self.chunk_count = (len(image) + chunk_size - 1) // chunk_size
+        self.pending = {}  # index -> devices that asked for it
+        self.requests = 0
+        self.repairs_broadcast = 0
+        self.repairs_unicast = 0
+
+    def payload(self, index):
+        start = index * self.chunk_size
+        return struct.pack("<II", self.session, index) + \
+            self.image[start:start + self.chunk_size]
+
+    def command(self, fallback_url=None, request_id=None):
+        ota = {
+            "SHA256": hashlib.sha256(self.image).hexdigest(),
+            "broadcast": {"session": self.session, "size": len(self.image),
+                          "chunk": self.chunk_size},
+        }
+        if fallback_url:
+            ota["firmwareUrl"] = fallback_url
+        return {"request_id": request_id or str(uuid.uuid4()),
+                "sent_at": int(time.time() * 1000), "OTA": ota}
+
+    def handle(self, message):
+        """A gap request; False if it is not for this broadcast"""
+        device = message.get("id")
+        missing = message.get("missing")
+        if message.get("session") != self.session or \
+                not isinstance(device, str) or not isinstance(missing, list):
+            return False
+        self.requests += 1
+        for run in missing:
+            if not isinstance(run, list) or len(run) != 2:
+                continue
+            first = max(int(run[0]), 0)
+            last = min(int(run[1]), self.chunk_count - 1)
+            for index in range(first, last + 1):
+                self.pending.setdefault(index, set()).add(device)
+        return True
+
+    def repairs(self):
+        """Takes the pending repairs as (index, device), device None for the
+        whole board"""
+        out = []
+        for index in sorted(self.pending):
+            devices = self.pending[index]
+            if len(devices) > self.unicast_max:
+                out.append((index, None))
+                self.repairs_broadcast += 1
+            else:
+                out += [(index, device) for device in sorted(devices)]
+                self.repairs_unicast += len(devices)
+        self.pending = {}
+        return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--user")
+    parser.add_argument("--password")
+    parser.add_argument("--topic", default=DEFAULT_TOPIC)
+    parser.add_argument("--board", required=True)
+    parser.add_argument("--image", required=True)
+    parser.add_argument("--session", type=int,
+                        help="default: random")
+    parser.add_argument("--chunk", type=int, default=CHUNK_SIZE)
+    parser.add_argument("--rate-kbps", type=float, default=800,
+                        help="0 for as fast as the broker takes them")
+    parser.add_argument("--holdoff-ms", type=int, default=500)
+    parser.add_argument("--unicast-max", type=int, default=32)
+    parser.add_argument("--linger-s", type=float, default=30)
+    parser.add_argument("--command", action="store_true",
+                        help="send the OTA command first")
+    parser.add_argument("--command-topic", default=DEFAULT_COMMAND_TOPIC)
+    parser.add_argument("--url", help="fallback download in the command")
+    parser.add_argument("--lead-s", type=float, default=2,
+                        help="after the command, before the first chunk")
+    args = parser.parse_args()
+    if args.chunk <= 0 or args.chunk % 4096:
+        parser.error("--chunk must be a multiple of 4096")
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    session = args.session
+    if session is None:
+        session = struct.unpack("<I", os.urandom(4))[0]
+    sender = BroadcastSender(image, session, args.chunk, args.unicast_max)
+    data_topic = f"{args.topic}/data/{args.board}"
+    client = MqttClient(args.host, args.port, f"ota-broadcast-{session}",
+                        args.user, args.password)
+    client.subscribe(f"{args.topic}/gaps/{args.board}")
+
+    start = time.monotonic()
+    if args.command:
+        command = sender.command(args.url)
+        client.publish(f"{args.command_topic}/{args.board}",
+                       json.dumps(command))
+        print(f"sent command {command['request_id']}", file=sys.stderr)
+        time.sleep(args.lead_s)
+
+    interval = args.chunk * 8 / (args.rate_kbps * 1000) \
+        if args.rate_kbps > 0 else 0
+    next_send = time.monotonic()
+    first_pending = None
+    last_request = time.monotonic()
+
+    def poll(timeout):
+        nonlocal first_pending, last_request
+        for _, payload in client.loop(timeout):
+            try:
+                message = json.loads(payload)
+            except ValueError:
+                continue
+            if isinstance(message, dict) and sender.handle(message):
+                last_request = time.monotonic()
+                if first_pending is None:
+                    first_pending = last_request
+
+    def send(topic, index):
+        nonlocal next_send
+        poll(max(next_send - time.monotonic(), 0))
+        client.publish(topic, sender.payload(index))
+        next_send = max(next_send, time.monotonic()) + interval
+
+    for index in range(sender.chunk_count):
+        send(data_topic, index)
+    last_request = time.monotonic()
+    while time.monotonic() - last_request < args.linger_s:
+        poll(0.05)
+        if first_pending is not None and \
+                time.monotonic() - first_pending >= args.holdoff_ms / 1000:
+            first_pending = None
+            for index, device in sender.repairs():
+                send(data_topic if device is None
+                     else f"{data_topic}/{device}", index)
+    client.close()
+
+    print(f"session={session} chunks={sender.chunk_count} "
+          f"gap_requests={sender.requests} "
+          f"repairs_broadcast={sender.repairs_broadcast} "
+          f"repairs_unicast={sender.repairs_unicast} "
+          f"bytes_sent={client.bytes_sent} "
+          f"bytes_received={client.bytes_received} "
+          f"elapsed_s={time.monotonic() - start - args.linger_s:.1f}")
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except KeyboardInterrupt:
+        sys.exit(0)
@@ -0,0 +1,393 @@
+// Fleet of devices receiving a firmware broadcast (OTABroadcastReceiver)
+// through a real MQTT broker, used by test/test_ota_broadcast.py.
+//
+//   c++ -std=c++11 -O2 -I../lib/OTA/src -o ota_broadcast_fleet_host
+//       ota_broadcast_fleet_host.cpp ../lib/OTA/src/OTABroadcast.cpp
+//   ./ota_broadcast_fleet_host --image firmware.bin --session S [options]
+//
+// Every device is its own MQTT connection, subscribed like src/main.cpp to
+// <topic>/data/<board> and <topic>/data/<board>/<id>, and sends its gap
+// requests to <topic>/gaps/<board>. Once all are subscribed the tool prints
+// "ready", as the OTA command would have started their updates; start
+// tools/ota_broadcast.py then. A chunk a device takes is compared with the
+// image where it would be written to flash.
+//
+// Options:
+//   --host H --port P  broker (default 127.0.0.1:1883)
+//   --devices N        (default 100)
+//   --topic T          (default iotplatform/esp32/ota/broadcast)
+//   --board B          (default esp32-c3-devkitm-1)
+//   --chunk C          (default OTA_BROADCAST_CHUNK_SIZE)
+//   --loss P           share of chunks each device drops, as when its
+//                      chunk queue is full (default 0.01)
+//   --idle-ms I --spread-ms S  see OTABroadcastReceiver::configure()
+//   --timeout-s T      give up after this (default 120)
+//   --seed S
+//
+// Then one summary line:
+//   devices= completed= corrupt= bytes_in= bytes_out= gap_requests=
+//   duplicates= dropped= elapsed_s=
+// bytes_in and bytes_out are the MQTT bytes all devices received and sent.
+//
+// Exit status: 0 all complete, 1 not, 2 usage or connection error.
+
+#include "OTABroadcast.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+struct Device {
+  int fd = -1;
+  std::string id;
+  std::vector<uint8_t> rx;
+  OTABroadcastReceiver receiver;
+  int subacks = 0;
+  bool failed = false;
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+  uint32_t corrupt = 0;
+  uint32_t dropped = 0;
+};
+
+static uint32_t nowMs() {
+  using namespace std::chrono;
+  static const steady_clock::time_point start = steady_clock::now();
+  return static_cast<uint32_t>(
+      duration_cast<milliseconds>(steady_clock::now() - start).count());
+}
+
+static void appendString(std::string &out, const std::string &text) {
+  out += static_cast<char>(text.size() >> 8);
+  out += static_cast<char>(text.size() & 0xff);
+  out += text;
+}
+
+static std::string packet(uint8_t first, const std::string &body) {
+  std::string out(1, static_cast<char>(first));
+  size_t length = body.size();
+  do {
+    uint8_t byte = length % 128;
+    length /= 128;
+    out += static_cast<char>(byte | (length ? 0x80 : 0));
+  } while (length);
+  return out + body;
+}
+
+static bool sendAll(Device &device, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(device.fd, data.data() + sent, data.size() - sent,
+                     MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      pollfd p = {device.fd, POLLOUT, 0};
+      poll(&p, 1, 100);
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  device.bytesOut += data.size();
+  return true;
+}
+
+static bool connectDevice(Device &device, const char *host, int port,
+                          const std::string &topic) {
+  device.fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (device.fd < 0 || inet_pton(AF_INET, host, &addr.sin_addr) != 1 ||
+      connect(device.fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+    return false;
+  }
+  int one = 1;
+  setsockopt(device.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(device.fd, F_SETFL, fcntl(device.fd, F_GETFL) | O_NONBLOCK);
+
+  // Clean session, keepalive off
+  std::string body;
+  appendString(body, "MQTT");
+  body += std::string("\x04\x02\x00\x00", 4);
+  appendString(body, "fleet-" + device.id);
+  std::string subscribe("\x00\x01", 2);
+  appendString(subscribe, topic);
+  subscribe += '\0';
+  std::string own("\x00\x02", 2);
+  appendString(own, topic + "/" + device.id);
+  own += '\0';
+  return sendAll(device, packet(0x10, body)) &&
+         sendAll(device, packet(0x82, subscribe)) &&
+         sendAll(device, packet(0x82, own));
+}
+
+// A gap request like OTA::_sendGaps()
+static bool sendGaps(Device &device, const std::string &topic) {
+  uint32_t ranges[OTA_BROADCAST_MAX_RANGES][2];
+  size_t count =
+      device.receiver.missingRanges(ranges, OTA_BROADCAST_MAX_RANGES);
+  std::string json = "{\"id\":\"" + device.id + "\",\"session\":" +
+                     std::to_string(device.receiver.session()) +
+                     ",\"missing\":[";
+  for (size_t i = 0; i < count; i++) {
+    json += (i ? ",[" : "[") + std::to_string(ranges[i][0]) + "," +
+            std::to_string(ranges[i][1]) + "]";
+  }
+  json += "],\"left\":" + std::to_string(device.receiver.missing()) + "}";
+  std::string body;
+  appendString(body, topic);
+  return sendAll(device, packet(0x30, body + json));
+}
+
+// Handles the whole packets in the device's buffer
+static void receive(Device &device, const std::vector<uint8_t> &image,
+                    uint32_t session, double loss, std::mt19937 &rng) {
+  std::uniform_real_distribution<double> uniform(0, 1);
+  size_t pos = 0;
+  for (;;) {
+    size_t length = 0;
+    size_t header = 1;
+    uint32_t multiplier = 1;
+    bool whole = false;
+    while (pos + header < device.rx.size()) {
+      uint8_t byte = device.rx[pos + header++];
+      length += (byte & 0x7f) * multiplier;
+      multiplier *= 128;
+      if (!(byte & 0x80)) {
+        whole = true;
+        break;
+      }
+    }
+    if (!whole || pos + header + length > device.rx.size()) {
+      break;
+    }
+    uint8_t type = device.rx[pos] & 0xf0;
+    const uint8_t *body = &device.rx[pos + header];
+    pos += header + length;
+    if (type == 0x90) {
+      device.subacks++;
+      continue;
+    }
+    if (type != 0x30 || length < 2) {
+      continue; // CONNACK
+    }
+    size_t topicLength = body[0] << 8 | body[1];
+    if (2 + topicLength > length) {
+      continue;
+    }
+    const uint8_t *payload = body + 2 + topicLength;
+    size_t payloadLength = length - 2 - topicLength;
+    uint32_t chunkSession;
+    uint32_t index;
+    if (!device.receiver.chunkCount() ||
+        !OTABroadcastReceiver::parseHeader(payload, payloadLength,
+                                           chunkSession, index) ||
+        chunkSession != session) {
+      continue;
+    }
+    if (uniform(rng) < loss) {
+      device.dropped++;
+      continue;
+    }
+    size_t dataLength = payloadLength - OTABroadcastReceiver::HEADER_SIZE;
+    if (!device.receiver.wanted(index, dataLength)) {
+      continue;
+    }
+    if (memcmp(payload + OTABroadcastReceiver::HEADER_SIZE,
+               image.data() + device.receiver.chunkOffset(index),
+               dataLength) != 0) {
+      device.corrupt++;
+    }
+    device.receiver.received(index, nowMs());
+  }
+  device.rx.erase(device.rx.begin(), device.rx.begin() + pos);
+}
+
+int main(int argc, char **argv) {
+  std::string host = "127.0.0.1";
+  int port = 1883;
+  uint32_t devices = 100;
+  std::string topic = "iotplatform/esp32/ota/broadcast";
+  std::string board = "esp32-c3-devkitm-1";
+  std::string imagePath;
+  uint32_t session = 0;
+  bool haveSession = false;
+  uint32_t chunk = OTA_BROADCAST_CHUNK_SIZE;
+  double loss = 0.01;
+  uint32_t idleMs = OTA_BROADCAST_IDLE_MS;
+  uint32_t spreadMs = OTA_BROADCAST_SPREAD_MS;
+  uint32_t timeoutS = 120;
+  unsigned seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", option.c_str());
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (option == "--host") {
+      host = value;
+    } else if (option == "--port") {
+      port = atoi(value);
+    } else if (option == "--devices") {
+      devices = strtoul(value, nullptr, 0);
+    } else if (option == "--topic") {
+      topic = value;
+    } else if (option == "--board") {
+      board = value;
+    } else if (option == "--image") {
+      imagePath = value;
+    } else if (option == "--session") {
+      session = strtoul(value, nullptr, 0);
+      haveSession = true;
+    } else if (option == "--chunk") {
+      chunk = strtoul(value, nullptr, 0);
+    } else if (option == "--loss") {
+      loss = atof(value);
+    } else if (option == "--idle-ms") {
+      idleMs = strtoul(value, nullptr, 0);
+    } else if (option == "--spread-ms") {
+      spreadMs = strtoul(value, nullptr, 0);
+    } else if (option == "--timeout-s") {
+      timeoutS = strtoul(value, nullptr, 0);
+    } else if (option == "--seed") {
+      seed = strtoul(value, nullptr, 0);
+    } else {
+      fprintf(stderr, "unknown option %s\n", option.c_str());
+      return 2;
+    }
+  }
+  std::vector<uint8_t> image;
+  FILE *file = imagePath.empty() ? nullptr : fopen(imagePath.c_str(), "rb");
+  if (file) {
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+      image.insert(image.end(), buffer, buffer + n);
+    }
+    fclose(file);
+  }
+  if (image.empty() || !haveSession || devices == 0 || chunk == 0) {
+    fprintf(stderr, "usage: ota_broadcast_fleet_host --image F --session S "
+                    "[options]\n");
+    return 2;
+  }
+
+  std::string dataTopic = topic + "/data/" + board;
+  std::string gapsTopic = topic + "/gaps/" + board;
+  std::mt19937 rng(seed);
+  std::vector<Device> fleet(devices);
+  for (size_t i = 0; i < fleet.size(); i++) {
+    // Consecutive MACs of one vendor, as DeviceConfigManager::getDeviceId()
+    char id[16];
+    snprintf(id, sizeof(id), "%04X%08X", 0x3C61u, 0x05000000u + (unsigned)i);
+    fleet[i].id = id;
+    fleet[i].receiver.configure(idleMs, spreadMs);
+    if (!connectDevice(fleet[i], host.c_str(), port, dataTopic)) {
+      fprintf(stderr, "device %s could not connect: %s\n", id,
+              strerror(errno));
+      return 2;
+    }
+  }
+
+  std::vector<pollfd> fds(fleet.size());
+  for (size_t i = 0; i < fleet.size(); i++) {
+    fds[i] = {fleet[i].fd, POLLIN, 0};
+  }
+  bool ready = false;
+  uint32_t startedAt = 0;
+  uint32_t deadline = nowMs() + timeoutS * 1000;
+  uint32_t finished = 0;
+  while (finished < devices &&
+         static_cast<int32_t>(nowMs() - deadline) < 0) {
+    poll(fds.data(), fds.size(), 10);
+    uint32_t now = nowMs();
+    for (size_t i = 0; i < fleet.size(); i++) {
+      Device &device = fleet[i];
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        uint8_t buffer[65536];
+        ssize_t n;
+        while ((n = recv(device.fd, buffer, sizeof(buffer), 0)) > 0) {
+          device.rx.insert(device.rx.end(), buffer, buffer + n);
+          device.bytesIn += n;
+        }
+        if (n == 0) {
+          fprintf(stderr, "broker closed the connection of %s\n",
+                  device.id.c_str());
+          return 2;
+        }
+        receive(device, image, session, loss, rng);
+      }
+      if (!ready || device.failed || device.receiver.complete()) {
+        continue;
+      }
+      uint32_t waitMs;
+      OTABroadcastAction action = device.receiver.poll(now, rng(), waitMs);
+      if (action == OTA_BROADCAST_REQUEST) {
+        sendGaps(device, gapsTopic);
+      } else if (action == OTA_BROADCAST_STALLED) {
+        device.failed = true;
+      }
+    }
+    finished = 0;
+    for (const Device &device : fleet) {
+      finished += ready && (device.failed || device.receiver.complete());
+    }
+    if (!ready) {
+      ready = true;
+      for (const Device &device : fleet) {
+        ready = ready && device.subacks == 2;
+      }
+      if (ready) {
+        // The OTA command has arrived
+        startedAt = nowMs();
+        for (Device &device : fleet) {
+          device.receiver.begin(session, image.size(), chunk, startedAt);
+        }
+        printf("ready\n");
+        fflush(stdout);
+      }
+    }
+  }
+
+  uint32_t completed = 0;
+  uint32_t corrupt = 0;
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+  uint32_t requests = 0;
+  uint32_t duplicates = 0;
+  uint32_t dropped = 0;
+  uint32_t last = 0;
+  for (Device &device : fleet) {
+    completed += device.receiver.complete() && !device.corrupt;
+    corrupt += device.corrupt != 0;
+    bytesIn += device.bytesIn;
+    bytesOut += device.bytesOut;
+    OTABroadcastStats stats = device.receiver.getStats();
+    requests += stats.requests;
+    duplicates += stats.duplicates;
+    dropped += device.dropped;
+    close(device.fd);
+  }
+  last = nowMs();
+  printf("devices=%u completed=%u corrupt=%u bytes_in=%llu bytes_out=%llu "
+         "gap_requests=%u duplicates=%u dropped=%u elapsed_s=%.1f\n",
+         devices, completed, corrupt, (unsigned long long)bytesIn,
+         (unsigned long long)bytesOut, requests, duplicates, dropped,
+         ready ? (last - startedAt) / 1000.0 : -1.0);
+  fflush(stdout);
+  return completed == devices ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+"""
+Reference lease coordinator for fleet OTA admission
+
+Devices (OTAAdmission in lib/OTA/src) ask for a download slot before they
+download an update. This coordinator grants at most --max-concurrent slots
+at a time and answers on <topic>/<device id>:
+
+    device -> <topic>          {"op": "request", "id": ..., "ticket": ...}
+                               {"op": "renew", "id": ..., "ticket": ...,
+                                "progress": 42}
+                               {"op": "release", "id": ..., "ticket": ...,
+                                "result": "success"}
+    <topic>/<id> -> device     {"ticket": ..., "granted": true,
+                                "lease_ms": 60000}
+                               {"ticket": ..., "granted": false,
+                                "retry_ms": 5000}
+
+A lease that is not renewed within lease_ms is taken back. Denied devices
+wait in arrival order and are granted without asking again when a slot
+frees up; they keep their place by repeating the request. Replies are sent
+with QoS 0: a lost grant is sent again when the device repeats its request.
+A renewal of a lease the coordinator does not know (after a restart of the
+coordinator) is adopted, even above the limit, rather than stopping a
+download halfway.
+
+Runs against any MQTT 3.1.1 broker, e.g. a local mosquitto for testing:
+
+    python ota_lease_coordinator.py --host localhost --max-concurrent 20
+
+LeaseCoordinator itself does not touch the network and takes the time as
+an argument, so test/test_ota_admission.py drives it from a simulation.
+"""
+
+import argparse
+import collections
+import json
+import sys
+import time
+
+from mqtt_client import MqttClient
+
+DEFAULT_TOPIC = "iotplatform/esp32/ota/lease"
+
+
+class LeaseCoordinator:
+    """Download slots, keyed by device ID. Times are milliseconds."""
+
+    def __init__(self, max_concurrent, lease_ms=60000, retry_ms=5000,
+                 log=None):
+        self.max_concurrent = max_concurrent
+        self.lease_ms = lease_ms
+        self.retry_ms = retry_ms
+        self.log = log or (lambda message: None)
+        self.leases = {}  # id -> [ticket, expires, progress]
+        # id -> [ticket, last request], in arrival order
+        self.waiting = collections.OrderedDict()
+        self.peak = 0
+        self.grants = 0
+        self.denials = 0
+        self.expired = 0
+        self.adopted = 0
+
+    def handle(self, message, now):
+        """A message from a device; returns the replies as (id, reply)"""
+        device = message.get("id")
+        ticket = message.get("ticket")
+        op = message.get("op")
+        if not isinstance(device, str) or not isinstance(ticket, int):
+            return []
+        lease = self.leases.get(device)
+        if op == "request":
+            if lease and lease[0] == ticket:
+                # The grant was lost
+                lease[1] = now + self.lease_ms
+                return [(device, self._grant(ticket))]
+            if lease:
+                # A new update: the device dropped the old one
+                del self.leases[device]
+            self.waiting[device] = [ticket, now]
+            replies = self._fill(now)
+            if device in self.waiting:
+                self.denials += 1
+                replies.append((device, {"ticket": ticket, "granted": False,
+                                         "retry_ms": self.retry_ms}))
+            return replies
+        if op == "renew":
+            if lease and lease[0] == ticket:
+                lease[1] = now + self.lease_ms
+                lease[2] = message.get("progress", lease[2])
+            else:
+                self.log(f"adopting the download of {device}")
+                self.waiting.pop(device, None)
+                self.leases[device] = [ticket, now + self.lease_ms,
+                                       message.get("progress", 0)]
+                self.adopted += 1
+                self.peak = max(self.peak, len(self.leases))
+            return []
+        if op == "release":
+            if lease and lease[0] == ticket:
+                del self.leases[device]
+                self.log(f"{device} finished: {message.get('result')}")
+                return self._fill(now)
+            return []
+        return []
+
+    def expire(self, now):
+        """Takes back leases that were not renewed; returns new grants"""
+        for device, lease in list(self.leases.items()):
+            if now >= lease[1]:
+                self.log(f"lease of {device} expired at {lease[2]}%")
+                del self.leases[device]
+                self.expired += 1
+        return self._fill(now)
+
+    def _grant(self, ticket):
+        return {"ticket": ticket, "granted": True, "lease_ms": self.lease_ms}
+
+    def _fill(self, now):
+        replies = []
+        while self.waiting and len(self.leases) < self.max_concurrent:
+            device, (ticket, seen) = self.waiting.popitem(last=False)
+            # Gone quiet: it gave up or downloaded without a coordinator
+            if now - seen > 3 * self.retry_ms:
+                continue
+            self.leases[device] = [ticket, now + self.lease_ms, 0]
+            self.grants += 1
+            self.peak = max(self.peak, len(self.leases))
+            self.log(f"granted {device} ({len(self.leases)} downloading, "
+                     f"{len(self.waiting)} waiting)")
+            replies.append((device, self._grant(ticket)))
+        return replies
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--user")
+    parser.add_argument("--password")
+    parser.add_argument("--topic", default=DEFAULT_TOPIC)
+    parser.add_argument("--max-concurrent", type=int, default=20)
+    parser.add_argument("--lease-ms", type=int, default=60000)
+    parser.add_argument("--retry-ms", type=int, default=5000)
+    args = parser.parse_args()
+
+    def log(message):
+        print(f"{time.strftime('%H:%M:%S')} {message}", flush=True)
+
+    coordinator = LeaseCoordinator(args.max_concurrent, args.lease_ms,
+                                   args.retry_ms, log)
+    start = time.monotonic()
+    # The leases outlive a lost connection; devices keep renewing them
+    while True:
+        try:
+            serve(args, coordinator, start, log)
+        except OSError as error:
+            log(f"broker connection lost ({error}), reconnecting in 5 s")
+            time.sleep(5)
+
+
+def serve(args, coordinator, start, log):
+    client = MqttClient(args.host, args.port,
+                        f"ota-lease-coordinator-{int(time.time())}",
+                        args.user, args.password)
+    # Exactly the request topic, not the replies under it
+    client.subscribe(args.topic)
+    log(f"coordinating {args.topic} on {args.host}:{args.port}, "
+        f"{args.max_concurrent} slots")
+
+    while True:
+        messages = client.loop(1.0)
+        now = int((time.monotonic() - start) * 1000)
+        replies = []
+        for topic, payload in messages:
+            try:
+                message = json.loads(payload)
+            except ValueError:
+                log(f"ignoring unparsable message on {topic}")
+                continue
+            if isinstance(message, dict):
+                replies += coordinator.handle(message, now)
+        replies += coordinator.expire(now)
+        for device, reply in replies:
+            client.publish(f"{args.topic}/{device}", json.dumps(reply))
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except KeyboardInterrupt:
+        sys.exit(0)
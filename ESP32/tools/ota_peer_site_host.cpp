@@ -0,0 +1,552 @@
+// Sites of devices updating from each other (OTAPeerSelector, OTAPeerHttp)
+// instead of each downloading the image from the origin, used by
+// test/test_ota_peer.py.
+//
+//   c++ -std=c++11 -O2 -pthread -I../lib/OTA/src -o ota_peer_site_host
+//       ota_peer_site_host.cpp ../lib/OTA/src/OTAPeer.cpp
+//   ./ota_peer_site_host --image firmware.bin --sha256 HEX --token T
+//       --origin-port P
+//
+// Every device is a thread with its own HTTP endpoint on a loopback
+// address of its site (127.0.<site + 1>.<device + 1>), serving the image
+// like the firmware does once it runs it: one transfer at a time, 503 to
+// anyone else meanwhile. A site's devices find each other through a shared
+// table standing in for mDNS, where each announces the image it serves and
+// the one it downloads from the origin; a lookup returns the table as it is
+// --lookup-ms later, as an mDNS query collects answers for a while. All
+// devices get the command at once. A device that downloaded the image
+// compares it with the file, is gone for --restart-ms (reboot, validation)
+// and then serves it, to requests with --token only.
+//
+// The origin is an HTTP server at 127.0.0.1:<origin-port><origin-path>;
+// devices add ?site=<site> so it can count the bytes each site pulled over
+// its uplink.
+//
+// Options:
+//   --sites S --devices N   sites and devices per site (default 3, 20)
+//   --origin-port P --origin-path PATH  (default /firmware.bin)
+//   --no-peers              every device downloads from the origin
+//   --spread-ms --retry-ms --reboot-ms  see OTAPeerSelector::configure()
+//                           (default 1000, 200, 3000)
+//   --lookup-ms L           (default 100)
+//   --restart-ms R          (default 300)
+//   --lan-kbps K            rate of one peer transfer (default 20000)
+//   --timeout-s T           give up after this (default 60)
+//   --seed S
+//
+// Once all are done, one device of each site serving the image is asked for
+// it without the token and with a wrong one. Then one summary line per
+// site:
+//   site= devices= completed= corrupt= from_origin= from_peers=
+//   origin_bytes= peer_bytes= busy= failures= lookups= refused=
+//   elapsed_s=
+// where refused counts those two requests answered 401.
+//
+// Exit status: 0 all complete, 1 not, 2 usage error.
+
+#include "OTAPeer.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct Config {
+  uint32_t sites = 3;
+  uint32_t devices = 20;
+  int originPort = 0;
+  std::string originPath = "/firmware.bin";
+  bool peers = true;
+  uint32_t spreadMs = 1000;
+  uint32_t retryMs = 200;
+  uint32_t rebootMs = 3000;
+  uint32_t lookupMs = 100;
+  uint32_t restartMs = 300;
+  uint32_t lanKbps = 20000;
+  uint32_t timeoutS = 60;
+  unsigned seed = 1;
+  std::vector<uint8_t> image;
+  std::string sha256;
+  std::string token;
+};
+
+// What a device announces (mDNS TXT records on the device)
+struct Announcement {
+  uint32_t address;
+  uint16_t port;
+  bool serving;
+  bool fetching;
+};
+
+struct Site {
+  std::mutex lock;
+  std::vector<Announcement> table;
+};
+
+struct Device {
+  uint32_t site = 0;
+  uint32_t index = 0;
+  uint32_t address = 0; // network order, as lwIP keeps it
+  uint16_t port = 0;
+  int listener = -1;
+  std::atomic<bool> serving{false};
+  bool completed = false;
+  bool corrupt = false;
+  bool fromOrigin = false;
+  uint64_t originBytes = 0;
+  uint64_t peerBytes = 0;
+  OTAPeerStats stats = OTAPeerStats();
+};
+
+static std::atomic<bool> stopping(false);
+
+static uint32_t nowMs() {
+  using namespace std::chrono;
+  static const steady_clock::time_point start = steady_clock::now();
+  return static_cast<uint32_t>(
+      duration_cast<milliseconds>(steady_clock::now() - start).count());
+}
+
+static void sleepMs(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+static bool sendAll(int fd, const void *data, size_t len) {
+  const char *p = static_cast<const char *>(data);
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static void refuse(int fd) {
+  OTAPeerRequest none = OTAPeerRequest();
+  char head[256];
+  size_t len = OTAPeerHttp::responseHead(head, sizeof(head), 503, none, 0);
+  sendAll(fd, head, len);
+  close(fd);
+}
+
+// One request per connection, as OTA::_servePeer() handles them
+static void serveOne(const Config &config, Device &device, int fd) {
+  char head[512];
+  size_t used = 0;
+  while (used < sizeof(head) - 1) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 2000) <= 0) {
+      break;
+    }
+    ssize_t n = recv(fd, head + used, sizeof(head) - 1 - used, 0);
+    if (n <= 0) {
+      break;
+    }
+    used += n;
+    head[used] = '\0';
+    if (strstr(head, "\r\n\r\n")) {
+      break;
+    }
+  }
+  head[used] = '\0';
+
+  OTAPeerRequest request;
+  uint32_t size = static_cast<uint32_t>(config.image.size());
+  int status = 400;
+  if (OTAPeerHttp::parseRequest(head, request)) {
+    status = OTAPeerHttp::status(
+        request, device.serving ? config.sha256.c_str() : nullptr,
+        config.token.c_str(), size);
+  }
+  char response[256];
+  size_t len = OTAPeerHttp::responseHead(response, sizeof(response), status,
+                                         request, size);
+  bool ok = sendAll(fd, response, len);
+  if (ok && (status == 200 || status == 206)) {
+    uint32_t offset = status == 206 ? request.first : 0;
+    const uint32_t piece = 4096;
+    uint32_t pieceUs = static_cast<uint32_t>(
+        uint64_t(piece) * 8 * 1000 / (config.lanKbps ? config.lanKbps : 1));
+    while (ok && offset < size) {
+      uint32_t n = size - offset < piece ? size - offset : piece;
+      ok = sendAll(fd, config.image.data() + offset, n);
+      offset += n;
+      // Others asking meanwhile are told to come back later
+      for (;;) {
+        struct pollfd pfd = {device.listener, POLLIN, 0};
+        if (poll(&pfd, 1, 0) <= 0) {
+          break;
+        }
+        int other = accept(device.listener, nullptr, nullptr);
+        if (other < 0) {
+          break;
+        }
+        refuse(other);
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(pieceUs));
+    }
+  }
+  shutdown(fd, SHUT_WR);
+  close(fd);
+}
+
+static void serve(const Config &config, Device &device) {
+  while (!stopping) {
+    struct pollfd pfd = {device.listener, POLLIN, 0};
+    if (poll(&pfd, 1, 50) <= 0) {
+      continue;
+    }
+    int fd = accept(device.listener, nullptr, nullptr);
+    if (fd >= 0) {
+      serveOne(config, device, fd);
+    }
+  }
+}
+
+// GET of path from address:port, with token unless it is empty; the
+// status, or -1 if the connection failed or broke off. The body goes to
+// body.
+static int httpGet(uint32_t address, uint16_t port, const std::string &path,
+                   const std::string &token, std::vector<uint8_t> &body) {
+  body.clear();
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = address;
+  addr.sin_port = htons(port);
+  std::string request = "GET " + path + " HTTP/1.1\r\nHost: peer\r\n";
+  if (!token.empty()) {
+    request += "Authorization: Bearer " + token + "\r\n";
+  }
+  request += "Connection: close\r\n\r\n";
+  if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+              sizeof(addr)) != 0 ||
+      !sendAll(fd, request.data(), request.size())) {
+    close(fd);
+    return -1;
+  }
+  std::string response;
+  char buffer[16384];
+  for (;;) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 15000) <= 0) {
+      close(fd);
+      return -1;
+    }
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n < 0) {
+      close(fd);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    response.append(buffer, n);
+  }
+  close(fd);
+
+  size_t end = response.find("\r\n\r\n");
+  int status = 0;
+  if (end == std::string::npos ||
+      sscanf(response.c_str(), "HTTP/1.%*d %d", &status) != 1) {
+    return -1;
+  }
+  const char *length = strcasestr(response.c_str(), "\r\nContent-Length:");
+  if (!length || length > response.c_str() + end) {
+    return -1;
+  }
+  size_t expected = strtoul(length + 17, nullptr, 10);
+  if (response.size() - end - 4 != expected) {
+    return -1; // cut off
+  }
+  body.assign(response.begin() + end + 4, response.end());
+  return status;
+}
+
+static void announce(Site &site, const Device &device, bool serving,
+                     bool fetching) {
+  std::lock_guard<std::mutex> guard(site.lock);
+  for (Announcement &entry : site.table) {
+    if (entry.address == device.address && entry.port == device.port) {
+      entry.serving = serving;
+      entry.fetching = fetching;
+      return;
+    }
+  }
+}
+
+static size_t lookup(const Config &config, Site &site, OTAPeerInfo *peers) {
+  sleepMs(config.lookupMs);
+  std::lock_guard<std::mutex> guard(site.lock);
+  size_t count = 0;
+  for (const Announcement &entry : site.table) {
+    if ((entry.serving || entry.fetching) && count < OTA_PEER_MAX_PEERS) {
+      peers[count].address = entry.address;
+      peers[count].port = entry.port;
+      peers[count].serving = entry.serving;
+      peers[count].fetching = entry.fetching;
+      count++;
+    }
+  }
+  return count;
+}
+
+static void update(const Config &config, Site &site, Device &device,
+                   unsigned seed) {
+  std::mt19937 random(seed);
+  uint32_t deadline = nowMs() + config.timeoutS * 1000;
+  std::string peerPath = "/ota/" + config.sha256;
+  std::string originPath =
+      config.originPath + "?site=" + std::to_string(device.site);
+  std::vector<uint8_t> body;
+  bool done = false;
+
+  if (config.peers) {
+    OTAPeerSelector selector;
+    selector.configure(config.spreadMs, config.retryMs, config.rebootMs,
+                       config.timeoutS * 1000);
+    selector.begin(device.address, device.port, nowMs(), random());
+    OTAPeerInfo peers[OTA_PEER_MAX_PEERS];
+    size_t count = 0;
+    while (!done && static_cast<int32_t>(nowMs() - deadline) < 0) {
+      OTAPeerInfo peer;
+      uint32_t waitMs = 0;
+      OTAPeerAction action =
+          selector.next(peers, count, nowMs(), random(), peer, waitMs);
+      announce(site, device, false, selector.fetching());
+      if (action == OTA_PEER_WAIT) {
+        sleepMs(waitMs);
+        count = lookup(config, site, peers);
+      } else if (action == OTA_PEER_CLAIM) {
+        count = lookup(config, site, peers);
+      } else if (action == OTA_PEER_DOWNLOAD) {
+        int status =
+            httpGet(peer.address, peer.port, peerPath, config.token, body);
+        if (status == 200 && body == config.image) {
+          device.peerBytes += body.size();
+          selector.succeeded(nowMs());
+          done = true;
+        } else {
+          if (status == 200) {
+            device.peerBytes += body.size();
+          }
+          selector.failed(peer, status == 503 || status < 0, nowMs());
+        }
+      } else {
+        break;
+      }
+    }
+    device.stats = selector.getStats();
+  }
+
+  if (!done) {
+    device.fromOrigin = true;
+    int status = httpGet(htonl(INADDR_LOOPBACK), config.originPort,
+                         originPath, "", body);
+    device.originBytes += body.size();
+    done = status == 200;
+    device.corrupt = done && body != config.image;
+    done = done && !device.corrupt;
+  }
+  announce(site, device, false, false);
+  if (!done) {
+    return;
+  }
+  device.completed = true;
+  sleepMs(config.restartMs);
+  device.serving = true;
+  announce(site, device, true, false);
+}
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &out) {
+  FILE *file = path.empty() ? nullptr : fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    out.insert(out.end(), buffer, buffer + n);
+  }
+  fclose(file);
+  return !out.empty();
+}
+
+int main(int argc, char **argv) {
+  Config config;
+  std::string imagePath;
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (option == "--no-peers") {
+      config.peers = false;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", option.c_str());
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (option == "--sites") {
+      config.sites = strtoul(value, nullptr, 0);
+    } else if (option == "--devices") {
+      config.devices = strtoul(value, nullptr, 0);
+    } else if (option == "--image") {
+      imagePath = value;
+    } else if (option == "--sha256") {
+      config.sha256 = value;
+    } else if (option == "--token") {
+      config.token = value;
+    } else if (option == "--origin-port") {
+      config.originPort = atoi(value);
+    } else if (option == "--origin-path") {
+      config.originPath = value;
+    } else if (option == "--spread-ms") {
+      config.spreadMs = strtoul(value, nullptr, 0);
+    } else if (option == "--retry-ms") {
+      config.retryMs = strtoul(value, nullptr, 0);
+    } else if (option == "--reboot-ms") {
+      config.rebootMs = strtoul(value, nullptr, 0);
+    } else if (option == "--lookup-ms") {
+      config.lookupMs = strtoul(value, nullptr, 0);
+    } else if (option == "--restart-ms") {
+      config.restartMs = strtoul(value, nullptr, 0);
+    } else if (option == "--lan-kbps") {
+      config.lanKbps = strtoul(value, nullptr, 0);
+    } else if (option == "--timeout-s") {
+      config.timeoutS = strtoul(value, nullptr, 0);
+    } else if (option == "--seed") {
+      config.seed = strtoul(value, nullptr, 0);
+    } else {
+      fprintf(stderr, "unknown option %s\n", option.c_str());
+      return 2;
+    }
+  }
+  if (!readFile(imagePath, config.image) || config.sha256.size() != 64 ||
+      !OTAPeerHttp::validToken(config.token.c_str()) ||
+      config.originPort <= 0 || config.sites == 0 || config.sites > 250 ||
+      config.devices == 0 || config.devices > 250) {
+    fprintf(stderr, "usage: %s --image FILE --sha256 HEX --token T "
+                    "--origin-port P [options]\n",
+            argv[0]);
+    return 2;
+  }
+
+  std::vector<Site> sites(config.sites);
+  std::vector<Device> devices(config.sites * config.devices);
+  for (uint32_t s = 0; s < config.sites; s++) {
+    for (uint32_t d = 0; d < config.devices; d++) {
+      Device &device = devices[s * config.devices + d];
+      device.site = s;
+      device.index = d;
+      char address[32];
+      snprintf(address, sizeof(address), "127.0.%u.%u", s + 1, d + 1);
+      device.address = inet_addr(address);
+      device.listener = socket(AF_INET, SOCK_STREAM, 0);
+      int reuse = 1;
+      setsockopt(device.listener, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse));
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = device.address;
+      socklen_t addrLen = sizeof(addr);
+      if (bind(device.listener, reinterpret_cast<struct sockaddr *>(&addr),
+               sizeof(addr)) != 0 ||
+          listen(device.listener, 64) != 0 ||
+          getsockname(device.listener,
+                      reinterpret_cast<struct sockaddr *>(&addr),
+                      &addrLen) != 0) {
+        perror("listen");
+        return 2;
+      }
+      device.port = ntohs(addr.sin_port);
+      sites[s].table.push_back({device.address, device.port, false, false});
+    }
+  }
+
+  uint32_t start = nowMs();
+  std::vector<std::thread> servers;
+  std::vector<std::thread> updates;
+  for (size_t i = 0; i < devices.size(); i++) {
+    Device &device = devices[i];
+    servers.emplace_back(serve, std::cref(config), std::ref(device));
+    updates.emplace_back(update, std::cref(config),
+                         std::ref(sites[device.site]), std::ref(device),
+                         config.seed * 7919u + static_cast<unsigned>(i));
+  }
+  for (std::thread &thread : updates) {
+    thread.join();
+  }
+  float elapsed = (nowMs() - start) / 1000.0f;
+
+  // Anyone else on the network asking for the image
+  std::string wrongToken = config.token;
+  wrongToken[0] = wrongToken[0] == 'a' ? 'b' : 'a';
+  std::vector<uint32_t> refused(config.sites, 0);
+  for (uint32_t s = 0; s < config.sites; s++) {
+    for (uint32_t d = 0; d < config.devices; d++) {
+      const Device &device = devices[s * config.devices + d];
+      if (!device.serving) {
+        continue;
+      }
+      std::vector<uint8_t> body;
+      std::string path = "/ota/" + config.sha256;
+      refused[s] += httpGet(device.address, device.port, path, "", body) ==
+                    401;
+      refused[s] +=
+          httpGet(device.address, device.port, path, wrongToken, body) == 401;
+      break;
+    }
+  }
+  stopping = true;
+  for (std::thread &thread : servers) {
+    thread.join();
+  }
+
+  bool allComplete = true;
+  for (uint32_t s = 0; s < config.sites; s++) {
+    uint32_t completed = 0, corrupt = 0, fromOrigin = 0, fromPeers = 0;
+    uint64_t originBytes = 0, peerBytes = 0;
+    uint32_t busy = 0, failures = 0, lookups = 0;
+    for (uint32_t d = 0; d < config.devices; d++) {
+      const Device &device = devices[s * config.devices + d];
+      close(device.listener);
+      completed += device.completed;
+      corrupt += device.corrupt;
+      if (device.completed) {
+        fromOrigin += device.fromOrigin;
+        fromPeers += !device.fromOrigin;
+      }
+      originBytes += device.originBytes;
+      peerBytes += device.peerBytes;
+      busy += device.stats.busy;
+      failures += device.stats.failures;
+      lookups += device.stats.lookups;
+    }
+    allComplete = allComplete && completed == config.devices;
+    printf("site=%u devices=%u completed=%u corrupt=%u from_origin=%u "
+           "from_peers=%u origin_bytes=%llu peer_bytes=%llu busy=%u "
+           "failures=%u lookups=%u refused=%u elapsed_s=%.1f\n",
+           s, config.devices, completed, corrupt, fromOrigin, fromPeers,
+           (unsigned long long)originBytes, (unsigned long long)peerBytes,
+           busy, failures, lookups, refused[s], elapsed);
+  }
+  return allComplete ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+// Host benchmark of OTA progress reporting (OTAProgressChannel with
+// StatusModel), used by test/test_ota_progress.py.
+//
+//   c++ -std=c++11 -O2 -pthread -I../lib/OTA/src
+//       -I../lib/StatusReporter/src -o ota_progress_host
+//       ota_progress_host.cpp ../lib/OTA/src/OTAProgress.cpp
+//       ../lib/StatusReporter/src/StatusModel.cpp
+//   ./ota_progress_host [options]
+//
+// Options:
+//   --mode M         off: no progress reporting
+//                    inline: the previous onOtaProgress, on the download
+//                    thread: on every new percent print the progress,
+//                    format the status document into a heap string and
+//                    copy it into the publish queue
+//                    sampled: the download thread only updates the
+//                    progress channel; a reporter thread samples it every
+//                    --interval-us and, when due, updates the status model
+//                    and queues the message
+//   --downloads N    downloads per run (default 20)
+//   --size B         image size (default 1572864, a 1.5 MB app slot)
+//   --interval-us U  sampling interval (default 100)
+//   --step P         percentage step of the sampled reports (default 1)
+//
+// The download thread consumes the image in 4 KB chunks; per chunk it
+// hashes it (FNV-1a, standing in for SHA-256) and copies it into a flash
+// buffer. A sender thread drains the publish queue, like the MQTT sender
+// task. The host finishes a download in a few milliseconds, so the
+// sampling interval is scaled down from the device's second to give a
+// similar number of reports per download.
+//
+// Prints one line:
+//   mode= downloads= bytes_per_sec= reports= last_percent= queued_bytes=
+// reports and queued_bytes are per download.
+//
+// Exit status: 0 done, 1 the last report of a download was not 100% or a
+// sampled run reported more than once per step, 2 usage error.
+
+#include "OTAProgress.h"
+#include "StatusModel.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const size_t CHUNK = 4096;
+
+// The MQTT publish queue: messages are copied in and a sender drains them
+class PublishQueue {
+public:
+  void push(const char *payload, size_t length) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _messages.push_back(std::string(payload, length));
+    _bytes += length;
+    _ready.notify_one();
+  }
+
+  void drain() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stopped || !_messages.empty()) {
+      _ready.wait(lock, [this] { return _stopped || !_messages.empty(); });
+      _messages.clear();
+    }
+  }
+
+  void stop() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopped = true;
+    _ready.notify_one();
+  }
+
+  size_t bytes() const { return _bytes; }
+
+private:
+  std::mutex _mutex;
+  std::condition_variable _ready;
+  std::deque<std::string> _messages;
+  size_t _bytes = 0;
+  bool _stopped = false;
+};
+
+// The status document with the progress, as it went out on every percent
+static size_t formatStatus(char *out, size_t size, int percent) {
+  return snprintf(out, size,
+                  "{\"id\":\"a0b1c2d3e4f5\",\"chip\":\"ESP32-C3\",\"board\":"
+                  "\"esp32-c3-devkitm-1\",\"git_version\":\"3f2c9a1e7b5d4c6f"
+                  "8a0e2b4d6f8a1c3e5b7d9f0a\",\"status\":\"OTA Progress\","
+                  "\"config_version\":\"20251016T093000\",\"boot_to_mqtt_ms\":"
+                  "1874,\"config_source\":\"cache\",\"progress\":%d}",
+                  percent);
+}
+
+static char serialLine[64]; // what Serial.printf formats
+static std::atomic<int> lastPercent(-1);
+static std::atomic<uint32_t> reports(0);
+
+static void report(PublishQueue &queue, StatusModel *model, int percent) {
+  snprintf(serialLine, sizeof(serialLine), "OTA Progress: %d%%\n", percent);
+  if (model) {
+    model->setProgress(percent);
+  }
+  char status[512];
+  size_t length = formatStatus(status, sizeof(status), percent);
+  // as<String>() and the copy into the queue
+  std::string payload(status, length);
+  queue.push(payload.data(), payload.size());
+  lastPercent = percent;
+  reports++;
+}
+
+int main(int argc, char **argv) {
+  std::string mode = "sampled";
+  int downloads = 20;
+  size_t size = 0x180000;
+  uint32_t intervalUs = 100;
+  uint8_t step = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", option.c_str());
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (option == "--mode") {
+      mode = value;
+    } else if (option == "--downloads") {
+      downloads = atoi(value);
+    } else if (option == "--size") {
+      size = strtoul(value, nullptr, 0);
+    } else if (option == "--interval-us") {
+      intervalUs = strtoul(value, nullptr, 0);
+    } else if (option == "--step") {
+      step = atoi(value);
+    } else {
+      fprintf(stderr, "unknown option %s\n", option.c_str());
+      return 2;
+    }
+  }
+  if ((mode != "off" && mode != "inline" && mode != "sampled") ||
+      downloads <= 0 || size < CHUNK) {
+    fprintf(stderr, "usage error\n");
+    return 2;
+  }
+
+  std::vector<uint8_t> image(size);
+  for (size_t i = 0; i < size; i++) {
+    image[i] = (uint8_t)(i * 2654435761u >> 13);
+  }
+  std::vector<uint8_t> flash(size);
+
+  PublishQueue queue;
+  std::thread sender([&] { queue.drain(); });
+  static StatusModel model;
+  OTAProgressChannel channel;
+  channel.setStep(step);
+  std::atomic<bool> downloading(true);
+  std::thread reporter;
+  if (mode == "sampled") {
+    reporter = std::thread([&] {
+      while (downloading) {
+        std::this_thread::sleep_for(std::chrono::microseconds(intervalUs));
+        OTAProgress progress;
+        if (channel.sample(progress)) {
+          report(queue, &model, OTAProgressChannel::percent(progress));
+        }
+      }
+    });
+  }
+
+  bool ok = true;
+  uint32_t hash = 2166136261u;
+  double seconds = 0;
+  for (int d = 0; d < downloads; d++) {
+    int inlinePercent = -1;
+    uint32_t reportsBefore = reports;
+    channel.begin(size, 0);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t received = 0; received < size;) {
+      size_t len = size - received < CHUNK ? size - received : CHUNK;
+      const uint8_t *chunk = image.data() + received;
+      for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ chunk[i]) * 16777619u;
+      }
+      memcpy(flash.data() + received, chunk, len);
+      received += len;
+
+      if (mode == "inline") {
+        int percent = (uint64_t)received * 100 / size;
+        if (percent > inlinePercent) {
+          report(queue, nullptr, percent);
+          inlinePercent = percent;
+        }
+      } else if (mode == "sampled") {
+        channel.update(received);
+      }
+    }
+    seconds += std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+    if (mode == "sampled") {
+      // As OTA::_stopProgress() does before the success callback
+      OTAProgress progress;
+      if (channel.sample(progress)) {
+        report(queue, &model, OTAProgressChannel::percent(progress));
+      }
+      channel.end();
+    }
+    uint32_t made = reports - reportsBefore;
+    if (mode != "off" && lastPercent != 100) {
+      fprintf(stderr, "download %d: last report %d%%\n", d, lastPercent.load());
+      ok = false;
+    }
+    if (mode == "sampled" && made > 100u / step + 1) {
+      fprintf(stderr, "download %d: %u reports\n", d, made);
+      ok = false;
+    }
+  }
+  downloading = false;
+  if (reporter.joinable()) {
+    reporter.join();
+  }
+  queue.stop();
+  sender.join();
+
+  printf("mode=%s downloads=%d bytes_per_sec=%.0f reports=%.1f "
+         "last_percent=%d queued_bytes=%.0f hash=%08x\n",
+         mode.c_str(), downloads, (double)size * downloads / seconds,
+         (double)reports / downloads, lastPercent.load(),
+         (double)queue.bytes() / downloads, hash);
+  return ok ? 0 : 1;
+}
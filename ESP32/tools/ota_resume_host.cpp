@@ -0,0 +1,326 @@
+// Resumable OTA download (OTAResume) against an HTTP server, with the retry
+// loop of OTA::_downloadImage, used by test/test_ota_resume.py.
+//
+//   c++ -std=c++11 -O2 -I../lib/OTA/src -o ota_resume_host
+//       ota_resume_host.cpp ../lib/OTA/src/OTAResume.cpp
+//   ./ota_resume_host --port P --out image.bin [options]
+//
+// Options:
+//   --port P          server at 127.0.0.1:P
+//   --path PATH       (default /firmware.bin)
+//   --out FILE        where the image goes once complete
+//   --attempts N      attempts, as OTA::setRetryPolicy() (default 5)
+//   --no-resume       drop the partial image after every failure, as the
+//                     download did before Range requests
+//   --restore FILE --total T
+//                     start from a checkpoint: FILE holds the bytes already
+//                     in flash of an image of T bytes, as restored by
+//                     OTA::_restoreCheckpoint()
+//
+// Every attempt is one request on a new connection. The body is written
+// into an in-memory partition at the position OTAResume keeps, so a
+// resumed body that does not continue the image shows up as a wrong image
+// rather than a short one. Prints one line:
+//   result= attempts= requests= ranged= restarts= mismatches= bytes=
+//   received= total= error=
+// result is ok, fatal (a 4xx, like OTA_FATAL_HTTP_4XX_ERROR) or failed
+// (out of attempts); bytes counts body bytes read over all attempts.
+//
+// Exit status: 0 image complete, 1 not, 2 usage error.
+
+#include "OTAResume.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+static const int READ_TIMEOUT_MS = 5000;
+static const size_t CHUNK = 4096;
+
+struct Config {
+  uint16_t port = 0;
+  std::string path = "/firmware.bin";
+  const char *out = nullptr;
+  int attempts = 5;
+  bool resume = true;
+  const char *restore = nullptr;
+  size_t total = 0;
+};
+
+struct Counters {
+  int requests = 0;
+  int ranged = 0;
+  int restarts = 0;
+  int mismatches = 0;
+  size_t bytes = 0;
+};
+
+enum AttemptResult { ATTEMPT_OK, ATTEMPT_TRANSIENT, ATTEMPT_FATAL };
+
+static bool sendAll(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Up to len bytes, 0 once the connection is closed or stalls
+static size_t readSome(int fd, uint8_t *buffer, size_t len) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  if (poll(&pfd, 1, READ_TIMEOUT_MS) <= 0) {
+    return 0;
+  }
+  ssize_t n = recv(fd, buffer, len, 0);
+  return n > 0 ? static_cast<size_t>(n) : 0;
+}
+
+// Value of header name in head (ending with the empty line), or "" if
+// missing
+static std::string header(const std::string &head, const char *name) {
+  std::string key = std::string("\r\n") + name + ":";
+  const char *found = strcasestr(head.c_str(), key.c_str());
+  if (!found) {
+    return "";
+  }
+  const char *value = found + key.size();
+  while (*value == ' ') {
+    ++value;
+  }
+  const char *end = strstr(value, "\r\n");
+  return std::string(value, end ? end - value : strlen(value));
+}
+
+// Drops the image, as OTA::_abortImage()
+static void abortImage(OTAResume &resume, std::vector<uint8_t> &flash) {
+  resume.reset();
+  flash.clear();
+}
+
+// One request and its body, as one pass through OTA::_downloadImage
+static AttemptResult attempt(const Config &config, OTAResume &resume,
+                             std::vector<uint8_t> &flash, Counters &counters,
+                             std::string &error) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    error = "socket";
+    return ATTEMPT_TRANSIENT;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(config.port);
+
+  std::string request = "GET " + config.path + " HTTP/1.1\r\nHost: ota\r\n";
+  size_t rangeStart = resume.rangeStart();
+  if (rangeStart > 0) {
+    request += "Range: bytes=" + std::to_string(rangeStart) + "-\r\n";
+    ++counters.ranged;
+  }
+  request += "Connection: close\r\n\r\n";
+  ++counters.requests;
+  if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+              sizeof(addr)) != 0 ||
+      !sendAll(fd, request.data(), request.size())) {
+    close(fd);
+    error = "connect";
+    return ATTEMPT_TRANSIENT;
+  }
+
+  // Response head; whatever follows it is the start of the body
+  std::string head;
+  uint8_t buffer[CHUNK];
+  size_t end;
+  while ((end = head.find("\r\n\r\n")) == std::string::npos) {
+    size_t n = readSome(fd, buffer, sizeof(buffer));
+    if (n == 0) {
+      close(fd);
+      error = "no_response";
+      return ATTEMPT_TRANSIENT;
+    }
+    head.append(reinterpret_cast<char *>(buffer), n);
+  }
+  std::string body = head.substr(end + 4);
+  head.resize(end + 2);
+
+  int status = 0;
+  if (sscanf(head.c_str(), "HTTP/1.%*d %d", &status) != 1) {
+    close(fd);
+    error = "bad_response";
+    return ATTEMPT_TRANSIENT;
+  }
+  if (status != 200 && status != 206) {
+    close(fd);
+    error = "http_" + std::to_string(status);
+    return status >= 400 && status < 500 ? ATTEMPT_FATAL : ATTEMPT_TRANSIENT;
+  }
+  long contentLength = strtol(header(head, "Content-Length").c_str(),
+                              nullptr, 10);
+  if (contentLength <= 0) {
+    close(fd);
+    error = "no_content_length";
+    return ATTEMPT_TRANSIENT;
+  }
+
+  std::string contentRange = header(head, "Content-Range");
+  OTAResumeAction action = resume.accept(
+      status == 206, contentRange.empty() ? nullptr : contentRange.c_str());
+  if (action == OTA_RESUME_MISMATCH) {
+    ++counters.mismatches;
+    abortImage(resume, flash);
+    close(fd);
+    error = "content_range";
+    return ATTEMPT_TRANSIENT;
+  }
+  if (action != OTA_RESUME_CONTINUE) {
+    if (action == OTA_RESUME_RESTART) {
+      ++counters.restarts;
+      abortImage(resume, flash);
+    }
+    resume.begin(contentLength);
+    flash.clear();
+  }
+
+  // The body goes where the image continues
+  size_t pending = body.size();
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(body.data());
+  while (resume.received() < resume.total()) {
+    if (pending == 0) {
+      pending = readSome(fd, buffer, sizeof(buffer));
+      data = buffer;
+      if (pending == 0) {
+        break;
+      }
+    }
+    size_t len = pending;
+    if (len > resume.total() - resume.received()) {
+      len = resume.total() - resume.received();
+    }
+    counters.bytes += len;
+    flash.resize(resume.received());
+    flash.insert(flash.end(), data, data + len);
+    resume.advance(len);
+    data += len;
+    pending -= len;
+  }
+  close(fd);
+  if (!resume.complete()) {
+    error = "incomplete";
+    return ATTEMPT_TRANSIENT;
+  }
+  return ATTEMPT_OK;
+}
+
+static bool parseArgs(int argc, char **argv, Config &config) {
+  for (int i = 1; i < argc; ++i) {
+    const char *name = argv[i];
+    if (strcmp(name, "--no-resume") == 0) {
+      config.resume = false;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      return false;
+    }
+    const char *value = argv[++i];
+    if (strcmp(name, "--port") == 0) {
+      config.port = static_cast<uint16_t>(atoi(value));
+    } else if (strcmp(name, "--path") == 0) {
+      config.path = value;
+    } else if (strcmp(name, "--out") == 0) {
+      config.out = value;
+    } else if (strcmp(name, "--attempts") == 0) {
+      config.attempts = atoi(value);
+    } else if (strcmp(name, "--restore") == 0) {
+      config.restore = value;
+    } else if (strcmp(name, "--total") == 0) {
+      config.total = strtoul(value, nullptr, 10);
+    } else {
+      return false;
+    }
+  }
+  return config.port != 0 && config.attempts > 0 &&
+         (!config.restore || config.total > 0);
+}
+
+int main(int argc, char **argv) {
+  Config config;
+  if (!parseArgs(argc, argv, config)) {
+    fprintf(stderr,
+            "usage: ota_resume_host --port P [--path PATH] [--out FILE] "
+            "[--attempts N] [--no-resume] [--restore FILE --total T]\n");
+    return 2;
+  }
+
+  OTAResume resume;
+  std::vector<uint8_t> flash;
+  if (config.restore) {
+    FILE *file = fopen(config.restore, "rb");
+    if (!file) {
+      perror(config.restore);
+      return 2;
+    }
+    uint8_t buffer[CHUNK];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+      flash.insert(flash.end(), buffer, buffer + n);
+    }
+    fclose(file);
+    if (!resume.restore(flash.size(), config.total)) {
+      flash.clear();
+    }
+  }
+
+  Counters counters;
+  std::string error;
+  const char *result = "failed";
+  int attempts = 0;
+  for (int i = 1; i <= config.attempts; ++i) {
+    attempts = i;
+    AttemptResult outcome = attempt(config, resume, flash, counters, error);
+    if (outcome == ATTEMPT_OK) {
+      result = "ok";
+      error.clear();
+      break;
+    }
+    bool fatal = outcome == ATTEMPT_FATAL;
+    bool keep = config.resume &&
+                OTAResume::keepAfterFailure(fatal, i == config.attempts);
+    if (!keep) {
+      abortImage(resume, flash);
+    }
+    if (fatal) {
+      result = "fatal";
+      break;
+    }
+  }
+
+  bool ok = strcmp(result, "ok") == 0;
+  if (ok && config.out) {
+    FILE *file = fopen(config.out, "wb");
+    if (!file || fwrite(flash.data(), 1, flash.size(), file) != flash.size()) {
+      perror(config.out);
+      ok = false;
+    }
+    if (file) {
+      fclose(file);
+    }
+  }
+  printf("result=%s attempts=%d requests=%d ranged=%d restarts=%d "
+         "mismatches=%d bytes=%zu received=%zu total=%zu error=%s\n",
+         result, attempts, counters.requests, counters.ranged,
+         counters.restarts, counters.mismatches, counters.bytes,
+         resume.received(), resume.total(),
+         error.empty() ? "-" : error.c_str());
+  return ok ? 0 : 1;
+}
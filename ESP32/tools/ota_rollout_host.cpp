@@ -0,0 +1,99 @@
+// Staged rollout planner (OTARollout), used by test/test_ota_rollout.py.
+//
+//   c++ -std=c++11 -O2 -I../lib/OTA/src -o ota_rollout_host
+//       ota_rollout_host.cpp ../lib/OTA/src/OTARollout.cpp
+//   ./ota_rollout_host --salt S [--waves 1,5,25,50,100] < device_ids
+//
+// Reads one device ID (DeviceConfigManager::getDeviceId()) per line and
+// prints, for each, its bucket and the first wave whose percentage takes it
+// in, the same way the devices decide on an OTA command with
+// "rollout": {"percent": P, "salt": S}. Without "salt" in the command the
+// devices use its SHA256, so pass that as --salt.
+//
+//   device=<id> bucket=<0..9999> wave=<percent, or none>
+//
+// Then one line per wave, with the devices the wave reaches in total and
+// the ones it adds:
+//
+//   wave=<percent> threshold=<buckets> devices=<n> new=<n>
+//
+// Exit status: 0 done, 2 usage error.
+
+#include "OTARollout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv) {
+  std::string salt;
+  bool haveSalt = false;
+  std::vector<double> waves = {1, 5, 25, 50, 100};
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", option.c_str());
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (option == "--salt") {
+      salt = value;
+      haveSalt = true;
+    } else if (option == "--waves") {
+      waves.clear();
+      for (const char *p = value; *p;) {
+        char *next;
+        waves.push_back(strtod(p, &next));
+        if (next == p || (*next && *next != ',')) {
+          fprintf(stderr, "bad wave list %s\n", value);
+          return 2;
+        }
+        p = *next ? next + 1 : next;
+      }
+    } else {
+      fprintf(stderr, "unknown option %s\n", option.c_str());
+      return 2;
+    }
+  }
+  if (!haveSalt || waves.empty()) {
+    fprintf(stderr, "usage: ota_rollout_host --salt S [--waves 1,5,...]\n");
+    return 2;
+  }
+  for (size_t i = 0; i < waves.size(); i++) {
+    if (OTARollout::threshold(waves[i]) < 0 ||
+        (i > 0 && waves[i] < waves[i - 1])) {
+      fprintf(stderr, "waves must be rising percentages 0..100\n");
+      return 2;
+    }
+  }
+
+  std::vector<uint32_t> added(waves.size(), 0);
+  char line[128];
+  while (fgets(line, sizeof(line), stdin)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!line[0]) {
+      continue;
+    }
+    uint32_t bucket = OTARollout::bucket(line, salt.c_str());
+    size_t wave = 0;
+    while (wave < waves.size() &&
+           static_cast<int32_t>(bucket) >= OTARollout::threshold(waves[wave])) {
+      wave++;
+    }
+    if (wave < waves.size()) {
+      added[wave]++;
+      printf("device=%s bucket=%u wave=%g\n", line, bucket, waves[wave]);
+    } else {
+      printf("device=%s bucket=%u wave=none\n", line, bucket);
+    }
+  }
+
+  uint32_t total = 0;
+  for (size_t i = 0; i < waves.size(); i++) {
+    total += added[i];
+    printf("wave=%g threshold=%d devices=%u new=%u\n", waves[i],
+           OTARollout::threshold(waves[i]), total, added[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,156 @@
+// Bytes per device-hour of MQTT presence tracking (keepalive pings, the
+// heartbeat of MqttController, birth message and will), used by
+// test/test_presence_cost.py.
+//
+//   c++ -std=c++11 -O2 -I../lib/MqttController/src -o presence_cost_host
+//       presence_cost_host.cpp ../lib/MqttController/src/MqttPresence.cpp
+//   ./presence_cost_host [options]
+//
+// Options:
+//   --keepalive S    MQTT keepalive (default 60)
+//   --heartbeat S    seconds between heartbeats, 0 for none (default 300)
+//   --payload P      compact: the "hb ..." heartbeat (default)
+//                    status: the full status document instead
+//   --topic T        presence topic (default
+//                    iotplatform/esp32/status/presence/ESP32-<12 hex>)
+//
+// One hour of an idle, connected device is stepped through second by
+// second. The client pings when it or the broker has been silent for the
+// keepalive; a QoS 0 heartbeat counts as client activity but gets no
+// answer, so it does not stop the pings the broker's silence causes.
+//
+// Wire bytes add 40 bytes of IPv4 and TCP header to every segment and
+// count the bare ACK of every segment that is not answered: the broker
+// ACKs a PINGREQ with the PINGRESP but a QoS 0 PUBLISH with an empty
+// segment, and the device ACKs the PINGRESP.
+//
+// Prints one line:
+//   pings= heartbeats= heartbeat_payload= mqtt_bytes= wire_bytes=
+//   connect_will_bytes= birth_bytes= offline_after_s=
+// mqtt_bytes and wire_bytes are per hour and both directions; the connect
+// and birth costs are once per connection.
+//
+// Exit status: 0 done, 1 a heartbeat did not survive formatting and
+// parsing, 2 usage error.
+
+#include "MqttPresence.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+static const size_t TCP_IP_HEADER = 40;
+static const size_t PING_PACKET = 2; // PINGREQ and PINGRESP
+
+// As src/main.cpp sends it on connect
+static const char *STATUS_DOCUMENT =
+    "{\"id\":\"a0b1c2d3e4f5\",\"chip\":\"ESP32-C3\",\"board\":"
+    "\"esp32-c3-devkitm-1\",\"git_version\":\"v1.4.2-3-gabcdef0\","
+    "\"status\":\"Online\",\"config_version\":\"20251016-1\","
+    "\"boot_to_mqtt_ms\":2481,\"config_source\":\"cache\"}";
+
+static bool roundTrips() {
+  const MqttHeartbeat cases[] = {
+      {0, 0, 0}, {86400, -61, 182}, {4294967295u, -128, 4294967295u},
+      {59, 127, 1}};
+  for (const MqttHeartbeat &heartbeat : cases) {
+    char text[40];
+    MqttHeartbeat parsed;
+    size_t length = mqttFormatHeartbeat(text, sizeof(text), heartbeat);
+    if (!length || !mqttParseHeartbeat(text, length, parsed) ||
+        parsed.uptimeS != heartbeat.uptimeS || parsed.rssi != heartbeat.rssi ||
+        parsed.freeHeapKb != heartbeat.freeHeapKb) {
+      fprintf(stderr, "heartbeat %s did not round trip\n", text);
+      return false;
+    }
+  }
+  const char *invalid[] = {"hb", "hb 1 2", "hb 1 2 3 4", "hb x 2 3",
+                           "hb 1 -200 3", "online", "hb 1 2 3 "};
+  for (const char *text : invalid) {
+    MqttHeartbeat parsed;
+    if (mqttParseHeartbeat(text, strlen(text), parsed)) {
+      fprintf(stderr, "accepted %s\n", text);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  uint32_t keepalive = 60;
+  uint32_t heartbeatS = 300;
+  std::string payloadName = "compact";
+  std::string topic =
+      "iotplatform/esp32/status/presence/ESP32-a0b1c2d3e4f5";
+
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", option.c_str());
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (option == "--keepalive") {
+      keepalive = strtoul(value, nullptr, 0);
+    } else if (option == "--heartbeat") {
+      heartbeatS = strtoul(value, nullptr, 0);
+    } else if (option == "--payload") {
+      payloadName = value;
+    } else if (option == "--topic") {
+      topic = value;
+    } else {
+      fprintf(stderr, "unknown option %s\n", option.c_str());
+      return 2;
+    }
+  }
+  if (keepalive == 0 ||
+      (payloadName != "compact" && payloadName != "status")) {
+    fprintf(stderr, "usage error\n");
+    return 2;
+  }
+
+  char compact[40];
+  MqttHeartbeat sample = {86400, -61, 182};
+  size_t payloadLength =
+      payloadName == "compact"
+          ? mqttFormatHeartbeat(compact, sizeof(compact), sample)
+          : strlen(STATUS_DOCUMENT);
+  size_t heartbeatPacket =
+      mqttPublishPacketBytes(topic.size(), payloadLength, 0);
+
+  uint32_t pings = 0;
+  uint32_t heartbeats = 0;
+  uint32_t clientIdle = 0;
+  uint32_t serverIdle = 0;
+  for (uint32_t second = 1; second <= 3600; second++) {
+    clientIdle++;
+    serverIdle++;
+    if (heartbeatS && second % heartbeatS == 0) {
+      heartbeats++;
+      clientIdle = 0;
+    }
+    if (clientIdle >= keepalive || serverIdle >= keepalive) {
+      pings++;
+      clientIdle = 0;
+      serverIdle = 0;
+    }
+  }
+
+  size_t mqttBytes = pings * 2 * PING_PACKET + heartbeats * heartbeatPacket;
+  // PINGREQ, PINGRESP (ACKs the request), ACK; PUBLISH, ACK
+  size_t wireBytes = pings * (2 * (PING_PACKET + TCP_IP_HEADER) +
+                              TCP_IP_HEADER) +
+                     heartbeats * (heartbeatPacket + 2 * TCP_IP_HEADER);
+  // Will flag's topic and message fields in CONNECT
+  size_t willBytes = 2 + topic.size() + 2 + strlen(MQTT_PRESENCE_OFFLINE);
+  size_t birthBytes =
+      mqttPublishPacketBytes(topic.size(), strlen(MQTT_PRESENCE_ONLINE), 1);
+
+  printf("pings=%u heartbeats=%u heartbeat_payload=%u mqtt_bytes=%u "
+         "wire_bytes=%u connect_will_bytes=%u birth_bytes=%u "
+         "offline_after_s=%u\n",
+         pings, heartbeats, (unsigned)payloadLength, (unsigned)mqttBytes,
+         (unsigned)wireBytes, (unsigned)willBytes, (unsigned)birthBytes,
+         keepalive * 3 / 2);
+  return roundTrips() ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+// Fleet reconnect simulation for the MQTT reconnect policy
+// (MqttReconnectPolicy), used by test/test_reconnect_backoff.py.
+//
+//   c++ -std=c++11 -O2 -I../lib/MqttController/src -o reconnect_sim_host
+//       reconnect_sim_host.cpp ../lib/MqttController/src/MqttReconnectPolicy.cpp
+//   ./reconnect_sim_host [options]
+//
+// Every device is connected when the broker restarts at t = 0 and is down
+// for --restart seconds. The broker is modelled as a local one: it accepts
+// at most --accept-rate connections per second and refuses the rest, and
+// when more than --overload attempts arrive within one second it falls
+// over, dropping every connection, and restarts again. A refused or failed
+// attempt is a disconnect to the device, which waits for the policy's next
+// delay, exactly as MqttController does.
+//
+// --policy fixed is the old behaviour (a 2000 ms one-shot timer),
+// --policy backoff the MqttReconnectPolicy defaults.
+//
+// With --curve one line per second:
+//   t=<s> attempts= accepted= connected=
+// Then one summary line:
+//   policy= devices= recovered_s= (-1 if not within --duration)
+//   peak_attempts= crashes= attempts= max_delay_ms= violations=
+//
+// Exit status: 0 done, 1 a delay was outside [base, cap], 2 usage error.
+
+#include "MqttReconnectPolicy.h"
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static const uint32_t TICK_MS = 10;
+static const uint32_t FIXED_DELAY_MS = 2000;
+
+struct Device {
+  MqttReconnectPolicy policy;
+  uint32_t nextAttempt; // ms
+  bool connected;
+};
+
+int main(int argc, char **argv) {
+  std::string policyName = "backoff";
+  uint32_t devices = 5000;
+  uint32_t acceptRate = 500;
+  uint32_t overload = 2500;
+  uint32_t restartSeconds = 10;
+  uint32_t duration = 600;
+  unsigned seed = 1;
+  bool curve = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (option == "--curve") {
+      curve = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", option.c_str());
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (option == "--policy") {
+      policyName = value;
+    } else if (option == "--devices") {
+      devices = strtoul(value, nullptr, 0);
+    } else if (option == "--accept-rate") {
+      acceptRate = strtoul(value, nullptr, 0);
+    } else if (option == "--overload") {
+      overload = strtoul(value, nullptr, 0);
+    } else if (option == "--restart") {
+      restartSeconds = strtoul(value, nullptr, 0);
+    } else if (option == "--duration") {
+      duration = strtoul(value, nullptr, 0);
+    } else if (option == "--seed") {
+      seed = strtoul(value, nullptr, 0);
+    } else {
+      fprintf(stderr, "unknown option %s\n", option.c_str());
+      return 2;
+    }
+  }
+  bool fixed = policyName == "fixed";
+  if (!fixed && policyName != "backoff") {
+    fprintf(stderr, "unknown policy %s\n", policyName.c_str());
+    return 2;
+  }
+
+  std::mt19937 rng(seed);
+  std::vector<Device> fleet(devices);
+  uint64_t violations = 0;
+  uint32_t maxDelay = 0;
+  uint64_t totalAttempts = 0;
+
+  // Schedules the next attempt of a device that just lost its connection
+  auto disconnect = [&](Device &device, uint32_t now) {
+    device.connected = false;
+    uint32_t delay = FIXED_DELAY_MS;
+    if (!fixed) {
+      delay = device.policy.nextDelay(now, rng());
+      if (delay < MQTT_RECONNECT_BASE_MS || delay > MQTT_RECONNECT_CAP_MS) {
+        violations++;
+      }
+    }
+    if (delay > maxDelay) {
+      maxDelay = delay;
+    }
+    device.nextAttempt = now + delay;
+  };
+
+  // Connected for a while before the restart, so the first drop starts
+  // every device's backoff from the beginning
+  for (Device &device : fleet) {
+    device.policy.connected(0);
+    disconnect(device, MQTT_RECONNECT_STABLE_MS);
+    device.nextAttempt -= MQTT_RECONNECT_STABLE_MS;
+  }
+
+  uint32_t brokerUpAt = restartSeconds * 1000;
+  uint32_t connected = 0;
+  uint32_t crashes = 1; // the restart at t = 0
+  uint32_t peakAttempts = 0;
+  long recovered = -1;
+  uint32_t secondAttempts = 0;
+  uint32_t secondAccepted = 0;
+  uint32_t acceptedThisSecond = 0;
+
+  for (uint32_t now = 0; now < duration * 1000; now += TICK_MS) {
+    bool brokerUp = now >= brokerUpAt;
+    for (Device &device : fleet) {
+      if (device.connected || device.nextAttempt > now) {
+        continue;
+      }
+      secondAttempts++;
+      totalAttempts++;
+      if (brokerUp && acceptedThisSecond < acceptRate) {
+        acceptedThisSecond++;
+        secondAccepted++;
+        device.connected = true;
+        device.policy.connected(now);
+        connected++;
+      } else {
+        disconnect(device, now);
+      }
+    }
+
+    if (brokerUp && secondAttempts > overload) {
+      // Falls over: every connection drops, the broker restarts
+      crashes++;
+      brokerUpAt = now + restartSeconds * 1000;
+      for (Device &device : fleet) {
+        if (device.connected) {
+          disconnect(device, now);
+        }
+      }
+      connected = 0;
+    }
+    if (recovered < 0 && connected == devices) {
+      recovered = now / 1000;
+    }
+
+    if ((now + TICK_MS) % 1000 == 0) {
+      if (curve) {
+        printf("t=%u attempts=%u accepted=%u connected=%u\n", now / 1000,
+               secondAttempts, secondAccepted, connected);
+      }
+      if (secondAttempts > peakAttempts) {
+        peakAttempts = secondAttempts;
+      }
+      secondAttempts = 0;
+      secondAccepted = 0;
+      acceptedThisSecond = 0;
+    }
+  }
+
+  printf("policy=%s devices=%u recovered_s=%ld peak_attempts=%u crashes=%u "
+         "attempts=%llu max_delay_ms=%u violations=%llu\n",
+         policyName.c_str(), devices, recovered, peakAttempts, crashes,
+         (unsigned long long)totalAttempts, maxDelay,
+         (unsigned long long)violations);
+  return violations == 0 ? 0 : 1;
+}
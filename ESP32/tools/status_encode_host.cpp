@@ -0,0 +1,340 @@
+// Host benchmark of the status messages (StatusModel and StatusEncoder),
+// used by test/test_status_encoding.py.
+//
+//   c++ -std=c++11 -O2 -pthread -I<ArduinoJson>/src
+//       -I../lib/StatusReporter/src -o status_encode_host
+//       status_encode_host.cpp ../lib/StatusReporter/src/StatusEncoder.cpp
+//       ../lib/StatusReporter/src/StatusModel.cpp
+//   ./status_encode_host [--iterations N] [--writes N]
+//
+// Replays the status updates of one connection with an OTA update, as
+// src/main.cpp makes them: the status on connect, the boot timeline, 100
+// progress updates and the success. Each is sent three ways:
+//   string   the previous code: a global JsonDocument updated in place and
+//            serialized into a heap string (as<String>()), the whole
+//            document every time
+//   json     StatusModel updates, taken and encoded by StatusEncoder as
+//            JSON into its buffer
+//   msgpack  the same as MessagePack, the snapshot and then deltas
+// The JSON messages must hold what the previous code sent. The MessagePack
+// messages are decoded and merged into a copy of the status, which must
+// match after every message.
+//
+// One line per encoding:
+//   format= messages= bytes= first_bytes= max_bytes= ns_per_message=
+//   heap_allocations=
+// first_bytes is the connect message, heap_allocations counts the output
+// allocations of one pass.
+//
+// Then three threads write the model as fast as they can (connects, OTA
+// progress and errors, --writes each) while the main thread takes
+// snapshots, and checks that no snapshot mixes two writes:
+//   concurrency writes= snapshots= torn= write_waits= read_retries=
+//
+// Exit status: 0 done, 1 a message did not encode, differs from the
+// previous code or a snapshot was torn, 2 usage error.
+
+#include "StatusEncoder.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char *DEVICE_ID = "a0b1c2d3e4f5";
+static const char *GIT_VERSION = "3f2c9a1e7b5d4c6f8a0e2b4d6f8a1c3e5b7d9f0a";
+
+static const int MESSAGES = 103;
+
+static void bootTimeline(JsonObject status) {
+  JsonObject boot = status["boot"].to<JsonObject>();
+  boot["setup"] = 312;
+  boot["config_ready"] = 341;
+  boot["setup_done"] = 398;
+  boot["wifi"] = 1204;
+  boot["mqtt"] = 1874;
+  boot["reported"] = 1880;
+  boot["config_checked"] = 2210;
+  JsonObject wifi = status["wifi"].to<JsonObject>();
+  wifi["fast"] = true;
+  wifi["connect_ms"] = 892;
+  wifi["channel"] = 6;
+}
+
+// The n-th update as the previous code made it, serialized into payload
+static void previousUpdate(JsonDocument &status, int n, std::string &payload) {
+  if (n == 0) {
+    status.clear();
+    status["id"] = DEVICE_ID;
+    status["chip"] = "ESP32-C3";
+    status["board"] = "esp32-c3-devkitm-1";
+    status["git_version"] = GIT_VERSION;
+    status["status"] = "Online";
+    status["config_version"] = "20251016T093000";
+    status["boot_to_mqtt_ms"] = 1874;
+    status["config_source"] = "cache";
+  } else if (n == 1) {
+    bootTimeline(status.as<JsonObject>());
+  } else if (n <= 101) {
+    status["status"] = "OTA Progress";
+    status["progress"] = n - 1;
+  } else {
+    status["status"] = "OTA Success";
+  }
+  payload.clear();
+  serializeJson(status, payload);
+  if (n == 1) {
+    status.remove("boot");
+    status.remove("wifi");
+  }
+}
+
+#define REPORT_BOOT_TIMELINE STATUS_REPORT(1)
+
+// The n-th update as src/main.cpp makes it now
+static void modelUpdate(StatusModel &model, int n) {
+  if (n == 0) {
+    StatusIdentity identity = {DEVICE_ID, "ESP32-C3", "esp32-c3-devkitm-1",
+                               GIT_VERSION, "20251016T093000", "cache",
+                               1874};
+    model.reset(identity);
+  } else if (n == 1) {
+    model.request(REPORT_BOOT_TIMELINE);
+  } else if (n <= 101) {
+    model.setProgress(n - 1);
+  } else {
+    model.setSuccess();
+  }
+}
+
+struct Result {
+  size_t bytes = 0;
+  size_t firstBytes = 0;
+  size_t maxBytes = 0;
+  size_t allocations = 0;
+  double nsPerMessage = 0;
+};
+
+static void count(Result &result, int n, size_t length) {
+  result.bytes += length;
+  if (n == 0) {
+    result.firstBytes = length;
+  }
+  if (length > result.maxBytes) {
+    result.maxBytes = length;
+  }
+}
+
+// Every key of want must have its value in got
+static bool contains(JsonDocument &want, JsonDocument &got) {
+  for (JsonPairConst pair : want.as<JsonObjectConst>()) {
+    std::string a, b;
+    serializeJson(pair.value(), a);
+    serializeJson(got[pair.key().c_str()], b);
+    if (a != b) {
+      fprintf(stderr, "%s: %s, got %s\n", pair.key().c_str(), a.c_str(),
+              b.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writers keep fields that belong together consistent; a snapshot that
+// breaks this mixes two writes
+static bool consistent(const StatusSnapshot &status) {
+  if (status.present & STATUS_BIT(STATUS_FIELD_ID)) {
+    unsigned long id = strtoul(status.id + 3, nullptr, 10);
+    unsigned long version = strtoul(status.configVersion + 1, nullptr, 10);
+    if (id != status.bootToMqttMs || id != version) {
+      return false;
+    }
+  }
+  if (status.present & STATUS_BIT(STATUS_FIELD_ERROR)) {
+    char text[32];
+    snprintf(text, sizeof(text), "error %ld", (long)status.error);
+    if (strcmp(text, status.errorString) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool concurrency(uint32_t writes) {
+  StatusModel model;
+  std::atomic<int> running(3);
+  std::thread connects([&] {
+    for (uint32_t i = 0; i < writes; i++) {
+      char id[16], version[16];
+      snprintf(id, sizeof(id), "dev%lu", (unsigned long)i);
+      snprintf(version, sizeof(version), "v%lu", (unsigned long)i);
+      StatusIdentity identity = {id, "ESP32-C3", "esp32-c3-devkitm-1",
+                                 GIT_VERSION, version, "cache", i};
+      model.reset(identity);
+    }
+    running--;
+  });
+  std::thread progress([&] {
+    for (uint32_t i = 0; i < writes; i++) {
+      model.setProgress(i % 101);
+    }
+    running--;
+  });
+  std::thread errors([&] {
+    for (uint32_t i = 0; i < writes; i++) {
+      char text[32];
+      snprintf(text, sizeof(text), "error %ld", (long)i);
+      model.setError(i, text);
+    }
+    running--;
+  });
+
+  static StatusSnapshot status;
+  uint32_t snapshots = 0;
+  uint32_t torn = 0;
+  while (running > 0) {
+    model.take(status);
+    snapshots++;
+    if (!consistent(status)) {
+      torn++;
+    }
+  }
+  connects.join();
+  progress.join();
+  errors.join();
+  printf("concurrency writes=%lu snapshots=%lu torn=%lu write_waits=%lu "
+         "read_retries=%lu\n",
+         (unsigned long)writes * 3, (unsigned long)snapshots,
+         (unsigned long)torn, (unsigned long)model.getWriteWaits(),
+         (unsigned long)model.getReadRetries());
+  return torn == 0;
+}
+
+int main(int argc, char **argv) {
+  int iterations = 200;
+  uint32_t writes = 200000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--writes") == 0 && i + 1 < argc) {
+      writes = strtoul(argv[++i], nullptr, 0);
+    } else {
+      fprintf(stderr,
+              "usage: status_encode_host [--iterations N] [--writes N]\n");
+      return 2;
+    }
+  }
+  bool ok = true;
+
+  // Previous code; its messages are what the others must carry
+  std::vector<std::string> expected(MESSAGES);
+  Result previous;
+  JsonDocument document;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    for (int n = 0; n < MESSAGES; n++) {
+      std::string payload;
+      previousUpdate(document, n, payload);
+      if (i == 0) {
+        count(previous, n, payload.size());
+        previous.allocations++;
+        expected[n] = payload;
+      }
+    }
+  }
+  previous.nsPerMessage =
+      std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - start)
+          .count() /
+      (iterations * MESSAGES);
+
+  static StatusModel model;
+  static StatusEncoder encoder;
+  static StatusSnapshot status;
+  Result results[2];
+  const StatusFormat formats[2] = {STATUS_FORMAT_JSON, STATUS_FORMAT_MSGPACK};
+  for (int f = 0; f < 2; f++) {
+    const char *name = StatusEncoder::formatName(formats[f]);
+    encoder.setFormat(formats[f]);
+    JsonDocument merged;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      uint16_t expectedSeq = 0;
+      for (int n = 0; n < MESSAGES; n++) {
+        // As statusTask does it
+        modelUpdate(model, n);
+        uint32_t changed = model.take(status);
+        JsonDocument reports;
+        if (changed & REPORT_BOOT_TIMELINE) {
+          bootTimeline(reports.to<JsonObject>());
+        }
+        bool snapshot;
+        size_t length = encoder.encode(status, changed,
+                                       reports.as<JsonObjectConst>(),
+                                       snapshot);
+        if (i > 0) {
+          continue;
+        }
+        if (!length) {
+          fprintf(stderr, "%s: message %d did not fit\n", name, n);
+          ok = false;
+          continue;
+        }
+        count(results[f], n, length);
+
+        JsonDocument want, got;
+        deserializeJson(want, expected[n]);
+        if (f == 0) {
+          if (deserializeJson(got, (const char *)encoder.data()) ||
+              !contains(want, got) || !contains(got, want)) {
+            fprintf(stderr, "json: message %d differs\n", n);
+            ok = false;
+          }
+          continue;
+        }
+        // Merged as a receiver would: a snapshot replaces the state
+        if (deserializeMsgPack(got, encoder.data(), length)) {
+          fprintf(stderr, "message %d does not decode\n", n);
+          ok = false;
+          continue;
+        }
+        if (snapshot != (n == 0) || got["seq"].as<int>() != expectedSeq++) {
+          fprintf(stderr, "message %d: snapshot %d, seq %d\n", n, snapshot,
+                  got["seq"].as<int>());
+          ok = false;
+        }
+        if (snapshot) {
+          merged.clear();
+        }
+        for (JsonPairConst pair : got.as<JsonObjectConst>()) {
+          merged[pair.key().c_str()] = pair.value();
+        }
+        if (!contains(want, merged)) {
+          fprintf(stderr, "message %d: merged state differs\n", n);
+          ok = false;
+        }
+      }
+    }
+    results[f].nsPerMessage =
+        std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start)
+            .count() /
+        (iterations * MESSAGES);
+  }
+
+  const Result *all[3] = {&previous, &results[0], &results[1]};
+  const char *names[3] = {"string", "json", "msgpack"};
+  for (int i = 0; i < 3; i++) {
+    printf("format=%s messages=%d bytes=%zu first_bytes=%zu max_bytes=%zu "
+           "ns_per_message=%.0f heap_allocations=%zu\n",
+           names[i], MESSAGES, all[i]->bytes, all[i]->firstBytes,
+           all[i]->maxBytes, all[i]->nsPerMessage, all[i]->allocations);
+  }
+  if (!concurrency(writes)) {
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
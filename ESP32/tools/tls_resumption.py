@@ -0,0 +1,388 @@
+#!/usr/bin/env python3
+"""
+TLS session resumption server and protocol benchmark
+
+Runs a local HTTPS stand-in for the config server and firmware CDN (TLS 1.2,
+like the device) that logs whether each handshake was resumed. Pointed at a
+real device, it shows what SecureClient and SecureSessionCache actually do:
+
+    python tls_resumption.py --serve firmware.bin --port 8443
+
+Without --serve it replays a boot against the server with a Python model of
+SecureConnectionManager: a connection each for the config fetch and OTA,
+one TLS context each for the lifetime of the process, one session cache for
+both, the last session offered on every new connection, HTTP keep-alive
+between requests. The baseline models the previous code, a fresh
+WiFiClientSecure per request. Reports full vs resumed handshakes as seen by
+the server and the handshake time of each kind. The model uses Python's ssl
+session reuse; it does not run SecureClient or SecureSessionCache, so it
+checks the connection pattern and measures what resumption saves, not the
+device's resumption detection or cache keying.
+
+Needs the openssl command line tool to create a throwaway certificate, or
+--cert and --key.
+"""
+
+import argparse
+import hashlib
+import http.client
+import json
+import os
+import shutil
+import socket
+import ssl
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+CHUNK_SIZE = 4096
+MAX_RETRIES = 5
+HANDSHAKE_SAMPLES = 30
+
+
+def make_certificate(workdir):
+    """Self-signed certificate for 127.0.0.1, or None without openssl"""
+    openssl = shutil.which("openssl")
+    if not openssl:
+        return None
+    cert = os.path.join(workdir, "cert.pem")
+    key = os.path.join(workdir, "key.pem")
+    subprocess.check_call([
+        openssl, "req", "-x509", "-newkey", "rsa:2048", "-nodes",
+        "-keyout", key, "-out", cert, "-days", "1", "-subj", "/CN=127.0.0.1",
+    ], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+class TlsServer(ThreadingHTTPServer):
+    """Config and firmware endpoints over TLS, counting resumed handshakes"""
+
+    daemon_threads = True
+
+    def __init__(self, cert, key, image, address=("127.0.0.1", 0),
+                 verbose=False):
+        super().__init__(address, TlsHandler)
+        self.context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        self.context.maximum_version = ssl.TLSVersion.TLSv1_2
+        self.context.load_cert_chain(cert, key)
+        self.image = image
+        self.verbose = verbose
+        self.drops = 0
+        self.full = 0
+        self.resumed = 0
+        self.requests = 0
+        self.lock = threading.Lock()
+
+    def get_request(self):
+        sock, address = super().get_request()
+        # Handshake in the handler thread, not in the accept loop
+        return self.context.wrap_socket(
+            sock, server_side=True, do_handshake_on_connect=False), address
+
+    def record_handshake(self, resumed, address):
+        with self.lock:
+            if resumed:
+                self.resumed += 1
+            else:
+                self.full += 1
+        if self.verbose:
+            print(f"{address[0]}:{address[1]} "
+                  f"{'resumed' if resumed else 'full'} handshake")
+
+    def take_drop(self):
+        with self.lock:
+            if self.drops > 0:
+                self.drops -= 1
+                return True
+            return False
+
+    @property
+    def port(self):
+        return self.server_address[1]
+
+
+class TlsHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        pass
+
+    def setup(self):
+        try:
+            self.request.do_handshake()
+        except (ssl.SSLError, OSError):
+            self.close_connection = True
+        else:
+            self.server.record_handshake(self.request.session_reused,
+                                         self.client_address)
+        super().setup()
+
+    def _count(self):
+        with self.server.lock:
+            self.server.requests += 1
+
+    def do_POST(self):
+        self._count()
+        length = int(self.headers.get("Content-Length", "0"))
+        request = json.loads(self.rfile.read(length) or b"{}")
+        body = json.dumps({
+            "device_id": request.get("device_id", ""),
+            "config": {"MQTT_BROKER": "127.0.0.1", "MQTT_PORT": 1883,
+                       "MQTT_USER": "", "MQTT_PASSWORD": "",
+                       "config_version": "1"},
+        }).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        self._count()
+        image = self.server.image
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(image)))
+        self.end_headers()
+        if self.server.take_drop():
+            self.wfile.write(image[:len(image) // 2])
+            self.close_connection = True
+            self.request.shutdown(socket.SHUT_RDWR)
+            return
+        self.wfile.write(image)
+
+
+class SharedClient:
+    """Mirrors one channel of SecureConnectionManager: one context, the
+    session cache of the manager, connection kept open while it goes to the
+    same server"""
+
+    def __init__(self, port, keep_alive=True, resume=True, sessions=None):
+        self.port = port
+        self.keep_alive = keep_alive
+        self.resume = resume
+        # SecureSessionCache, shared by the channels. Python only resumes a
+        # session in the context that made it, so the context goes with it;
+        # mbedtls sessions do not depend on the SSL configuration.
+        self.sessions = sessions if sessions is not None else {}
+        self.context = self.sessions.setdefault("context",
+                                                self._new_context())
+        self.conn = None
+        self.handshake_times = {"full": [], "resumed": []}
+        self.reused = 0
+
+    @staticmethod
+    def _new_context():
+        # rootCA nullptr on the device: no certificate validation
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+        context.check_hostname = False
+        context.verify_mode = ssl.CERT_NONE
+        context.maximum_version = ssl.TLSVersion.TLSv1_2
+        return context
+
+    def _connect(self):
+        if not self.resume:
+            # WiFiClientSecure rebuilds the whole mbedtls state every time
+            self.context = self._new_context()
+        sock = socket.create_connection(("127.0.0.1", self.port), timeout=5)
+        started = time.perf_counter()
+        session = self.sessions.get(self.port) if self.resume else None
+        tls = self.context.wrap_socket(sock, session=session)
+        elapsed = (time.perf_counter() - started) * 1000
+        kind = "resumed" if tls.session_reused else "full"
+        self.handshake_times[kind].append(elapsed)
+        if self.resume:
+            self.sessions[self.port] = tls.session
+        conn = http.client.HTTPConnection("127.0.0.1", self.port, timeout=5)
+        conn.sock = tls
+        return conn
+
+    def acquire(self):
+        if self.conn is not None:
+            self.reused += 1
+            return self.conn
+        self.conn = self._connect()
+        return self.conn
+
+    def release(self, keep_alive):
+        if not (keep_alive and self.keep_alive):
+            self.conn.close()
+            self.conn = None
+
+    def request(self, method, path, body=None):
+        """Returns (status, body) or None if the transfer was cut"""
+        conn = self.acquire()
+        headers = {"Content-Type": "application/json"} if body else {}
+        try:
+            conn.request(method, path, body=body, headers=headers)
+            response = conn.getresponse()
+            length = int(response.getheader("Content-Length", "0"))
+            data = bytearray()
+            while len(data) < length:
+                chunk = response.read(min(CHUNK_SIZE, length - len(data)))
+                if not chunk:
+                    break
+                data += chunk
+        except (http.client.HTTPException, OSError):
+            self.release(False)
+            return None
+        complete = len(data) == length
+        self.release(complete and not response.will_close)
+        return (response.status, bytes(data)) if complete else None
+
+
+def boot_sequence(config, ota, expected_sha256):
+    """Config fetch, then the firmware download with OTA-style retries, each
+    on its own channel"""
+    body = json.dumps({"device_id": "ESP32-TEST", "git_version": "0"})
+    result = config.request("POST", "/api/devices/register", body)
+    if not result or result[0] != 200:
+        return False
+    for _ in range(MAX_RETRIES):
+        result = ota.request("GET", "/firmware.bin")
+        if result and result[0] == 200:
+            return hashlib.sha256(result[1]).hexdigest() == expected_sha256
+    return False
+
+
+def run_boot(cert, key, image, drops, shared):
+    server = TlsServer(cert, key, image)
+    server.drops = drops
+    thread = threading.Thread(target=server.serve_forever, args=(0.05,),
+                              daemon=True)
+    thread.start()
+    try:
+        sessions = {}
+        config, ota = (SharedClient(server.port, keep_alive=shared,
+                                    resume=shared, sessions=sessions)
+                       for _ in range(2))
+        ok = boot_sequence(config, ota, hashlib.sha256(image).hexdigest())
+        for client in (config, ota):
+            if client.conn is not None:
+                client.conn.close()
+    finally:
+        server.shutdown()
+        server.server_close()
+    return ok, server, ota
+
+
+def bench_boot_handshakes(cert, key):
+    """One full handshake per boot: the firmware connection resumes the
+    session of the config fetch, and resumes again after drops"""
+    image = os.urandom(256 * 1024)
+    drops = 2
+    ok, server, client = run_boot(cert, key, image, drops, shared=True)
+    if not ok:
+        print("ERROR: shared client boot failed")
+        return False
+    ok, base_server, _ = run_boot(cert, key, image, drops, shared=False)
+    if not ok:
+        print("ERROR: baseline boot failed")
+        return False
+
+    print(f"Requests:          {server.requests} (config + firmware, "
+          f"{drops} dropped)")
+    print(f"Shared sessions:   {server.full} full, {server.resumed} resumed, "
+          f"{client.reused} kept-alive")
+    print(f"Client per request: {base_server.full} full, "
+          f"{base_server.resumed} resumed")
+    if server.full != 1 or server.resumed != drops + 1 or client.reused != 0:
+        print("ERROR: expected 1 full handshake for the config fetch and a "
+              "resumed one for the firmware connection and per drop")
+        return False
+    if base_server.full != base_server.requests:
+        print("ERROR: baseline should pay a full handshake per request")
+        return False
+    return True
+
+
+def bench_handshake_time(cert, key):
+    """Cold vs resumed handshake time on this host"""
+    server = TlsServer(cert, key, b"")
+    thread = threading.Thread(target=server.serve_forever, args=(0.05,),
+                              daemon=True)
+    thread.start()
+    try:
+        client = SharedClient(server.port, keep_alive=False)
+        for _ in range(HANDSHAKE_SAMPLES):
+            client.acquire()
+            client.release(False)
+        cold = SharedClient(server.port, keep_alive=False, resume=False)
+        for _ in range(HANDSHAKE_SAMPLES):
+            cold.acquire()
+            cold.release(False)
+    finally:
+        server.shutdown()
+        server.server_close()
+
+    full = cold.handshake_times["full"]
+    resumed = client.handshake_times["resumed"]
+    if len(resumed) != HANDSHAKE_SAMPLES - 1:
+        print(f"ERROR: only {len(resumed)} of {HANDSHAKE_SAMPLES - 1} "
+              "handshakes were resumed")
+        return False
+    print(f"Full handshake:    median {statistics.median(full):.2f} ms "
+          f"over {len(full)}")
+    print(f"Resumed handshake: median {statistics.median(resumed):.2f} ms "
+          f"over {len(resumed)}")
+    return True
+
+
+def serve(path, port, cert, key):
+    with open(path, "rb") as f:
+        image = f.read()
+    server = TlsServer(cert, key, image, address=("0.0.0.0", port),
+                       verbose=True)
+    print(f"Serving {path} ({len(image)} bytes) on https://0.0.0.0:{port}, "
+          f"SHA256 {hashlib.sha256(image).hexdigest()}")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        print(f"\n{server.full} full and {server.resumed} resumed handshakes "
+              f"for {server.requests} requests")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--serve", metavar="FIRMWARE",
+                        help="serve a real image")
+    parser.add_argument("--port", type=int, default=8443)
+    parser.add_argument("--cert",
+                        help="PEM certificate (default: self-signed)")
+    parser.add_argument("--key", help="PEM private key for --cert")
+    args = parser.parse_args()
+
+    workdir = tempfile.mkdtemp(prefix="tls_resumption_")
+    try:
+        if args.cert and args.key:
+            cert, key = args.cert, args.key
+        else:
+            generated = make_certificate(workdir)
+            if not generated:
+                print("openssl not found, cannot create a certificate")
+                return False
+            cert, key = generated
+
+        if args.serve:
+            serve(args.serve, args.port, cert, key)
+            return True
+
+        print("TLS Resumption Benchmark")
+        print("=" * 40)
+        results = [
+            bench_boot_handshakes(cert, key),
+            bench_handshake_time(cert, key),
+        ]
+        return all(results)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    if not main():
+        print("\nTLS resumption benchmark FAILED")
+        sys.exit(1)
@@ -0,0 +1,48 @@
+// app/api/devices/[deviceId]/commands/route.ts
+
+import { NextRequest, NextResponse } from 'next/server';
+import pool, { withRetry } from '../../../../../lib/database';
+
+// Latest command replies of a device and the round-trip latency over them
+export async function GET(
+  request: NextRequest,
+  { params }: { params: Promise<{ deviceId: string }> }
+) {
+  try {
+    const { deviceId } = await params;
+
+    if (!deviceId) {
+      return NextResponse.json({ error: 'Device ID is required' }, { status: 400 });
+    }
+
+    const limit = Math.min(Number(new URL(request.url).searchParams.get('limit')) || 50, 500);
+
+    const { replies, latency } = await withRetry(async () => {
+      const repliesResult = await pool.query(
+        `SELECT request_id, topic, result, round_trip_ms, queued_ms, handled_ms, received_at
+         FROM command_replies WHERE device_id = $1
+         ORDER BY received_at DESC LIMIT $2`,
+        [deviceId, limit]
+      );
+      const latencyResult = await pool.query(
+        `SELECT COUNT(round_trip_ms)::int AS count,
+                ROUND(AVG(round_trip_ms))::int AS avg_ms,
+                percentile_cont(0.5) WITHIN GROUP (ORDER BY round_trip_ms) AS p50_ms,
+                percentile_cont(0.95) WITHIN GROUP (ORDER BY round_trip_ms) AS p95_ms,
+                MAX(round_trip_ms) AS max_ms
+         FROM (SELECT round_trip_ms FROM command_replies WHERE device_id = $1
+               ORDER BY received_at DESC LIMIT $2) recent`,
+        [deviceId, limit]
+      );
+      return { replies: repliesResult.rows, latency: latencyResult.rows[0] };
+    }, 3, `Get command replies for device: ${deviceId}`);
+
+    return NextResponse.json({ replies, latency });
+  } catch (error) {
+    console.error('Error fetching command replies:', error);
+    return NextResponse.json(
+      { error: 'Failed to fetch command replies' },
+      { status: 500 }
+    );
+  }
+}
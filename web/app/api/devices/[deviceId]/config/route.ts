@@ -1,5 +1,6 @@
 import { NextRequest, NextResponse } from 'next/server';
 import pool, { withRetry } from '../../../../../lib/database';
+import { configDelta, isConfigPushConfigured, publishConfigPush } from '../../../../../lib/configPush';
 
 export async function GET(
     request: NextRequest,
@@ -85,7 +86,7 @@ export async function PUT(
             );
         }
 
-        await withRetry(async () => {
+        const update = await withRetry(async () => {
             const client = await pool.connect();
             try {
                 // Start transaction
@@ -107,6 +108,15 @@ export async function PUT(
 
                 const gitVersion = deviceResult.rows[0].git_version;
 
+                // Current config, to push only what changed against it
+                const currentResult = await client.query(`
+                    SELECT dc.version, cv.config
+                    FROM device_configs dc
+                    JOIN config_version cv ON dc.device_id = cv.device_id AND dc.version = cv.version
+                    WHERE dc.device_id = $1
+                `, [deviceId]);
+                const previous = currentResult.rows[0];
+
                 // Create new config version
                 await client.query(
                     'INSERT INTO config_version (device_id, version, git_version, config) VALUES ($1, $2, $3, $4)',
@@ -123,6 +133,7 @@ export async function PUT(
                 await client.query('COMMIT');
 
                 console.log(`✅ Successfully updated device config: ${deviceId}, version: ${version}`);
+                return { version, previous };
             } catch (error) {
                 await client.query('ROLLBACK');
                 throw error;
@@ -131,8 +142,29 @@ export async function PUT(
             }
         }, 3, `Update device config: ${deviceId}`);
 
+        // A failed push is not a failed update: the device still gets the
+        // new version at its next config fetch
+        let push: { success: boolean; topic?: string; error?: string } | undefined;
+        if (isConfigPushConfigured) {
+            try {
+                const topic = await publishConfigPush(deviceId, update.previous
+                    ? {
+                        version: update.version,
+                        base: update.previous.version,
+                        config: configDelta(update.previous.config, newConfig),
+                    }
+                    : { version: update.version, config: newConfig });
+                push = { success: true, topic };
+            } catch (e) {
+                push = { success: false, error: e instanceof Error ? e.message : String(e) };
+                console.error(`❌ Config push for ${deviceId} failed:`, e);
+            }
+        }
+
         return NextResponse.json({
             success: true,
+            version: update.version,
+            push,
             message: `Device configuration updated successfully`,
             timestamp: new Date().toISOString()
         });
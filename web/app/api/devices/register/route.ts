@@ -39,11 +39,19 @@ export async function POST(request: NextRequest) {
 
         console.log(`✅ Device registration successful: ${body.device_id}, version: ${response.version}`);
 
+        // Devices booting from a cached config send its version as an ETag;
+        // registration above still runs so last_seen and git_version stay current
+        const etag = `"${response.version}"`;
+        if (request.headers.get('if-none-match') === etag) {
+            console.log(`♻️ Config not modified for ${body.device_id}: ${response.version}`);
+            return new NextResponse(null, { status: 304, headers: { ETag: etag } });
+        }
+
         return NextResponse.json({
             ...response,
             timestamp: new Date().toISOString(),
             endpoint: '/api/devices/register'
-        });
+        }, { headers: { ETag: etag } });
     } catch (error) {
         console.error('❌ Device registration error:', error);
 
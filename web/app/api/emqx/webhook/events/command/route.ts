@@ -0,0 +1,59 @@
+import { NextRequest, NextResponse } from 'next/server';
+import { EmqxMessagePublish, isMessagePublishEvent } from '../../../../../../types/emqx-webhook';
+import { isValidCommandReply } from '../../../../../../types/command-types';
+import pool, { withRetry } from '../../../../../../lib/database';
+
+// Replies to commands that carried a request_id. sent_at is the backend's
+// own clock, echoed by the device, so the round trip needs no lookup.
+async function processCommandReply(event: EmqxMessagePublish) {
+    if (!event.clientid.startsWith('ESP32-')) {
+        console.log(`📝 Ignoring reply from non-IoT client: ${event.clientid}`);
+        return;
+    }
+    const deviceId = event.clientid.replace('ESP32-', '');
+
+    let reply: unknown;
+    try {
+        reply = JSON.parse(event.payload);
+    } catch {
+        console.error('❌ Failed to parse command reply:', event.payload);
+        return;
+    }
+    if (!isValidCommandReply(reply)) {
+        console.warn('⚠️ Command reply has an unexpected format:', reply);
+        return;
+    }
+
+    const roundTripMs = reply.sent_at !== undefined ? Date.now() - reply.sent_at : null;
+    console.log(`✅ Command ${reply.request_id} on ${deviceId}: ${reply.result ?? 'done'}, ` +
+        `round trip ${roundTripMs ?? '?'} ms (queued ${reply.queued_ms} ms, handled ${reply.handled_ms} ms)`);
+
+    try {
+        await withRetry(async () => {
+            await pool.query(
+                `INSERT INTO command_replies
+                   (device_id, request_id, topic, result, round_trip_ms, queued_ms, handled_ms)
+                 VALUES ($1, $2, $3, $4, $5, $6, $7)
+                 ON CONFLICT (device_id, request_id) DO NOTHING`,
+                [deviceId, reply.request_id, reply.topic, reply.result ?? null,
+                    roundTripMs, reply.queued_ms, reply.handled_ms]
+            );
+        }, 3, `Store command reply ${reply.request_id} from ${deviceId}`);
+    } catch (dbError) {
+        console.error('❌ Database error:', dbError);
+    }
+}
+
+export async function POST(request: NextRequest) {
+    const body: unknown = await request.json();
+
+    if (isMessagePublishEvent(body)) {
+        await processCommandReply(body);
+        return NextResponse.json({ success: true, message: 'Command reply received' });
+    } else {
+        return NextResponse.json(
+            { error: 'Event is not a message.publish event or has invalid format' },
+            { status: 400 }
+        );
+    }
+}
@@ -1,7 +1,7 @@
 import { NextRequest, NextResponse } from 'next/server';
 import { EmqxMessagePublish, isMessagePublishEvent } from '../../../../../../types/emqx-webhook';
 import { OTAPayloadBase, isValidOTAPayload, isValidOTAPayloadBase } from '../../../../../../types/ota-types';
-import { pusherService } from '../../../../../services/pusherService';
+import { dispatchOtaStatus } from '../../../../../../lib/otaStatus';
 
 
 
@@ -27,30 +27,7 @@ async function processOtaUpdate(event: EmqxMessagePublish) {
             // 例如：更新数据库中的OTA进度、通过Pusher将进度推送到前端等
             // await updateOtaProgressInDB(payloadObject.id, payloadObject.progress);
             // await pusherService.triggerOtaProgressUpdate(payloadObject);
-            const deviceId = payloadObject.id;
-            const otaStatus = payloadObject.status;
-            const progress = payloadObject.progress.toString();
-            try {
-
-                switch (otaStatus) {
-                    case "OTA Progress":
-                        console.log(`✅: ${payloadObject.progress}%`);
-                        await pusherService.triggerDeviceOTAProgressUpdate(deviceId, progress);
-                        break;
-                    case "OTA Success":
-                        console.log(`✅: ${payloadObject.progress}%`);
-                        await pusherService.triggerDeviceOTASuccess(deviceId);
-                        break;
-                    default:
-                        console.log(`✅: ${payloadObject.progress}%`);
-                        await pusherService.triggerDeviceOTAError(deviceId);
-                }
-
-
-            } catch (dbError) {
-                console.error('❌ Database or Pusher error:', dbError);
-                // Continue processing even if database/Pusher fails
-            }
+            await dispatchOtaStatus(payloadObject);
 
         } else {
             // 如果解析出的JSON对象结构不符合预期
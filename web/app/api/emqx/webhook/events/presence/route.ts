@@ -0,0 +1,51 @@
+import { NextRequest, NextResponse } from 'next/server';
+import { EmqxMessagePublish, isMessagePublishEvent } from '../../../../../../types/emqx-webhook';
+import { parsePresencePayload } from '../../../../../../types/presence-types';
+import { databaseService } from '../../../../../services/databaseService';
+import { pusherService } from '../../../../../services/pusherService';
+
+// Presence pushed by the broker: the device's birth message, its Last Will
+// (published by EMQX under the device's client ID) and heartbeats. Only
+// changes of state go to Pusher; a heartbeat just moves last_seen.
+async function processPresence(event: EmqxMessagePublish) {
+    if (!event.clientid.startsWith('ESP32-')) {
+        console.log(`📝 Ignoring presence from non-IoT client: ${event.clientid}`);
+        return;
+    }
+    const deviceId = event.clientid.replace('ESP32-', '');
+
+    const presence = parsePresencePayload(event.payload);
+    if (!presence) {
+        console.warn('⚠️ Presence message has an unexpected format:', event.payload);
+        return;
+    }
+
+    try {
+        await databaseService.updateDeviceStatus({
+            device_id: deviceId,
+            status: presence.state,
+            last_seen: new Date(),
+        });
+        if ('heartbeat' in presence) {
+            return;
+        }
+        console.log(`📱 Device ${deviceId} is ${presence.state}`);
+        await pusherService.triggerDeviceStatusUpdate(deviceId, presence.state);
+    } catch (dbError) {
+        console.error('❌ Database or Pusher error:', dbError);
+    }
+}
+
+export async function POST(request: NextRequest) {
+    const body: unknown = await request.json();
+
+    if (isMessagePublishEvent(body)) {
+        await processPresence(body);
+        return NextResponse.json({ success: true, message: 'Presence received' });
+    } else {
+        return NextResponse.json(
+            { error: 'Event is not a message.publish event or has invalid format' },
+            { status: 400 }
+        );
+    }
+}
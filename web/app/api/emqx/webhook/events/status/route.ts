@@ -0,0 +1,61 @@
+import { NextRequest, NextResponse } from 'next/server';
+import { decode } from '@msgpack/msgpack';
+import { EmqxMessagePublish, isMessagePublishEvent } from '../../../../../../types/emqx-webhook';
+import { isValidOTAPayloadBase } from '../../../../../../types/ota-types';
+import { dispatchOtaStatus } from '../../../../../../lib/otaStatus';
+
+// MessagePack status messages (device config STATUS_FORMAT "msgpack") on
+// <MQTT_TOPIC_STATUS>/msgpack/<device id>. The EMQX rule base64-encodes the
+// binary payload. After each connect the device sends the whole document
+// (seq 0), then only the keys that changed plus "status" and "seq", so the
+// device ID comes from the client ID and a progress the delta left out is
+// the previous one.
+async function processStatus(event: EmqxMessagePublish) {
+    if (!event.clientid.startsWith('ESP32-')) {
+        console.log(`📝 Ignoring status from non-IoT client: ${event.clientid}`);
+        return;
+    }
+    const deviceId = event.clientid.replace('ESP32-', '');
+
+    let message: unknown;
+    try {
+        message = decode(Buffer.from(event.payload, 'base64'));
+    } catch (e) {
+        console.error('❌ Failed to decode MessagePack status:', event.payload);
+        return;
+    }
+    if (!message || typeof message !== 'object') {
+        console.warn('⚠️ Status message has an unexpected format:', message);
+        return;
+    }
+    const status = { id: deviceId, ...(message as Record<string, unknown>) };
+
+    if (typeof status.status !== 'string' || !status.status.startsWith('OTA')) {
+        return;
+    }
+    if (status.progress === undefined) {
+        if (status.status === 'OTA Progress') {
+            return; // nothing new since the previous progress
+        }
+        status.progress = 100;
+    }
+    if (isValidOTAPayloadBase(status)) {
+        await dispatchOtaStatus(status);
+    } else {
+        console.warn('⚠️ Status message has an unexpected format:', status);
+    }
+}
+
+export async function POST(request: NextRequest) {
+    const body: unknown = await request.json();
+
+    if (isMessagePublishEvent(body)) {
+        await processStatus(body);
+        return NextResponse.json({ success: true, message: 'Status received' });
+    } else {
+        return NextResponse.json(
+            { error: 'Event is not a message.publish event or has invalid format' },
+            { status: 400 }
+        );
+    }
+}
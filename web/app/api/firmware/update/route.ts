@@ -1,13 +1,15 @@
 import { NextRequest, NextResponse } from 'next/server';
+import { createHmac, randomUUID } from 'crypto';
 import { S3Client } from "@aws-sdk/client-s3";
 import { getSignedUrl } from "@aws-sdk/s3-request-presigner";
 import { GetObjectCommand } from "@aws-sdk/client-s3";
-import { FirmwareUpdateRequest, FirmwareApiResponse } from '../../../../types/firmware';
+import { FirmwareUpdateRequest, FirmwareClearRequest, FirmwareApiResponse } from '../../../../types/firmware';
 
 // --- 配置检查 ---
 const {
     OSS_ACCESS_KEY_ID, OSS_SECRET_ACCESS_KEY, OSS_BUCKET_NAME, OSS_ENDPOINT_URL,
-    EMQX_API_KEY, EMQX_SECRET_KEY, EMQX_ENDPOINT_URL, EMQX_OTA_TOPIC
+    EMQX_API_KEY, EMQX_SECRET_KEY, EMQX_ENDPOINT_URL, EMQX_OTA_TOPIC,
+    OTA_PEER_SECRET
 } = process.env;
 
 const isS3Configured = OSS_ACCESS_KEY_ID && OSS_SECRET_ACCESS_KEY && OSS_BUCKET_NAME && OSS_ENDPOINT_URL;
@@ -23,6 +25,47 @@ const s3Client = isS3Configured ? new S3Client({
     },
 }) : null;
 
+// 命令保留在主题上，之后上线的设备也会收到，固件链接用预签名允许的最长期限7天。
+// 保留消息的过期时间比链接早1小时：链接失效前代理删除保留的命令（以及持久会话中还没投递的副本），
+// 设备不会拿着过期链接收到403、每次重连都上报OTA错误；之后要继续发布需重新调用
+const FIRMWARE_URL_TTL_S = 7 * 24 * 3600;
+const COMMAND_EXPIRY_S = FIRMWARE_URL_TTL_S - 3600;
+
+// 发布到板型的OTA主题；payload 为空字符串时清除主题上保留的命令
+async function publishOtaCommand(board: string, payload: string, expirySeconds?: number): Promise<string> {
+    const topic = `${EMQX_OTA_TOPIC}/${board}`;
+    const credentials = Buffer.from(`${EMQX_API_KEY}:${EMQX_SECRET_KEY}`).toString('base64');
+    const emqxResponse = await fetch(`${EMQX_ENDPOINT_URL}/api/v5/publish`, {
+        method: 'POST',
+        headers: {
+            'Authorization': `Basic ${credentials}`,
+            'Content-Type': 'application/json',
+        },
+        body: JSON.stringify({
+            topic: topic,
+            payload: payload,
+            qos: 1, // Quality of Service: at least once
+            // 每条命令都以保留消息发布，替换主题上的上一条：扩大发布范围只需再发布一次，
+            // 之后上线的设备收到的总是最新的命令，不会拿到过期的旧版本
+            retain: true,
+            ...(expirySeconds !== undefined && { properties: { message_expiry_interval: expirySeconds } }),
+        }),
+    });
+    if (!emqxResponse.ok) {
+        const errorBody = await emqxResponse.text();
+        throw new Error(`EMQX API Error (${emqxResponse.status}): ${errorBody}`);
+    }
+    return topic;
+}
+
+// 局域网分发的令牌：设备只把固件提供给出示同一令牌的设备（固件中含有WiFi和MQTT凭据）。
+// 由密钥、固件SHA256和板型计算，同一版本各阶段的命令令牌相同，已升级的设备可以继续提供固件；
+// 未设置 OTA_PEER_SECRET 时命令不带令牌，设备只从 firmwareUrl 下载
+function peerToken(sha256: string, board: string): string | undefined {
+    if (!OTA_PEER_SECRET) return undefined;
+    return createHmac('sha256', OTA_PEER_SECRET).update(`${board}:${sha256}`).digest('base64url').slice(0, 32);
+}
+
 // --- 主处理函数 ---
 export async function POST(request: NextRequest) {
     if (!isS3Configured || !isEmqxConfigured) {
@@ -31,11 +74,15 @@ export async function POST(request: NextRequest) {
 
     try {
         const body: FirmwareUpdateRequest = await request.json();
-        const { commitSha, boards } = body;
+        const { commitSha, boards, rollout } = body;
 
         if (!commitSha || !boards || boards.length === 0) {
             return NextResponse.json({ error: "commitSha and at least one board are required." }, { status: 400 });
         }
+        if (rollout && (typeof rollout.percent !== 'number' || !(rollout.percent >= 0 && rollout.percent <= 100) ||
+            (rollout.salt !== undefined && typeof rollout.salt !== 'string'))) {
+            return NextResponse.json({ error: "rollout.percent must be a number from 0 to 100." }, { status: 400 });
+        }
 
         // 1. 从 /api/firmware 获取固件信息，以找到 Key 和 SHA256
         // 注意：这里我们直接调用内部逻辑，而不是通过HTTP fetch，效率更高。
@@ -65,42 +112,28 @@ export async function POST(request: NextRequest) {
                     Bucket: OSS_BUCKET_NAME,
                     Key: firmwareInfo.key,
                 });
-                const firmwareUrl = await getSignedUrl(s3Client!, command, { expiresIn: 3600 }); // URL 1小时有效
+                const firmwareUrl = await getSignedUrl(s3Client!, command, { expiresIn: FIRMWARE_URL_TTL_S });
 
                 // 4. 构建EMQX Payload
+                // 设备把 request_id 和 sent_at 带回到 `${EMQX_OTA_TOPIC}/reply`，用于计算往返延迟
+                const requestId = randomUUID();
+                const token = peerToken(firmwareInfo.firmwareSha256, board);
                 const payload = {
+                    request_id: requestId,
+                    sent_at: Date.now(),
                     OTA: {
                         firmwareUrl: firmwareUrl,
                         SHA256: firmwareInfo.firmwareSha256,
+                        ...(rollout && { rollout }),
+                        ...(token && { peerToken: token }),
                     },
                 };
 
-                // 5. 构建EMQX请求
-                const topic = `${EMQX_OTA_TOPIC}/${board}`;
-                const emqxApiUrl = `${EMQX_ENDPOINT_URL}/api/v5/publish`;
-                const credentials = Buffer.from(`${EMQX_API_KEY}:${EMQX_SECRET_KEY}`).toString('base64');
-
-                // 6. 发送指令到EMQX
-                const emqxResponse = await fetch(emqxApiUrl, {
-                    method: 'POST',
-                    headers: {
-                        'Authorization': `Basic ${credentials}`,
-                        'Content-Type': 'application/json',
-                    },
-                    body: JSON.stringify({
-                        topic: topic,
-                        payload: JSON.stringify(payload),
-                        qos: 1, // Quality of Service: at least once
-                        retain: false,
-                    }),
-                });
-
-                if (!emqxResponse.ok) {
-                    const errorBody = await emqxResponse.text();
-                    throw new Error(`EMQX API Error (${emqxResponse.status}): ${errorBody}`);
-                }
+                // 5. 发送指令到EMQX，在链接失效前过期
+                const topic = await publishOtaCommand(board, JSON.stringify(payload), COMMAND_EXPIRY_S);
+                const expiresAt = new Date(Date.now() + COMMAND_EXPIRY_S * 1000).toISOString();
 
-                results.push({ board, success: true, topic });
+                results.push({ board, success: true, topic, requestId, expiresAt });
 
             } catch (e: any) {
                 results.push({ board, success: false, error: e.message });
@@ -114,4 +147,37 @@ export async function POST(request: NextRequest) {
         const errorMessage = error instanceof Error ? error.message : "An unknown server error occurred";
         return NextResponse.json({ error: "Failed to process OTA update request.", details: errorMessage }, { status: 500 });
     }
-}
\ No newline at end of file
+}
+// 发布结束后清除板型主题上保留的OTA命令：发布一条空的保留消息，之后上线的设备不再收到它。
+// 设备忽略空消息，已经收到命令的设备不受影响
+export async function DELETE(request: NextRequest) {
+    if (!isEmqxConfigured) {
+        return NextResponse.json({ error: "Server is not fully configured for OTA updates. (Missing EMQX settings)" }, { status: 503 });
+    }
+
+    try {
+        const body: FirmwareClearRequest = await request.json();
+        const { boards } = body;
+
+        if (!boards || boards.length === 0) {
+            return NextResponse.json({ error: "At least one board is required." }, { status: 400 });
+        }
+
+        const results = [];
+        for (const board of boards) {
+            try {
+                const topic = await publishOtaCommand(board, "");
+                results.push({ board, success: true, topic });
+            } catch (e: any) {
+                results.push({ board, success: false, error: e.message });
+            }
+        }
+
+        return NextResponse.json({ message: "Retained OTA commands cleared.", results });
+
+    } catch (error) {
+        console.error("❌ Error clearing retained OTA commands:", error);
+        const errorMessage = error instanceof Error ? error.message : "An unknown server error occurred";
+        return NextResponse.json({ error: "Failed to clear retained OTA commands.", details: errorMessage }, { status: 500 });
+    }
+}
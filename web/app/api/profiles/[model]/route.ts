@@ -1,5 +1,7 @@
 import { NextRequest, NextResponse } from 'next/server';
 import pool, { withRetry } from '../../../../lib/database';
+import { DeviceService } from '../../../../lib/deviceService';
+import { configDelta, isConfigPushConfigured, publishConfigPushes } from '../../../../lib/configPush';
 
 export async function PUT(
     request: NextRequest,
@@ -28,9 +30,20 @@ export async function PUT(
             );
         }
 
-        const profile = await withRetry(async () => {
+        // A changed profile config also changes the current config of every
+        // device of that model: keys a device set to its own value stay,
+        // the ones it took from the profile follow it. With live config
+        // push each changed device is told the keys that changed for it.
+        const pushVersion = DeviceService.generateVersion();
+        const { profile, updated } = await withRetry(async () => {
             const client = await pool.connect();
             try {
+                await client.query('BEGIN');
+
+                const previous = await client.query(
+                    'SELECT default_config FROM device_profiles WHERE model = $1',
+                    [model]
+                );
                 const result = await client.query(
                     'UPDATE device_profiles SET model = $1, default_config = $2 WHERE model = $3 RETURNING *',
                     [newModel, default_config, model]
@@ -40,17 +53,91 @@ export async function PUT(
                     throw new Error('Profile not found');
                 }
 
-                return result.rows[0];
+                const changed = Object.keys(
+                    configDelta(previous.rows[0].default_config, result.rows[0].default_config)
+                ).length > 0;
+                let updated: { device_id: string; base: string; previous: Record<string, unknown>; config: Record<string, unknown> }[] = [];
+                if (changed && newModel !== 'default') {
+                    // A key is the device's own when the device has a value
+                    // the old profile ($3) does not; everything else is
+                    // taken from the new profile ($2), so keys dropped from
+                    // the profile go too
+                    const rewrite = await client.query(`
+                        WITH current AS (
+                            SELECT d.device_id, d.git_version, dc.version, cv.config, (
+                                SELECT COALESCE(jsonb_object_agg(m.key, m.value), '{}'::jsonb) FROM (
+                                    SELECT c.key, c.value FROM jsonb_each(cv.config) c
+                                    WHERE NOT ($3::jsonb ? c.key) OR $3::jsonb -> c.key <> c.value
+                                    UNION ALL
+                                    SELECT n.key, n.value FROM jsonb_each($2::jsonb) n
+                                    WHERE NOT (cv.config ? n.key) OR cv.config -> n.key = $3::jsonb -> n.key
+                                ) m
+                            ) AS merged
+                            FROM devices d
+                            JOIN device_configs dc ON dc.device_id = d.device_id
+                            JOIN config_version cv ON cv.device_id = dc.device_id AND cv.version = dc.version
+                            WHERE d.chip = $4
+                        ), inserted AS (
+                            INSERT INTO config_version (device_id, version, git_version, config)
+                            SELECT device_id, $1, git_version, merged FROM current
+                            WHERE merged <> config
+                            ON CONFLICT (device_id, version) DO NOTHING
+                            RETURNING device_id
+                        ), moved AS (
+                            UPDATE device_configs dc SET version = $1, updated_at = NOW()
+                            FROM inserted i
+                            WHERE dc.device_id = i.device_id
+                            RETURNING dc.device_id
+                        )
+                        SELECT c.device_id, c.version AS base, c.config AS previous, c.merged AS config
+                        FROM current c JOIN moved m ON m.device_id = c.device_id
+                    `, [
+                        pushVersion,
+                        JSON.stringify(result.rows[0].default_config),
+                        JSON.stringify(previous.rows[0].default_config),
+                        newModel,
+                    ]);
+                    updated = rewrite.rows;
+                }
+
+                await client.query('COMMIT');
+                return { profile: result.rows[0], updated };
+            } catch (error) {
+                await client.query('ROLLBACK');
+                throw error;
             } finally {
                 client.release();
             }
         }, 3, `Update profile: ${model}`);
 
-        console.log(`✅ Successfully updated profile: ${model} -> ${newModel}`);
+        // Deltas against each device's version: a device at another one
+        // fetches its whole config instead
+        let push: { success: boolean; devices?: number; failed?: number; version?: string; error?: string } | undefined;
+        if (updated.length > 0 && isConfigPushConfigured) {
+            try {
+                const failed = await publishConfigPushes(updated.map((row) => ({
+                    deviceId: row.device_id,
+                    message: {
+                        version: pushVersion,
+                        base: row.base,
+                        config: configDelta(row.previous, row.config),
+                    },
+                })));
+                push = { success: failed === 0, devices: updated.length, failed, version: pushVersion };
+            } catch (e) {
+                // Devices still get the new version at their next config fetch
+                push = { success: false, error: e instanceof Error ? e.message : String(e) };
+                console.error(`❌ Config push for profile ${newModel} failed:`, e);
+            }
+        }
+
+        console.log(`✅ Successfully updated profile: ${model} -> ${newModel}, ${updated.length} device configs changed`);
 
         return NextResponse.json({
             success: true,
             profile: profile,
+            devices_updated: updated.length,
+            push,
             message: `Profile updated successfully`,
             timestamp: new Date().toISOString()
         });
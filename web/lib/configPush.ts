@@ -0,0 +1,110 @@
+// Live config push over MQTT, published through the EMQX REST API.
+// Each device subscribes to `${EMQX_CONFIG_TOPIC}/<device_id>` only. A
+// device change is published there, and a profile change is published in
+// bulk to every affected device's topic, since each device merges the
+// profile with its own keys (see PUT /api/profiles/[model]). Pushes are
+// retained, so a device that connects later still gets the latest one, and
+// the device ignores anything not newer than the version it already has.
+const {
+    EMQX_API_KEY, EMQX_SECRET_KEY, EMQX_ENDPOINT_URL, EMQX_CONFIG_TOPIC
+} = process.env;
+
+export const isConfigPushConfigured = Boolean(
+    EMQX_API_KEY && EMQX_SECRET_KEY && EMQX_ENDPOINT_URL && EMQX_CONFIG_TOPIC
+);
+
+// Messages per EMQX bulk publish request
+const BULK_PUBLISH_SIZE = 100;
+
+export interface ConfigPushMessage {
+    version: string;
+    // Version the delta was made against; devices at another version
+    // fetch the whole config over HTTP instead
+    base?: string;
+    // Changed keys only; null removes a key
+    config: Record<string, unknown>;
+}
+
+// Keys whose value differs between the two configs, removed keys as null
+export function configDelta(
+    oldConfig: Record<string, unknown>,
+    newConfig: Record<string, unknown>
+): Record<string, unknown> {
+    const delta: Record<string, unknown> = {};
+    for (const [key, value] of Object.entries(newConfig)) {
+        if (JSON.stringify(oldConfig[key]) !== JSON.stringify(value)) {
+            delta[key] = value;
+        }
+    }
+    for (const key of Object.keys(oldConfig)) {
+        if (!(key in newConfig)) {
+            delta[key] = null;
+        }
+    }
+    return delta;
+}
+
+// target is a chip model or a device id
+export async function publishConfigPush(target: string, message: ConfigPushMessage): Promise<string> {
+    if (!isConfigPushConfigured) {
+        throw new Error('Config push is not configured (missing EMQX settings)');
+    }
+
+    const topic = `${EMQX_CONFIG_TOPIC}/${target}`;
+    const credentials = Buffer.from(`${EMQX_API_KEY}:${EMQX_SECRET_KEY}`).toString('base64');
+    const response = await fetch(`${EMQX_ENDPOINT_URL}/api/v5/publish`, {
+        method: 'POST',
+        headers: {
+            'Authorization': `Basic ${credentials}`,
+            'Content-Type': 'application/json',
+        },
+        body: JSON.stringify({
+            topic,
+            payload: JSON.stringify(message),
+            qos: 1,
+            retain: true,
+        }),
+    });
+
+    if (!response.ok) {
+        const errorBody = await response.text();
+        throw new Error(`EMQX API Error (${response.status}): ${errorBody}`);
+    }
+    console.log(`📡 Config ${message.version} pushed to ${topic}`);
+    return topic;
+}
+
+// Per device topics, published in bulk; returns the number of failures
+export async function publishConfigPushes(
+    pushes: { deviceId: string; message: ConfigPushMessage }[]
+): Promise<number> {
+    if (!isConfigPushConfigured) {
+        throw new Error('Config push is not configured (missing EMQX settings)');
+    }
+
+    const credentials = Buffer.from(`${EMQX_API_KEY}:${EMQX_SECRET_KEY}`).toString('base64');
+    let failed = 0;
+    for (let start = 0; start < pushes.length; start += BULK_PUBLISH_SIZE) {
+        const batch = pushes.slice(start, start + BULK_PUBLISH_SIZE);
+        const response = await fetch(`${EMQX_ENDPOINT_URL}/api/v5/publish/bulk`, {
+            method: 'POST',
+            headers: {
+                'Authorization': `Basic ${credentials}`,
+                'Content-Type': 'application/json',
+            },
+            body: JSON.stringify(batch.map(({ deviceId, message }) => ({
+                topic: `${EMQX_CONFIG_TOPIC}/${deviceId}`,
+                payload: JSON.stringify(message),
+                qos: 1,
+                retain: true,
+            }))),
+        });
+        if (!response.ok) {
+            console.error(`❌ EMQX bulk publish failed (${response.status}): ${await response.text()}`);
+            failed += batch.length;
+        }
+    }
+    console.log(`📡 Config pushed to ${pushes.length - failed} of ${pushes.length} devices`);
+    return failed;
+}
+
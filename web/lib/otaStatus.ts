@@ -0,0 +1,27 @@
+import { OTAPayloadBase } from '../types/ota-types';
+import { pusherService } from '../app/services/pusherService';
+
+// Pushes an OTA status message to the frontend. Shared by the JSON status
+// topic and the MessagePack one, which carry the same fields.
+export async function dispatchOtaStatus(payload: OTAPayloadBase) {
+    const deviceId = payload.id;
+    const progress = payload.progress.toString();
+    try {
+        switch (payload.status) {
+            case "OTA Progress":
+                console.log(`✅: ${payload.progress}%`);
+                await pusherService.triggerDeviceOTAProgressUpdate(deviceId, progress);
+                break;
+            case "OTA Success":
+                console.log(`✅: ${payload.progress}%`);
+                await pusherService.triggerDeviceOTASuccess(deviceId);
+                break;
+            default:
+                console.log(`✅: ${payload.progress}%`);
+                await pusherService.triggerDeviceOTAError(deviceId);
+        }
+    } catch (dbError) {
+        console.error('❌ Database or Pusher error:', dbError);
+        // Continue processing even if database/Pusher fails
+    }
+}
@@ -0,0 +1,30 @@
+// 设备对带 request_id 的命令的回复，发布在 `<EMQX_OTA_TOPIC>/reply`
+export interface CommandReplyPayload {
+    request_id: string;
+    // 后端发送命令时的时间戳（毫秒），设备原样带回
+    sent_at?: number;
+    // 设备收到命令的主题
+    topic: string;
+    // 设备上：收到到开始处理、处理耗时
+    queued_ms: number;
+    handled_ms: number;
+    // 处理结果："accepted" / "rejected" / "busy" / "installed" / "skipped"（不在本阶段发布范围内）/ "replaced"（当前固件替换掉的版本）/ "rolled_back"（该固件验证失败已回滚）
+    result?: string;
+}
+
+/**
+ * 类型守卫函数，检查一个未知对象是否是合法的命令回复。
+ * @param obj - 待检查的任意对象。
+ * @returns 如果对象是CommandReplyPayload类型，则返回true，否则返回false。
+ */
+export function isValidCommandReply(obj: any): obj is CommandReplyPayload {
+    if (!obj || typeof obj !== 'object') {
+        return false;
+    }
+    return typeof obj.request_id === 'string' &&
+        typeof obj.topic === 'string' &&
+        typeof obj.queued_ms === 'number' &&
+        typeof obj.handled_ms === 'number' &&
+        (obj.sent_at === undefined || typeof obj.sent_at === 'number') &&
+        (obj.result === undefined || typeof obj.result === 'string');
+}
@@ -17,18 +17,36 @@ export type FirmwareApiResponse = Record<string, {
     firmwareInfo: FirmwareInfo[];
 }>;
 
+// 分阶段发布：只有按设备ID和 salt 计算的桶号落在 percent 以内的设备升级
+export interface FirmwareRollout {
+    // 0~100，精度0.01%
+    percent: number;
+    // 不填时设备使用固件的 SHA256，同一版本的各阶段桶号不变
+    salt?: string;
+}
+
 export interface FirmwareUpdateRequest {
     commitSha: string;
     boards: string[];
+    rollout?: FirmwareRollout;
 }
 
 export interface FirmwareUpdateResult {
     board: string;
     success: boolean;
     topic?: string;
+    // 设备回复中带回的命令ID
+    requestId?: string;
+    // 保留的命令被代理删除的时间（ISO 8601），在固件链接失效之前
+    expiresAt?: string;
     error?: string;
 }
 
+// DELETE /api/firmware/update：清除这些板型主题上保留的OTA命令
+export interface FirmwareClearRequest {
+    boards: string[];
+}
+
 export interface FirmwareUpdateResponse {
     message: string;
     results: FirmwareUpdateResult[];
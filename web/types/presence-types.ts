@@ -0,0 +1,37 @@
+// 设备在 `<MQTT_TOPIC_STATUS>/presence/<clientid>` 上发布的在线状态：
+// "online"（出生消息，保留）、"offline"（遗嘱消息，由代理发布，保留）、
+// "hb <uptime_s> <rssi> <heap_kb>"（心跳，不保留）
+export type PresenceState = 'online' | 'offline';
+
+export interface PresenceHeartbeat {
+    uptime_s: number;
+    rssi: number;
+    free_heap_kb: number;
+}
+
+export type PresenceMessage =
+    | { state: PresenceState }
+    | { state: 'online'; heartbeat: PresenceHeartbeat };
+
+/**
+ * 解析在线状态主题上的消息。
+ * @param payload - 消息内容。
+ * @returns 解析结果，格式不对时返回null。
+ */
+export function parsePresencePayload(payload: string): PresenceMessage | null {
+    if (payload === 'online' || payload === 'offline') {
+        return { state: payload };
+    }
+    const match = /^hb (\d+) (-?\d+) (\d+)$/.exec(payload);
+    if (!match) {
+        return null;
+    }
+    return {
+        state: 'online',
+        heartbeat: {
+            uptime_s: Number(match[1]),
+            rssi: Number(match[2]),
+            free_heap_kb: Number(match[3]),
+        },
+    };
+}